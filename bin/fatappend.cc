@@ -0,0 +1,131 @@
+// File append benchmark for nearly-full volumes.
+//
+//   fatappend dir [threads] [fill MB] [append MB per thread] [chunk KB]
+//
+// First fills the volume holding dir with a [fill]-MB file (default
+// 64), so that most clusters near the start of the FAT are in use,
+// then has [threads] threads (default 4) each append [append] MB
+// (default 4) to a file of their own in [chunk]-KB writes (default 4),
+// and reports the aggregate append rate.  On a FAT32 mount, every
+// chunk that crosses a cluster boundary has to allocate a cluster, so
+// this mostly measures cluster allocation.  Pick [fill] to leave just
+// a little more than [threads] * [append] MB free.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static pthread_barrier_t bar;
+static std::string dir;
+static unsigned long append_bytes;
+static size_t chunk;
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+static unsigned long
+now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static std::string
+path(int id)
+{
+  return dir + "/fatapp" + std::to_string(id) + ".tmp";
+}
+
+static void
+write_all(int fd, const char *buf, unsigned long total)
+{
+  for (unsigned long done = 0; done < total; ) {
+    size_t n = total - done < chunk ? total - done : chunk;
+    if (write(fd, buf, n) != (ssize_t)n)
+      die("fatappend: write");
+    done += n;
+  }
+}
+
+static void*
+thread(void *x)
+{
+  int id = (int)(long)x;
+  std::vector<char> buf(chunk, 'a' + id % 26);
+
+  std::string p = path(id);
+  unlink(p.c_str());
+  int fd = open(p.c_str(), O_CREAT|O_WRONLY|O_APPEND, 0666);
+  if (fd < 0)
+    die("fatappend: open");
+
+  pthread_barrier_wait(&bar);
+  write_all(fd, buf.data(), append_bytes);
+  pthread_barrier_wait(&bar);
+  close(fd);
+  unlink(p.c_str());
+  return nullptr;
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s dir [threads] [fill MB] [append MB] [chunk KB]\n",
+            argv[0]);
+    exit(2);
+  }
+  dir = argv[1];
+  int nthreads = argc > 2 ? atoi(argv[2]) : 4;
+  unsigned long fill_mb = argc > 3 ? atol(argv[3]) : 64;
+  append_bytes = (argc > 4 ? atol(argv[4]) : 4) * 1024 * 1024;
+  chunk = (argc > 5 ? atol(argv[5]) : 4) * 1024;
+  if (nthreads < 1 || !append_bytes || !chunk)
+    die("fatappend: threads, append size and chunk must be positive");
+
+  // The fill file is written in large chunks; its speed isn't the point
+  std::string fill = dir + "/fatfill.tmp";
+  unlink(fill.c_str());
+  int fd = open(fill.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0666);
+  if (fd < 0)
+    die("fatappend: open fill file");
+  size_t append_chunk = chunk;
+  chunk = 1024 * 1024;
+  std::vector<char> buf(chunk, 'f');
+  write_all(fd, buf.data(), fill_mb * 1024 * 1024);
+  close(fd);
+  chunk = append_chunk;
+
+  pthread_barrier_init(&bar, nullptr, nthreads + 1);
+  std::vector<pthread_t> tids(nthreads);
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&tids[i], nullptr, thread, (void*)(long)i) != 0)
+      die("fatappend: pthread_create");
+
+  pthread_barrier_wait(&bar);
+  unsigned long start = now_nsec();
+  pthread_barrier_wait(&bar);
+  unsigned long nsec = now_nsec() - start;
+  for (auto &t : tids)
+    pthread_join(t, nullptr);
+  unlink(fill.c_str());
+
+  unsigned long total = append_bytes * nthreads;
+  printf("%d threads appended %lu MB in %lu ms: %.1f MB/s, %.2f usec per %zu KB write\n",
+         nthreads, total >> 20, nsec / 1000000,
+         (double)total / (1 << 20) / (nsec / 1e9),
+         (double)nsec / 1000 / (total / chunk) * nthreads, chunk >> 10);
+  return 0;
+}
@@ -0,0 +1,77 @@
+// File write-back benchmark.
+//
+//   fsyncbench [MB] [chunk KB]
+//
+// Writes a file of the given size (default 64 MB) in chunks (default
+// 64 KB), then fsyncs it, and reports the rate of the writes alone and
+// of the writes plus fsync.  On Ward, writes only touch mfs and fsync
+// sends the dirty pages to disk in block order, merged into large
+// requests; /dev/mfsstats shows how many disk writes that took.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH "/fsyncbench.tmp"
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+static unsigned long
+now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned long mb = argc > 1 ? atol(argv[1]) : 64;
+  size_t chunk = (argc > 2 ? atol(argv[2]) : 64) * 1024;
+  if (!mb || !chunk)
+    die("size and chunk must be positive");
+
+  char *buf = (char*)malloc(chunk);
+  if (!buf)
+    die("malloc");
+  memset(buf, 'x', chunk);
+
+  unlink(PATH);
+  int fd = open(PATH, O_CREAT|O_WRONLY|O_TRUNC, 0644);
+  if (fd < 0)
+    die("open");
+
+  unsigned long total = mb * 1024 * 1024;
+  unsigned long start = now_nsec();
+  for (unsigned long done = 0; done < total; ) {
+    size_t n = total - done < chunk ? total - done : chunk;
+    if (write(fd, buf, n) != (ssize_t)n)
+      die("write");
+    done += n;
+  }
+  unsigned long mid = now_nsec();
+  if (fsync(fd) < 0)
+    die("fsync");
+  unsigned long end = now_nsec();
+  close(fd);
+
+  printf("%lu MB in %zu KB chunks\n", mb, chunk / 1024);
+  printf("write: %lu us, %lu MB/sec\n", (mid - start) / 1000,
+         total * 1000UL / (mid - start));
+  printf("write+fsync: %lu us, %lu MB/sec (fsync %lu us)\n",
+         (end - start) / 1000, total * 1000UL / (end - start),
+         (end - mid) / 1000);
+
+  unlink(PATH);
+  free(buf);
+  return 0;
+}
@@ -164,11 +164,25 @@ content_type(int s)
 }
 
 static int
-content(int s, int fd)
+content(int s, int fd, u64 size)
 {
   char buf[256];
   int n;
 
+  // Send regular files straight from their pages if we can; fall back
+  // to copying through buf for anything sendfile doesn't support
+  // (e.g., devices, which report a size of 0).
+  if (size != 0) {
+    while (size) {
+      ssize_t r = ward_sendfile(s, fd, nullptr, size);
+      if (r <= 0)
+        break;
+      size -= r;
+    }
+    if (size == 0)
+      return 0;
+  }
+
   for (;;) {
     n = ward_read(fd, buf, sizeof(buf));
     if (n < 0) {
@@ -229,7 +243,7 @@ resp_get(int s, const char *url)
   if (r < 0)
     goto error;
 
-  r = content(s, fd);
+  r = content(s, fd, stat.st_size);
   if (r < 0)
     goto error;
   
@@ -30,6 +30,9 @@
   const int MITIGATION_STYLES = 3;
 #endif /* HW_linux */
 
+// On Linux, the ward_fast_* functions are the libc ones
+#include "uk/timepage.h"
+
 static inline u64 start_timer() {
   u32 cycles_low, cycles_high;
   asm volatile ("CPUID\n\t"
@@ -225,6 +228,29 @@ u64 getpid_test() {
   return endTime - startTime;
 }
 
+u64 fast_getpid_test() {
+  u64 startTime = start_timer();
+  ward_fast_getpid();
+  u64 endTime = end_timer();
+  return endTime - startTime;
+}
+
+u64 clock_gettime_test() {
+  struct timespec ts;
+  u64 startTime = start_timer();
+  syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+  u64 endTime = end_timer();
+  return endTime - startTime;
+}
+
+u64 fast_clock_gettime_test() {
+  struct timespec ts;
+  u64 startTime = start_timer();
+  ward_fast_clock_gettime(CLOCK_MONOTONIC, &ts);
+  u64 endTime = end_timer();
+  return endTime - startTime;
+}
+
 int file_size = -1;
 u64 read_test() {
   char *buf_in = (char *) malloc (sizeof(char) * file_size);
@@ -555,5 +581,9 @@ int main(int argc, char *argv[])
   if(mask & (1ull<<25)) one_line_test(munmap_test, base_iter / 4, "huge munmap");
   if(mask & (1ull<<26)) one_line_test(page_fault_test, base_iter * 5, "huge page fault");
 
+  if(mask & (1ull<<27)) one_line_test(fast_getpid_test, base_iter * 500, "fast getpid");
+  if(mask & (1ull<<28)) one_line_test(clock_gettime_test, base_iter * 500, "clock_gettime");
+  if(mask & (1ull<<29)) one_line_test(fast_clock_gettime_test, base_iter * 500, "fast clock_gettime");
+
   return(0);
 }
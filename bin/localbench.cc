@@ -0,0 +1,163 @@
+// UNIX datagram socket benchmark.
+//
+//   localbench [size] [count] [batch]
+//
+// Measures round-trip latency with sendto/recvfrom ping-pong, then
+// one-way throughput with sendmmsg/recvmmsg moving batch messages
+// per call.  Buffers are page-aligned, so messages of a page or more
+// can be remapped instead of copied.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define SERVER "/localbench.server"
+#define CLIENT "/localbench.client"
+#define MAXBATCH 64
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+static unsigned long
+now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static socklen_t
+make_addr(struct sockaddr_un *name, const char *path)
+{
+  memset(name, 0, sizeof(*name));
+  name->sun_family = AF_LOCAL;
+  strncpy(name->sun_path, path, sizeof(name->sun_path) - 1);
+  return SUN_LEN(name);
+}
+
+static int
+make_named_socket(const char *path)
+{
+  struct sockaddr_un name;
+  socklen_t size = make_addr(&name, path);
+
+  unlink(path);
+  int sock = socket(PF_LOCAL, SOCK_DGRAM, 0);
+  if (sock < 0)
+    die("socket");
+  if (bind(sock, (struct sockaddr*)&name, size) < 0)
+    die("bind");
+  return sock;
+}
+
+static char *
+alloc_bufs(size_t size, int n)
+{
+  void *p = mmap(NULL, size * n, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    die("mmap");
+  memset(p, 1, size * n);
+  return (char*)p;
+}
+
+// Bounce count messages between the two sockets.
+static void
+latency(int sock, const char *peer, size_t size, int count, bool first)
+{
+  struct sockaddr_un name;
+  socklen_t len = make_addr(&name, peer);
+  char *buf = alloc_bufs(size, 1);
+
+  for (int i = 0; i < count; i++) {
+    if (!first && recvfrom(sock, buf, size, 0, NULL, NULL) < 0)
+      die("recvfrom");
+    if (sendto(sock, buf, size, 0, (struct sockaddr*)&name, len) < 0)
+      die("sendto");
+    if (first && recvfrom(sock, buf, size, 0, NULL, NULL) < 0)
+      die("recvfrom");
+  }
+  munmap(buf, size);
+}
+
+// Send or receive count messages, batch at a time.
+static void
+stream(int sock, const char *peer, size_t size, int count, int batch,
+       bool sender)
+{
+  struct sockaddr_un name;
+  socklen_t len = make_addr(&name, peer);
+  char *bufs = alloc_bufs(size, batch);
+  struct iovec iov[MAXBATCH];
+  struct mmsghdr msgs[MAXBATCH];
+
+  for (int i = 0; i < batch; i++) {
+    iov[i].iov_base = bufs + i * size;
+    iov[i].iov_len = size;
+    memset(&msgs[i], 0, sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (sender) {
+      msgs[i].msg_hdr.msg_name = &name;
+      msgs[i].msg_hdr.msg_namelen = len;
+    }
+  }
+
+  for (int done = 0; done < count; ) {
+    int n = count - done < batch ? count - done : batch;
+    int r = sender ? sendmmsg(sock, msgs, n, 0) :
+      recvmmsg(sock, msgs, n, MSG_WAITFORONE, NULL);
+    if (r <= 0)
+      die(sender ? "sendmmsg" : "recvmmsg");
+    done += r;
+  }
+  munmap(bufs, size * batch);
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t size = argc > 1 ? atol(argv[1]) : 64;
+  int count = argc > 2 ? atoi(argv[2]) : 100000;
+  int batch = argc > 3 ? atoi(argv[3]) : 16;
+  if (batch < 1 || batch > MAXBATCH)
+    die("batch must be between 1 and 64");
+
+  int server = make_named_socket(SERVER);
+  int client = make_named_socket(CLIENT);
+
+  unsigned long start = now_nsec();
+  pid_t pid = fork();
+  if (pid < 0)
+    die("fork");
+  if (pid == 0) {
+    latency(client, SERVER, size, count, false);
+    stream(client, SERVER, size, count, batch, true);
+    exit(0);
+  }
+  latency(server, CLIENT, size, count, true);
+  unsigned long mid = now_nsec();
+  stream(server, CLIENT, size, count, batch, false);
+  unsigned long end = now_nsec();
+  wait(NULL);
+
+  printf("%zu byte messages, %d messages\n", size, count);
+  printf("latency: %lu ns/round trip\n", (mid - start) / count);
+  printf("throughput (batch %d): %lu msgs/sec, %lu MB/sec\n", batch,
+         count * 1000000000UL / (end - mid),
+         count * size * 1000UL / (end - mid));
+
+  unlink(SERVER);
+  unlink(CLIENT);
+  return 0;
+}
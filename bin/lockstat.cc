@@ -1,96 +1,138 @@
-#include "types.h"
-#include "user.h"
+// Kernel lock contention profiler.
+//
+//   lockstat command...
+//
+// Runs command with kernel lock profiling enabled and then reports,
+// for every lock class that was contended, its acquire and contention
+// counts, total wait and hold cycles, log2 histograms of wait and hold
+// times, and the call sites that waited longest.  Classes are sorted
+// by total wait.
+
 #include <fcntl.h>
-#include "amd64.h"
-#include "uk/lockstat.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <vector>
 
+// The record layout returned by /dev/lockstat; see include/uk/lockstat.h
+#define LOCKSTAT_NAME      24
+#define LOCKSTAT_HIST      32
+#define LOCKSTAT_TOP_SITES 8
+
+#define LOCKSTAT_START     1
+#define LOCKSTAT_STOP      2
+#define LOCKSTAT_CLEAR     3
+
+struct lockstat_report {
+  char name[LOCKSTAT_NAME];
+  unsigned long acquires;
+  unsigned long contends;
+  unsigned long wait;
+  unsigned long hold;
+  unsigned long wait_hist[LOCKSTAT_HIST];
+  unsigned long hold_hist[LOCKSTAT_HIST];
+  struct {
+    unsigned long rip;
+    unsigned long contends;
+    unsigned long wait;
+    char sym[48];
+  } sites[LOCKSTAT_TOP_SITES];
+};
+
 static void
-xwrite(int fd, char c)
+die(const char *msg)
 {
-  if (write(fd, &c, 1) != 1)
-    die("lockstat: write failed");
+  perror(msg);
+  exit(1);
 }
 
 static void
-stats(void)
+command(int fd, int cmd)
 {
-  static const u64 sz = sizeof(struct lockstat);
-  struct lockstat ls;
-  int sfd, fd;
-  int r;
-
-  fd = open("/dev/lockstat", O_RDONLY);
-  if (fd < 0)
-    die("lockstat: open failed");
+  char c = '0' + cmd;
+  if (write(fd, &c, 1) != 1)
+    die("lockstat: write /dev/lockstat");
+}
 
-  unlink("/lockstat.last");
-  sfd = open("/lockstat.last", O_RDWR|O_CREAT, 0666);
-  if (sfd < 0)
-    die("lockstat: open failed");
+static void
+print_hist(const char *label, const unsigned long *hist)
+{
+  printf("    %s:", label);
+  for (int i = 0; i < LOCKSTAT_HIST; i++)
+    if (hist[i])
+      printf(" 2^%d:%lu", i, hist[i]);
+  printf("\n");
+}
 
-  printf("## name acquires contends locking locked\n");
-  dprintf(sfd, "## name acquires contends locking locked\n");
-  
-  while (1) {
-    r = read(fd, &ls, sz);
-    if (r < 0)
-      die("lockstat: read failed");
-    if (r == 0)
+static void
+report(int fd)
+{
+  std::vector<lockstat_report> classes;
+  lockstat_report r;
+  for (off_t off = 0;; off += sizeof(r)) {
+    ssize_t n = pread(fd, &r, sizeof(r), off);
+    if (n < 0)
+      die("lockstat: read /dev/lockstat");
+    if (n == 0)
       break;
-    if (r != sz)
-      die("lockstat: unexpected read");
-
-    u64 acquires = 0, contends = 0,
-      locking = 0, locked = 0;
-    
-    for (int i = 0; i < NCPU; i++) {
-      acquires += ls.cpu[i].acquires;
-      contends += ls.cpu[i].contends;
-      locking += ls.cpu[i].locking;
-      locked += ls.cpu[i].locked;
-    }
-    if (contends > 0) {
-      printf("%s %lu %lu %lu %lu\n", 
-             ls.name, acquires, contends, locking, locked);
-      dprintf(sfd, "%s %lu %lu %lu %lu\n",
-             ls.name, acquires, contends, locking, locked);
+    if (n != sizeof(r)) {
+      fprintf(stderr, "lockstat: unexpected record size %zd\n", n);
+      exit(1);
     }
+    if (r.contends)
+      classes.push_back(r);
   }
 
-  close(sfd);
+  std::sort(classes.begin(), classes.end(),
+            [](const lockstat_report &a, const lockstat_report &b) {
+              return a.wait > b.wait;
+            });
+
+  printf("## name acquires contends wait-cycles hold-cycles\n");
+  for (auto &c : classes) {
+    printf("%.*s %lu %lu %lu %lu\n", LOCKSTAT_NAME, c.name,
+           c.acquires, c.contends, c.wait, c.hold);
+    print_hist("wait", c.wait_hist);
+    print_hist("hold", c.hold_hist);
+    for (auto &s : c.sites) {
+      if (!s.contends)
+        break;
+      printf("    %016lx %s contends %lu wait %lu\n", s.rip,
+             s.sym[0] ? s.sym : "?", s.contends, s.wait);
+    }
+  }
 }
 
 int
-main(int ac, char * const av[])
+main(int argc, char *argv[])
 {
-  if (ac <= 1)
-    die("usage: %s command...", av[0]);
+  if (argc <= 1) {
+    fprintf(stderr, "usage: %s command...\n", argv[0]);
+    exit(2);
+  }
 
   int fd = open("/dev/lockstat", O_RDWR);
   if (fd < 0)
-    die("lockstat: open failed");
-  xwrite(fd, '2');
-  xwrite(fd, '3');
+    die("lockstat: open /dev/lockstat");
+  command(fd, LOCKSTAT_STOP);
+  command(fd, LOCKSTAT_CLEAR);
 
   int pid = fork();
   if (pid < 0)
-    die("lockstat: fork failed");
-
+    die("lockstat: fork");
   if (pid == 0) {
-    xwrite(fd, '1');
-    std::vector<const char *> args(av + 1, av + ac);
-    args.push_back(nullptr);
-    execv(args[0], const_cast<char * const *>(args.data()));
-    die("lockstat: exec failed");
+    command(fd, LOCKSTAT_START);
+    execv(argv[1], argv + 1);
+    die("lockstat: exec");
   }
-  
-  wait(NULL);
-  xwrite(fd, '2');
-  stats();
-  xwrite(fd, '3');
+
+  wait(nullptr);
+  command(fd, LOCKSTAT_STOP);
+  report(fd);
+  close(fd);
   return 0;
 }
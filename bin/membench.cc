@@ -0,0 +1,60 @@
+// Kernel memset/memcpy benchmark.
+//
+//   membench [bytes]
+//
+// For each size class from 8 bytes up to [bytes] (default 2M), has the
+// kernel memset, memcpy and memmove a buffer of that size through
+// /dev/membench, and reports the time per byte of each.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// The request layout expected by kernel/membench.cc
+struct membench_req {
+  unsigned long out;
+  unsigned int size;
+  unsigned int iters;
+};
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned int max = argc > 1 ? atoi(argv[1]) : 2 << 20;
+  if (max < 8) {
+    fprintf(stderr, "usage: %s [bytes]\n", argv[0]);
+    exit(2);
+  }
+
+  int fd = open("/dev/membench", O_WRONLY);
+  if (fd < 0)
+    die("membench: open /dev/membench");
+
+  printf("## bytes memset-ns/B memcpy-ns/B memmove-ns/B\n");
+  for (unsigned int size = 8; size <= max; size *= 2) {
+    unsigned long nsec[3];
+    membench_req req;
+    req.out = (unsigned long)nsec;
+    req.size = size;
+    // Touch about 256MB per operation, but time at least 1000 calls
+    req.iters = (256 << 20) / size;
+    if (req.iters < 1000)
+      req.iters = 1000;
+    if (write(fd, &req, sizeof(req)) != sizeof(req))
+      die("membench: write /dev/membench");
+
+    double bytes = (double)size * req.iters;
+    printf("%u %.4f %.4f %.4f\n", size,
+           nsec[0] / bytes, nsec[1] / bytes, nsec[2] / bytes);
+  }
+  close(fd);
+  return 0;
+}
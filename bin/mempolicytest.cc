@@ -0,0 +1,129 @@
+// NUMA memory policy test.
+//
+//   mempolicytest [pages]
+//
+// Faults in [pages] (default 256) anonymous pages under each memory
+// policy, set with mbind and with set_mempolicy, and checks where
+// /dev/numastat says they landed: interleaved pages spread evenly
+// over the nodes, and bound and preferred pages land on the requested
+// node.  Then prints the per-node statistics.  Run under the two-node
+// QEMU configuration (QEMUNUMA) to exercise placement; on one node
+// every policy allocates locally.
+
+#include "types.h"
+#include "sysstubs.h"
+#include "uk/mempolicy.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static int failures;
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+// Read the per-node statistics into out.  Returns the number of nodes.
+static int
+read_numastat(numastat_record *out)
+{
+  int fd = open("/dev/numastat", O_RDONLY);
+  if (fd < 0)
+    die("mempolicytest: open /dev/numastat");
+  ssize_t r = read(fd, out, sizeof(numastat_record) * MPOL_MAX_NODES);
+  if (r < 0)
+    die("mempolicytest: read /dev/numastat");
+  close(fd);
+  return r / sizeof(numastat_record);
+}
+
+// Map and touch pages anonymous pages, optionally mbinding them first
+// (if mode >= 0), and return the pages allocated on each node.
+static void
+touch(int mode, unsigned long nodes, size_t pages, u64 *hits)
+{
+  numastat_record before[MPOL_MAX_NODES], after[MPOL_MAX_NODES];
+  size_t len = pages * 4096;
+  char *p = (char*)mmap(nullptr, len, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    die("mempolicytest: mmap");
+  if (mode >= 0 && ward_mbind(p, len, mode, &nodes, MPOL_MAX_NODES, 0) < 0)
+    die("mempolicytest: mbind");
+
+  int nnodes = read_numastat(before);
+  for (size_t i = 0; i < len; i += 4096)
+    p[i] = 1;
+  read_numastat(after);
+  munmap(p, len);
+
+  for (int n = 0; n < nnodes; n++)
+    hits[n] = (after[n].hit + after[n].miss) - (before[n].hit + before[n].miss);
+}
+
+static void
+check(const char *what, bool ok)
+{
+  if (!ok) {
+    printf("mempolicytest: FAIL %s\n", what);
+    failures++;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  size_t pages = argc > 1 ? atoi(argv[1]) : 256;
+  numastat_record stats[MPOL_MAX_NODES];
+  int nnodes = read_numastat(stats);
+  if (nnodes < 1)
+    die("mempolicytest: no nodes");
+  unsigned long all = (1ul << nnodes) - 1, last = 1ul << (nnodes - 1);
+  u64 hits[MPOL_MAX_NODES];
+
+  touch(MPOL_INTERLEAVE, all, pages, hits);
+  for (int n = 0; n < nnodes; n++)
+    check("interleave spreads pages evenly", hits[n] == pages / nnodes);
+
+  touch(MPOL_BIND, last, pages, hits);
+  check("bind places pages on the bound node", hits[nnodes - 1] == pages);
+
+  touch(MPOL_PREFERRED, last, pages, hits);
+  check("preferred places pages on the preferred node",
+        hits[nnodes - 1] == pages);
+
+  // The address space policy applies where mbind left MPOL_DEFAULT
+  if (ward_set_mempolicy(MPOL_BIND, &last, MPOL_MAX_NODES) < 0)
+    die("mempolicytest: set_mempolicy");
+  touch(-1, 0, pages, hits);
+  check("set_mempolicy places pages on the bound node",
+        hits[nnodes - 1] == pages);
+  touch(MPOL_INTERLEAVE, all, pages, hits);
+  for (int n = 0; n < nnodes; n++)
+    check("mbind overrides set_mempolicy", hits[n] == pages / nnodes);
+  if (ward_set_mempolicy(MPOL_DEFAULT, nullptr, 0) < 0)
+    die("mempolicytest: set_mempolicy");
+
+  unsigned long bad = 1ul << nnodes;
+  check("set_mempolicy rejects missing nodes",
+        ward_set_mempolicy(MPOL_BIND, &bad, MPOL_MAX_NODES) < 0);
+
+  read_numastat(stats);
+  printf("## node hit miss foreign interleave_hit local_node other_node\n");
+  for (int n = 0; n < nnodes; n++)
+    printf("%d %lu %lu %lu %lu %lu %lu\n", n, stats[n].hit, stats[n].miss,
+           stats[n].foreign, stats[n].interleave_hit, stats[n].local_node,
+           stats[n].other_node);
+
+  if (failures)
+    return 1;
+  printf("mempolicytest: OK\n");
+  return 0;
+}
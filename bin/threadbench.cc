@@ -0,0 +1,97 @@
+// Thread create/join latency benchmark.
+//
+//   threadbench [iters] [creators]
+//
+// Each of [creators] threads (default 1) repeatedly creates a thread
+// that does nothing and joins it, [iters] times (default 10000).
+// Reports the average create+join latency seen by each creator and the
+// total rate across all of them.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <vector>
+
+static unsigned long iters;
+static int ncreators;
+static std::atomic<int> ready;
+
+static void
+die(const char *msg, int err)
+{
+  fprintf(stderr, "threadbench: %s: %s\n", msg, strerror(err));
+  exit(1);
+}
+
+static unsigned long
+now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void *
+nop(void *arg)
+{
+  return arg;
+}
+
+static void *
+creator(void *arg)
+{
+  unsigned long *nsec = (unsigned long*)arg;
+
+  // Start all creators at once
+  ready++;
+  while (ready < ncreators)
+    ;
+
+  unsigned long start = now_nsec();
+  for (unsigned long i = 0; i < iters; i++) {
+    pthread_t t;
+    int r = pthread_create(&t, nullptr, nop, nullptr);
+    if (r != 0)
+      die("pthread_create", r);
+    r = pthread_join(t, nullptr);
+    if (r != 0)
+      die("pthread_join", r);
+  }
+  *nsec = now_nsec() - start;
+  return nullptr;
+}
+
+int
+main(int argc, char *argv[])
+{
+  iters = argc > 1 ? atol(argv[1]) : 10000;
+  ncreators = argc > 2 ? atoi(argv[2]) : 1;
+  if (!iters || ncreators <= 0) {
+    fprintf(stderr, "usage: %s [iters] [creators]\n", argv[0]);
+    exit(2);
+  }
+
+  std::vector<pthread_t> threads(ncreators);
+  std::vector<unsigned long> nsec(ncreators);
+  unsigned long start = now_nsec();
+  for (int i = 0; i < ncreators; i++) {
+    int r = pthread_create(&threads[i], nullptr, creator, &nsec[i]);
+    if (r != 0)
+      die("pthread_create", r);
+  }
+  for (auto &t : threads)
+    pthread_join(t, nullptr);
+  unsigned long total = now_nsec() - start;
+
+  unsigned long sum = 0;
+  for (auto n : nsec)
+    sum += n;
+  printf("%d creators: %lu ns per create+join, %lu threads/sec\n",
+         ncreators, sum / (iters * ncreators),
+         (unsigned long)(iters * ncreators * 1000000000.0 / total));
+  return 0;
+}
@@ -0,0 +1,107 @@
+// File system population benchmark.
+//
+//   treewalk [path]
+//
+// Reads every file under path (default /) twice and reports the time
+// for each pass.  On Ward, the first pass pulls directories and file
+// pages in from disk as they are first touched and the second pass
+// runs entirely from memory.  Also prints how long mfs took to load
+// at boot, from /dev/mfsstats.
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+struct walkstats
+{
+  unsigned long dirs;
+  unsigned long files;
+  unsigned long bytes;
+};
+
+static unsigned long
+now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+walk(const std::string &path, walkstats *ws)
+{
+  static char buf[65536];
+  struct stat st;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    ws->files++;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+      ws->bytes += n;
+    close(fd);
+    return;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    close(fd);
+    return;
+  }
+
+  ws->dirs++;
+  std::string base = path == "/" ? "" : path;
+  DIR *dir = fdopendir(fd);
+  struct dirent *de;
+  while ((de = readdir(dir)) != nullptr)
+    if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+      walk(base + '/' + de->d_name, ws);
+  closedir(dir);
+}
+
+static void
+pass(const char *name, const char *path)
+{
+  walkstats ws = {};
+  unsigned long start = now_nsec();
+  walk(path, &ws);
+  unsigned long nsec = now_nsec() - start;
+  printf("%s: %lu dirs, %lu files, %lu KB in %lu us\n", name,
+         ws.dirs, ws.files, ws.bytes / 1024, nsec / 1000);
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *path = argc > 1 ? argv[1] : "/";
+
+  int fd = open("/dev/mfsstats", O_RDONLY);
+  if (fd >= 0) {
+    char buf[1024];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n > 0) {
+      buf[n] = 0;
+      char *line = strstr(buf, "mfs load");
+      if (line)
+        printf("%.*s\n", (int)strcspn(line, "\n"), line);
+    }
+  }
+
+  pass("cold", path);
+  pass("warm", path);
+  return 0;
+}
@@ -0,0 +1,70 @@
+// User memory access benchmark.
+//
+//   uaccessbench [bytes]
+//
+// For each size class from 8 bytes up to [bytes] (default 64K), has the
+// kernel copy a buffer of that size in and out of user memory, copy
+// it in as a string, and scan it for its NUL, through
+// /dev/uaccessbench, and reports the time per byte of each.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The request layout expected by kernel/uaccessbench.cc
+struct uaccessbench_req {
+  unsigned long buf;
+  unsigned long out;
+  unsigned int size;
+  unsigned int iters;
+};
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  unsigned int max = argc > 1 ? atoi(argv[1]) : 64 * 1024;
+  if (max < 8) {
+    fprintf(stderr, "usage: %s [bytes]\n", argv[0]);
+    exit(2);
+  }
+
+  int fd = open("/dev/uaccessbench", O_WRONLY);
+  if (fd < 0)
+    die("uaccessbench: open /dev/uaccessbench");
+  char *buf = (char*)malloc(max);
+  if (!buf)
+    die("uaccessbench: malloc");
+
+  printf("## bytes fetchmem-ns/B putmem-ns/B fetchstr-ns/B strend-ns/B\n");
+  for (unsigned int size = 8; size <= max; size *= 2) {
+    memset(buf, 'x', size - 1);
+    buf[size - 1] = '\0';
+
+    unsigned long nsec[4];
+    uaccessbench_req req;
+    req.buf = (unsigned long)buf;
+    req.out = (unsigned long)nsec;
+    req.size = size;
+    // Copy about 256MB per operation, but time at least 1000 calls
+    req.iters = (256 << 20) / size;
+    if (req.iters < 1000)
+      req.iters = 1000;
+    if (write(fd, &req, sizeof(req)) != sizeof(req))
+      die("uaccessbench: write /dev/uaccessbench");
+
+    double bytes = (double)size * req.iters;
+    printf("%u %.4f %.4f %.4f %.4f\n", size,
+           nsec[0] / bytes, nsec[1] / bytes, nsec[2] / bytes, nsec[3] / bytes);
+  }
+  close(fd);
+  return 0;
+}
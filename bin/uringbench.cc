@@ -0,0 +1,190 @@
+// System call ring benchmark.
+//
+//   uringbench [file] [ops] [batch]
+//
+// Performs [ops] (default 100000) stats of file (default /README) and
+// [ops] 64-byte preads from it, first with direct system calls, then
+// through a ring with one uring_enter per [batch] (default 32)
+// submissions, then through a ring polled by a kernel thread, and
+// reports the time per operation of each.
+
+#include "types.h"
+#include "sysstubs.h"
+#include "uk/uring.h"
+
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct ring
+{
+  int fd;
+  bool sqpoll;
+  uring_shared *shared;
+  uring_sqe *sqes;
+  uring_cqe *cqes;
+  u32 sq_entries;
+};
+
+static const char *path;
+static int file_fd;
+static struct stat stat_buf;
+static char read_buf[64];
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+static unsigned long
+now_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+ring_init(ring *r, u32 entries, bool sqpoll)
+{
+  uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.sq_entries = entries;
+  p.flags = sqpoll ? URING_SETUP_SQPOLL : 0;
+  r->fd = ward_uring_setup(&p);
+  if (r->fd < 0)
+    die("uringbench: uring_setup");
+  r->sqpoll = sqpoll;
+  r->shared = (uring_shared*)p.shared;
+  r->sqes = (uring_sqe*)p.sqes;
+  r->cqes = (uring_cqe*)p.cqes;
+  r->sq_entries = p.sq_entries;
+}
+
+static void
+ring_queue(ring *r, int op, unsigned long i)
+{
+  u32 tail = r->shared->sq_tail;
+  uring_sqe *sqe = &r->sqes[tail & r->shared->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->user_data = i;
+  if (op == URING_OP_STAT) {
+    sqe->addr = (u64)path;
+    sqe->addr2 = (u64)&stat_buf;
+  } else {
+    sqe->fd = file_fd;
+    sqe->addr = (u64)read_buf;
+    sqe->len = sizeof(read_buf);
+    sqe->off = 0;
+  }
+  __atomic_store_n(&r->shared->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Reap completions until n have arrived
+static void
+ring_reap(ring *r, u32 n)
+{
+  u32 head = r->shared->cq_head;
+  while (n) {
+    u32 tail = __atomic_load_n(&r->shared->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (!r->sqpoll)
+        die("uringbench: missing completions");
+      // Order our sq_tail store before the flag load; see uk/uring.h
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (r->shared->flags & URING_SQ_NEED_WAKEUP)
+        ward_uring_enter(r->fd, 0, 0, URING_ENTER_SQ_WAKEUP);
+      __builtin_ia32_pause();
+      continue;
+    }
+    for (; head != tail && n; head++, n--) {
+      uring_cqe *c = &r->cqes[head & r->shared->cq_mask];
+      if (c->res < 0) {
+        fprintf(stderr, "uringbench: op %lu failed: %ld\n",
+                (unsigned long)c->user_data, (long)c->res);
+        exit(1);
+      }
+    }
+    __atomic_store_n(&r->shared->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+static void
+direct(int op, unsigned long ops)
+{
+  for (unsigned long i = 0; i < ops; i++) {
+    if (op == URING_OP_STAT) {
+      if (stat(path, &stat_buf) < 0)
+        die("uringbench: stat");
+    } else if (pread(file_fd, read_buf, sizeof(read_buf), 0) < 0) {
+      die("uringbench: pread");
+    }
+  }
+}
+
+static void
+batched(ring *r, int op, unsigned long ops, u32 batch)
+{
+  for (unsigned long i = 0; i < ops; ) {
+    u32 n = ops - i < batch ? ops - i : batch;
+    for (u32 j = 0; j < n; j++)
+      ring_queue(r, op, i + j);
+    if (!r->sqpoll && ward_uring_enter(r->fd, n, n, URING_ENTER_GETEVENTS) != n)
+      die("uringbench: uring_enter");
+    ring_reap(r, n);
+    i += n;
+  }
+}
+
+static void
+report(const char *name, const char *how, unsigned long ops, unsigned long nsec)
+{
+  printf("%-6s %-8s %8.1f ns/op\n", name, how, (double)nsec / ops);
+}
+
+int
+main(int argc, char *argv[])
+{
+  path = argc > 1 ? argv[1] : "/README";
+  unsigned long ops = argc > 2 ? atol(argv[2]) : 100000;
+  u32 batch = argc > 3 ? atoi(argv[3]) : 32;
+  if (!ops || !batch || batch > URING_MAX_ENTRIES) {
+    fprintf(stderr, "usage: %s [file] [ops] [batch]\n", argv[0]);
+    exit(2);
+  }
+
+  file_fd = open(path, O_RDONLY);
+  if (file_fd < 0)
+    die("uringbench: open");
+
+  ring enter_ring, poll_ring;
+  ring_init(&enter_ring, batch, false);
+  ring_init(&poll_ring, batch, true);
+
+  const struct { int op; const char *name; } ops_list[] = {
+    { URING_OP_STAT, "stat" },
+    { URING_OP_PREAD, "pread" },
+  };
+  for (auto &o : ops_list) {
+    unsigned long start = now_nsec();
+    direct(o.op, ops);
+    report(o.name, "syscall", ops, now_nsec() - start);
+
+    start = now_nsec();
+    batched(&enter_ring, o.op, ops, batch);
+    report(o.name, "ring", ops, now_nsec() - start);
+
+    start = now_nsec();
+    batched(&poll_ring, o.op, ops, batch);
+    report(o.name, "sqpoll", ops, now_nsec() - start);
+  }
+  return 0;
+}
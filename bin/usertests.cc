@@ -1221,6 +1221,103 @@ bigfile(void)
   printf("bigfile test ok\n");
 }
 
+void
+sparsefile(void)
+{
+  int fd, i;
+  struct stat st;
+  off_t far = 64 << 20;
+
+  printf("sparsefile test\n");
+
+  unlink("sparsefile");
+  fd = open("sparsefile", O_CREAT | O_RDWR, 0666);
+  if(fd < 0){
+    printf("cannot create sparsefile\n");
+    exit(0);
+  }
+
+  // A write far past the end leaves a hole that reads as zeros
+  if(pwrite(fd, "x", 1, far) != 1){
+    printf("pwrite sparsefile failed\n");
+    exit(0);
+  }
+  if(fstat(fd, &st) < 0 || st.st_size != far + 1){
+    printf("sparsefile wrong size\n");
+    exit(0);
+  }
+  memset(buf, 1, sizeof(buf));
+  if(pread(fd, buf, sizeof(buf), far / 2) != sizeof(buf)){
+    printf("pread sparsefile hole failed\n");
+    exit(0);
+  }
+  for(i = 0; i < sizeof(buf); i++){
+    if(buf[i] != 0){
+      printf("sparsefile hole not zero\n");
+      exit(0);
+    }
+  }
+  if(lseek(fd, 0, SEEK_HOLE) != 0 || lseek(fd, 0, SEEK_DATA) != far){
+    printf("sparsefile SEEK_DATA/SEEK_HOLE wrong\n");
+    exit(0);
+  }
+
+  char *p = (char*)mmap(0, 2 * 4096, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED || p[0] != 0 || p[4096 + 17] != 0){
+    printf("sparsefile mmap hole not zero\n");
+    exit(0);
+  }
+  munmap(p, 2 * 4096);
+
+  // Punching a hole zeroes the partial edge and drops whole pages
+  memset(buf, 'a', sizeof(buf));
+  if(pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf)){
+    printf("pwrite sparsefile failed\n");
+    exit(0);
+  }
+  if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 100,
+               sizeof(buf)) < 0){
+    printf("sparsefile punch hole failed\n");
+    exit(0);
+  }
+  if(pread(fd, buf, sizeof(buf), 0) != sizeof(buf)){
+    printf("pread sparsefile failed\n");
+    exit(0);
+  }
+  for(i = 0; i < sizeof(buf); i++){
+    if(buf[i] != (i < 100 ? 'a' : 0)){
+      printf("sparsefile punched data wrong\n");
+      exit(0);
+    }
+  }
+  if(lseek(fd, 4096, SEEK_DATA) != far){
+    printf("sparsefile SEEK_DATA after punch wrong\n");
+    exit(0);
+  }
+
+  // Shrinking and growing again must not bring back old data
+  if(ftruncate(fd, 50) < 0 || ftruncate(fd, 5000) < 0){
+    printf("sparsefile ftruncate failed\n");
+    exit(0);
+  }
+  if(fstat(fd, &st) < 0 || st.st_size != 5000 ||
+     pread(fd, buf, sizeof(buf), 0) != 5000){
+    printf("sparsefile ftruncate wrong size\n");
+    exit(0);
+  }
+  for(i = 0; i < 5000; i++){
+    if(buf[i] != (i < 50 ? 'a' : 0)){
+      printf("sparsefile ftruncate data wrong\n");
+      exit(0);
+    }
+  }
+
+  close(fd);
+  unlink("sparsefile");
+
+  printf("sparsefile test ok\n");
+}
+
 void
 twentyfour(void)
 {
@@ -1778,6 +1875,7 @@ main(int argc, char *argv[])
   rmdot();
   /* twentyfour(); */
   bigfile();
+  sparsefile();
   /* subdir(); */
   linktest();
   unlinkread();
@@ -0,0 +1,118 @@
+// World barrier profiler.
+//
+//   wbstat command...
+//
+// Runs command with world barrier profiling enabled and then reports,
+// for every system call that ran, its call count, how many calls took
+// the barrier eagerly at entry, the transparent and intentional
+// barriers it took, and the cycles spent in them, followed by the
+// code sites that took the most barriers.  System calls are sorted by
+// barrier cycles.
+
+#include "types.h"
+#include "uk/wbstat.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#define TOP_SITES 20
+
+static void
+die(const char *msg)
+{
+  perror(msg);
+  exit(1);
+}
+
+static void
+command(int fd, int cmd)
+{
+  char c = '0' + cmd;
+  if (write(fd, &c, 1) != 1)
+    die("wbstat: write /dev/wbstat");
+}
+
+static void
+report(int fd)
+{
+  std::vector<wbstat_record> syscalls, sites;
+  wbstat_record r;
+  for (off_t off = 0;; off += sizeof(r)) {
+    ssize_t n = pread(fd, &r, sizeof(r), off);
+    if (n < 0)
+      die("wbstat: read /dev/wbstat");
+    if (n == 0)
+      break;
+    if (n != sizeof(r)) {
+      fprintf(stderr, "wbstat: unexpected record size %zd\n", n);
+      exit(1);
+    }
+    if (r.kind == WBSTAT_SYSCALL)
+      syscalls.push_back(r);
+    else if (r.kind == WBSTAT_SITE)
+      sites.push_back(r);
+  }
+
+  auto by_cycles = [](const wbstat_record &a, const wbstat_record &b) {
+    return a.cycles > b.cycles;
+  };
+  std::sort(syscalls.begin(), syscalls.end(), by_cycles);
+  std::sort(sites.begin(), sites.end(), by_cycles);
+
+  printf("## syscall calls eager transparent intentional barriers/call cycles\n");
+  for (auto &s : syscalls) {
+    u64 barriers = s.eager + s.transparent + s.intentional;
+    printf("%-*.*s %lu %lu %lu %lu %.2f %lu\n",
+           WBSTAT_NAME, WBSTAT_NAME, s.name[0] ? s.name : "?",
+           s.calls, s.eager, s.transparent, s.intentional,
+           s.calls ? (double)barriers / s.calls : 0.0, s.cycles);
+  }
+
+  printf("## site syscall transparent intentional cycles\n");
+  for (size_t i = 0; i < sites.size() && i < TOP_SITES; i++) {
+    auto &s = sites[i];
+    printf("%s %lu %lu %lu\n",
+           s.sysno == WBSTAT_NO_SYSCALL ? "-" : s.name[0] ? s.name : "?",
+           s.transparent, s.intentional, s.cycles);
+    for (int j = 0; j < WBSTAT_DEPTH && s.rips[j]; j++)
+      printf("    %016lx %.*s\n", s.rips[j], WBSTAT_SYM,
+             s.sym[j][0] ? s.sym[j] : "?");
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc <= 1) {
+    fprintf(stderr, "usage: %s command...\n", argv[0]);
+    exit(2);
+  }
+
+  int fd = open("/dev/wbstat", O_RDWR);
+  if (fd < 0)
+    die("wbstat: open /dev/wbstat");
+  command(fd, WBSTAT_STOP);
+  command(fd, WBSTAT_CLEAR);
+
+  int pid = fork();
+  if (pid < 0)
+    die("wbstat: fork");
+  if (pid == 0) {
+    command(fd, WBSTAT_START);
+    execv(argv[1], argv + 1);
+    die("wbstat: exec");
+  }
+
+  wait(nullptr);
+  command(fd, WBSTAT_STOP);
+  report(fd);
+  close(fd);
+  return 0;
+}
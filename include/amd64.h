@@ -367,6 +367,18 @@ locked_test_and_set_bit(int nr, volatile void *a)
   return old;
 }
 
+// Atomically clear bit nr of *a and return its old value
+static inline int
+locked_test_and_reset_bit(int nr, volatile void *a)
+{
+  int old;
+  __asm volatile("lock; btrq %2,%1; sbb %0,%0"
+                 : "=r" (old), "+m" (*(volatile uint64_t*)a)
+                 : "Ir" (nr)
+                 : "memory");
+  return old;
+}
+
 // Atomically clear bit nr of *a, with release semantics appropriate
 // for clearing a lock bit.
 static inline void
@@ -52,6 +52,7 @@
 #define MSR_FS_BASE     0xc0000100
 #define MSR_GS_BASE     0xc0000101
 #define MSR_GS_KERNBASE 0xc0000102
+#define MSR_TSC_AUX     0xc0000103      // Returned in ecx by rdtscp
 
 // SYSCALL and SYSRET registers
 #define MSR_STAR        0xc0000081
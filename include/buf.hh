@@ -18,6 +18,7 @@ public:
 
   static sref<buf> get(u32 dev, u64 block);
   void writeback();
+  static u64 writeback(sref<buf> *bufs, size_t n);
 
   u32 dev() { return dev_; }
   u64 block() { return block_; }
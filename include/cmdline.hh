@@ -15,6 +15,24 @@ Supported params and corresponding values:
    - no -> remove retpolines
  - root_disk (default=0)
     -> index of detected disks to use as root disk
+ - net_tcp_pcbs, net_tcp_segs, net_pbufs, net_pbuf_pool (default=0)
+    -> maximum number of lwIP TCP PCBs, queued TCP segments, PBUF_REF/ROM
+       headers and PBUF_POOL buffers; 0 uses the size in net/lwipopts.h
+ - net_heap (default=0)
+    -> maximum bytes in lwIP's heap; 0 uses MEM_SIZE
+ - net_tcp_wnd (default=65535)
+    -> TCP receive window of new sockets, in bytes
+ - net_tcp_sndbuf (default=23360)
+    -> TCP send buffer of new sockets, in bytes
+ - unix_dgram_qlen (default=10)
+    -> messages queued per CPU on a UNIX datagram socket before
+       senders block
+ - mfs_prefetch (default=/bin)
+    -> comma-separated directories whose entries and files are read
+       in from disk in the background after boot; empty disables
+ - mfs_writeback_ms (default=5000)
+    -> interval between write-back passes of dirty mfs state to the
+       on-disk file system; 0 leaves write-back to sync and fsync
  */
 struct cmdline_params_t
 {
@@ -23,10 +41,23 @@ struct cmdline_params_t
   bool lazy_barrier;
   char root_disk[CMDLINE_VALUE+1];
   char boot_uuid[CMDLINE_VALUE+1];
+  char mfs_prefetch[CMDLINE_VALUE+1];
   bool use_vga;
   bool use_cga;
   bool track_wbs;
 
+  // lwIP sizing
+  u64 net_tcp_pcbs;
+  u64 net_tcp_segs;
+  u64 net_pbufs;
+  u64 net_pbuf_pool;
+  u64 net_heap;
+  u64 net_tcp_wnd;
+  u64 net_tcp_sndbuf;
+
+  u64 unix_dgram_qlen;
+  u64 mfs_writeback_ms;
+
   // mitigations
   bool spectre_v2;
   bool kpti;
@@ -184,15 +184,18 @@ public:
 
     // 7.EBX
     bool fsgsbase : 1;
+    bool erms : 1;              // Enhanced REP MOVSB/STOSB
     bool invpcid : 1;
     bool intel_pt : 1;
 
     // 7.EDX
+    bool fsrm : 1;              // Fast short REP MOVSB
     bool md_clear : 1;
     bool spec_ctrl : 1;
 
     // 80000001.EDX
     bool page1GB : 1;
+    bool rdtscp : 1;
 
     // D:1.EAX
     bool xsaveopt : 1;
@@ -4,9 +4,14 @@
 #include "vfs.hh"
 #include "sleeplock.hh"
 #include "rwlock.hh"
+#include "gc.hh"
+#include "percpu.hh"
 
 #define SECTORSIZ 512
 
+// How many clusters of a file to read at once when a read misses in the cluster cache
+#define FAT32_READAHEAD 16
+
 #define ATTR_READ_ONLY 0x01u
 #define ATTR_HIDDEN 0x02u
 #define ATTR_SYSTEM 0x04u
@@ -140,9 +145,16 @@ public:
   // just called dec(), and then they'll fail to tryinc(), so they'll fall through to taking the cluster lock, and once
   // we release it in the code that's actively freeing the cluster, it will go back and allocate that exact same cluster
   // once again.
+  //
+  // clusters to evict are chosen by a simplified CLOCK-Pro: a cluster starts out cold, and becomes hot if it is looked
+  // up again before the clock hand comes back around to it. the hand evicts cold clusters that have not been looked up
+  // since it last passed, and demotes hot clusters that have not been looked up to cold, so a cluster that is only
+  // used once (such as one streamed by a large read) never pushes out the working set.
   class cluster : public referenced {
   public:
     u8 *buffer_ptr();
+    // true if the cluster's data has been read in already
+    bool populated() { return cluster_data != nullptr; }
     sref<page_info> page_ref(u32 page);
     void mark_free_on_delete(sref<class fat32_alloc_table> fat);
     void mark_dirty();
@@ -153,6 +165,10 @@ public:
     NEW_DELETE_OPS(cluster);
   private:
     void populate_cache_data();
+    // allocates (but does not fill) a buffer for cluster_data, setting kalloc_pages
+    u8 *alloc_cache_data();
+    // byte offset of this cluster on disk; negative if the cluster starts before the disk does
+    s64 disk_offset();
     bool try_writeback();
     void skip_writeback();
     void onzero() override;
@@ -169,7 +185,10 @@ public:
     sleeplock cluster_data_lock;
     u8 *cluster_data = nullptr; // this counts as a page reference to every page up to kalloc_pages
     s64 cluster_id;
+    // the clock ring; protected by the cache's alloc lock, as is hot
     cluster *next_try_free = nullptr, *prev_try_free = nullptr;
+    std::atomic<bool> referenced; // looked up since the clock hand last passed
+    bool hot = false;
 
     friend fat32_cluster_cache;
   };
@@ -181,7 +200,15 @@ public:
   sref<cluster> evict_cluster(s64 cluster_id);
   // only returns a cluster if it happens to be present in the cache
   sref<cluster> try_get_cluster(s64 cluster_id);
-  sref<cluster> get_cluster(s64 cluster_id);
+  // touch=false looks up the cluster without counting it as a use for eviction, as for readahead
+  sref<cluster> get_cluster(s64 cluster_id, bool touch = true);
+  // reads in whichever of these (at most FAT32_READAHEAD) clusters are not already populated, merging runs of clusters
+  // that are adjacent on disk into single requests. releases the passed references.
+  void prefetch(sref<cluster> *clusters, u32 count);
+  // sleeps until a cluster could be allocated without going over budget. get_cluster can't sleep if its caller holds
+  // a spinlock, so such callers should call this before taking the spinlock. if the caller already holds a spinlock,
+  // this only evicts what it can without sleeping.
+  void wait_for_space();
   ~fat32_cluster_cache() override;
   u32 devno();
 
@@ -193,41 +220,113 @@ public:
 private:
   // alloc lock must be held
   bool evict_unused_cluster();
+  bool make_space_locked();
+  void sleep_for_space_locked();
   u32 writeback_all();
+  // reads or writes a run of clusters that are adjacent on disk
+  void read_run(sref<cluster> *run, u32 len);
+  u32 write_run(sref<cluster> *run, u32 len);
+  // the most clusters that fit in a single disk request
+  u32 max_run();
   static void __attribute__((noreturn)) writeback_thread(void *cache_ptr);
 
   spinlock alloc;
   u64 clusters_used = 0;
   bool allow_writeback = false;
-  cluster *first_try_free = nullptr;
+  cluster *clock_hand = nullptr;
   public_chainhash<s64, cluster*> cached_clusters;
+  // woken when writeback may have made clusters evictable
+  condvar evict_cv;
+  // the writeback thread sleeps here between passes, and can be woken early when the cache is full of dirty clusters
+  spinlock writeback_lock;
+  condvar writeback_cv;
+};
+
+// an in-memory bitmap of which clusters are free. level 0 has one bit per cluster, and each level above it has one bit
+// per word of the level below, which is set if that word has any bits set. finding the next free cluster after a given
+// one therefore only has to look at a couple of words per level, no matter how full the volume is.
+// not internally synchronized.
+class fat32_free_map {
+public:
+  explicit fat32_free_map(u32 cluster_count);
+  ~fat32_free_map();
+  fat32_free_map(const fat32_free_map &) = delete;
+  fat32_free_map &operator=(const fat32_free_map &) = delete;
+
+  bool is_free(u32 cluster_id);
+  void set_free(u32 cluster_id);
+  void set_used(u32 cluster_id);
+  // finds the first free cluster at or after start, wrapping around to first_valid if none are found before the end
+  bool find_free(u32 start, u32 first_valid, u32 *cluster_id_out);
+  // marks up to max_count consecutive free clusters starting at first (which must be free) as used, and returns how
+  // many that was
+  u32 take_run(u32 first, u32 max_count);
+  u32 free_count() { return free_clusters; }
+
+  NEW_DELETE_OPS(fat32_free_map);
+private:
+  // enough for 2^30 clusters, which is more than FAT32 can address
+  static const u32 max_levels = 5;
+
+  bool find_from(u64 start, u32 *cluster_id_out);
+
+  u32 cluster_count;
+  u32 free_clusters = 0;
+  u32 levels = 0;
+  u64 *level_words[max_levels] = {};
+  u64 level_len[max_levels] = {}; // in words
+  u64 *alloc_base = nullptr;
+  u64 alloc_bytes = 0;
 };
 
+// how many consecutive clusters each CPU reserves from the free map at once
+#define FAT32_RESERVE_BATCH 16
+
 class fat32_alloc_table : public referenced {
 public:
-  explicit fat32_alloc_table(sref<fat32_cluster_cache> cluster_cache, u32 offset, u32 sectors);
+  // cluster_count is the number of valid cluster IDs, including the two reserved ones at the start
+  explicit fat32_alloc_table(sref<fat32_cluster_cache> cluster_cache, u32 offset, u32 sectors, u32 cluster_count);
 
   // returns false if there are no subsequent clusters
   bool get_next_cluster_id(u32 from_cluster_id, u32 *to_cluster_id_out);
   void set_next_cluster_id(u32 from_cluster_id, u32 to_cluster_id);
   void mark_cluster_final(u32 cluster_id);
   void mark_cluster_free(u32 cluster_id);
-  bool requisition_free_cluster(u32 *cluster_id_out);
+  // hint is the cluster that the caller would most like to get, usually the one right after the end of the file being
+  // extended, so that files stay contiguous on disk. 0 means no preference.
+  bool requisition_free_cluster(u32 *cluster_id_out, u32 hint = 0);
 
   NEW_DELETE_OPS(fat32_alloc_table);
 private:
-  sref<fat32_cluster_cache::cluster> get_table_entry_ptr(u32 cluster_id, u32 **table_entry_ptr_out);
-  bool find_first_free_cluster(u32 *cluster_id_out);
+  // a run of clusters [next, end) that have been taken out of free_map for the exclusive use of one CPU, but are
+  // still free in the FAT on disk.
+  struct reservation {
+    spinlock lock;
+    u32 next = 0, end = 0;
+  };
 
-  // to make sure that two threads don't clobber each others' attempts to allocate free clusters
-  sleeplock allocation_lock;
+  sref<fat32_cluster_cache::cluster> get_table_entry_ptr(u32 cluster_id, u32 **table_entry_ptr_out);
+  void build_free_map();
+  // picks a free cluster and removes it from free_map, but does not touch the FAT itself
+  bool reserve_cluster(u32 hint, u32 *cluster_id_out);
+  bool reserve_cluster_locked(reservation *r, u32 hint, u32 *cluster_id_out);
+  // returns every CPU's reserved clusters to free_map
+  void release_reservations();
 
   sref<fat32_cluster_cache> cluster_cache;
   u32 table_base_offset;
   u32 table_len;
+
+  // protects free_map and next_search
+  spinlock free_lock;
+  fat32_free_map free_map;
+  u32 next_search = 2; // where to search from when there is no hint
+  percpu<reservation, NO_CRITICAL> reservations;
 };
 
-class vnode_fat32 : public vnode {
+// Freed through gc_delayed, so that ref_child can follow sibling
+// pointers under a gc epoch without holding structure_lock.
+class vnode_fat32 : public vnode, public rcu_freed {
 public:
   explicit vnode_fat32(sref<class fat32_filesystem_weaklink> fs, u32 first_cluster_id, bool is_directory, sref<vnode_fat32> parent_dir, u32 file_size);
   u32 first_cluster_id();
@@ -272,6 +371,8 @@ private:
   sref<vnode_fat32> ref_child_locked(const char *name, sref<vnode_fat32> *prev_out);
 
   sref<fat32_cluster_cache::cluster> get_cluster_data(u32 cluster_local_id);
+  // if cluster_local_id is not cached yet, reads it and the clusters after it in the file
+  void readahead(u32 cluster_local_id);
   void validate_cluster_id(fat32_header &hdr, u32 cluster_id);
   lock_guard<rwlock::read> populate_children();
   sref<fat32_cluster_cache::cluster> get_dirent_ref(u32 dirent_index, fat32_dirent **out);
@@ -300,6 +401,7 @@ private:
   // helper function for onzero; should not be used otherwise
   void retire_clusters();
   void onzero() override;
+  void do_gc() override { delete this; }
 
   sref<fat32_filesystem_weaklink> filesystem;
 
@@ -12,10 +12,23 @@
 #include "sleeplock.hh"
 #include "vfs.hh"
 #include <uk/unistd.h>
+#include <uk/fs.h>
 
 class dirns;
 class filetable;
 
+// A kernel copy of one struct mmsghdr for sendmmsg and recvmmsg.  The
+// iovecs still point to user memory.
+#define KMMSG_IOV   8   // iovecs per message
+#define KMMSG_BATCH 16  // messages per call into the file
+struct kmmsg {
+  struct sockaddr_storage *addr;  // null if the user passed none
+  size_t addrlen;                 // set by recvmmsg
+  struct kernel_iovec iov[KMMSG_IOV];
+  int iovcnt;
+  size_t len;                     // bytes transferred
+};
+
 u64 namehash(const strbuf<DIRSIZ>&);
 
 struct file {
@@ -28,6 +41,11 @@ struct file {
   virtual ssize_t write(const userptr<void> data, size_t n) { return -1; }
   virtual ssize_t pread(char *addr, size_t n, off_t offset) { return -1; }
   virtual ssize_t pwrite(const userptr<void> data, size_t n, off_t offset) { return -1; }
+  // read and pread into user memory.  The defaults bounce through a
+  // kernel buffer; files that can copy straight to user memory
+  // override them.
+  virtual ssize_t read_user(userptr<void> data, size_t n);
+  virtual ssize_t pread_user(userptr<void> data, size_t n, off_t offset);
 
   // Directory operations
   virtual ssize_t getdents(linux_dirent* out_dirents, size_t bytes) { return -1; }
@@ -53,6 +71,26 @@ struct file {
                            struct sockaddr_storage *src_addr,
                            size_t *addrlen)
   { return -1; }
+  // Send or receive up to n (at most KMMSG_BATCH) datagrams.  flags
+  // are Linux MSG_* flags.  Returns the number of messages transferred,
+  // or a negative error if none were.  The defaults fall back to
+  // sendto/recvfrom one message at a time.
+  virtual int sendmmsg(struct kmmsg *msgs, unsigned int n, int flags);
+  virtual int recvmmsg(struct kmmsg *msgs, unsigned int n, int flags,
+                       u64 deadline);
+  // optval is a kernel buffer.  For getsockopt, *optlen is the size
+  // of optval on entry and the size of the option on return.
+  virtual int setsockopt(int level, int optname, const void *optval,
+                         size_t optlen)
+  { return -1; }
+  virtual int getsockopt(int level, int optname, void *optval,
+                         size_t *optlen)
+  { return -1; }
+  // Send n bytes of page starting at off.  The file may hold a
+  // reference to page until the data has been delivered, so the
+  // caller must not modify it.
+  virtual ssize_t sendpage(const sref<page_info> &page, size_t off, size_t n)
+  { return -1; }
 
   virtual sref<vnode> get_vnode() { return sref<vnode>(); }
 
@@ -85,6 +123,8 @@ public:
   ssize_t write(const userptr<void> data, size_t n) override;
   ssize_t pread(char* addr, size_t n, off_t off) override;
   ssize_t pwrite(const userptr<void> data, size_t n, off_t offset) override;
+  ssize_t read_user(userptr<void> data, size_t n) override;
+  ssize_t pread_user(userptr<void> data, size_t n, off_t offset) override;
   ssize_t getdents(linux_dirent* out_dirents, size_t bytes) override;
   void onzero() override
   {
@@ -98,6 +98,31 @@ void            panic(const char*, ...)
 void            kerneltrap(struct trapframe *tf) __noret__;
 int             vsnprintf(char *buf, u32 n, const char *fmt, va_list ap);
 extern "C" int  snprintf(char *buf, u32 n, const char *fmt, ...);
+void            consflush(void);
+
+// Per-call-site rate limiting for log messages.  Allows @c burst
+// messages in each window of @c interval_ms and counts the rest, which
+// are reported when the next window opens.
+struct ratelimit {
+  u32 interval_ms;
+  u32 burst;
+  std::atomic<u64> window_end;
+  std::atomic<u32> count;
+  std::atomic<u32> missed;
+
+  constexpr ratelimit(u32 interval_ms, u32 burst)
+    : interval_ms(interval_ms), burst(burst), window_end(0),
+      count(0), missed(0) { }
+
+  bool allow();
+};
+
+#define cprintf_ratelimited(...)                        \
+  do {                                                  \
+    static ratelimit __rl(5000, 10);                    \
+    if (__rl.allow())                                   \
+      cprintf(__VA_ARGS__);                             \
+  } while (0)
 void            printtrap(struct trapframe *, bool lock = true);
 void            printtrace(u64 rbp);
 void            consoleintr(int(*)(void));
@@ -117,7 +142,11 @@ void            ilock(sref<inode>, int writer);
 void            iupdate(sref<inode>);
 void            iunlock(sref<inode>);
 void            itrunc(inode*);
+void            ifree(sref<inode>);
 int             readi(sref<inode>, char*, u32, u32);
+int             writei(sref<inode>, const char*, u32, u32);
+u64             iwriteback(sref<inode>, u32 off, u32 n);
+u64             bitmap_writeback(u32 dev);
 void            stati(sref<inode>, struct kernel_stat*);
 sref<inode>     nameiparent(sref<inode> cwd, const char*, char*);
 int             dirlink(sref<inode>, const char*, u32);
@@ -148,6 +177,9 @@ void            ideintr(void);
 // idle.cc
 struct proc *   idleproc(void);
 
+// rtc.cc
+u64             rtc_nsec_offset(void);
+
 // ipi.cc
 void            pause_other_cpus_and_call(void (*fn)(void));
 
@@ -163,6 +195,8 @@ void            verifyfree(char *ptr, u64 nbytes);
 void            kminit(void);
 void            kmemprint(print_stream *s);
 char*           zalloc(const char* name);
+char*           kalloc_node(const char *name, int node);
+char*           zalloc_node(const char *name, int node);
 void            zfree(void* p);
 char*           palloc(const char* name, size_t size = PGSIZE);
 void            pfree(void* p);
@@ -177,6 +211,9 @@ void            mouseintr(void);
 void            halt(void) __attribute__((noreturn));
 void            paravirtual_exit(int exit_code) __attribute__((noreturn));
 
+// mempolicy.cc
+char*           mempolicy_zalloc(int mode, u16 nodes, u64 ilx);
+
 // mp.c
 extern int      ncpu;
 extern int      nsocket;
@@ -226,6 +263,7 @@ void            userinit(void);
 void            yield(void);
 struct proc*    threadrun(void (*fn)(void*), void *arg, const char *name);
 struct proc*    threadpin(void (*fn)(void*), void *arg, const char *name, int cpu);
+struct proc*    threadclone(void (*fn)(void*), void *arg, const char *name);
 
 // sampler.c
 void            sampstart(void);
@@ -277,6 +315,9 @@ void            ensure_secrets()  __attribute__((noinline));
 void            uartputc(char c);
 void            uartintr(void);
 
+// uring.cc
+void            uring_exit_group(int tgid);
+
 // vga.c
 void            vgaputc(int c);
 bool            get_framebuffer(paddr* out_address, u64* out_size);
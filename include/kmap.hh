@@ -0,0 +1,39 @@
+#pragma once
+
+// kmap_local maps physical pages at per-CPU virtual addresses that are
+// present whether or not secrets are mapped.  The mapping is only
+// valid on the calling CPU, which runs with interrupts disabled until
+// the matching kunmap_local; unmapping invalidates the local TLB and
+// never sends IPIs.  Mappings nest, and must be released in reverse
+// order.  At most KMAP_SLOTS pages can be mapped per CPU at once.
+
+// Map npages physical pages, in order, at consecutive virtual
+// addresses and return the address of the first.
+void* kmap_local(const paddr* pas, size_t npages);
+void kunmap_local(void* va, size_t npages);
+
+static inline void*
+kmap_local(paddr pa)
+{
+  return kmap_local(&pa, 1);
+}
+
+static inline void
+kunmap_local(void* va)
+{
+  kunmap_local(va, 1);
+}
+
+// Scoped kmap_local of a single page
+class scoped_kmap
+{
+  void* va_;
+
+public:
+  explicit scoped_kmap(paddr pa) : va_(kmap_local(pa)) {}
+  ~scoped_kmap() { kunmap_local(va_); }
+  scoped_kmap(const scoped_kmap&) = delete;
+  scoped_kmap& operator=(const scoped_kmap&) = delete;
+
+  char* va() const { return (char*)va_; }
+};
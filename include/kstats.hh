@@ -24,6 +24,9 @@
   X(uint64_t, tlb_shootdown_targets)                                   \
   /* Total number of cycles spent in TLB shootdown operations. */      \
   X(uint64_t, tlb_shootdown_cycles)                                    \
+  /* # of pages mapped with kmap_local.  These are unmapped with a     \
+   * local invalidation only. */                                       \
+  X(uint64_t, kmap_local_count)                                        \
 
 #define KSTATS_VM(X)                            \
   X(uint64_t, page_fault_count)                 \
@@ -72,17 +75,47 @@
   X(uint64_t, socket_local_client_sendto_cnt)   \
   X(uint64_t, socket_local_recvfrom_cycles)   \
   X(uint64_t, socket_local_recvfrom_cnt)   \
+  X(uint64_t, socket_zerocopy_bytes)   \
+  X(uint64_t, socket_local_remap_pages)   \
 
 #define KSTATS_FILE(X)                          \
   X(uint64_t, write_cycles)                     \
   X(uint64_t, write_count)                      \
   X(uint64_t, mnode_alloc)                      \
   X(uint64_t, mnode_free)                       \
+  X(uint64_t, mfs_dir_load_count)               \
+  X(uint64_t, mfs_page_load_count)              \
+  X(uint64_t, mfs_load_cycles)                  \
+  X(uint64_t, mfs_punch_page_count)             \
+  /* Walks over a run of path elements that   \
+   * took no references on intermediate        \
+   * directories, and those that had to retry  \
+   * the slow way.  A syscall path is one run  \
+   * unless it crosses a mount point or "..". */ \
+  X(uint64_t, mfs_namei_rcu_count)              \
+  X(uint64_t, mfs_namei_rcu_fallback_count)     \
 
 #define KSTATS_SCHED(X)                         \
   X(uint64_t, sched_tick_count)                 \
   X(uint64_t, sched_blocked_tick_count)         \
   X(uint64_t, sched_delayed_tick_count)         \
+  /* Procs allocated from and missing the     \
+   * per-CPU cache of exited procs' memory. */ \
+  X(uint64_t, proc_cache_hit_count)             \
+  X(uint64_t, proc_cache_miss_count)            \
+
+#define KSTATS_WB(X)                            \
+  /* World barriers taken by page faults on   \
+   * secret data. */                          \
+  X(uint64_t, wb_transparent_count)             \
+  /* World barriers taken by ensure_secrets. */ \
+  X(uint64_t, wb_intentional_count)             \
+  /* World barriers taken at system call entry \
+   * by the adaptive barrier policy. */        \
+  X(uint64_t, wb_eager_count)                   \
+  /* Cycles spent switching page tables in all \
+   * of the above. */                         \
+  X(uint64_t, wb_cycles)                        \
 
 #define KSTATS_ALL(X)                           \
   KSTATS_TLB(X)                                 \
@@ -92,6 +125,7 @@
   KSTATS_SOCKET(X)                              \
   KSTATS_SCHED(X)                               \
   KSTATS_FILE(X)                                \
+  KSTATS_WB(X)                                  \
 
 struct kstats;
 #ifdef XV6_KERNEL
@@ -126,6 +126,39 @@ public:
     return false;
   }
 
+  // Add v to k's value, inserting k if it isn't present.  Returns
+  // false if k isn't present and the table is full.
+  bool add(const K& k, const V& v) const {
+    u64 h = hash(k);
+    for (u64 i = 0; i < nslots_; i++) {
+      slot* s = &slots_[(h + i) % nslots_];
+      scoped_acquire l(&s->lock);
+      auto w = s->seq.write_begin();
+      if (!s->data.used) {
+        s->data.used = true;
+        s->data.valid = true;
+        s->data.key = k;
+        s->data.val = v;
+        return true;
+      } else if (s->data.valid && s->data.key == k) {
+        s->data.val += v;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Remove every key.  Not atomic with respect to concurrent updates.
+  void clear() {
+    for (u64 i = 0; i < nslots_; i++) {
+      slot* s = &slots_[i];
+      scoped_acquire l(&s->lock);
+      auto w = s->seq.write_begin();
+      s->data.used = false;
+      s->data.valid = false;
+    }
+  }
+
   void increment(const K& k) const {
     u64 h = hash(k);
     for (u64 i = 0; i < nslots_; i++) {
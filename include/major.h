@@ -10,3 +10,9 @@
 #define MAJ_MFSSTATS  10
 #define MAJ_QSTATS    11
 #define MAJ_NULL      12
+#define MAJ_LOCKBENCH 13
+#define MAJ_KMSG      14
+#define MAJ_WBSTAT    15
+#define MAJ_UACCESSBENCH 16
+#define MAJ_MEMBENCH  17
+#define MAJ_NUMASTAT  18
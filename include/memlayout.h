@@ -3,10 +3,6 @@
 // Everything above KGLOBAL is identical in every address space.
 #define KGLOBAL    KVMALLOC
 
-// Temporary mappings consistent only within address spaces
-#define KTEMPORARY    0xFFFFE00000000000ull
-#define KTEMPORARYEND 0xFFFFE08000000000ull  // 512GB
-
 // [KVMALLOC, KVMALLOCEND) is used for dynamic kernel virtual mappings
 // of vmalloc'd memory.
 #define KVMALLOC    0xFFFFF00000000000ull
@@ -21,6 +17,13 @@
 #define KPUBLIC     0xFFFFF18000000000ull
 #define KPUBLICEND  0xFFFFF20000000000ull  // 512GB
 
+// Per-CPU temporary mapping slots (see kmap_local), KMAP_SLOTS pages
+// per CPU.  Like the public area, these are in every page table, and
+// each CPU only ever touches its own slots.
+#define KKMAP       0xFFFFF20000000000ull
+#define KKMAPEND    0xFFFFF28000000000ull  // 512GB
+#define KMAP_SLOTS  512
+
 // Physical memory is direct-mapped from KBASE to KBASEEND in initpg.
 #define KBASE       0xFFFFFF0000000000ull
 #define KBASEEND    0xFFFFFF8000000000ull  // 512GB
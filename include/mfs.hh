@@ -4,11 +4,22 @@
 
 extern u64 root_inum;
 extern mfs* root_fs;
+extern u64 mfsload_nsec;
 sref<mnode> namei(sref<mnode> cwd, const char* path);
 sref<mnode> nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf);
+sref<mnode> namei_prefix(const sref<mnode>& cwd, const char** path, bool keep_last);
 s64 readi(sref<mnode> m, char* buf, u64 start, u64 nbytes);
+s64 readi(sref<mnode> m, userptr<void> data, u64 start, u64 nbytes);
 s64 writei(sref<mnode> m, userptr<void> data, u64 start, u64 nbytes,
            mfile::resizer* resize = nullptr);
+s64 appendi(sref<mnode> m, userptr<void> data, u64 nbytes);
 
 class print_stream;
 void mfsprint(print_stream *s);
+
+// Write-back to the on-disk file system (mfswb.cc)
+void initmfswb();
+int mfs_fsync(sref<mnode> m);
+void mfs_sync();
+void mfs_free_disk_inode(mfs *fs, u32 inum);
+void mfswb_print(print_stream *s);
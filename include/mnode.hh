@@ -6,6 +6,7 @@
 #include "radix_array.hh"
 #include "page_info.hh"
 #include "kalloc.hh"
+#include "sleeplock.hh"
 #include "fs.h"
 
 #include <time.h>
@@ -54,6 +55,9 @@ public:
   void cache_pin(bool flag);
   u8 type() const { return inumber(inum_).type(); }
 
+  // Queue this mnode to be written back to its on-disk inode.
+  void mark_dirty();
+
   mdir* as_dir();
   const mdir* as_dir() const;
   mfile* as_file();
@@ -74,17 +78,29 @@ public:
   linkcount nlink_ __mpalign__;
   __padout__;
 
+  // The on-disk inode backing this mnode, or 0 if it has none yet.
+  // Set when the mnode is read in from disk or first written back.
+  std::atomic<u32> disk_inum_;
+
 protected:
   mnode(mfs* fs, u64 inum);
 
   atomic<u64> mtime_;
 
 private:
+  friend class mfs_writeback;
   void onzero() override;
 
   std::atomic<bool> cache_pin_;
   std::atomic<bool> dirty_;
   std::atomic<bool> valid_;
+
+  // Write-back state (see mfswb.cc).  Mnodes allocated before
+  // write-back is enabled at boot (/dev, mount points) are transient
+  // and never get an on-disk inode.
+  bool transient_;
+  mnode* wb_next_;
+  sleeplock wb_lock_;
 };
 
 /*
@@ -144,31 +160,59 @@ private:
   percpu<u64> next_inum_;
 
 public:
+  mfs() : disk_dev_(0), persist_(false) {}
   NEW_DELETE_OPS(mfs);
 
+  // The device holding the on-disk file system, and whether new
+  // mnodes should be written back to it.
+  u32 disk_dev_;
+  std::atomic<bool> persist_;
+
   sref<mnode> get(u64 n);
   mlinkref alloc(u8 type);
+
+  // Like get, but return a null sref if inode n isn't in the mnode
+  // cache (for example, because it was just garbage collected).
+  sref<mnode> get_cached(u64 n);
+
+  // Return directory n without taking a reference, or nullptr if n
+  // isn't a directory or isn't in the mnode cache.  The caller must be
+  // in a gc epoch, which keeps the mdir from being freed.
+  const mdir* get_dir_rcu(u64 n);
 };
 
 
-class mdir : public mnode {
+// Directories are freed through RCU rather than directly by refcache,
+// so path walks can step through them without taking references (see
+// namex in mfs.cc).
+class mdir : public mnode, public rcu_freed {
 private:
   // ~32K cache
-  mdir(mfs* fs, u64 inum) : mnode(fs, inum), map_(1367), mount_data(nullptr) {}
+  mdir(mfs* fs, u64 inum)
+    : mnode(fs, inum), rcu_freed("mdir", this, sizeof(*this)),
+      map_(1367), on_disk_(false), parent_inum_(0), mount_data(nullptr) {}
   PUBLIC_NEW_DELETE_OPS(mdir);
   friend class mnode;
   friend class mfs;
 
+  void do_gc() override { delete this; }
+
   // XXX We should deal with varying directory sizes better.  One way
   // would be to make this a resizable hash table.  Linux uses a
   // unified directory cache hash table, but that would make
   // serializing a directory much harder for us.
   public_chainhash<strbuf<DIRSIZ>, u64> map_;
 
-public:
-  void *mount_data;
+  // Directories read in from the on-disk file system start out as
+  // stubs: their entries stay on disk until the first operation that
+  // needs map_ (see mfsload.cc).
+  std::atomic<bool> on_disk_;
+  u64 parent_inum_;
+  sleeplock load_lock_;
 
-  bool insert(const strbuf<DIRSIZ>& name, mlinkref* ilink) {
+  void load_from_disk();
+
+  bool insert_loaded(const strbuf<DIRSIZ>& name, mlinkref* ilink) {
     if (name == ".")
       return false;
     if (!map_.insert(name, ilink->mn()->inum_))
@@ -178,19 +222,57 @@ public:
     return true;
   }
 
+public:
+  void *mount_data;
+
+  /*
+   * Mark a freshly allocated directory as backed by on-disk inode
+   * inum, whose ".." is parent_inum.  Must be called before the
+   * directory is linked anywhere.
+   */
+  void set_disk_inode(u32 inum, u64 parent_inum) {
+    disk_inum_ = inum;
+    parent_inum_ = parent_inum;
+    on_disk_.store(true, std::memory_order_release);
+  }
+
+  bool loaded() const {
+    return !on_disk_.load(std::memory_order_acquire);
+  }
+
+  // Read in this directory's entries, if it is still a stub.
+  void load() const {
+    if (on_disk_.load(std::memory_order_acquire))
+      const_cast<mdir*>(this)->load_from_disk();
+  }
+
+  bool insert(const strbuf<DIRSIZ>& name, mlinkref* ilink) {
+    load();
+    if (!insert_loaded(name, ilink))
+      return false;
+    mark_dirty();
+    return true;
+  }
+
   bool remove(const strbuf<DIRSIZ>& name, sref<mnode> m) {
+    load();
     if (!map_.remove(name, m->inum_))
       return false;
+    mark_dirty();
     m->nlink_.dec();
     return true;
   }
 
   bool replace_from(const strbuf<DIRSIZ>& dstname, sref<mnode> mdst,
                     mdir* src, const strbuf<DIRSIZ>& srcname, sref<mnode> msrc) {
+    load();
+    src->load();
     u64 dstinum = mdst ? mdst->inum_ : 0;
     if (!map_.replace_from(dstname, mdst ? &dstinum : nullptr,
                            &src->map_, srcname, msrc->inum_))
       return false;
+    mark_dirty();
+    src->mark_dirty();
     if (mdst)
       mdst->nlink_.dec();
     return true;
@@ -200,6 +282,7 @@ public:
     if (name == ".")
       return true;
 
+    load();
     return map_.lookup(name);
   }
 
@@ -207,6 +290,7 @@ public:
     if (name == ".")
       return fs_->get(inum_);
 
+    load();
     u64 iprev = -1;
     for (;;) {
       u64 inum;
@@ -227,6 +311,16 @@ public:
     }
   }
 
+  // Look up name's inode number without loading this directory or
+  // taking any references.  The caller must have checked loaded().
+  bool lookup_inum(const strbuf<DIRSIZ>& name, u64* inum) const {
+    if (name == ".") {
+      *inum = inum_;
+      return true;
+    }
+    return map_.lookup(name, inum);
+  }
+
   mlinkref lookup_link(const strbuf<DIRSIZ>& name) const {
     if (name == ".")
       /*
@@ -291,19 +385,23 @@ public:
     if (*prev == ".")
       prev = nullptr;
 
+    load();
     return map_.enumerate(prev, name);
   }
 
   bool kill(sref<mnode> parent) {
+    load();
     if (!map_.remove_and_kill("..", parent->inum_))
       return false;
+    mark_dirty();
 
     parent->nlink_.dec();
     return true;
   }
 
   bool killed() const {
-    return map_.killed();
+    // A stub cannot have been killed, since kill() loads it first.
+    return loaded() && map_.killed();
   }
 };
 
@@ -324,10 +422,13 @@ mnode::as_dir() const
 
 class mfile : public mnode {
 private:
-  mfile(mfs* fs, u64 inum) : mnode(fs, inum), size_(0) {}
+  mfile(mfs* fs, u64 inum)
+    : mnode(fs, inum), size_(0), disk_size_(0), wb_hole_lo_(0),
+      wb_hole_hi_(0), append_state_(0), append_done_(0), append_shift_(0) {}
   PUBLIC_NEW_DELETE_OPS(mfile);
   friend class mnode;
   friend class mfs;
+  friend class mfs_writeback;
 
 public:
   class page_state {
@@ -336,6 +437,8 @@ public:
       FLAG_LOCK = 1 << FLAG_LOCK_BIT,
       FLAG_PARTIAL_PAGE_BIT = 1,
       FLAG_PARTIAL_PAGE = 1 << FLAG_PARTIAL_PAGE_BIT,
+      FLAG_DIRTY_BIT = 2,
+      FLAG_DIRTY = 1 << FLAG_DIRTY_BIT,
     };
 
     /*
@@ -404,6 +507,11 @@ public:
       return get_page_info_raw() != nullptr;
     }
 
+    // A punched page that is still on disk (see punch_hole)
+    bool is_zero_page() const {
+      return is_set() && get_page_info_raw() == zero_page_.load();
+    }
+
     bit_spinlock get_lock() {
       return bit_spinlock(&value_, FLAG_LOCK_BIT);
     }
@@ -418,9 +526,28 @@ public:
       else
         locked_reset_bit(FLAG_PARTIAL_PAGE_BIT, &value_);
     }
+
+    // Dirty pages differ from the on-disk inode and need write-back
+    bool is_dirty() {
+      return !!(value_ & FLAG_DIRTY);
+    }
+
+    void set_dirty() {
+      locked_set_bit(FLAG_DIRTY_BIT, &value_);
+    }
+
+    bool test_and_clear_dirty() {
+      return locked_test_and_reset_bit(FLAG_DIRTY_BIT, &value_);
+    }
   };
 
 private:
+  // Holes inside the file are unset slots of pages_ and read as the
+  // shared zero page.  Pages below disk_size_ cannot simply be unset,
+  // since that would read them back from disk, so punching them fills
+  // their slots with the zero page instead.
+  static std::atomic<page_info*> zero_page_;
+
   enum { maxidx = ULONG_MAX / PGSIZE + 1 };
   radix_array<page_state, maxidx, PGSIZE,
               palloc_allocator<page_state>> pages_;
@@ -429,6 +556,44 @@ private:
   seqcount<u32> seq_;
   u64 size_;
 
+  // Pages below disk_size_ that are not yet in pages_ are read from
+  // the on-disk inode on first access (see mfsload.cc).  disk_size_
+  // only shrinks, and is written under lock_.
+  std::atomic<u64> disk_size_;
+
+  // The byte range of holes made since the last write-back, which may
+  // still hold data on disk.  Protected by lock_.
+  u64 wb_hole_lo_, wb_hole_hi_;
+
+  // Appends reserve their byte range by advancing the end field of
+  // append_state_ and publish it by advancing append_done_, in
+  // reservation order.  The high bits of append_state_ count resizers,
+  // which stop new reservations and wait until every reserved range
+  // is published before they take lock_.
+  //
+  // An append whose user copy faults publishes only what it copied.
+  // The rest of its range stays reserved and append_shift_ counts it,
+  // so each later append publishes its data that many bytes lower
+  // (see publish_append).  The shift is cleared when the last reserved
+  // range is published, and by resizers.  Only the appender whose turn
+  // it is to publish, or a resizer, touches append_shift_.  With no
+  // append or resize in flight and no shift, both ends equal size_.
+  enum : u64 {
+    APPEND_END_BITS = 48,
+    APPEND_END_MASK = (1ull << APPEND_END_BITS) - 1,
+    APPEND_RESIZER = 1ull << APPEND_END_BITS,
+  };
+  std::atomic<u64> append_state_;
+  std::atomic<u64> append_done_;
+  u64 append_shift_;
+
+  page_state load_page(u64 pageidx);
+  u64 move_append(u64 dst, u64 src, u64 n);
+  void add_wb_hole(u64 lo, u64 hi);
+  void zero_bytes(u64 pageidx, u64 pgoff, u64 n);
+  void begin_resize();
+  void end_resize();
+
 public:
   class resizer : public lock_guard<spinlock>,
                   public seq_writer {
@@ -441,21 +606,107 @@ public:
 
   public:
     resizer() : mf_(nullptr) {}
+    resizer(resizer&& o)
+      : lock_guard<spinlock>(std::move(o)), seq_writer(std::move(o)),
+        mf_(o.mf_) {
+      o.mf_ = nullptr;
+    }
+    resizer& operator=(resizer&& o) {
+      if (mf_)
+        mf_->end_resize();
+      lock_guard<spinlock>::operator=(std::move(o));
+      seq_writer::operator=(std::move(o));
+      mf_ = o.mf_;
+      o.mf_ = nullptr;
+      return *this;
+    }
+    ~resizer() {
+      if (mf_)
+        mf_->end_resize();
+    }
+
     explicit operator bool () const { return !!mf_; }
     u64 size() { return mf_->size_; }
+    void resize(u64 size);
     void resize_nogrow(u64 size);
     void resize_append(u64 size, sref<page_info> pi);
   };
 
+  // Must not be called with any locks held, since it waits for
+  // in-flight appends.
   resizer write_size() {
+    begin_resize();
     return resizer(this);
   }
 
+  // The largest file size, which append_state_ must be able to hold
+  static constexpr u64 max_size() { return APPEND_END_MASK; }
+
+  /*
+   * Lock-free appends.  reserve_append reserves nbytes at the end of
+   * the file and stores their offset in *off, or fails if the file
+   * would grow past max_size().  append_page returns the page at
+   * pageidx, creating it if it does not exist yet.  Once the appender
+   * has filled its range, or the first written bytes of it,
+   * publish_append waits for all earlier reservations to be published
+   * and then extends the file size over the written bytes.  It returns
+   * how many it published, which is fewer only if out of memory.
+   */
+  bool reserve_append(u64 nbytes, u64 *off);
+  page_state append_page(u64 pageidx);
+  u64 publish_append(u64 off, u64 nbytes, u64 written);
+
   u64 size() {
     return *seq_reader<u64>(&size_, &seq_);
   }
 
   page_state get_page(u64 pageidx);
+
+  // True if pageidx has not been read from disk yet, in which case
+  // get_page will read it, which may sleep.
+  bool page_on_disk(u64 pageidx) {
+    return pageidx < PGROUNDUP(disk_size_.load()) / PGSIZE &&
+      !pages_.find(pageidx).is_set();
+  }
+
+  // Like get_page, but a hole inside the file reads as the zero page
+  page_state get_page_or_zero(u64 pageidx);
+
+  // Give the hole at pageidx a zeroed page of its own and return it,
+  // or whatever page a concurrent writer put there first.  Returns an
+  // unset page_state if pageidx is past the end of the file or memory
+  // is exhausted.
+  page_state fill_hole(u64 pageidx);
+
+  // Drop the pages of [off, off + len), which then read as zeros.
+  // Partial pages at either edge are zeroed in place.  Returns false
+  // if memory is exhausted.
+  bool punch_hole(u64 off, u64 len);
+
+  // Return the first offset at or after off that holds data, or that
+  // is in a hole if hole is set.  The end of the file counts as a
+  // hole.  Returns -1 if off is not inside the file.
+  s64 seek_data(u64 off, bool hole);
+
+  // The page shared by all holes
+  static sref<page_info> zero_page();
+
+  // Record that pageidx was modified in place, for write-back
+  void mark_page_dirty(u64 pageidx);
+
+  /*
+   * Mark a freshly allocated, empty file as backed by on-disk inode
+   * inum of the given size.  Must be called before the file is linked
+   * anywhere.
+   */
+  void set_disk_inode(u32 inum, u64 size) {
+    disk_inum_ = inum;
+    size_ = size;
+    disk_size_ = size;
+    append_state_ = size;
+    append_done_ = size;
+    append_shift_ = 0;
+  }
 };
 
 inline mfile*
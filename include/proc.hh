@@ -139,6 +139,7 @@ public:
 
   u64 transparent_barriers;
   u64 intentional_barriers;
+  int syscall_num;              // System call in progress, or -1
 
   // These pointers are set to USERTOP if invalid
   userptr<robust_list_head> robust_list_ptr;
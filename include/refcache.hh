@@ -384,6 +384,14 @@ namespace refcache {
     // Convert this weak reference into a regular reference.  If the
     // pointed-to object has been collected, this will return sref().
     sref<T> get() const;
+
+    // Return the pointed-to object without reviving it, or nullptr if
+    // it has been collected.  The object may already be dying, so the
+    // caller must otherwise ensure its memory stays valid.
+    T* peek() const
+    {
+      return ptr_and_state(ptr_and_state_.load()).ptr_;
+    }
   };
 
   // The reference delta cache.  There is one instance of class cache
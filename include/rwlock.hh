@@ -2,11 +2,34 @@
 
 #include "spinlock.hh"
 #include "condvar.hh"
-
-// NOTE: this is a dead-simple read/write lock implementations.
-// do not expect this to be fast; feel free to improve it.
-
-// sleeplock, but read-write lock
+#include "seqlock.hh"
+#include "cpu.hh"
+
+#include <atomic>
+
+// Number of reader indicator cache lines per rwlock.  Readers on
+// different CPUs mostly touch different lines, so concurrent read
+// sections do not bounce a shared cache line; this is a stripe count
+// rather than NCPU because every FAT32 vnode carries an rwlock.
+#define RWLOCK_STRIPES 8
+
+// A sleeping reader-writer lock for read-mostly structures.
+//
+// Readers announce themselves by incrementing the indicator for their
+// CPU and then checking for a writer; writers announce themselves by
+// setting writer_ and then waiting for the indicator sum to drain to
+// zero.  Both sides use sequentially consistent operations, so at
+// least one of them sees the other.  A reader that sees a writer backs
+// out and sleeps, so writers are never starved by a stream of new
+// readers.  A reader may release on a different CPU than it acquired
+// on, so individual indicators may go negative; only their sum is
+// meaningful.
+//
+// Readers that can tolerate retrying may skip the indicators entirely
+// with an optimistic read section (see read_optimistic()).
+//
+// Read sections must not nest: a writer waiting for the outer section
+// blocks the inner one.
 class rwlock {
 public:
   rwlock() : reader(this), writer(this) {}
@@ -14,29 +37,30 @@ public:
   class read {
   public:
     void acquire() {
+      if (rw->try_fast_read())
+        return;
       lock_guard<spinlock> x(&rw->spin);
-      while (rw->readers == rwlock_held_for_writing)
+      while (rw->writer_.load(std::memory_order_relaxed))
         rw->cond.sleep(&rw->spin);
-      rw->readers++;
-      assert(rw->readers != rwlock_held_for_writing); // overflow check
+      // Any writer must take spin to set writer_, and will then see
+      // this increment.
+      rw->stripe()->fetch_add(1);
     }
 
     bool try_acquire() {
+      if (rw->try_fast_read())
+        return true;
       lock_guard<spinlock> x(&rw->spin);
-      if (rw->readers == rwlock_held_for_writing)
+      if (rw->writer_.load(std::memory_order_relaxed))
         return false;
-      rw->readers++;
-      assert(rw->readers != rwlock_held_for_writing); // overflow check
+      rw->stripe()->fetch_add(1);
       return true;
     }
 
     void release() {
-      lock_guard<spinlock> x(&rw->spin);
-      assert(rw->readers != rwlock_held_for_writing);
-      assert(rw->readers > 0);
-      rw->readers--;
-      if (rw->readers == 0)
-        rw->cond.wake_all();
+      rw->stripe()->fetch_sub(1);
+      if (rw->writer_.load())
+        rw->wake();
     }
   private:
     explicit read(rwlock *rw) : rw(rw) {}
@@ -49,23 +73,32 @@ public:
   public:
     void acquire() {
       lock_guard<spinlock> x(&rw->spin);
-      while (rw->readers != 0 || rw->upgrading)
+      while (rw->writer_.load(std::memory_order_relaxed))
         rw->cond.sleep(&rw->spin);
-      rw->readers = rwlock_held_for_writing;
+      rw->writer_.store(1);
+      rw->drain_readers();
     }
 
     bool try_acquire() {
       lock_guard<spinlock> x(&rw->spin);
-      if (rw->readers != 0 || rw->upgrading)
+      if (rw->writer_.load(std::memory_order_relaxed) || rw->readers() != 0)
         return false;
-      rw->readers = rwlock_held_for_writing;
+      rw->writer_.store(1);
+      if (rw->readers() != 0) {
+        // Lost a race with a fast-path reader
+        rw->writer_.store(0);
+        rw->cond.wake_all();
+        return false;
+      }
+      rw->seq_writer_ = rw->seq_.write_begin();
       return true;
     }
 
     void release() {
       lock_guard<spinlock> x(&rw->spin);
-      assert(rw->readers == rwlock_held_for_writing);
-      rw->readers = 0;
+      assert(rw->writer_.load(std::memory_order_relaxed));
+      rw->seq_writer_.done();
+      rw->writer_.store(0);
       rw->cond.wake_all();
     }
   private:
@@ -84,7 +117,7 @@ public:
   }
 
   // an upgrade either succeeds and atomically switches from a reader lock to a writer lock, or fails because another
-  // thread tried to upgrade at the exact same time.
+  // writer (or upgrader) got there first.  either way, the passed-in read guard is released.
   lock_guard<write> upgrade(lock_guard<read> &r) {
     auto o = r.unsafe_transfer_out();
     if (!o)
@@ -92,20 +125,15 @@ public:
     assert(o == &reader);
 
     lock_guard<spinlock> l(&spin);
-    assert(readers != rwlock_held_for_writing && readers >= 1);
-    readers--; // release the passed-in guard
-
-    // try to claim upgrade lock
-    if (upgrading)
-      return lock_guard<write>(); // someone else is upgrading; can't do it!
-    upgrading = true;
-    while (readers > 0) {
-      assert(readers != rwlock_held_for_writing); // nobody should be able to take the lock for writing right now
-      cond.sleep(&spin);
+    stripe()->fetch_sub(1); // release the passed-in guard
+    if (writer_.load(std::memory_order_relaxed)) {
+      // someone else is writing or waiting to; can't do it!  they
+      // may be waiting on us.
+      cond.wake_all();
+      return lock_guard<write>();
     }
-    assert(upgrading && readers == 0);
-    readers = rwlock_held_for_writing;
-    upgrading = false;
+    writer_.store(1);
+    drain_readers();
 
     lock_guard<write> w;
     w.unsafe_transfer_in(&writer);
@@ -120,9 +148,10 @@ public:
     assert(o == &writer);
 
     lock_guard<spinlock> l(&spin);
-    assert(readers == rwlock_held_for_writing);
-    assert(!upgrading); // nobody can be upgrading, since we held the write lock
-    readers = 1;
+    assert(writer_.load(std::memory_order_relaxed));
+    stripe()->fetch_add(1);
+    seq_writer_.done();
+    writer_.store(0);
     cond.wake_all();
 
     lock_guard<read> r;
@@ -130,12 +159,67 @@ public:
     return r;
   }
 
+  // Begin an optimistic read section, which takes no lock and writes
+  // nothing shared.  Returns false if a writer currently holds the
+  // lock, in which case the caller should fall back to guard_read().
+  // Otherwise, after reading, the caller must check
+  // out->need_retry() and discard what it read if that returns true.
+  // As with any seqcount reader, the data read may be garbage until
+  // validated, so pointers must not be followed without some other
+  // protection.
+  bool read_optimistic(seqcount<u32>::reader *out) const {
+    return seq_.try_read_begin(out);
+  }
+
   read reader;
   write writer;
 private:
-  static constexpr u64 rwlock_held_for_writing = 0xFFFFFFFF;
+  struct stripe_t {
+    std::atomic<s32> count;
+    char pad[CACHELINE - sizeof(std::atomic<s32>)];
+  };
+
+  std::atomic<s32> *stripe() {
+    return &stripes_[myid() % RWLOCK_STRIPES].count;
+  }
+
+  s64 readers() const {
+    s64 sum = 0;
+    for (auto &s : stripes_)
+      sum += s.count.load();
+    return sum;
+  }
+
+  bool try_fast_read() {
+    if (writer_.load(std::memory_order_relaxed))
+      return false;
+    auto c = stripe();
+    c->fetch_add(1);
+    if (!writer_.load())
+      return true;
+    // A writer arrived; back out so it isn't left waiting for us.
+    c->fetch_sub(1);
+    wake();
+    return false;
+  }
+
+  // Wait for all readers to leave, with spin held and writer_ set.
+  void drain_readers() {
+    while (readers() != 0)
+      cond.sleep(&spin);
+    seq_writer_ = seq_.write_begin();
+  }
+
+  // Wake a writer waiting in drain_readers.
+  void wake() {
+    lock_guard<spinlock> x(&spin);
+    cond.wake_all();
+  }
+
+  stripe_t stripes_[RWLOCK_STRIPES] = {};
   spinlock spin;
   condvar cond;
-  bool upgrading = false; // if set, DO NOT acquire the lock except by upgrade
-  u64 readers = 0; // small integer or rwlock_held_for_writing
+  std::atomic<u32> writer_{0};  // set while a writer holds or is waiting for the lock
+  seqcount<u32> seq_;
+  seqcount<u32>::writer seq_writer_;
 };
@@ -107,6 +107,21 @@ public:
     return reader(this, s);
   }
 
+  /**
+   * Like read_begin(), but rather than spinning while a write section
+   * is in progress, return false.  This is for seqcounts whose write
+   * sections may block for a long time.
+   */
+  bool try_read_begin(reader *out) const
+  {
+    auto s = seq_.load(std::memory_order_acquire);
+    if (s & 1)
+      return false;
+    barrier();
+    *out = reader(this, s);
+    return true;
+  }
+
   /**
    * An RAII section representing a write section that may conflict
    * with read sections managed by a seqcount.
@@ -97,8 +97,27 @@ public:
 
 #define USE_CODEX_IMPL CODEX
 
+// Lock classes that use queued spinlocks.  Waiters on a queued lock
+// line up in FIFO order and each spins on its own per-CPU queue node
+// instead of the lock word, which keeps heavily contended locks from
+// bouncing their cache line around and starving unlucky CPUs.  The
+// uncontended cost is a single compare-and-swap either way.
+#define QSPIN_CONDVAR 1
+#define QSPIN_FUTEX   1
+#define QSPIN_KALLOC  1
+#define QSPIN_SCHED   1
+
 // Mutual exclusion lock.
 struct spinlock {
+  // Bits of the lock word.  A test-and-set lock only ever holds 0 or
+  // SPINLOCK_LOCKED.  A queued lock always has SPINLOCK_QUEUED set and
+  // keeps the queue's tail node in the high bits (see spinlock.cc).
+  enum : u32 {
+    SPINLOCK_LOCKED = 1,
+    SPINLOCK_QUEUED = 1 << 8,
+    SPINLOCK_TAIL_SHIFT = 16,
+    SPINLOCK_TAIL_MASK = 0xffffu << SPINLOCK_TAIL_SHIFT,
+  };
 
 // Is the lock held?
 #if !USE_CODEX_IMPL
@@ -109,9 +128,12 @@ struct spinlock {
   u32 locked;
 #endif
 
+#if SPINLOCK_DEBUG || LOCKSTAT
+  const char *name;  // Name of lock, which is also its lockstat class.
+#endif
+
 #if SPINLOCK_DEBUG
   // For debugging:
-  const char *name;  // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uptr pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
@@ -119,6 +141,7 @@ struct spinlock {
 
 #if LOCKSTAT
   struct klockstat *stat;
+  u64 locked_ts;     // When the current holder acquired the lock.
 #endif
 
   // Construct an uninitialized spinlock.  This should be
@@ -127,23 +150,31 @@ struct spinlock {
   // incurring a static constructor.
   constexpr spinlock()
     : locked(0)
+#if SPINLOCK_DEBUG || LOCKSTAT
+    , name(nullptr)
+#endif
 #if SPINLOCK_DEBUG
-    , name(nullptr), cpu(nullptr), pcs{}
+    , cpu(nullptr), pcs{}
 #endif
 #if LOCKSTAT
-    , stat(nullptr)
+    , stat(nullptr), locked_ts(0)
 #endif
   { }
 
-  // Create a spinlock.  This is constexpr, so it can be used for
-  // global spinlocks without incurring a static constructor.
-  constexpr spinlock(const char *name, bool lockstat = false)
-    : locked(0)
+  // Create a spinlock, which is a queued spinlock if queued is set.
+  // This is constexpr, so it can be used for global spinlocks without
+  // incurring a static constructor.
+  constexpr spinlock(const char *name, bool lockstat = false,
+                     bool queued = false)
+    : locked(queued && !USE_CODEX_IMPL ? SPINLOCK_QUEUED : 0)
+#if SPINLOCK_DEBUG || LOCKSTAT
+    , name(name)
+#endif
 #if SPINLOCK_DEBUG
-    , name(name), cpu(nullptr), pcs{}
+    , cpu(nullptr), pcs{}
 #endif
 #if LOCKSTAT
-    , stat(lockstat ? &klockstat_lazy : nullptr)
+    , stat(lockstat ? &klockstat_lazy : nullptr), locked_ts(0)
 #endif
   { }
 
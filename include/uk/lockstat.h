@@ -4,22 +4,55 @@
 
 #if __cplusplus
 
+#define LOCKSTAT_NAME      24   // Lock class name length
+#define LOCKSTAT_HIST      32   // Histogram buckets; bucket i counts
+                                // 2^i to 2^(i+1)-1 cycles
+#define LOCKSTAT_SITES     4    // Contended call sites tracked per CPU
+#define LOCKSTAT_TOP_SITES 8    // Contended call sites reported
+
+struct lockstat_site {
+  u64 rip;
+  u64 contends;
+  u64 wait;
+};
+
 struct cpulockstat {
   u64 acquires;
   u64 contends;
-  u64 locking;
-  u64 locked;
+  u64 wait;                     // Cycles spent acquiring
+  u64 hold;                     // Cycles spent holding
 
-  u64 locking_ts;
-  u64 locked_ts;
+  u32 wait_hist[LOCKSTAT_HIST];
+  u32 hold_hist[LOCKSTAT_HIST];
+  struct lockstat_site sites[LOCKSTAT_SITES];
   __padout__;
 } __mpalign__;
 
+// The statistics for one lock class, which is all the locks with the
+// same name.
 struct lockstat {
-  char name[16];
+  char name[LOCKSTAT_NAME];
   struct cpulockstat cpu[NCPU] __mpalign__;
 };
 
+// Reading /dev/lockstat returns one of these for each lock class,
+// summed over CPUs.
+struct lockstat_report {
+  char name[LOCKSTAT_NAME];
+  u64 acquires;
+  u64 contends;
+  u64 wait;
+  u64 hold;
+  u64 wait_hist[LOCKSTAT_HIST];
+  u64 hold_hist[LOCKSTAT_HIST];
+  struct {
+    u64 rip;
+    u64 contends;
+    u64 wait;
+    char sym[48];               // Symbol containing rip, with offset
+  } sites[LOCKSTAT_TOP_SITES];  // Sorted by wait; unused sites are zero
+};
+
 #else
 struct klockstat;
 #endif
@@ -0,0 +1,36 @@
+#pragma once
+
+// NUMA memory policies, set for a whole address space with
+// set_mempolicy(mode, nodemask, maxnode) or for a range of it with
+// mbind(addr, len, mode, nodemask, maxnode, flags).  A policy decides
+// which node each newly allocated anonymous page comes from; pages
+// that are already allocated stay where they are.  nodemask is a bit
+// array of maxnode bits, and is ignored for MPOL_DEFAULT and
+// MPOL_LOCAL.  The modes match Linux's.
+
+#define MPOL_DEFAULT    0       // mbind: use the address space's policy;
+                                // set_mempolicy: same as MPOL_LOCAL
+#define MPOL_PREFERRED  1       // The lowest node in nodemask, falling
+                                // back to any node
+#define MPOL_BIND       2       // Only nodes in nodemask, nearest first
+#define MPOL_INTERLEAVE 3       // Round-robin over nodemask by page
+#define MPOL_LOCAL      4       // The allocating CPU's node
+
+#define MPOL_MAX_NODES  16
+
+// Per-node allocation statistics for pages allocated under a memory
+// policy, read from /dev/numastat as one record per node.  These
+// follow Linux's numastat.
+struct numastat_record {
+  u64 hit;                      // Pages allocated here as intended
+  u64 miss;                     // Pages allocated here but intended
+                                // for another node
+  u64 foreign;                  // Pages intended for here but
+                                // allocated on another node
+  u64 interleave_hit;           // Interleaved pages allocated here as
+                                // intended
+  u64 local_node;               // Pages allocated here by a CPU on
+                                // this node
+  u64 other_node;               // Pages allocated here by a CPU on
+                                // another node
+};
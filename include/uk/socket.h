@@ -35,3 +35,27 @@ static_assert(SOCK_DGRAM_UNORDERED != SOCK_STREAM,
 static_assert(SOCK_DGRAM_UNORDERED != SOCK_DGRAM,
               "SOCK_DGRAM_UNORDERED == SOCK_DGRAM");
 #endif
+
+// Linux's layout of struct msghdr and struct mmsghdr, used by
+// sendmmsg and recvmmsg.  msg_iov points to an array of struct iovec.
+struct msghdr
+{
+  void *msg_name;
+  socklen_t msg_namelen;
+  void *msg_iov;
+  size_t msg_iovlen;
+  void *msg_control;
+  size_t msg_controllen;
+  int msg_flags;
+};
+
+struct mmsghdr
+{
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+// Linux's values for the MSG_* flags that UNIX domain sockets
+// understand.  lwIP's MSG_* constants differ.
+#define LINUX_MSG_DONTWAIT   0x40
+#define LINUX_MSG_WAITFORONE 0x10000
@@ -0,0 +1,154 @@
+#pragma once
+
+// The time page is a read-only page that the kernel maps at
+// TIMEPAGE_VA in every address space.  It publishes what user space
+// needs to answer clock_gettime, gettimeofday, getpid and gettid
+// without a system call: the TSC calibration of every CPU, the
+// wall-clock time at TSC zero, the process ID, and the ID of the
+// thread of this process that last ran on each CPU.
+//
+// Readers find their CPU with rdtscp, which returns the TSC and the
+// CPU number (from IA32_TSC_AUX) atomically, so a timestamp is always
+// converted with the calibration of the CPU that produced it.
+
+// Well below the stack at the top of the address space, and far above
+// anything mmap hands out.
+#define TIMEPAGE_VA       0x00007ff000000000ull
+
+#define TIMEPAGE_VERSION  1
+#define TIMEPAGE_NCPU     252
+
+// Set in flags if IA32_TSC_AUX holds the CPU number on every CPU
+#define TIMEPAGE_RDTSCP   0x1
+
+struct timepage_cpu {
+  // Odd while the kernel is updating tid
+  u32 seq;
+  // The thread of this process that last ran on this CPU
+  u32 tid;
+  // TSC cycles per tsc_scale nanoseconds, or 0 if not calibrated
+  u64 tsc_period;
+};
+
+struct timepage {
+  u32 version;
+  u32 flags;
+  u32 pid;
+  u32 ncpu;
+  u64 tsc_scale;
+  // Nanoseconds since the UNIX epoch at TSC zero
+  u64 realtime_offset;
+  u64 pad[4];
+  struct timepage_cpu cpus[TIMEPAGE_NCPU];
+};
+
+#ifdef XV6_USER
+// Not sys/syscall.h, whose SYS_ names clash with sysstubs.h
+#include <asm/unistd.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline const volatile struct timepage *
+timepage_get(void)
+{
+#ifdef HW_linux
+  return 0;
+#else
+  const volatile struct timepage *tp =
+    (const volatile struct timepage *)TIMEPAGE_VA;
+  if (tp->version != TIMEPAGE_VERSION || !(tp->flags & TIMEPAGE_RDTSCP))
+    return 0;
+  return tp;
+#endif
+}
+
+static inline u64
+timepage_rdtscp(u32 *cpu)
+{
+  u32 lo, hi, aux;
+  __asm__ volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+  *cpu = aux;
+  return ((u64)hi << 32) | lo;
+}
+
+// Nanoseconds since boot, computed exactly as the kernel's nsectime
+// does, or 0 if the time page can't be used.
+static inline u64
+timepage_nsec(const volatile struct timepage *tp)
+{
+  u32 cpu;
+  u64 tsc = timepage_rdtscp(&cpu);
+  if (cpu >= tp->ncpu || !tp->cpus[cpu].tsc_period)
+    return 0;
+  return tsc * tp->tsc_scale / tp->cpus[cpu].tsc_period;
+}
+
+static inline int
+ward_fast_clock_gettime(clockid_t clk_id, struct timespec *ts)
+{
+  const volatile struct timepage *tp = timepage_get();
+  u64 nsec;
+  // The kernel treats all of these as the same clock
+  if (tp && (clk_id == CLOCK_REALTIME || clk_id == CLOCK_MONOTONIC ||
+             clk_id == CLOCK_MONOTONIC_RAW ||
+             clk_id == CLOCK_REALTIME_COARSE ||
+             clk_id == CLOCK_MONOTONIC_COARSE) &&
+      (nsec = timepage_nsec(tp)) != 0) {
+    nsec += tp->realtime_offset;
+    ts->tv_sec = nsec / 1000000000;
+    ts->tv_nsec = nsec % 1000000000;
+    return 0;
+  }
+  return clock_gettime(clk_id, ts);
+}
+
+static inline int
+ward_fast_gettimeofday(struct timeval *tv)
+{
+  const volatile struct timepage *tp = timepage_get();
+  u64 nsec;
+  if (tp && (nsec = timepage_nsec(tp)) != 0) {
+    nsec += tp->realtime_offset;
+    tv->tv_sec = nsec / 1000000000;
+    tv->tv_usec = (nsec % 1000000000) / 1000;
+    return 0;
+  }
+  return gettimeofday(tv, 0);
+}
+
+static inline pid_t
+ward_fast_getpid(void)
+{
+  const volatile struct timepage *tp = timepage_get();
+  if (tp)
+    return tp->pid;
+  return getpid();
+}
+
+static inline pid_t
+ward_fast_gettid(void)
+{
+  const volatile struct timepage *tp = timepage_get();
+  if (tp) {
+    for (;;) {
+      u32 cpu, cpu2;
+      timepage_rdtscp(&cpu);
+      if (cpu >= tp->ncpu)
+        break;
+      const volatile struct timepage_cpu *c = &tp->cpus[cpu];
+      u32 seq = c->seq;
+      __asm__ volatile("" ::: "memory");
+      u32 tid = c->tid;
+      // If we were still on the same CPU afterwards and nothing was
+      // switched in there in between, tid was set when this thread
+      // was switched in.
+      timepage_rdtscp(&cpu2);
+      __asm__ volatile("" ::: "memory");
+      if (!(seq & 1) && cpu2 == cpu && c->seq == seq)
+        return tid;
+    }
+  }
+  return syscall(__NR_gettid);
+}
+#endif
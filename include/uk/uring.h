@@ -0,0 +1,94 @@
+#pragma once
+
+// Submission and completion rings for batching system calls.
+//
+// uring_setup maps a shared region into the caller's address space
+// and returns a file descriptor for it.  User space fills in
+// uring_sqes at sq_tail and publishes them by advancing sq_tail; the
+// kernel consumes them from sq_head, performs them in order, and
+// posts a uring_cqe at cq_tail for each.  User space consumes
+// completions from cq_head.  Indexes are free-running and are reduced
+// with the ring's mask.  The kernel stops consuming submissions while
+// the completion ring is full, so no completion is ever dropped.
+//
+// Without URING_SETUP_SQPOLL, uring_enter performs up to to_submit
+// queued submissions in a single kernel entry.  With it, a kernel
+// thread polls the submission ring; once it has been idle for
+// sq_idle_ms (at most 5 seconds) it sets URING_SQ_NEED_WAKEUP and
+// exits, and user space must then call uring_enter with
+// URING_ENTER_SQ_WAKEUP to restart it.  The poller also exits when the
+// process that set up the ring exits.
+
+#define URING_MAX_ENTRIES    4096
+
+// uring_params.flags
+#define URING_SETUP_SQPOLL   0x1
+
+// uring_enter flags
+#define URING_ENTER_GETEVENTS 0x1  // Wait for min_complete completions
+#define URING_ENTER_SQ_WAKEUP 0x2  // Restart the poller if it's idle
+
+// uring_shared.flags
+#define URING_SQ_NEED_WAKEUP 0x1
+
+// Operations.  Results are what the corresponding system call returns.
+#define URING_OP_NOP         0
+#define URING_OP_READ        1   // fd, addr, len
+#define URING_OP_WRITE       2   // fd, addr, len
+#define URING_OP_PREAD       3   // fd, addr, len, off
+#define URING_OP_PWRITE      4   // fd, addr, len, off
+#define URING_OP_OPENAT      5   // fd (dirfd), addr (path), op_flags (O_*)
+#define URING_OP_CLOSE       6   // fd
+#define URING_OP_STAT        7   // addr (path), addr2 (struct stat)
+#define URING_OP_FSTAT       8   // fd, addr2 (struct stat)
+#define URING_OP_FSYNC       9   // fd
+#define URING_OP_ACCEPT      10  // fd, addr (sockaddr), addr2 (socklen_t)
+#define URING_OP_SEND        11  // fd, addr, len, op_flags (MSG_*)
+#define URING_OP_RECV        12  // fd, addr, len, op_flags (MSG_*)
+#define URING_OP_MAX         13
+
+// uring_sqe.flags
+#define URING_SQE_LINK       0x1  // Skip the next entry if this one fails
+
+struct uring_sqe {
+  u8 opcode;
+  u8 flags;
+  u16 __pad0;
+  s32 fd;
+  u32 len;
+  u32 op_flags;
+  u64 off;
+  u64 addr;
+  u64 addr2;
+  u64 user_data;                // Copied to the completion
+  u64 __pad1[2];
+};
+
+struct uring_cqe {
+  u64 user_data;
+  s64 res;
+};
+
+// The first page of the shared region.  Each index is written by only
+// one side, and each side's indexes are on their own cache line.
+struct uring_shared {
+  u32 sq_head;                  // Written by the kernel
+  u32 cq_tail;                  // Written by the kernel
+  u32 flags;                    // URING_SQ_*, written by the kernel
+  u32 __pad0[13];
+  u32 sq_tail;                  // Written by user space
+  u32 cq_head;                  // Written by user space
+  u32 __pad1[14];
+  u32 sq_mask;
+  u32 cq_mask;
+};
+
+struct uring_params {
+  u32 sq_entries;               // In: requested; out: rounded to 2^n
+  u32 cq_entries;               // Out: twice sq_entries
+  u32 flags;                    // In: URING_SETUP_*
+  u32 sq_idle_ms;               // In: poller idle time (0 for default)
+  u64 shared;                   // Out: user address of uring_shared
+  u64 sqes;                     // Out: user address of the SQE array
+  u64 cqes;                     // Out: user address of the CQE array
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+// World barrier profile, read from /dev/wbstat.
+//
+// A world barrier is a switch from the Q-mode page tables, which map
+// only non-secret kernel memory, to the full kernel page tables.  It is
+// transparent if it was taken by a page fault on secret data and
+// intentional if the kernel asked for it with ensure_secrets().  A
+// system call that needs secrets nearly every time it runs is switched
+// to taking the barrier eagerly at entry, which avoids the page fault.
+//
+// Writing one of the commands below to /dev/wbstat controls the
+// profiler.  Reading returns an array of wbstat_records: one
+// WBSTAT_SYSCALL record for each system call that ran while profiling,
+// then one WBSTAT_SITE record for each distinct backtrace and system
+// call that took a barrier.
+
+#define WBSTAT_START     1
+#define WBSTAT_STOP      2
+#define WBSTAT_CLEAR     3
+
+#define WBSTAT_SYSCALL   1
+#define WBSTAT_SITE      2
+
+// Site records outside any system call (traps, kernel threads)
+#define WBSTAT_NO_SYSCALL 0xffffffff
+
+#define WBSTAT_DEPTH     3      // Return addresses per site
+#define WBSTAT_NAME      24
+#define WBSTAT_SYM       48
+
+struct wbstat_record {
+  u32 kind;                     // WBSTAT_SYSCALL or WBSTAT_SITE
+  u32 sysno;
+  char name[WBSTAT_NAME];       // System call name
+  u64 calls;                    // Syscall records: calls made
+  u64 eager;                    // Syscall records: calls that took
+                                // the barrier at entry
+  u64 transparent;              // Transparent barriers taken
+  u64 intentional;              // Intentional barriers taken
+  u64 cycles;                   // Cycles spent in these barriers
+  u64 rips[WBSTAT_DEPTH];       // Site records: backtrace, innermost
+                                // first; unused entries are zero
+  char sym[WBSTAT_DEPTH][WBSTAT_SYM]; // Symbol containing each rip
+};
@@ -7,6 +7,7 @@
 #include "kernel.hh"
 #include <uk/stat.h>
 #include <uk/unistd.h>
+#include <errno.h>
 #include "cpputil.hh"
 #include "mnode.hh"
 #include "fs.h"
@@ -26,8 +27,19 @@ public:
   virtual u64 file_size() = 0;
   virtual bool is_offset_in_file(u64 offset) = 0; // this exists for optimization purposes
   virtual int read_at(char *data, u64 offset, size_t len) = 0;
+  // read_at straight into user memory; the default bounces through a kernel buffer
+  virtual int read_at_user(userptr<void> data, u64 offset, size_t len);
   virtual int write_at(userptr<void> data, u64 offset, size_t len, bool append) = 0;
   virtual int truncate() = 0;
+  // set the file size; growing leaves a hole.  The default only truncates to zero
+  virtual int set_size(u64 size) { return size ? -EOPNOTSUPP : truncate(); }
+  // make [offset, offset+len) part of the file, growing it if needed
+  virtual int allocate(u64 offset, u64 len) { return -EOPNOTSUPP; }
+  // drop the data in [offset, offset+len), which then reads as zeros
+  virtual int punch_hole(u64 offset, u64 len) { return -EOPNOTSUPP; }
+  // first offset at or after offset holding data (or in a hole); -ENXIO if past the end
+  virtual s64 seek_data(u64 offset, bool hole);
+  virtual int sync() { return 0; } // write back to stable storage, if any
   virtual u64 mtime() = 0;
   virtual bool set_mtime(u64 time) = 0;
 
@@ -72,6 +84,9 @@ public:
   virtual sref<vnode> root() = 0;
   virtual sref<vnode> resolve(const sref<vnode>& base, const char *path) = 0;
   virtual sref<vnode> resolveparent(const sref<vnode>& base, const char *path, strbuf<FILENAME_MAX> *name) = 0;
+  // resolves as many leading elements of *path as it can at once and advances *path past them, stopping
+  // before .., after a mountpoint, and before the final element if keep_last; the default resolves nothing
+  virtual sref<vnode> resolve_prefix(const sref<vnode>& base, const char **path, bool keep_last) { return base; }
 
   int hardlink(const sref<vnode> &base, const char *oldpath, const char *newpath);
   int rename(const sref<vnode>& base, const char *oldpath, const char *newpath);
@@ -108,6 +123,7 @@ public:
   explicit virtual_filesystem(sref<filesystem> root);
 
   sref<vnode> root() override;
+  sref<vnode> resolve_prefix(const sref<vnode>& base, const char **path, bool keep_last) override;
   sref<vnode> resolve_child(const sref<vnode>& base, const char *filename) override;
   sref<vnode> resolve_parent(const sref<vnode>& base) override;
 
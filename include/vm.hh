@@ -12,12 +12,24 @@
 #include "vector.hh"
 
 struct padded_length;
+struct timepage;
 
 using std::atomic;
 
 class pageable : public referenced {
 public:
   virtual sref<page_info> get_page_info(u64 page_idx) = 0; // for memory mapping
+  // for writable shared mappings, which must not get a page shared with other offsets
+  virtual sref<page_info> get_page_info_for_write(u64 page_idx) { return get_page_info(page_idx); }
+
+  // get_page_info is called under vmap spinlocks, so it must not
+  // sleep.  A pageable whose pages may have to be read from disk
+  // returns null for them, and then says so through needs_load, which
+  // must not sleep either.  The vmap drops its locks, calls load_page,
+  // which may sleep, and retries.  load_page returns false if the page
+  // can't be loaded.
+  virtual bool needs_load(u64 page_idx) { return false; }
+  virtual bool load_page(u64 page_idx) { return false; }
 };
 
 sref<pageable> new_shared_memory_region(size_t pages);
@@ -56,6 +68,17 @@ struct vmdesc
 
     // Set if the page should be shared across fork().
     FLAG_SHARED = 1<<5,
+
+    // The NUMA memory policy for anonymous pages allocated in this
+    // page frame: an MPOL_* mode from uk/mempolicy.h and the mask of
+    // nodes it applies to.  MPOL_DEFAULT defers to the vmap's policy.
+    // These are flag bits rather than a separate field so a range
+    // with one policy still compresses in the radix tree.
+    FLAG_MPOL_SHIFT = 8,
+    FLAG_MPOL_MODE = 0x7<<FLAG_MPOL_SHIFT,
+    FLAG_MPOL_NODES_SHIFT = 16,
+    FLAG_MPOL_NODES = 0xffffu<<FLAG_MPOL_NODES_SHIFT,
+    FLAG_MPOL = FLAG_MPOL_MODE | FLAG_MPOL_NODES,
   };
 
   // Flags
@@ -102,6 +125,23 @@ struct vmdesc
     return flags & FLAG_MAPPED;
   }
 
+  // Encode a memory policy as FLAG_MPOL bits.
+  static u64 mpol_flags(int mode, u16 nodes)
+  {
+    return ((u64)mode << FLAG_MPOL_SHIFT) |
+      ((u64)nodes << FLAG_MPOL_NODES_SHIFT);
+  }
+
+  static int mpol_mode(u64 flags)
+  {
+    return (flags & FLAG_MPOL_MODE) >> FLAG_MPOL_SHIFT;
+  }
+
+  static u16 mpol_nodes(u64 flags)
+  {
+    return (flags & FLAG_MPOL_NODES) >> FLAG_MPOL_NODES_SHIFT;
+  }
+
   // Duplicate this descriptor for use in another vmap.  This copies
   // the descriptor except for its lock bit (since it should be
   // initially unlocked in the new vmap) and its page tracker (since it is
@@ -162,6 +202,16 @@ struct vmap : public referenced {
   // Modify protection on a range.  flags must be 0 or FLAG_MAPPED.
   int mprotect(uptr start, uptr len, uint64_t flags);
 
+  // Set the memory policy of a range to mpol, which must be
+  // vmdesc::FLAG_MPOL bits.  This affects only pages allocated after
+  // the call.  Fails if any of the range is unmapped.
+  int mbind(uptr start, uptr len, u64 mpol);
+
+  // Set the memory policy for page frames whose own policy is
+  // MPOL_DEFAULT.  mpol must be vmdesc::FLAG_MPOL bits.
+  void set_mempolicy(u64 mpol) { mempolicy_ = mpol; }
+  u64 get_mempolicy() const { return mempolicy_; }
+
   // XXX(Austin) HACK for benchmarking.  Used to simulate the shared
   // pages we could have if we had a unified buffer cache.
   int dup_page(uptr dest, uptr src);
@@ -174,6 +224,17 @@ struct vmap : public referenced {
   // say, this mapping is only valid within the returned page.
   void* pagelookup(uptr va);
 
+  // Make the private anonymous page at page-aligned va copy-on-write
+  // and store a reference to it in *out, so its current contents can
+  // be handed to another address space without copying.  Returns
+  // false if va is not a private anonymous page.
+  bool share_page(uptr va, page_info_ref *out);
+
+  // Replace the private, writable anonymous page at page-aligned va
+  // with a copy-on-write mapping of page.  Returns false if va is not
+  // such a page.
+  bool map_page(uptr va, const page_info_ref &page);
+
   // Return the pageable and page index associated with the given virtual
   // address (or null if the region is anonymous memory or unmapped).
   sref<pageable> lookup_pageable(uptr va, u64* pageidx);
@@ -200,11 +261,12 @@ struct vmap : public referenced {
   void* qalloc(const char *name, bool cached_only = false);
   void qfree(void* page);
 
-  void* map_temporary(paddr pa);
-  void unmap_temporary(void* page);
-
   u64 asid() { return cache.asid_; }
 
+  // Record in the time page that thread tid of process pid is now
+  // running on this CPU.  Called whenever a thread is switched in.
+  void publish_thread(u32 pid, u32 tid);
+
   uptr brk_;                    // Top of heap
 
 private:
@@ -231,12 +293,22 @@ private:
 
   struct spinlock brklock_;
 
+  // The default memory policy, as vmdesc::FLAG_MPOL bits.  This is
+  // read without locks when allocating pages.
+  std::atomic<u64> mempolicy_;
+
   // Cache of free quasi user-visible pages for processes in this address space.
   static_vector<void*, 128> qpage_pool_;
   struct spinlock qpage_pool_lock_;
 
   nmiframe* nmi_stacks;
 
+  // The page mapped read-only at TIMEPAGE_VA (see uk/timepage.h).
+  // It is also q-visible, so that sched can update it without
+  // secrets mapped.
+  sref<pageable> timepage_region_;
+  struct timepage* timepage_;
+
   enum class access_type
   {
     READ, WRITE
@@ -249,6 +321,16 @@ private:
   paddr ensure_page(const vpf_array::iterator &it, access_type type,
                     bool *allocated = nullptr);
 
+  // If ensure_page failed at it because the file page there must be
+  // read from disk first, return its pageable and set *page_idx, so the
+  // caller can load it after releasing vpfs_lock_ and try again.
+  static sref<pageable> needs_load(const vpf_array::iterator &it,
+                                   u64 *page_idx);
+
+  // Allocate a zeroed anonymous page for the page frame at it,
+  // following its memory policy.  Returns null if out of memory.
+  char* alloc_anon_page(const vpf_array::iterator &it);
+
   // helper function for sbrk and brk; expects lock to be acquired
   int sbrk_update(ssize_t n);
 };
@@ -0,0 +1,90 @@
+#pragma once
+
+// World barrier accounting and the adaptive barrier policy.  See
+// include/uk/wbstat.h for the profile this feeds.
+//
+// With lazy barriers, every system call starts in Q-mode and takes a
+// transparent barrier (a page fault) the first time it touches secret
+// data.  That's cheap for system calls whose common case never touches
+// secrets, but for ones that almost always do, the page fault is pure
+// overhead.  So each CPU watches every WBSTAT_WINDOW calls of each
+// system call, and if at least WBSTAT_EAGER_MIN of them took a
+// transparent barrier, switches that system call to take the barrier
+// eagerly at entry.  One call in every window still runs lazily, and if
+// it gets by without secrets the system call goes back to lazy.
+
+#include "spercpu.hh"
+#include "proc.hh"
+
+#define WBSTAT_SYSCALLS  512    // System call numbers tracked
+#define WBSTAT_WINDOW    64     // Calls per policy decision
+#define WBSTAT_EAGER_MIN 60     // Barriers per window to switch to eager
+
+// Q-visible, since it's updated before the system call has secrets
+struct wbstat_cpu {
+  u8 window_calls[WBSTAT_SYSCALLS];
+  u8 window_barriers[WBSTAT_SYSCALLS];
+  bool eager[WBSTAT_SYSCALLS];
+  u32 calls[WBSTAT_SYSCALLS];   // Only counted while profiling
+};
+
+DECLARE_PERCPU(struct wbstat_cpu, wbstat_cpus, NO_CRITICAL);
+extern int wbstat_enable;
+
+enum class wb_kind { transparent, intentional, eager };
+
+// Take a world barrier for an eager system call.  Like
+// ensure_secrets(), but counted as an eager barrier.
+void eager_secrets(void) __attribute__((noinline));
+
+// Record a world barrier of the given kind that took cycles.  rip
+// and rbp locate the code that needed secrets.  Must be called with
+// secrets mapped.
+void wbstat_barrier(wb_kind kind, u64 cycles, uptr rip, void *rbp);
+
+// Called by syscall() around system call num.  begin returns a value
+// to pass to end, which is ~0 if the call took the barrier eagerly.
+static inline u64
+wbstat_syscall_begin(u64 num)
+{
+  proc *p = myproc();
+  p->syscall_num = num;
+  if (num >= WBSTAT_SYSCALLS)
+    return ~0ull;
+
+  wbstat_cpu *w = wbstat_cpus.get();
+  if (wbstat_enable)
+    w->calls[num]++;
+  if (w->eager[num]) {
+    if (++w->window_calls[num] < WBSTAT_WINDOW) {
+      eager_secrets();
+      return ~0ull;
+    }
+    // Run this one lazily to see if it still needs secrets
+    w->window_calls[num] = 0;
+  }
+  return p->transparent_barriers;
+}
+
+static inline void
+wbstat_syscall_end(u64 num, u64 begin)
+{
+  proc *p = myproc();
+  p->syscall_num = -1;
+  if (begin == ~0ull)
+    return;
+
+  wbstat_cpu *w = wbstat_cpus.get();
+  bool barrier = p->transparent_barriers != begin;
+  if (w->eager[num]) {
+    if (!barrier)
+      w->eager[num] = false;
+    return;
+  }
+  w->window_barriers[num] += barrier;
+  if (++w->window_calls[num] == WBSTAT_WINDOW) {
+    w->eager[num] = w->window_barriers[num] >= WBSTAT_EAGER_MIN;
+    w->window_calls[num] = 0;
+    w->window_barriers[num] = 0;
+  }
+}
@@ -55,6 +55,17 @@ private:
       return sref<V>();
     }
 
+    V*
+    peek(const K& k) const
+    {
+      for (auto &i: chain_) {
+        if (!(i.key_ == k))
+          continue;
+        return i.weakref_.peek();
+      }
+      return nullptr;
+    }
+
     bool
     insert(const K& k, V* v)
     {
@@ -131,6 +142,14 @@ public:
     return buckets_[hash(k) & mask_].lookup(k);
   }
 
+  // Look up k without taking a reference (see weakref::peek).  The
+  // caller must be in a gc epoch.
+  V*
+  peek(const K& k) const
+  {
+    return buckets_[hash(k) & mask_].peek(k);
+  }
+
   bool
   insert(const K& k, V* v)
   {
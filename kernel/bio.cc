@@ -41,6 +41,53 @@ buf::writeback()
   disk_write(dev_, copy->data, BSIZE, block_*BSIZE);
 }
 
+// Write back n buffers on the same device, sorted by block number.
+// Clean buffers are skipped and runs of consecutive blocks go to the
+// disk as single requests.  Returns the number of disk requests.
+u64
+buf::writeback(sref<buf> *bufs, size_t n)
+{
+  char *run = (char*) kmalloc(DISK_REQMAX, "buf writeback");
+  if (!run) {
+    for (size_t i = 0; i < n; i++)
+      if (bufs[i]->dirty())
+        bufs[i]->writeback();
+    return n;
+  }
+
+  u64 requests = 0;
+  size_t i = 0;
+  while (i < n) {
+    if (!bufs[i]->dirty()) {
+      i++;
+      continue;
+    }
+
+    // Hold each buffer's writeback lock until the request is issued,
+    // so writes of the same block stay ordered.
+    size_t j = i;
+    u64 nbytes = 0;
+    while (j < n && nbytes < DISK_REQMAX && bufs[j]->dirty() &&
+           bufs[j]->block_ == bufs[i]->block_ + (j - i)) {
+      bufs[j]->writeback_lock_.acquire();
+      bufs[j]->mark_clean();
+      auto copy = bufs[j]->read();
+      memmove(run + nbytes, copy->data, BSIZE);
+      nbytes += BSIZE;
+      j++;
+    }
+
+    disk_write(bufs[i]->dev_, run, nbytes, bufs[i]->block_*BSIZE);
+    for (size_t k = i; k < j; k++)
+      bufs[k]->writeback_lock_.release();
+    requests++;
+    i = j;
+  }
+
+  kmfree(run, DISK_REQMAX);
+  return requests;
+}
+
 void
 buf::onzero()
 {
@@ -23,6 +23,7 @@ struct param_metadata_t {
 };
 
 extern void initvga();
+extern void wbstat_track_changed();
 
 param_metadata_t<bool> binary_params[] = {
   { "disable_pcid",    &cmdline_params.disable_pcid,    false, refresh_pcid_mask },
@@ -30,17 +31,28 @@ param_metadata_t<bool> binary_params[] = {
   { "lazy_barrier",    &cmdline_params.lazy_barrier,    true,  apply_hotpatches },
   { "use_vga",         &cmdline_params.use_vga,         true,  initvga },
   { "use_cga",         &cmdline_params.use_cga,         false, NULL },
-  { "track_wbs",       &cmdline_params.track_wbs,       true, NULL },
+  { "track_wbs",       &cmdline_params.track_wbs,       true,  wbstat_track_changed },
   { "spectre_v2",      &cmdline_params.spectre_v2,      true,  apply_hotpatches },
   { "kpti",            &cmdline_params.kpti,            true,  apply_hotpatches },
   { "mds",             &cmdline_params.mds,             true,  apply_hotpatches },
 };
 
-param_metadata_t<u64> uint_params[] = {};
+param_metadata_t<u64> uint_params[] = {
+  { "net_tcp_pcbs",    &cmdline_params.net_tcp_pcbs,    0,     NULL },
+  { "net_tcp_segs",    &cmdline_params.net_tcp_segs,    0,     NULL },
+  { "net_pbufs",       &cmdline_params.net_pbufs,       0,     NULL },
+  { "net_pbuf_pool",   &cmdline_params.net_pbuf_pool,   0,     NULL },
+  { "net_heap",        &cmdline_params.net_heap,        0,     NULL },
+  { "net_tcp_wnd",     &cmdline_params.net_tcp_wnd,     65535, NULL },
+  { "net_tcp_sndbuf",  &cmdline_params.net_tcp_sndbuf,  16 * 1460, NULL },
+  { "unix_dgram_qlen", &cmdline_params.unix_dgram_qlen, 10,    NULL },
+  { "mfs_writeback_ms", &cmdline_params.mfs_writeback_ms, 5000, NULL },
+};
 
 param_metadata_t<const char*> string_params[] = {
   { "root_disk", (const char**) cmdline_params.root_disk, "memide.0", NULL },
   { "boot_uuid", (const char**) cmdline_params.boot_uuid, "", NULL },
+  { "mfs_prefetch", (const char**) cmdline_params.mfs_prefetch, "/bin", NULL },
 };
 
 static int
@@ -26,7 +26,7 @@ u64 cpuhz = 0;
 static u64 ticks __mpalign__;
 
 ilist<pproc,&pproc::cv_sleep> sleepers  __mpalign__;   // XXX one per core?
-struct spinlock sleepers_lock;
+struct spinlock sleepers_lock("sleepers", LOCKSTAT_CONDVAR, QSPIN_CONDVAR);
 
 static void
 wakeup(struct pproc *p)
@@ -37,6 +37,56 @@ static struct cons {
       holder(nullptr), nesting_count(0) { }
 } cons;
 
+// Kernel log.
+//
+// Once the log drain thread is running, cprintf and console streams
+// no longer write the UART and screens themselves.  Each CPU formats
+// into its own staging buffer with interrupts disabled and appends the
+// result as a record to its own log ring, without taking any locks.
+// The drain thread merges the rings in timestamp order, writes them to
+// the console devices under cons.lock, and keeps the most recent
+// output for /dev/kmsg.  A CPU that logs faster than the console
+// drains overwrites its oldest records, and the drain reports how much
+// was lost.  Panics flush whatever is queued and then print
+// synchronously.
+
+#define LOGRING_SIZE    8192    // Per-CPU log ring
+#define LOGSTAGE_SIZE   256     // Largest log record
+#define KMSG_SIZE       65536   // Output kept for /dev/kmsg
+#define LOGDRAIN_MS     10      // Drain thread polling interval
+
+struct logrec {
+  u64 tsc;
+  u32 len;
+};
+
+struct logring {
+  char buf[LOGRING_SIZE];
+  // Byte offsets into buf, which grow without wrapping.
+  std::atomic<u64> head;        // End of the last complete record
+  std::atomic<u64> reserve;     // End of the record being written
+  std::atomic<u64> first;       // Start of the oldest intact record
+  u64 tail;                     // Next record to drain; under cons.lock
+
+  // The record being formatted on this CPU
+  char stage[LOGSTAGE_SIZE];
+  u32 stagelen;
+  u32 nesting;
+} __mpalign__;
+
+static logring logrings[NCPU];
+static std::atomic<bool> logasync;
+static u64 logdropped;          // Under cons.lock
+
+static struct kmsg {
+  struct spinlock lock;
+  char buf[KMSG_SIZE];
+  u64 total;
+
+  constexpr kmsg()
+    : lock("kmsg", LOCKSTAT_CONSOLE), buf{}, total(0) { }
+} kmsg;
+
 static void
 consputc(int c)
 {
@@ -63,11 +113,274 @@ consputc(int c)
   vgaputc(c);
 }
 
+// Append output to the /dev/kmsg history.  Before initconsole, boot is
+// single-threaded and locks don't work yet.
+static void
+kmsgappend(const char *s, u32 n)
+{
+  lock_guard<spinlock> l;
+  if (cons.locking)
+    l = kmsg.lock.guard();
+  for (u32 i = 0; i < n; i++)
+    kmsg.buf[(kmsg.total + i) % KMSG_SIZE] = s[i];
+  kmsg.total += n;
+}
+
+static void
+ringcopyin(logring *r, u64 pos, const void *src, u32 n)
+{
+  u32 off = pos % LOGRING_SIZE;
+  u32 m = MIN(n, LOGRING_SIZE - off);
+  memmove(r->buf + off, src, m);
+  memmove(r->buf, (const char*)src + m, n - m);
+}
+
+static void
+ringcopyout(const logring *r, u64 pos, void *dst, u32 n)
+{
+  u32 off = pos % LOGRING_SIZE;
+  u32 m = MIN(n, LOGRING_SIZE - off);
+  memmove(dst, r->buf + off, m);
+  memmove((char*)dst + m, r->buf, n - m);
+}
+
+// Append a record to r, retiring the oldest records it overwrites.
+// Only r's CPU calls this, with interrupts disabled.
+static void
+logappend(logring *r, const char *s, u32 n)
+{
+  logrec rec = { rdtsc(), n };
+  u64 head = r->head.load(std::memory_order_relaxed);
+  u64 end = head + sizeof(rec) + n;
+  u64 first = r->first.load(std::memory_order_relaxed);
+  while (end - first > LOGRING_SIZE) {
+    logrec old;
+    ringcopyout(r, first, &old, sizeof(old));
+    first += sizeof(old) + old.len;
+  }
+  r->first.store(first, std::memory_order_relaxed);
+  // Readers check reserve after copying a record to detect that we
+  // overwrote it, so it must be visible before we write.
+  r->reserve.store(end);
+  ringcopyin(r, head, &rec, sizeof(rec));
+  ringcopyin(r, head + sizeof(rec), s, n);
+  r->head.store(end, std::memory_order_release);
+}
+
+// Return true if the bytes copied from r starting at pos were not
+// overwritten while they were being read.
+static bool
+logintact(const logring *r, u64 pos)
+{
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return r->reserve.load(std::memory_order_acquire) - pos <= LOGRING_SIZE;
+}
+
+// Read the header of the next record to drain from r.  Returns false
+// if r is empty.  Caller must hold cons.lock.
+static bool
+logpeek(logring *r, logrec *rec)
+{
+  for (;;) {
+    if (r->tail == r->head.load(std::memory_order_acquire))
+      return false;
+    u64 first = r->first.load(std::memory_order_acquire);
+    if (r->tail < first) {
+      logdropped += first - r->tail;
+      r->tail = first;
+      continue;
+    }
+    ringcopyout(r, r->tail, rec, sizeof(*rec));
+    if (rec->len <= LOGSTAGE_SIZE && logintact(r, r->tail))
+      return true;
+  }
+}
+
+// Copy the oldest queued record on any CPU into out and return its
+// length, or return -1 if nothing is queued.  Caller must hold
+// cons.lock.
+static int
+lognext(char *out)
+{
+  for (;;) {
+    logring *best = nullptr;
+    logrec bestrec;
+    for (int i = 0; i < ncpu; i++) {
+      logrec rec;
+      if (logpeek(&logrings[i], &rec) && (!best || rec.tsc < bestrec.tsc)) {
+        best = &logrings[i];
+        bestrec = rec;
+      }
+    }
+    if (!best)
+      return -1;
+    u64 pos = best->tail;
+    ringcopyout(best, pos + sizeof(bestrec), out, bestrec.len);
+    if (!logintact(best, pos))
+      continue;                 // The next logpeek counts the loss
+    best->tail = pos + sizeof(bestrec) + bestrec.len;
+    return bestrec.len;
+  }
+}
+
+// Write a drained record to the console.  Caller must hold cons.lock.
+static void
+logemit(const char *s, u32 n)
+{
+  if (logdropped) {
+    char msg[64];
+    int len = snprintf(msg, sizeof(msg), "[kmsg: %lu bytes dropped]\n",
+                       logdropped);
+    logdropped = 0;
+    logemit(msg, len);
+  }
+  for (u32 i = 0; i < n; i++)
+    consputc(s[i] & 0xff);
+  kmsgappend(s, n);
+}
+
+// Drain every queued record.  Caller must hold cons.lock.
+static void
+logflush(void)
+{
+  char buf[LOGSTAGE_SIZE];
+  int n;
+  while ((n = lognext(buf)) >= 0)
+    logemit(buf, n);
+}
+
+static void
+logcommit(logring *r)
+{
+  if (r->stagelen)
+    logappend(r, r->stage, r->stagelen);
+  r->stagelen = 0;
+}
+
+// Begin formatting a log record on this CPU.  Nested calls add to the
+// same record.
+static logring *
+logbegin(void)
+{
+  pushcli();
+  logring *r = &logrings[myid()];
+  r->nesting++;
+  return r;
+}
+
+static void
+logend(logring *r)
+{
+  if (--r->nesting == 0)
+    logcommit(r);
+  popcli();
+}
+
+// Return this CPU's log ring if it is formatting a record.
+static logring *
+logstaging(void)
+{
+  if (!cons.locking)
+    return nullptr;
+  logring *r = &logrings[myid()];
+  return r->nesting ? r : nullptr;
+}
+
+static void
+writestage(int c, void *arg)
+{
+  logring *r = (logring*) arg;
+  if (r->stagelen == LOGSTAGE_SIZE)
+    logcommit(r);
+  r->stage[r->stagelen++] = c;
+}
+
+// Switch to synchronous console output for a panic.
+static void
+logsync(void)
+{
+  logasync.store(false);
+}
+
+static void
+kmsg_thread(void *)
+{
+  condvar v("kmsg drain sleeper");
+  spinlock s;
+  char buf[LOGSTAGE_SIZE];
+
+  // Until now, the rest of boot printed synchronously, since nothing
+  // could drain the rings before the scheduler started.
+  if (!panicked)
+    logasync.store(true);
+
+  for (;;) {
+    u64 cur = nsectime();
+    for (;;) {
+      // Emit one record at a time so that panics and console writes
+      // don't wait for a whole backlog.
+      lock_guard<spinlock> l(&cons.lock);
+      int n = lognext(buf);
+      if (n < 0)
+        break;
+      logemit(buf, n);
+    }
+
+    s.acquire();
+    v.sleep_to(&s, cur + LOGDRAIN_MS * 1000000);
+    s.release();
+  }
+}
+
+// Write any queued log output to the console now.
+void
+consflush(void)
+{
+  if (panicked || !cons.locking)
+    return;
+  // The drain thread holds cons.lock for one record at a time, but
+  // give up after a while to prevent deadlock.
+  bool locked = tryacquire(&cons.lock);
+  if (!locked) {
+    u64 t = rdtsc() + 1000000000;
+    while(rdtsc() < t && !(locked = tryacquire(&cons.lock)))
+      ;
+  }
+  if (!locked)
+    return;
+  logflush();
+  release(&cons.lock);
+}
+
+bool
+ratelimit::allow()
+{
+  u64 now = nsectime();
+  u64 end = window_end.load(std::memory_order_relaxed);
+  if (now >= end &&
+      window_end.compare_exchange_strong(end, now + interval_ms * 1000000ull)) {
+    count.store(0);
+    u32 m = missed.exchange(0);
+    if (m)
+      cprintf("(%u similar messages suppressed)\n", m);
+  }
+  if (count.load(std::memory_order_relaxed) >= burst ||
+      count.fetch_add(1) >= burst) {
+    missed++;
+    return false;
+  }
+  return true;
+}
+
 // Print to the console.
 static void
 writecons(int c, void *arg)
 {
   consputc(c);
+  if (!cons.locking) {
+    char ch = c;
+    kmsgappend(&ch, 1);
+  }
 }
 
 
@@ -125,21 +438,21 @@ cprintf(const char *fmt, ...)
 {
   va_list ap;
 
-  int locking = cons.locking;
-  if(locking)
-    acquire(&cons.lock);
-
   va_start(ap, fmt);
-  vprintfmt(writecons, 0, fmt, ap);
+  vcprintf(fmt, ap);
   va_end(ap);
-
-  if(locking)
-    release(&cons.lock);
 }
 
 void
 vcprintf(const char *fmt, va_list ap)
 {
+  if (logasync.load(std::memory_order_relaxed)) {
+    logring *r = logbegin();
+    vprintfmt(writestage, r, fmt, ap);
+    logend(r);
+    return;
+  }
+
   int locking = cons.locking;
   if(locking)
     acquire(&cons.lock);
@@ -226,8 +539,10 @@ printtrap(struct trapframe *tf, bool lock)
   int tid = 0;
 
   lock_guard<spinlock> l;
-  if (lock && cons.locking)
+  if (lock && cons.locking) {
     l = cons.lock.guard();
+    logflush();
+  }
 
   if (myproc() != nullptr) {
     if (myproc()->name[0] != 0)
@@ -285,11 +600,15 @@ kerneltrap(struct trapframe *tf)
   cli();
 
   // Try to acquire the lock, but give up after a while to prevent deadlock.
-  if (!tryacquire(&cons.lock)) {
+  logsync();
+  bool locked = tryacquire(&cons.lock);
+  if (!locked) {
     u64 t = rdtsc() + 1000000000;
-    while(rdtsc() < t && !tryacquire(&cons.lock))
+    while(rdtsc() < t && !(locked = tryacquire(&cons.lock)))
       ;
   }
+  if (locked)
+    logflush();
 
   __cprintf("kernel ");
   printtrap(tf, false);
@@ -313,7 +632,9 @@ panic(const char *fmt, ...)
   va_list ap;
 
   cli();
+  logsync();
   acquire(&cons.lock);
+  logflush();
 
   __cprintf("cpu%d-%s: panic: ",
             mycpu()->id,
@@ -336,6 +657,8 @@ consolewrite(const char *buf, u32 n)
   int i;
 
   acquire(&cons.lock);
+  // Keep user output ordered after kernel output queued before it
+  logflush();
   for(i = 0; i < n; i++)
     consputc(buf[i] & 0xff);
   release(&cons.lock);
@@ -445,11 +768,31 @@ consoleread(char *dst, u32 n)
   return target - n;
 }
 
+// Read the most recent console output.
+static int
+kmsgread(char *dst, u32 off, u32 n)
+{
+  lock_guard<spinlock> l(&kmsg.lock);
+  u64 start = kmsg.total > KMSG_SIZE ? kmsg.total - KMSG_SIZE : 0;
+  if (off >= kmsg.total - start)
+    return 0;
+  if (n > kmsg.total - start - off)
+    n = kmsg.total - start - off;
+  for (u32 i = 0; i < n; i++)
+    dst[i] = kmsg.buf[(start + off + i) % KMSG_SIZE];
+  return n;
+}
+
 // Console stream support
 
 void
 console_stream::_begin_print()
 {
+  if (logasync.load(std::memory_order_relaxed)) {
+    logbegin();
+    return;
+  }
+
   // Acquire cons.lock in a reentrant way.  The holder check is
   // technically racy, but can't succeed unless this CPU is the
   // holder, in which case it's not racy.
@@ -465,6 +808,11 @@ console_stream::_begin_print()
 void
 console_stream::end_print()
 {
+  if (logring *r = logstaging()) {
+    logend(r);
+    return;
+  }
+
   if (--cons.nesting_count != 0 || !cons.locking)
     return;
 
@@ -476,22 +824,32 @@ console_stream::end_print()
 void
 console_stream::write(char c)
 {
-  consputc(c);
+  if (logring *r = logstaging())
+    writestage(c, r);
+  else
+    consputc(c);
 }
 
 void
 console_stream::write(sbuf buf)
 {
-  for (size_t i = 0; i < buf.len; i++)
-    consputc(buf.base[i]);
+  logring *r = logstaging();
+  for (size_t i = 0; i < buf.len; i++) {
+    if (r)
+      writestage(buf.base[i], r);
+    else
+      consputc(buf.base[i]);
+  }
 }
 
 bool
 panic_stream::begin_print()
 {
   cli();
+  logsync();
   console_stream::begin_print();
   if (cons.nesting_count == 1) {
+    logflush();
     print("cpu ", myid(), " (", myproc() ? myproc()->name : "unknown",
           ") panic: ");
   }
@@ -522,6 +880,10 @@ initconsole(void)
 
   devsw[MAJ_CONSOLE].write = consolewrite;
   devsw[MAJ_CONSOLE].read = consoleread;
+  devsw[MAJ_KMSG].pread = kmsgread;
+
+  // Output stays synchronous until the drain thread first runs
+  threadrun(kmsg_thread, nullptr, "kmsg drain");
 
   extpic->map_isa_irq(IRQ_KBD).enable();
   extpic->map_isa_irq(IRQ_MOUSE).enable();
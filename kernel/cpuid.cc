@@ -40,8 +40,10 @@ cpuid::cpuid() : basic_{}, extended_{}
 
   l = get_leaf(leafid::ext_features);
   features_.fsgsbase = l.b & (1<<0);
+  features_.erms = l.b & (1<<9);
   features_.invpcid = l.b & (1<<10);
   features_.intel_pt = l.b & (1<<25);
+  features_.fsrm = l.d & (1<<4);
   features_.md_clear = l.d & (1<<10);
   features_.spec_ctrl = l.d & (1<<26);
 
@@ -62,4 +64,5 @@ cpuid::cpuid() : basic_{}, extended_{}
 
   l = get_leaf(leafid::extended_features);
   features_.page1GB = l.d & (1<<26);
+  features_.rdtscp = l.d & (1<<27);
 }
@@ -222,7 +222,7 @@ e1000::transmit(void *buf, u32 len)
   // nothing to transmit.  Therefore, we can accomodate
   // TX_RING_SIZE-1 buffers.
   if (txinuse_ == TX_RING_SIZE-1) {
-    cprintf("TX ring overflow\n");
+    cprintf_ratelimited("TX ring overflow\n");
     return -1;
   }
 
@@ -187,6 +187,7 @@ exec(const char *path, const char * const *argv)
 
   // Switch to the new address space
   switchvm(oldvmap.get(), myproc()->vmap.get());
+  myproc()->vmap->publish_thread(myproc()->tgid, myproc()->tid);
 
   return 0;
 }
@@ -257,6 +258,9 @@ load_image(proc *p, const char *path, const char * const *argv,
     cprintf("kernel: load_image: could not allocate vmap\n");
     return -1;
   }
+  // As on Linux, the memory policy survives exec
+  if (p->vmap)
+    vmp->set_mempolicy(p->vmap->get_mempolicy());
 
   u64 max_va = 0;
   u64 load_addr = -1;
@@ -1,10 +1,34 @@
 #include "types.h"
 #include "fat32.hh"
 
-fat32_alloc_table::fat32_alloc_table(sref<fat32_cluster_cache> cluster_cache, u32 offset, u32 sectors)
-  : cluster_cache(std::move(cluster_cache)), table_base_offset(offset)
+fat32_alloc_table::fat32_alloc_table(sref<fat32_cluster_cache> cluster_cache, u32 offset, u32 sectors, u32 cluster_count)
+  : cluster_cache(std::move(cluster_cache)), table_base_offset(offset),
+    table_len(MIN(sectors * SECTORSIZ / sizeof(u32), cluster_count)),
+    free_lock("fat32 free map"), free_map(table_len)
 {
-  table_len = sectors * SECTORSIZ / sizeof(u32);
+  build_free_map();
+}
+
+// scans the whole FAT once at mount, so that allocation never has to
+void
+fat32_alloc_table::build_free_map()
+{
+  u64 entries_per_cluster = cluster_cache->cache_metadata->cluster_size / sizeof(u32);
+  // the first two entries are reserved, and never describe real clusters
+  for (u32 i = 2; i < table_len;) {
+    u64 byte_offset_on_disk = table_base_offset * SECTORSIZ + i * sizeof(u32);
+    u64 offset_within_cluster = 0;
+    auto c = cluster_cache->get_cluster_for_disk_byte_offset(byte_offset_on_disk, &offset_within_cluster);
+    assert(offset_within_cluster % sizeof(u32) == 0); // alignment
+    u64 starting_entry_in_cluster = offset_within_cluster / sizeof(u32);
+    assert(starting_entry_in_cluster < entries_per_cluster);
+    u64 max_entries_to_read = MIN(entries_per_cluster - starting_entry_in_cluster, table_len - i);
+    u32 *table_ptr = (u32*) c->buffer_ptr();
+    for (u32 j = 0; j < max_entries_to_read; j++)
+      if ((table_ptr[starting_entry_in_cluster + j] & 0x0FFFFFFFu) == 0x00000000)
+        free_map.set_free(i + j);
+    i += max_entries_to_read;
+  }
 }
 
 sref<fat32_cluster_cache::cluster>
@@ -25,32 +49,6 @@ fat32_alloc_table::get_table_entry_ptr(u32 cluster_id, u32 **table_entry_ptr_out
   return c; // we need to return this so that the sref to the cluster is kept, and it stays alive
 }
 
-bool
-fat32_alloc_table::find_first_free_cluster(u32 *cluster_id_out)
-{
-  // TODO: maybe use the FSInfo structure to help speed this up?
-
-  u64 entries_per_cluster = cluster_cache->cache_metadata->cluster_size / sizeof(u32);
-  for (u32 i = 0; i < table_len;) {
-    u64 byte_offset_on_disk = table_base_offset * SECTORSIZ + i * sizeof(u32);
-    u64 offset_within_cluster = 0;
-    auto c = cluster_cache->get_cluster_for_disk_byte_offset(byte_offset_on_disk, &offset_within_cluster);
-    assert(offset_within_cluster % sizeof(u32) == 0); // alignment
-    u64 starting_entry_in_cluster = offset_within_cluster / sizeof(u32);
-    assert(starting_entry_in_cluster < entries_per_cluster);
-    u64 max_entries_to_read = MIN(entries_per_cluster - starting_entry_in_cluster, table_len - i);
-    u32 *table_ptr = (u32*) c->buffer_ptr();
-    for (u32 j = 0; j < max_entries_to_read; j++) {
-      if ((table_ptr[starting_entry_in_cluster + j] & 0x0FFFFFFFu) == 0x00000000) {
-        *cluster_id_out = i + j;
-        return true;
-      }
-    }
-    i += max_entries_to_read;
-  }
-  return false;
-}
-
 bool
 fat32_alloc_table::get_next_cluster_id(u32 from_cluster_id, u32 *to_cluster_id_out)
 {
@@ -118,24 +116,31 @@ fat32_alloc_table::mark_cluster_free(u32 cluster_id)
   u32 *table_entry_ptr = nullptr;
   auto ref = get_table_entry_ptr(cluster_id, &table_entry_ptr);
 
-  u32 previous_value = *table_entry_ptr & 0x0FFFFFFFu;
-  if (previous_value == 0x0FFFFFF7)
+  // the top four bits of an entry are reserved: ignore them, but write them back unchanged
+  u32 previous_value = *table_entry_ptr;
+  if ((previous_value & 0x0FFFFFFFu) == 0x0FFFFFF7)
     panic("should never encounter a bad cluster while changing a file");
 
   barrier();
   *table_entry_ptr = (previous_value & 0xF0000000u) | 0x00000000u;
   ref->mark_dirty();
+
+  if ((previous_value & 0x0FFFFFFFu) != 0x00000000) {
+    lock_guard<spinlock> l(&free_lock);
+    free_map.set_free(cluster_id);
+  }
 }
 
 bool
-fat32_alloc_table::requisition_free_cluster(u32 *cluster_id_out)
+fat32_alloc_table::requisition_free_cluster(u32 *cluster_id_out, u32 hint)
 {
-  lock_guard<sleeplock> l(&allocation_lock);
   u32 cluster_id = 0;
-  if (!find_first_free_cluster(&cluster_id))
+  if (!reserve_cluster(hint, &cluster_id))
     return false;
   assert(cluster_id >= 2);
 
+  // nobody else can be given this cluster now that it's out of free_map, so we don't need any lock to claim it in the
+  // FAT itself.
   u32 *table_entry_ptr = nullptr;
   auto ref = get_table_entry_ptr(cluster_id, &table_entry_ptr);
 
@@ -150,3 +155,69 @@ fat32_alloc_table::requisition_free_cluster(u32 *cluster_id_out)
   *cluster_id_out = cluster_id;
   return true;
 }
+
+bool
+fat32_alloc_table::reserve_cluster(u32 hint, u32 *cluster_id_out)
+{
+  if (hint < 2 || hint >= table_len)
+    hint = 0;
+  {
+    reservation *r = &reservations[myid()];
+    lock_guard<spinlock> l(&r->lock);
+    if (reserve_cluster_locked(r, hint, cluster_id_out))
+      return true;
+  }
+  // the only free clusters left might be sitting in other CPUs' reservations
+  release_reservations();
+  reservation *r = &reservations[myid()];
+  lock_guard<spinlock> l(&r->lock);
+  return reserve_cluster_locked(r, hint, cluster_id_out);
+}
+
+bool
+fat32_alloc_table::reserve_cluster_locked(reservation *r, u32 hint, u32 *cluster_id_out)
+{
+  // the common case, for a file being extended from the same CPU as last time: the cluster it wants is the next one
+  // we reserved. this doesn't need to touch any shared state.
+  if (r->next < r->end && (!hint || r->next == hint)) {
+    *cluster_id_out = r->next++;
+    return true;
+  }
+
+  lock_guard<spinlock> l(&free_lock);
+  u32 start;
+  if (hint && free_map.is_free(hint)) {
+    // keep the file contiguous, even at the cost of giving back what's left of our current batch
+    for (; r->next < r->end; r->next++)
+      free_map.set_free(r->next);
+    start = hint;
+  } else if (r->next < r->end) {
+    *cluster_id_out = r->next++;
+    return true;
+  } else {
+    // if the hint is taken, the nearest free cluster after it is still better than nothing
+    start = hint ? hint : next_search;
+  }
+
+  u32 first;
+  if (!free_map.find_free(start, 2, &first))
+    return false;
+  u32 count = free_map.take_run(first, FAT32_RESERVE_BATCH);
+  r->next = first + 1;
+  r->end = first + count;
+  next_search = r->end;
+  *cluster_id_out = first;
+  return true;
+}
+
+void
+fat32_alloc_table::release_reservations()
+{
+  for (int i = 0; i < ncpu; i++) {
+    reservation *r = &reservations[i];
+    lock_guard<spinlock> l(&r->lock);
+    lock_guard<spinlock> fl(&free_lock);
+    for (; r->next < r->end; r->next++)
+      free_map.set_free(r->next);
+  }
+}
@@ -1,34 +1,42 @@
 #include <utility>
+#include <vector>
+#include <algorithm>
 
 #include "types.h"
 #include "fat32.hh"
 
+// how many times to wait 10ms for writeback to make room in a full cache before going over budget
+#define FAT32_EVICT_WAITS 100
+
 // TODO: this thread prevents the cluster cache from being freed; fix that
 void __attribute__((noreturn))
 fat32_cluster_cache::writeback_thread(void *cache_ptr)
 {
   auto cc = sref<fat32_cluster_cache>::transfer((fat32_cluster_cache*) cache_ptr);
-  condvar v("writeback thread sleeper");
-  spinlock s;
 
   for (;;) {
     u64 cur = nsectime();
 
     if (cc->allow_writeback) {
       u32 writebacks = cc->writeback_all();
-      if (writebacks)
-        cprintf("FAT32: wrote back %u entries in disk cache\n", writebacks);
+      if (writebacks) {
+        cprintf_ratelimited("FAT32: wrote back %u entries in disk cache\n", writebacks);
+        // some of the clusters we just wrote back may now be evictable
+        lock_guard<spinlock> l(&cc->alloc);
+        cc->evict_cv.wake_all();
+      }
     }
 
-    // flush the disk cache once per five seconds
-    s.acquire();
-    v.sleep_to(&s, cur + 5000000000);
-    s.release();
+    // flush the disk cache once per five seconds, or sooner if get_cluster finds the cache full of dirty clusters
+    cc->writeback_lock.acquire();
+    cc->writeback_cv.sleep_to(&cc->writeback_lock, cur + 5000000000);
+    cc->writeback_lock.release();
   }
 }
 
 fat32_cluster_cache::fat32_cluster_cache(disk *device, u64 max_clusters_used, u64 cluster_size, u64 first_cluster_offset)
-  : cache_metadata(make_sref<metadata>(device, max_clusters_used, cluster_size, first_cluster_offset)), cached_clusters(max_clusters_used)
+  : cache_metadata(make_sref<metadata>(device, max_clusters_used, cluster_size, first_cluster_offset)), cached_clusters(max_clusters_used),
+    evict_cv("FAT32 cluster eviction"), writeback_lock("FAT32 writeback sleeper"), writeback_cv("FAT32 writeback")
 {
   // increment so that we can pass the reference to the new thread
   this->inc();
@@ -79,7 +87,7 @@ fat32_cluster_cache::cluster::mark_dirty()
 }
 
 fat32_cluster_cache::cluster::cluster(s64 cluster_id, sref<metadata> metadata)
-  : cache_metadata(std::move(metadata)), needs_writeback(false), cluster_id(cluster_id)
+  : cache_metadata(std::move(metadata)), needs_writeback(false), cluster_id(cluster_id), referenced(false)
 {
   assert(cache_metadata);
 }
@@ -103,16 +111,19 @@ fat32_cluster_cache::cluster::~cluster()
   }
 }
 
-void
-fat32_cluster_cache::cluster::populate_cache_data()
+s64
+fat32_cluster_cache::cluster::disk_offset()
 {
-  if (cluster_data) {
-    barrier();
-    return;
-  }
-  lock_guard<sleeplock> l(&cluster_data_lock);
-  if (cluster_data)
-    return;
+  s64 offset = (s64) cache_metadata->cluster_size * cluster_id + cache_metadata->first_cluster_offset;
+  if (offset <= -(s64) cache_metadata->cluster_size)
+    panic("offset too far before the start of disk: %ld <= %ld", offset, -cache_metadata->cluster_size); // only allow reads that are at least partially in the disk
+  return offset;
+}
+
+u8 *
+fat32_cluster_cache::cluster::alloc_cache_data()
+{
+  assert(!cluster_data);
   assert(cache_metadata->cluster_size % PGSIZE == 0);
   kalloc_pages = cache_metadata->cluster_size / PGSIZE;
   u8 *data = (u8*) kalloc("FAT32 disk cluster", kalloc_pages * PGSIZE);
@@ -123,20 +134,33 @@ fat32_cluster_cache::cluster::populate_cache_data()
     // page up to kalloc_pages.
     new (page_info::of(data + PGSIZE * i)) page_info();
   }
-  s64 offset = (s64) cache_metadata->cluster_size * cluster_id + cache_metadata->first_cluster_offset;
-  if (offset <= -(s64) cache_metadata->cluster_size)
-    panic("offset too far before the start of disk: %ld <= %ld", offset, -cache_metadata->cluster_size); // only allow reads that are at least partially in the disk
+  return data;
+}
+
+void
+fat32_cluster_cache::cluster::populate_cache_data()
+{
+  if (cluster_data) {
+    barrier();
+    return;
+  }
+  lock_guard<sleeplock> l(&cluster_data_lock);
+  if (cluster_data)
+    return;
+  u8 *data = alloc_cache_data();
+  s64 offset = disk_offset();
   u64 read_len = cache_metadata->cluster_size;
+  u8 *read_ptr = data;
   if (offset < 0) {
     u64 corrective_shift = -offset;
     assert(corrective_shift < cache_metadata->cluster_size);
     memset(data, 0, corrective_shift); // fill unavailable bytes with zeroes
-    data += corrective_shift;
+    read_ptr += corrective_shift;
     read_len -= corrective_shift;
     offset += corrective_shift;
     assert(offset == 0);
   }
-  cache_metadata->device->read((char*) data, read_len, offset);
+  cache_metadata->device->read((char*) read_ptr, read_len, offset);
   barrier();
   cluster_data = data;
 }
@@ -151,10 +175,7 @@ fat32_cluster_cache::cluster::try_writeback()
   // needs_writeback again so that we redo the write later.
   needs_writeback.store(false);
 
-  // TODO: deduplicate this code with the same calculations in populate_cache_data
-  s64 offset = (s64) cache_metadata->cluster_size * cluster_id + cache_metadata->first_cluster_offset;
-  if (offset <= -(s64) cache_metadata->cluster_size)
-    panic("offset too far before the start of disk: %ld <= %ld", offset, -cache_metadata->cluster_size); // only allow reads that are at least partially in the disk
+  s64 offset = disk_offset();
   u64 write_len = cache_metadata->cluster_size;
   u8 *data = cluster_data;
   assert(data);
@@ -217,11 +238,12 @@ fat32_cluster_cache::evict_cluster(s64 cluster_id)
   i->skip_writeback();
 
   if (i == i->next_try_free) {
-    assert(first_try_free == i);
+    assert(clock_hand == i);
     assert(i->prev_try_free == i);
-    first_try_free = nullptr;
+    clock_hand = nullptr;
   } else {
-    first_try_free = i->next_try_free;
+    if (clock_hand == i)
+      clock_hand = i->next_try_free;
     i->next_try_free->prev_try_free = i->prev_try_free;
     i->prev_try_free->next_try_free = i->next_try_free;
   }
@@ -249,36 +271,48 @@ fat32_cluster_cache::try_get_cluster(s64 cluster_id)
 }
 
 sref<fat32_cluster_cache::cluster>
-fat32_cluster_cache::get_cluster(s64 cluster_id)
+fat32_cluster_cache::get_cluster(s64 cluster_id, bool touch)
 {
   cluster *i;
   if (cached_clusters.lookup(cluster_id, &i)) {
     assert(i);
-    if (i->tryinc())
+    if (i->tryinc()) {
+      // only write the flag when it changes, so that hits on a hot cluster don't bounce its cache line around
+      if (touch && !i->referenced.load(std::memory_order_relaxed))
+        i->referenced.store(true, std::memory_order_relaxed);
       return sref<cluster>::transfer(i);
+    }
   }
-  // TODO: is it okay to take a spinlock here, or do we need a sleeplock to avoid causing deadlocks?
   lock_guard<spinlock> l(&alloc);
-  if (cached_clusters.lookup(cluster_id, &i)) {
-    assert(i);
-    if (i->tryinc())
-      return sref<cluster>::transfer(i);
-    panic("should never fail to increment while we have the lock!");
-  }
-  if (clusters_used >= cache_metadata->max_clusters_used) {
-    if (!evict_unused_cluster()) // TODO: don't panic here; it could reasonably happen if writeback is disabled.
-      panic("entire FAT32 cluster cache used up by unfreeable clusters");
-    assert(clusters_used < cache_metadata->max_clusters_used);
+  for (u32 waits = 0;; waits++) {
+    if (cached_clusters.lookup(cluster_id, &i)) {
+      assert(i);
+      if (i->tryinc()) {
+        if (touch)
+          i->referenced.store(true, std::memory_order_relaxed);
+        return sref<cluster>::transfer(i);
+      }
+      panic("should never fail to increment while we have the lock!");
+    }
+    // evicting never sleeps, so it's done even if our caller holds other spinlocks. if there's nothing left to evict
+    // and we can't sleep, we go over budget for now instead; later allocations will evict their way back under it.
+    // the same goes if we've been waiting for a long time, since then the cache is probably pinned by references that
+    // aren't going away soon (such as memory mappings).
+    if (make_space_locked() || mycpu()->ncli != 1 || waits >= FAT32_EVICT_WAITS)
+      break;
+    sleep_for_space_locked();
+    // someone else may have brought in this cluster while we slept, so go back and check.
   }
   i = new cluster(cluster_id, cache_metadata);
   clusters_used++;
-  // this ends up being "least recently allocated" order, which is imperfect but better than some of the other options
-  if (first_try_free) {
-    i->next_try_free = first_try_free;
-    i->prev_try_free = first_try_free->prev_try_free;
+  // new clusters start out cold, and go just behind the clock hand, so that they have as long as possible to be
+  // referenced again before the hand considers them.
+  if (clock_hand) {
+    i->next_try_free = clock_hand;
+    i->prev_try_free = clock_hand->prev_try_free;
     i->next_try_free->prev_try_free = i->prev_try_free->next_try_free = i;
   } else {
-    first_try_free = i;
+    clock_hand = i;
     i->next_try_free = i->prev_try_free = i;
   }
   if (!cached_clusters.insert(cluster_id, i))
@@ -287,14 +321,107 @@ fat32_cluster_cache::get_cluster(s64 cluster_id)
   return sref<cluster>::newref(i);
 }
 
+void
+fat32_cluster_cache::wait_for_space()
+{
+  lock_guard<spinlock> l(&alloc);
+  for (u32 waits = 0; waits < FAT32_EVICT_WAITS; waits++) {
+    // as in get_cluster, a caller holding other spinlocks (such as a page fault under the vmap's lock) only gets
+    // what can be evicted without sleeping
+    if (make_space_locked() || mycpu()->ncli != 1)
+      return;
+    sleep_for_space_locked();
+  }
+}
+
+// evicts unused clusters until there is room for one more without going over budget. never sleeps. returns false if
+// everything left in the cache is in use or dirty.
+bool
+fat32_cluster_cache::make_space_locked()
+{
+  while (clusters_used >= cache_metadata->max_clusters_used)
+    if (!evict_unused_cluster())
+      return false;
+  return true;
+}
+
+// called when make_space_locked fails: sleeps for a while with alloc released, after which the caller should check
+// again.
+void
+fat32_cluster_cache::sleep_for_space_locked()
+{
+  // everything in the cache is either in use or dirty. kick the writeback thread so that the dirty clusters become
+  // evictable, and wait for it.
+  writeback_lock.acquire();
+  writeback_cv.wake_all();
+  writeback_lock.release();
+  evict_cv.sleep_to(&alloc, nsectime() + 10000000);
+}
+
+u32
+fat32_cluster_cache::max_run()
+{
+  u32 n = DISK_REQMAX / cache_metadata->cluster_size;
+  return n ? n : 1;
+}
+
+void
+fat32_cluster_cache::prefetch(sref<cluster> *clusters, u32 count)
+{
+  assert(count <= FAT32_READAHEAD);
+  sref<cluster> run[FAT32_READAHEAD];
+  u32 len = 0;
+  u32 limit = max_run();
+  for (u32 k = 0; k < count; k++) {
+    sref<cluster> c = std::move(clusters[k]);
+    // if someone else is already reading it in, let them; the rare clusters before the start of the disk are left to
+    // populate_cache_data to zero-fill.
+    if (c->populated() || c->disk_offset() < 0 || !c->cluster_data_lock.try_acquire())
+      continue;
+    if (c->populated()) {
+      c->cluster_data_lock.release();
+      continue;
+    }
+    if (len > 0 && (run[len - 1]->cluster_id + 1 != c->cluster_id || len == limit)) {
+      read_run(run, len);
+      len = 0;
+    }
+    run[len++] = std::move(c);
+  }
+  if (len > 0)
+    read_run(run, len);
+}
+
+// the cluster_data_lock of each cluster in the run must be held, and is released
+void
+fat32_cluster_cache::read_run(sref<cluster> *run, u32 len)
+{
+  kiovec iov[FAT32_READAHEAD];
+  u8 *data[FAT32_READAHEAD];
+  assert(len > 0 && len <= FAT32_READAHEAD);
+  for (u32 k = 0; k < len; k++) {
+    data[k] = run[k]->alloc_cache_data();
+    iov[k] = { data[k], cache_metadata->cluster_size };
+  }
+  cache_metadata->device->readv(iov, len, run[0]->disk_offset());
+  barrier();
+  for (u32 k = 0; k < len; k++) {
+    run[k]->cluster_data = data[k];
+    run[k]->cluster_data_lock.release();
+    run[k].reset();
+  }
+}
+
 // at the point where this is deallocated, it must be the case that no references remain through which a get()
 // operation could be performed, so we do not bother taking the lock.
 fat32_cluster_cache::~fat32_cluster_cache()
 {
   // all we need to do to handle our deletion is to get rid of our manually-tracked references in cached_clusters.
   // that way, all of our clusters will be freed as their remaining references drop.
-  cluster *try_free = first_try_free;
-  first_try_free = nullptr;
+  if (clock_hand)
+    clock_hand->prev_try_free->next_try_free = nullptr; // break the ring so that the walk below terminates
+  cluster *try_free = clock_hand;
+  clock_hand = nullptr;
   while (try_free) {
     cluster *cur = try_free;
     try_free = cur->next_try_free;
@@ -321,39 +448,43 @@ fat32_cluster_cache::enable_writeback()
 bool
 fat32_cluster_cache::evict_unused_cluster()
 {
-  if (!first_try_free) {
+  if (!clock_hand) {
     assert(clusters_used == 0);
     return false;
   }
   assert(clusters_used > 0);
-  cluster *try_free = first_try_free;
-  do {
-    if (try_free->needs_writeback.load()) {
+  // every cluster can need up to three visits: one to clear its referenced bit, one to demote it from hot to cold, and
+  // one to evict it.
+  for (u64 steps = 3 * clusters_used; steps > 0; steps--) {
+    cluster *c = clock_hand;
+    clock_hand = c->next_try_free;
+    if (c->referenced.load(std::memory_order_relaxed)) {
+      c->referenced.store(false, std::memory_order_relaxed);
+      c->hot = true;
+    } else if (c->hot) {
+      c->hot = false;
+    } else if (c->needs_writeback.load()) {
       // cannot free this one without it being written back
     } else {
-      try_free->dec();
+      c->dec();
       // if tryinc fails, then # of refs has dropped to zero, and we can safely free this
-      if (!try_free->tryinc()) {
-        // let's free this one. remove it from the linked list and chainhash, then actually free it and decrement the number of clusters used
-        if (try_free == try_free->next_try_free) {
-          assert(first_try_free == try_free);
-          assert(try_free->prev_try_free == try_free);
-          first_try_free = nullptr;
+      if (!c->tryinc()) {
+        // let's free this one. remove it from the ring and chainhash, then actually free it and decrement the number of clusters used
+        if (c == c->next_try_free) {
+          assert(c->prev_try_free == c);
+          clock_hand = nullptr;
         } else {
-          first_try_free = try_free->next_try_free;
-          try_free->next_try_free->prev_try_free = try_free->prev_try_free;
-          try_free->prev_try_free->next_try_free = try_free->next_try_free;
+          c->next_try_free->prev_try_free = c->prev_try_free;
+          c->prev_try_free->next_try_free = c->next_try_free;
         }
-        if (!cached_clusters.remove(try_free->cluster_id, try_free))
+        if (!cached_clusters.remove(c->cluster_id, c))
           panic("should have been able to remove cluster from FAT32 cached_clusters");
         clusters_used--;
-        // cprintf("evicted cluster for %ld; %lu now used\n", try_free->cluster_id, clusters_used);
-        delete try_free;
+        delete c;
         return true;
       }
     }
-    try_free = try_free->next_try_free;
-  } while (try_free != first_try_free);
+  }
   return false;
 }
 
@@ -363,7 +494,7 @@ fat32_cluster_cache::writeback_all()
   s64 cluster_id, prev_cluster_id;
   if (!cached_clusters.enumerate(nullptr, &cluster_id))
     return 0;
-  u32 writebacks = 0;
+  std::vector<sref<cluster> > dirty;
   do {
     cluster *i = nullptr;
     // if we can't find it? no big deal. must have been removed from the cache; it's not like we hold the allocation lock.
@@ -374,12 +505,53 @@ fat32_cluster_cache::writeback_all()
       if (i->tryinc()) {
         auto ref = sref<cluster>::transfer(i);
         // the fact that we have a reference now prevents it from getting garbage-collected
-        if (ref->try_writeback())
-          writebacks++;
+        if (ref->needs_writeback.load())
+          dirty.push_back(std::move(ref));
       }
     }
 
     prev_cluster_id = cluster_id;
   } while (cached_clusters.enumerate(&prev_cluster_id, &cluster_id));
+
+  // write back in disk order, merging clusters that are adjacent on disk into a single request
+  std::sort(dirty.begin(), dirty.end(), [](const sref<cluster> &a, const sref<cluster> &b) {
+    return a->cluster_id < b->cluster_id;
+  });
+  u32 writebacks = 0;
+  u32 limit = max_run();
+  for (size_t start = 0; start < dirty.size(); ) {
+    size_t end = start + 1;
+    if (dirty[start]->disk_offset() >= 0)
+      while (end < dirty.size() && end - start < limit && dirty[end]->cluster_id == dirty[end - 1]->cluster_id + 1)
+        end++;
+    if (end - start == 1) {
+      if (dirty[start]->try_writeback())
+        writebacks++;
+    } else {
+      writebacks += write_run(&dirty[start], end - start);
+    }
+    start = end;
+  }
+  return writebacks;
+}
+
+// like try_writeback, but for a run of clusters that are adjacent on disk, none of which are before its start
+u32
+fat32_cluster_cache::write_run(sref<cluster> *run, u32 len)
+{
+  kiovec iov[DISK_REQMAX / PGSIZE];
+  assert(len > 1 && len <= DISK_REQMAX / PGSIZE);
+  u32 writebacks = 0;
+  for (u32 k = 0; k < len; k++) {
+    // even if this one has been written back since we looked, it's still cheaper to write it again than to split
+    // the request.
+    if (run[k]->needs_writeback.load()) {
+      run[k]->needs_writeback.store(false);
+      writebacks++;
+    }
+    assert(run[k]->cluster_data);
+    iov[k] = { run[k]->cluster_data, cache_metadata->cluster_size };
+  }
+  cache_metadata->device->writev(iov, len, run[0]->disk_offset());
   return writebacks;
 }
@@ -35,7 +35,7 @@ vfs_enable_fat32_writeback(const sref<filesystem> &fs)
 fat32_filesystem::fat32_filesystem(const sref<fat32_cluster_cache>& cluster_cache, fat32_header hdr)
   : hdr(hdr), weaklink(make_sref<fat32_filesystem_weaklink>(this)), cluster_cache(cluster_cache)
 {
-  fat = make_sref<fat32_alloc_table>(cluster_cache, hdr.first_fat_sector(), hdr.sectors_per_fat());
+  fat = make_sref<fat32_alloc_table>(cluster_cache, hdr.first_fat_sector(), hdr.sectors_per_fat(), hdr.num_data_clusters() + 2);
   u32 cluster = hdr.root_directory_cluster_id;
   root_node = make_sref<vnode_fat32>(weaklink, cluster, true, sref<vnode_fat32>(), 0);
 }
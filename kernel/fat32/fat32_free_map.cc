@@ -0,0 +1,131 @@
+#include "types.h"
+#include "fat32.hh"
+
+fat32_free_map::fat32_free_map(u32 cluster_count)
+  : cluster_count(cluster_count)
+{
+  assert(cluster_count > 0);
+  u64 bits = cluster_count;
+  u64 total_words = 0;
+  do {
+    assert(levels < max_levels);
+    level_len[levels] = (bits + 63) / 64;
+    total_words += level_len[levels];
+    bits = level_len[levels];
+    levels++;
+  } while (bits > 1);
+
+  // a large volume needs megabytes of bitmap, which is more than kmalloc can provide
+  alloc_bytes = PGROUNDUP(total_words * sizeof(u64));
+  alloc_base = (u64*) kalloc("FAT32 free cluster map", alloc_bytes);
+  if (!alloc_base)
+    panic("out of memory for FAT32 free cluster map");
+  memset(alloc_base, 0, alloc_bytes);
+  u64 *next = alloc_base;
+  for (u32 l = 0; l < levels; l++) {
+    level_words[l] = next;
+    next += level_len[l];
+  }
+}
+
+fat32_free_map::~fat32_free_map()
+{
+  kfree(alloc_base, alloc_bytes);
+}
+
+bool
+fat32_free_map::is_free(u32 cluster_id)
+{
+  assert(cluster_id < cluster_count);
+  return level_words[0][cluster_id / 64] & (1ull << (cluster_id % 64));
+}
+
+void
+fat32_free_map::set_free(u32 cluster_id)
+{
+  assert(cluster_id < cluster_count);
+  u64 bit = cluster_id;
+  if (level_words[0][bit / 64] & (1ull << (bit % 64)))
+    panic("FAT32 cluster %u freed twice", cluster_id);
+  free_clusters++;
+  // set the bit in each level until we reach a word that was already nonzero, since its parent bit is then already set
+  for (u32 l = 0; l < levels; l++) {
+    u64 &word = level_words[l][bit / 64];
+    bool was_empty = word == 0;
+    word |= 1ull << (bit % 64);
+    if (!was_empty)
+      break;
+    bit /= 64;
+  }
+}
+
+void
+fat32_free_map::set_used(u32 cluster_id)
+{
+  assert(cluster_id < cluster_count);
+  u64 bit = cluster_id;
+  if (!(level_words[0][bit / 64] & (1ull << (bit % 64))))
+    panic("FAT32 cluster %u is already in use", cluster_id);
+  assert(free_clusters > 0);
+  free_clusters--;
+  // clear the bit in each level until we reach a word that is still nonzero
+  for (u32 l = 0; l < levels; l++) {
+    u64 &word = level_words[l][bit / 64];
+    word &= ~(1ull << (bit % 64));
+    if (word != 0)
+      break;
+    bit /= 64;
+  }
+}
+
+bool
+fat32_free_map::find_from(u64 start, u32 *cluster_id_out)
+{
+  // climb until we find a level with a set bit at or after our position in it...
+  u32 l = 0;
+  u64 bit = start;
+  for (;;) {
+    if (bit / 64 >= level_len[l])
+      return false;
+    u64 word = level_words[l][bit / 64] & (~0ull << (bit % 64));
+    if (word) {
+      bit = (bit & ~63ull) + __builtin_ctzll(word);
+      break;
+    }
+    if (l + 1 == levels)
+      return false;
+    // nothing more in this word, so move on to the parent of the next word
+    bit = bit / 64 + 1;
+    l++;
+  }
+  // ...then descend through the first set bit of each nonempty word below it
+  while (l > 0) {
+    l--;
+    u64 word = level_words[l][bit];
+    assert(word);
+    bit = bit * 64 + __builtin_ctzll(word);
+  }
+  assert(bit < cluster_count);
+  *cluster_id_out = bit;
+  return true;
+}
+
+bool
+fat32_free_map::find_free(u32 start, u32 first_valid, u32 *cluster_id_out)
+{
+  if (start < cluster_count && find_from(start, cluster_id_out))
+    return true;
+  return find_from(first_valid, cluster_id_out);
+}
+
+u32
+fat32_free_map::take_run(u32 first, u32 max_count)
+{
+  u32 n = 0;
+  while (n < max_count && first + n < cluster_count && is_free(first + n)) {
+    set_used(first + n);
+    n++;
+  }
+  assert(n > 0);
+  return n;
+}
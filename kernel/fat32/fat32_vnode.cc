@@ -3,7 +3,8 @@
 #include "fat32.hh"
 
 vnode_fat32::vnode_fat32(sref<fat32_filesystem_weaklink> fs, u32 first_cluster_id, bool is_directory, sref<vnode_fat32> parent_dir, u32 file_size)
-  : filesystem(std::move(fs)), parent_dir(parent_dir), directory(is_directory), file_byte_length(file_size)
+  : rcu_freed("vnode_fat32", this, sizeof(*this)), filesystem(std::move(fs)), parent_dir(parent_dir),
+    directory(is_directory), file_byte_length(file_size)
 {
   if (is_directory)
     assert(file_size == 0);
@@ -88,7 +89,8 @@ vnode_fat32::onzero()
     retire_clusters();
   if (cluster_count > 0)
     kmfree(cluster_ids, sizeof(u32) * cluster_count);
-  delete this;
+  // ref_child may still be walking past us under a gc epoch
+  gc_delayed(this);
 }
 
 void
@@ -158,6 +160,7 @@ vnode_fat32::read_at(char *addr, u64 off, size_t len)
   while (len > 0) {
     u32 cluster_local_id = off / bytes_per_cluster;
     u32 cluster_byte_offset = off % bytes_per_cluster;
+    readahead(cluster_local_id);
     sref<fat32_cluster_cache::cluster> cluster = get_cluster_data(cluster_local_id);
     if (!cluster)
       break; // we assume that the file was resized to be smaller since we checked file_size()
@@ -188,7 +191,7 @@ vnode_fat32::expand_to_cluster_count(size_t clusters_needed)
   for (u32 i = cluster_count; i < clusters_needed; i++) {
     // when we requisition a cluster, it comes already set to the "final cluster in the file" state.
     u32 new_cluster = 0;
-    if (!fat->requisition_free_cluster(&new_cluster))
+    if (!fat->requisition_free_cluster(&new_cluster, new_cluster_ids[i-1] + 1))
       panic("unimplemented: handling for running out of disk space");
     assert(new_cluster >= 2);
     new_cluster_ids[i] = new_cluster;
@@ -366,6 +369,8 @@ vnode_fat32::get_cluster_data(u32 cluster_local_id)
 {
   sref<fat32_cluster_cache::cluster> c;
 
+  // get_cluster can't wait for eviction under resize_lock
+  cluster_cache->wait_for_space();
   lock_guard<spinlock> l(&resize_lock);
   if (cluster_local_id >= cluster_count)
     return sref<fat32_cluster_cache::cluster>();
@@ -378,6 +383,26 @@ vnode_fat32::get_cluster_data(u32 cluster_local_id)
   // caller completes.
 }
 
+void
+vnode_fat32::readahead(u32 cluster_local_id)
+{
+  sref<fat32_cluster_cache::cluster> clusters[FAT32_READAHEAD];
+  u32 count = 0;
+  {
+    lock_guard<spinlock> l(&resize_lock);
+    if (cluster_local_id >= cluster_count)
+      return;
+    // only read ahead on a miss, so that reads that hit in the cache stay cheap
+    auto c = cluster_cache->try_get_cluster(cluster_ids[cluster_local_id] - 2);
+    if (c && c->populated())
+      return;
+    // we have to take the references under resize_lock, for the same reason as get_cluster_data
+    for (u32 i = cluster_local_id; i < cluster_count && count < FAT32_READAHEAD; i++)
+      clusters[count++] = cluster_cache->get_cluster(cluster_ids[i] - 2, false);
+  }
+  cluster_cache->prefetch(clusters, count);
+}
+
 static void
 lowercase(char *buf)
 {
@@ -707,6 +732,26 @@ vnode_fat32::ref_child_locked(const char *name, sref<vnode_fat32> *prev_out)
 sref<vnode_fat32>
 vnode_fat32::ref_child(const char *name)
 {
+  // lookups vastly outnumber changes to a directory, so first try an optimistic read section, which doesn't touch the
+  // lock's reader indicators.  vnodes are freed through gc_delayed, so the sibling list stays safe to follow under a gc
+  // epoch even while a writer changes it; the reference is only kept if no writer got in the way.
+  {
+    scoped_gc_epoch rcu_read;
+    seqcount<u32>::reader r;
+    if (structure_lock.read_optimistic(&r) && children_populated) {
+      vnode_fat32 *found = nullptr;
+      for (vnode_fat32 *child = first_child_node.get(); child; child = child->next_sibling_node.get()) {
+        if (strcasecmp(child->my_filename.ptr(), name) == 0) {
+          found = child;
+          break;
+        }
+      }
+      sref<vnode_fat32> out;
+      if ((!found || out.init(found)) && !r.need_retry())
+        return out;
+    }
+  }
+
   auto readlock = populate_children();
   return ref_child_locked(name, nullptr);
 }
@@ -729,7 +774,8 @@ vnode_fat32::next_dirent(const char *last, strbuf<FILENAME_MAX> *next)
     if (strcmp(last, "..") == 0) {
       v = first_child_node;
     } else {
-      v = ref_child(last);
+      // already holding the read lock, which must not be taken twice
+      v = ref_child_locked(last, nullptr);
       if (!v)
         panic("previous name not found when returning to next_dirent");
       v = v->next_sibling_node;
@@ -11,6 +11,75 @@
 
 struct devsw __mpalign__ devsw[NDEV];
 
+int
+file::sendmmsg(struct kmmsg *msgs, unsigned int n, int flags)
+{
+  unsigned int i;
+  for (i = 0; i < n; i++) {
+    kmmsg *m = &msgs[i];
+    // sendto takes a single buffer
+    if (m->iovcnt > 1)
+      break;
+    userptr<void> buf(m->iovcnt ? m->iov[0].base : nullptr);
+    ssize_t r = sendto(buf, m->iovcnt ? m->iov[0].len : 0, flags,
+                       (struct sockaddr*)m->addr, m->addrlen);
+    if (r < 0)
+      return i ? i : r;
+    m->len = r;
+  }
+  return i ? i : -1;
+}
+
+int
+file::recvmmsg(struct kmmsg *msgs, unsigned int n, int flags, u64 deadline)
+{
+  // Without a way to poll the file, only the first message can be
+  // received without risking blocking past the others.
+  kmmsg *m = &msgs[0];
+  if (n == 0 || m->iovcnt > 1)
+    return -1;
+  userptr<void> buf(m->iovcnt ? m->iov[0].base : nullptr);
+  ssize_t r = recvfrom(buf, m->iovcnt ? m->iov[0].len : 0, flags,
+                       m->addr, &m->addrlen);
+  if (r < 0)
+    return r;
+  m->len = r;
+  return 1;
+}
+
+ssize_t
+file::read_user(userptr<void> data, size_t n)
+{
+  char b[PGSIZE];
+  ssize_t bytes = 0;
+  while (bytes < n) {
+    size_t len = n - bytes;
+    if (len > PGSIZE)
+      len = PGSIZE;
+
+    ssize_t ret = read(b, len);
+    if (ret <= 0)
+      return bytes ? bytes : ret;
+    if (!(data + bytes).store_bytes(b, ret))
+      return bytes ? bytes : -1;
+
+    bytes += ret;
+  }
+  return bytes;
+}
+
+ssize_t
+file::pread_user(userptr<void> data, size_t n, off_t offset)
+{
+  char* b = (char*) kmalloc(n, "preadbuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([&](){kmfree(b, n);});
+  ssize_t r = pread(b, n, offset);
+  if (r > 0 && !data.store_bytes(b, r))
+    return -1;
+  return r;
+}
 
 int
 file_inode::stat(struct kernel_stat *st, enum stat_flags flags)
@@ -57,6 +126,34 @@ file_inode::read(char *addr, size_t n)
   return r;
 }
 
+// Regular files copy straight from their pages to user memory
+ssize_t
+file_inode::read_user(userptr<void> data, size_t n)
+{
+  if (!readable)
+    return -1;
+  if (!ip->is_regular_file())
+    return file::read_user(data, n);
+  if (!ip->is_offset_in_file(off))
+    return 0;
+
+  auto l = off_lock.guard();
+  ssize_t r = ip->read_at_user(data, off, n);
+  if (r > 0)
+    off += r;
+  return r;
+}
+
+ssize_t
+file_inode::pread_user(userptr<void> data, size_t n, off_t off)
+{
+  if (!readable)
+    return -1;
+  if (!ip->is_regular_file())
+    return file::pread_user(data, n, off);
+  return ip->read_at_user(data, off, n);
+}
+
 ssize_t
 file_inode::write(const userptr<void> data, size_t n) {
   if (!writable)
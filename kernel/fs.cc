@@ -43,6 +43,9 @@
 #include "cmdline.hh"
 #include "disk.hh"
 
+#include <algorithm>
+#include <vector>
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static sref<inode> the_root;
 
@@ -388,7 +391,7 @@ ialloc(u32 dev, short type)
 
 // Copy inode, which has changed, from memory to disk.
 void
-iupdate(struct inode *ip)
+iupdate(sref<inode> ip)
 {
   // XXX call iupdate to flush in-memory inode state to
   // buffer cache.  use seq value to detect updates.
@@ -912,6 +915,107 @@ writei(sref<inode> ip, const char *src, u32 off, u32 n)
   return tot;
 }
 
+// Write the dirty buffers holding bytes [off, off+n) of ip back to
+// disk, together with its on-disk inode, indirect blocks and the
+// block bitmap blocks covering its data.  The caller should iupdate
+// ip first.  Blocks are written in disk order, merging consecutive
+// blocks into single requests.  Returns the number of disk requests.
+u64
+iwriteback(sref<inode> ip, u32 off, u32 n)
+{
+  scoped_gc_epoch e;
+
+  ward_superblock sb;
+  readsb(ip->dev, &sb);
+
+  std::vector<sref<buf>> bufs;
+  auto add = [&](u32 block) {
+    sref<buf> bp = buf::get(ip->dev, block);
+    if (bp->dirty())
+      bufs.push_back(std::move(bp));
+  };
+
+  add(IBLOCK(ip->inum));
+  if (ip->addrs[NDIRECT])
+    add(ip->addrs[NDIRECT]);
+  if (ip->addrs[NDIRECT+1])
+    add(ip->addrs[NDIRECT+1]);
+
+  u32 last_bitmap = 0;
+  for (u32 bn = off / BSIZE; n && bn <= (off + n - 1) / BSIZE; bn++) {
+    u32 addr;
+    if (bn < NDIRECT) {
+      addr = ip->addrs[bn];
+    } else if (bn < NDIRECT + NINDIRECT) {
+      volatile u32 *iaddrs = ip->iaddrs;
+      addr = iaddrs ? iaddrs[bn - NDIRECT] : 0;
+    } else {
+      // Doubly-indirect blocks are written along with their data
+      addr = bmap(ip, bn);
+      u32 l1 = (bn - NDIRECT - NINDIRECT) / NINDIRECT;
+      sref<buf> top = buf::get(ip->dev, ip->addrs[NDIRECT+1]);
+      auto copy = top->read();
+      add(((u32*)copy->data)[l1]);
+    }
+    if (!addr)
+      continue;
+    add(addr);
+    if (BBLOCK(addr, sb.ninodes) != last_bitmap) {
+      last_bitmap = BBLOCK(addr, sb.ninodes);
+      add(last_bitmap);
+    }
+  }
+
+  std::sort(bufs.begin(), bufs.end(),
+            [](const sref<buf> &a, const sref<buf> &b) {
+              return a->block() < b->block();
+            });
+  bufs.erase(std::unique(bufs.begin(), bufs.end(),
+                         [](const sref<buf> &a, const sref<buf> &b) {
+                           return a->block() == b->block();
+                         }),
+             bufs.end());
+  return buf::writeback(bufs.data(), bufs.size());
+}
+
+// Write back the dirty block bitmap blocks of dev, which deferred
+// frees of truncated blocks leave behind.  Returns the number of disk
+// requests.
+u64
+bitmap_writeback(u32 dev)
+{
+  scoped_gc_epoch e;
+
+  ward_superblock sb;
+  readsb(dev, &sb);
+
+  std::vector<sref<buf>> bufs;
+  for (u32 b = 0; b < sb.size; b += BPB) {
+    sref<buf> bp = buf::get(dev, BBLOCK(b, sb.ninodes));
+    if (bp->dirty())
+      bufs.push_back(std::move(bp));
+  }
+  return buf::writeback(bufs.data(), bufs.size());
+}
+
+// Release an inode that no directory on disk refers to any more:
+// free its blocks and mark it unallocated on disk.
+void
+ifree(sref<inode> ip)
+{
+  ilock(ip, 1);
+  itrunc(ip.get());
+  {
+    auto w = ip->seq.write_begin();
+    ip->type = 0;
+  }
+  while (ip->nlink())
+    ip->unlink();
+  iupdate(ip);
+  iunlock(ip);
+  iwriteback(ip, 0, 0);
+}
+
 //PAGEBREAK!
 // Directories
 
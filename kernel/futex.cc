@@ -16,6 +16,8 @@
 struct futex_list_bucket {
   ilist<proc, &proc::futex_link> items;
   spinlock lock;
+
+  futex_list_bucket() : lock("futex bucket", LOCKSTAT_FUTEX, QSPIN_FUTEX) {}
 };
 
 struct futex_list {
@@ -62,19 +64,25 @@ u64 futex_bucket(futexkey* key) {
   return (hash(key->address) ^ hash(key->ptr)) % FUTEX_HASH_BUCKETS;
 }
 
-u32 futexval(futexkey* key)
+// Read the futex word.  This runs under the bucket lock, so it fails
+// for a shared futex whose page is still on disk; the caller loads the
+// page and retries.
+static bool futexval(futexkey* key, u32* val)
 {
   if (key->shared) {
-    auto p = key->pageable->get_page_info(PGROUNDDOWN(key->address));
-    return *(u32*)((char*)p->va() + (key->address % PGSIZE));
+    auto p = key->pageable->get_page_info(key->address / PGSIZE);
+    if (!p)
+      return false;
+    *val = *(u32*)((char*)p->va() + (key->address % PGSIZE));
+    return true;
   }
 
-  u32 val;
-  if (key->vmap == myproc()->vmap.get() && !fetchmem_ncli(&val, (const void*)(key->address), 4))
-    return val;
+  if (key->vmap == myproc()->vmap.get() && !fetchmem_ncli(val, (const void*)(key->address), 4))
+    return true;
 
   u32* kva = (u32*)key->vmap->pagelookup(key->address);
-  return kva ? *kva : 0;
+  *val = kva ? *kva : 0;
+  return true;
 }
 
 long futexwait(futexkey&& key, u32 val, u64 timer)
@@ -82,7 +90,18 @@ long futexwait(futexkey&& key, u32 val, u64 timer)
   futex_list_bucket* bucket = &futex_waiters.buckets[futex_bucket(&key)];
   scoped_acquire l(&bucket->lock);
 
-  if (futexval(&key) != val)
+  u32 cur;
+  while (!futexval(&key, &cur)) {
+    u64 pageidx = key.address / PGSIZE;
+    if (!key.pageable->needs_load(pageidx))
+      return -EFAULT;
+    // Read the page in without the bucket lock, since that may sleep
+    l.release();
+    if (!key.pageable->load_page(pageidx))
+      return -ENOMEM;
+    l = scoped_acquire(&bucket->lock);
+  }
+  if (cur != val)
     return -EWOULDBLOCK;
 
   myproc()->futex_key = std::move(key);
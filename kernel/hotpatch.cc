@@ -122,6 +122,10 @@ bool patch_needed(patch* p, bool ktext) {
     cmdline_value = cmdline_params.mds;
   } else if(strcmp(p->option, "fsgsbase") == 0) {
     cmdline_value = cpuid::features().fsgsbase;
+  } else if(strcmp(p->option, "erms") == 0) {
+    cmdline_value = cpuid::features().erms;
+  } else if(strcmp(p->option, "fsrm") == 0) {
+    cmdline_value = cpuid::features().fsrm;
   } else if(strcmp(p->option, "spectre_v2") == 0) {
     cmdline_value = cmdline_params.spectre_v2;
   } else if(strcmp(p->option, "retpolines") == 0) {
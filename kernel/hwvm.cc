@@ -19,6 +19,7 @@
 #include "cmdline.hh"
 #include "uefi.hh"
 #include "multiboot.hh"
+#include "kmap.hh"
 
 using namespace std;
 
@@ -57,6 +58,15 @@ atomic<u64> next_asid;
 
 DEFINE_PERCPU(const page_map_cache*, cur_page_map_cache);
 
+// Per-CPU kmap_local slots.  ptes points to the public alias of the
+// page table of this CPU's KMAP_SLOTS slots, so it can be updated
+// without secrets mapped.  Slots [0, top) are in use.
+struct kmap_state {
+  std::atomic<pme_t>* ptes;
+  size_t top;
+};
+DEFINE_QPERCPU_NOINIT(kmap_state, kmap_states, NO_INT);
+
 static bool use_invpcid __attribute__((section (".qdata"))) = true;
 
 static const char *levelnames[] __attribute__((section (".qdata"))) = {
@@ -133,6 +143,9 @@ public:
     memset(&pair.user->e[0], 0, PGSIZE);
     pair.user->e[p].store(e[p]);
 
+    size_t km = PX(L_PML4, KKMAP);
+    pair.user->e[km].store(e[km]);
+
     return pair;
   }
 
@@ -453,6 +466,15 @@ initpg(struct cpu *c)
       assert(!it.is_set());
     }
 
+    // Create kmap area.  Each CPU fills in its own page table below.
+    static_assert(NCPU * KMAP_SLOTS * PGSIZE <= KKMAPEND - KKMAP,
+                  "kmap area too small");
+    for (auto it = kpml4.find(KKMAP, pgmap::L_PDPT); it.index() < KKMAPEND;
+         it += it.span()) {
+      it.create(0);
+      assert(!it.is_set());
+    }
+
     // // Create UEFI area.
     // if (multiboot.flags & MULTIBOOT2_FLAG_EFI_MMAP) {
     //   for (int i = 0; i < multiboot.efi_mmap_descriptor_count; i++) {
@@ -590,6 +612,69 @@ inittls(struct cpu *c)
   writemsr(MSR_GS_KERNBASE, (u64)&c->cpu);
   c->cpu = c;
   c->proc = nullptr;
+
+  // Let user space find its CPU with rdtscp (see uk/timepage.h)
+  if (cpuid::features().rdtscp)
+    writemsr(MSR_TSC_AUX, c->id);
+}
+
+// Create the kmap_local page table of every CPU.  Requires initkalloc
+// and initpercpu.
+void
+initkmap(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    auto it = kpml4.find(KKMAP + c * KMAP_SLOTS * PGSIZE, pgmap::L_4K);
+    it.create(0);
+    void* pt = (char*)it.get_pgmap() - KBASE + KPUBLIC;
+    register_public_range(pt, 1);
+    kmap_states[c].ptes = (std::atomic<pme_t>*)pt;
+    kmap_states[c].top = 0;
+  }
+}
+
+void*
+kmap_local(const paddr* pas, size_t npages)
+{
+  pushcli();
+  kmap_state* ks = &*kmap_states;
+  if (ks->top + npages > KMAP_SLOTS)
+    panic("kmap_local: out of slots (%lu in use)", ks->top);
+
+  size_t first = ks->top;
+  ks->top += npages;
+  for (size_t i = 0; i < npages; i++)
+    ks->ptes[first + i].store(pas[i] | PTE_P | PTE_W | PTE_NX | PTE_A | PTE_D,
+                              memory_order_relaxed);
+  kstats::inc(&kstats::kmap_local_count, npages);
+  return (void*)(KKMAP + (myid() * KMAP_SLOTS + first) * PGSIZE);
+}
+
+void
+kunmap_local(void* va, size_t npages)
+{
+  kmap_state* ks = &*kmap_states;
+  size_t first = ((uintptr_t)va - KKMAP) / PGSIZE - myid() * KMAP_SLOTS;
+  if (first + npages != ks->top)
+    panic("kunmap_local: %p is not the last mapping", va);
+
+  // Only this CPU has used these slots, and with interrupts off since
+  // kmap_local, so only the current PCID and its kernel/user twin can
+  // cache them.
+  bool pcid = pcids_enabled() && use_invpcid;
+  u64 cur = rcr3() & 0xfff;
+  for (size_t i = 0; i < npages; i++) {
+    uintptr_t slot = (uintptr_t)va + i * PGSIZE;
+    ks->ptes[first + i].store(0, memory_order_relaxed);
+    if (pcid) {
+      invpcid(cur, slot, INVPCID_ONE_ADDR);
+      invpcid(cur ^ 0x1, slot, INVPCID_ONE_ADDR);
+    } else {
+      invlpg((void*)slot);
+    }
+  }
+  ks->top = first;
+  popcli();
 }
 
 // Allocate 'bytes' bytes in the KVMALLOC area, surrounded by at least
@@ -51,7 +51,7 @@ struct locked_buddy
   __padout__;
 
   locked_buddy(buddy_allocator &&alloc)
-    : lock(spinlock("buddy")), alloc(std::move(alloc))
+    : lock(spinlock("buddy", LOCKSTAT_KALLOC, QSPIN_KALLOC)), alloc(std::move(alloc))
   {
     free_limit = alloc.get_free_bytes();
   }
@@ -59,6 +59,12 @@ struct locked_buddy
 
 static static_vector<locked_buddy, MAX_BUDDIES> buddies;
 
+// The range of buddies that manage each NUMA node's memory, indexed
+// by numa_node::id.
+static struct {
+  size_t low, high;
+} node_buddies[MAX_NUMA_NODES];
+
 struct mempool : public balance_pool<mempool> {
   int buddy_;      // the buddy allocator this pool; it can contain any phys mem
   uintptr_t base_; // base this pool's local memory
@@ -1077,6 +1083,8 @@ initkalloc(void)
       }
     }
     size_t node_buddies = buddies.size() - node_low;
+    ::node_buddies[node.id].low = node_low;
+    ::node_buddies[node.id].high = buddies.size();
 
     verbose.println("kalloc: ", ssize(node_stats.free), " available in node ",
                     node.id,
@@ -1227,6 +1235,45 @@ kfree(void *v, size_t size)
 }
 #endif
 
+// Allocate a page from NUMA node node, bypassing the per-CPU hot
+// list (which may hold pages freed from any node).  Returns null if
+// node has no free pages.
+char*
+kalloc_node(const char *name, int node)
+{
+  if (!kinited || node < 0 || node >= numa_nodes.size())
+    return kalloc(name);
+
+  for (size_t idx = node_buddies[node].low; idx < node_buddies[node].high;
+       ++idx) {
+    auto &lb = buddies[idx];
+    void *res;
+    {
+      auto l = lb.lock.guard();
+      res = lb.alloc.alloc_nothrow(PGSIZE);
+    }
+    if (res) {
+      if (ALLOC_MEMSET)
+        memset(res, 2, PGSIZE);
+      kstats::inc(&kstats::kalloc_page_alloc_count);
+      return (char*)res;
+    }
+  }
+  return nullptr;
+}
+
+// Allocate a zeroed page from NUMA node node.
+char*
+zalloc_node(const char *name, int node)
+{
+  char *page = kalloc_node(name, node);
+  if (page) {
+    ensure_secrets();
+    memset(page, 0, PGSIZE);
+  }
+  return page;
+}
+
 void
 ksfree(int slab, void *v)
 {
@@ -0,0 +1,81 @@
+// Spinlock contention microbenchmark, driven by bin/spinbench through
+// /dev/lockbench.
+//
+// Each benchmark thread writes a request, which makes its CPU take
+// one of two shared locks over and over for the requested time: a
+// test-and-set spinlock or a queued spinlock.  Each critical section
+// writes a shared cache line, so that the protected data moves between
+// CPUs along with the lock.  Reading the device returns, for every
+// CPU, the number of acquisitions it made in its last run, which shows
+// both throughput and fairness.  Both locks report to lockstat.
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+
+namespace {
+  // The request written to /dev/lockbench
+  struct lockbench_req {
+    u32 queued;                 // Use the queued spinlock
+    u32 usec;                   // How long to run
+    u32 hold;                   // Shared writes per critical section
+  };
+
+  spinlock tas_lock("lockbench tas", true);
+  spinlock queued_lock("lockbench queued", true, true);
+
+  struct {
+    volatile u64 v __mpalign__;
+    __padout__;
+  } shared;
+
+  u64 counts[NCPU];
+};
+
+static int
+lockbench_write(const char *buf, u32 n)
+{
+  lockbench_req req;
+  if (n != sizeof(req))
+    return -1;
+  memcpy(&req, buf, sizeof(req));
+  ensure_secrets();
+
+  spinlock *lk = req.queued ? &queued_lock : &tas_lock;
+  u64 end = nsectime() + req.usec * 1000ull;
+  u64 count = 0;
+  while (nsectime() < end) {
+    for (int i = 0; i < 64; i++) {
+      lk->acquire();
+      for (u32 j = 0; j < req.hold; j++)
+        shared.v++;
+      lk->release();
+    }
+    count += 64;
+  }
+  counts[myid()] = count;
+  return n;
+}
+
+static int
+lockbench_read(char *dst, u32 off, u32 n)
+{
+  ensure_secrets();
+  u32 sz = ncpu * sizeof(counts[0]);
+  if (off >= sz)
+    return 0;
+  if (n > sz - off)
+    n = sz - off;
+  memmove(dst, (char*)counts + off, n);
+  return n;
+}
+
+void
+initlockbench(void)
+{
+  devsw[MAJ_LOCKBENCH].write = lockbench_write;
+  devsw[MAJ_LOCKBENCH].pread = lockbench_read;
+}
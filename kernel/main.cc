@@ -52,6 +52,10 @@ void initpci(void);
 void initnet(void);
 void initsched(void);
 void initlockstat(void);
+void initlockbench(void);
+void inituaccessbench(void);
+void initmembench(void);
+void initmempolicy(void);
 void initidle(void);
 void initcpprt(void);
 void initcmdline(void);
@@ -64,10 +68,13 @@ void initiommu(void);
 void initacpi(void);
 void initwd(void);
 void initdev(void);
+void initwbstat(void);
 void inithpet(void);
 void inittsc(void);
 void initrtc(void);
 void initmfs(void);
+void initmfswb(void);
+void initkmap(void);
 void initvfs(void);
 void idleloop(void);
 void inithotpatch(void);
@@ -231,6 +238,7 @@ cmain(u64 mbmagic, u64 mbaddr)
   initfpu();               // Requires nothing
   initmsr();               // Requires nothing
   initkalloc();            // Requires initpageinfo
+  initkmap();              // Requires initkalloc, initpercpu
   initproc();
   initsched();
   initidle();
@@ -239,6 +247,10 @@ cmain(u64 mbmagic, u64 mbaddr)
   initconsole();
   initsamp();
   initlockstat();
+  initlockbench();
+  inituaccessbench();
+  initmembench();
+  initmempolicy();
   initacpi();              // Requires initacpitables, initkalloc?
   inite1000();             // Before initpci
 #if AHCIIDE
@@ -248,16 +260,19 @@ cmain(u64 mbmagic, u64 mbaddr)
   initnet();
   initrtc();               // Requires inithpet
   initdev();
+  initwbstat();
   initide();
   initmemide();
   initpartition();
   initinode();
   initmfs();
 
-  // XXX hack until mnodes can load from disk
+  // Create mfs stubs for the on-disk file system; contents load on demand
   extern void mfsload();
   mfsload();
   initvfs();
+  // Everything created from here on is written back to disk
+  initmfswb();
 
 #if CODEX
   initcodex();
@@ -277,6 +292,7 @@ cmain(u64 mbmagic, u64 mbaddr)
 void
 halt(void)
 {
+  consflush();
   acpi_power_off();
 
   for (;;);
@@ -285,6 +301,7 @@ halt(void)
 void
 paravirtual_exit(int exit_code)
 {
+  consflush();
   if(exit_code != 0) {
     assert((exit_code & 1) == 1);
     if ((strcmp(cpuid::features().hypervisor_id, "KVMKVMKVM") == 0) ||
@@ -0,0 +1,84 @@
+// Kernel memset/memcpy microbenchmark, driven by bin/membench through
+// /dev/membench.
+//
+// Each request makes the kernel memset a buffer of size bytes, memcpy
+// it to a second buffer, and memmove it within an overlapping range,
+// each iters times, and writes the total nanoseconds spent in each to
+// the request's out array.  This measures whichever implementations
+// hotpatching selected for this CPU (see stringasm.S).
+
+#include "types.h"
+#include "kernel.hh"
+#include "condvar.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+
+namespace {
+  enum {
+    OP_MEMSET,
+    OP_MEMCPY,
+    OP_MEMMOVE,
+    NOPS
+  };
+
+  // The request written to /dev/membench
+  struct membench_req {
+    u64 out;                    // User u64[NOPS] for the results
+    u32 size;
+    u32 iters;
+  };
+
+  const u32 max_size = 2 << 20;
+};
+
+static int
+membench_write(const char *buf, u32 n)
+{
+  membench_req req;
+  if (n != sizeof(req))
+    return -1;
+  memcpy(&req, buf, sizeof(req));
+  if (req.size == 0 || req.size > max_size)
+    return -1;
+
+  // Room for the memmove to shift by a cache line
+  size_t bufsize = PGROUNDUP(req.size + 64);
+  char *a = kalloc("membench", bufsize);
+  char *b = kalloc("membench", bufsize);
+  if (!a || !b) {
+    if (a)
+      kfree(a, bufsize);
+    if (b)
+      kfree(b, bufsize);
+    return -1;
+  }
+  u64 nsec[NOPS];
+
+  u64 start = nsectime();
+  for (u32 i = 0; i < req.iters; i++)
+    memset(a, i, req.size);
+  nsec[OP_MEMSET] = nsectime() - start;
+
+  start = nsectime();
+  for (u32 i = 0; i < req.iters; i++)
+    memcpy(b, a, req.size);
+  nsec[OP_MEMCPY] = nsectime() - start;
+
+  start = nsectime();
+  for (u32 i = 0; i < req.iters; i++)
+    memmove(b + 64, b, req.size);
+  nsec[OP_MEMMOVE] = nsectime() - start;
+
+  kfree(a, bufsize);
+  kfree(b, bufsize);
+  if (putmem((void*)req.out, nsec, sizeof(nsec)) < 0)
+    return -1;
+  return n;
+}
+
+void
+initmembench(void)
+{
+  devsw[MAJ_MEMBENCH].write = membench_write;
+}
@@ -85,7 +85,7 @@ memdisk::readv(kiovec *iov, int iov_cnt, u64 offset)
       panic("readv: sector out of range");
 
     u8 *p = this->disk + offset;
-    memmove(iov->iov_base, p, iov->iov_len);
+    memmove(v.iov_base, p, v.iov_len);
 
     offset += v.iov_len;
   }
@@ -101,7 +101,7 @@ memdisk::writev(kiovec *iov, int iov_cnt, u64 offset)
       panic("writev: sector out of range");
 
     u8 *p = this->disk + offset;
-    memmove(p, iov->iov_base, iov->iov_len);
+    memmove(p, v.iov_base, v.iov_len);
 
     offset += v.iov_len;
   }
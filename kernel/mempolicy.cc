@@ -0,0 +1,153 @@
+// NUMA memory policies for user memory.  See include/uk/mempolicy.h.
+//
+// A policy is an MPOL_* mode and a mask of nodes, stored as flag bits
+// in each vmdesc (set by mbind) and in each vmap (set by
+// set_mempolicy, used where the vmdesc's mode is MPOL_DEFAULT).
+// vmap::ensure_page allocates anonymous pages through
+// mempolicy_zalloc, which also keeps Linux-style per-node allocation
+// statistics for /dev/numastat.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "numa.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include <uk/mempolicy.h>
+
+static_assert(MPOL_MAX_NODES == MAX_NUMA_NODES,
+              "node masks must cover every NUMA node");
+
+struct numastat_cpu {
+  struct numastat_record nodes[MAX_NUMA_NODES];
+};
+DEFINE_PERCPU(struct numastat_cpu, numastat_cpus, NO_CRITICAL);
+
+// Return the NUMA node whose memory contains page, or -1.
+static int
+node_of(const void *page)
+{
+  paddr pa = v2p((void*)page);
+  for (auto &node : numa_nodes)
+    for (auto &mem : node.mems)
+      if (pa >= mem.base && pa - mem.base < mem.length)
+        return node.id;
+  return -1;
+}
+
+// Return the index'th node set in nodes, wrapping around.
+static int
+nth_node(u16 nodes, u64 index)
+{
+  index %= __builtin_popcount(nodes);
+  for (; index; index--)
+    nodes &= nodes - 1;
+  return __builtin_ctz(nodes);
+}
+
+static void
+numastat_account(int want, int local, const char *page, bool interleave)
+{
+  int got = node_of(page);
+  if (got < 0)
+    return;
+
+  scoped_cli cli;
+  numastat_cpu *s = numastat_cpus.get();
+  if (got == want) {
+    s->nodes[got].hit++;
+    if (interleave)
+      s->nodes[got].interleave_hit++;
+  } else {
+    s->nodes[got].miss++;
+    s->nodes[want].foreign++;
+  }
+  if (got == local)
+    s->nodes[got].local_node++;
+  else
+    s->nodes[got].other_node++;
+}
+
+// Allocate a zeroed page for user memory under the policy mode/nodes.
+// ilx picks the node for MPOL_INTERLEAVE.  Returns null if out of
+// memory (or, for MPOL_BIND, out of memory on every node in nodes).
+char*
+mempolicy_zalloc(int mode, u16 nodes, u64 ilx)
+{
+  static const char *name = "(vmap::pagelookup)";
+  int local = mycpu()->node ? mycpu()->node->id : 0;
+  nodes &= (1 << numa_nodes.size()) - 1;
+  if (!nodes)
+    mode = MPOL_LOCAL;
+
+  char *page;
+  int want;
+  switch (mode) {
+  default:
+    // Local allocation goes through the per-CPU page caches, which
+    // is almost always local memory
+    page = zalloc(name);
+    want = local;
+    break;
+
+  case MPOL_PREFERRED:
+    want = __builtin_ctz(nodes);
+    page = zalloc_node(name, want);
+    if (!page)
+      page = zalloc(name);
+    break;
+
+  case MPOL_BIND:
+    // Nearest first, then the rest of the mask in order
+    want = (nodes & (1 << local)) ? local : __builtin_ctz(nodes);
+    page = zalloc_node(name, want);
+    for (int n = 0; !page && n < numa_nodes.size(); n++)
+      if (n != want && (nodes & (1 << n)))
+        page = zalloc_node(name, n);
+    break;
+
+  case MPOL_INTERLEAVE:
+    want = nth_node(nodes, ilx);
+    page = zalloc_node(name, want);
+    if (!page)
+      page = zalloc(name);
+    break;
+  }
+
+  if (page)
+    numastat_account(want, local, page, mode == MPOL_INTERLEAVE);
+  return page;
+}
+
+static int
+numastat_read(char *dst, u32 off, u32 n)
+{
+  static const u32 sz = sizeof(struct numastat_record);
+  if (off % sz || n < sz)
+    return -1;
+
+  u32 out = 0;
+  for (u32 node = off / sz; node < numa_nodes.size() && out + sz <= n;
+       node++, out += sz) {
+    struct numastat_record r = {};
+    for (int c = 0; c < ncpu; c++) {
+      auto &s = numastat_cpus[c].nodes[node];
+      r.hit += s.hit;
+      r.miss += s.miss;
+      r.foreign += s.foreign;
+      r.interleave_hit += s.interleave_hit;
+      r.local_node += s.local_node;
+      r.other_node += s.other_node;
+    }
+    memmove(dst + out, &r, sz);
+  }
+  return out;
+}
+
+void
+initmempolicy(void)
+{
+  devsw[MAJ_NUMASTAT].pread = numastat_read;
+}
@@ -4,6 +4,7 @@
 #include "major.h"
 #include "kstream.hh"
 #include "file.hh"
+#include "kmap.hh"
 
 u64 root_inum;
 mfs* root_fs;
@@ -51,6 +52,68 @@ skipelem(const char **rpath, char *name)
   return 1;
 }
 
+// Resolve a path like namex, but step through directories under a gc
+// epoch without taking references on them, so only the mnode returned
+// gets an sref.  Sets *out and returns true if the walk reached an
+// answer, including that the path doesn't exist.  Returns false if the
+// caller must retry by taking references, for example because a
+// directory is still a stub on disk, an mnode is being collected, or a
+// non-final element isn't a directory.
+static bool
+namex_rcu(const sref<mnode>& cwd, const char* path, bool nameiparent,
+          strbuf<DIRSIZ>* name, sref<mnode>* out)
+{
+  scoped_gc_epoch rcu_read;
+  const mnode* m;
+
+  if (*path == '/')
+    m = root_fs->get_dir_rcu(root_inum);
+  else
+    m = cwd.get();
+  if (!m)
+    return false;
+
+  int r;
+  while ((r = skipelem(&path, name->buf_)) == 1) {
+    if (m->type() != mnode::types::dir) {
+      *out = sref<mnode>();
+      return true;
+    }
+
+    if (nameiparent && *path == '\0') {
+      // Stop one level early.
+      *out = m->fs_->get_cached(m->inum_);
+      return (bool)*out;
+    }
+
+    const mdir* md = m->as_dir();
+    if (!md->loaded())
+      return false;
+    u64 inum;
+    if (!md->lookup_inum(*name, &inum)) {
+      *out = sref<mnode>();
+      return true;
+    }
+
+    if (*path == '\0') {
+      *out = m->fs_->get_cached(inum);
+      return (bool)*out;
+    }
+
+    m = m->fs_->get_dir_rcu(inum);
+    if (!m)
+      return false;
+  }
+
+  if (r == -1 || nameiparent) {
+    *out = sref<mnode>();
+    return true;
+  }
+
+  *out = m->fs_->get_cached(m->inum_);
+  return (bool)*out;
+}
+
 // Look up and return the mnode for a path name.  If nameiparent is true,
 // return the mnode for the parent and copy the final path element into name.
 static sref<mnode>
@@ -58,6 +121,12 @@ namex(sref<mnode> cwd, const char* path, bool nameiparent, strbuf<DIRSIZ>* name)
 {
   sref<mnode> m;
 
+  if (namex_rcu(cwd, path, nameiparent, name, &m)) {
+    kstats::inc(&kstats::mfs_namei_rcu_count);
+    return m;
+  }
+  kstats::inc(&kstats::mfs_namei_rcu_fallback_count);
+
   if (*path == '/')
     m = root_fs->get(root_inum);
   else
@@ -86,6 +155,57 @@ namex(sref<mnode> cwd, const char* path, bool nameiparent, strbuf<DIRSIZ>* name)
   return m;
 }
 
+// Resolve a run of leading elements of *path from cwd the way
+// namex_rcu does, and advance *path past them, so that a caller
+// stepping through a path one element at a time can skip most steps.
+// Stops before "..", after a directory that is a mount point, and, if
+// keep_last is set, before the final element, leaving those to the
+// caller.  Also stops wherever namex_rcu would give up, and before an
+// element that doesn't exist, so the caller reports the error.
+// Returns the mnode reached, or cwd if nothing was resolved.
+sref<mnode>
+namei_prefix(const sref<mnode>& cwd, const char** path, bool keep_last)
+{
+  scoped_gc_epoch rcu_read;
+  const char* p = *path;
+  const char* done = p;
+  const mnode* m = cwd.get();
+  strbuf<DIRSIZ> name;
+  sref<mnode> out;
+
+  while (skipelem(&p, name.buf_) == 1) {
+    if (name == ".." || (keep_last && *p == '\0'))
+      break;
+    if (m->type() != mnode::types::dir || !m->as_dir()->loaded())
+      break;
+    u64 inum;
+    if (!m->as_dir()->lookup_inum(name, &inum))
+      break;
+
+    const mdir* md = m->fs_->get_dir_rcu(inum);
+    if (!md) {
+      // Not a directory, or not one we can step through without a
+      // reference, which is fine for the final element
+      if (*p == '\0' && (out = m->fs_->get_cached(inum)))
+        done = p;
+      break;
+    }
+    m = md;
+    done = p;
+    if (md->mount_data)
+      break;
+  }
+
+  // If nothing was resolved, the caller's next step goes through namex,
+  // which counts the walk.
+  if (done == *path ||
+      (!out && !(out = m->fs_->get_cached(m->inum_))))
+    return cwd;
+  kstats::inc(&kstats::mfs_namei_rcu_count);
+  *path = done;
+  return out;
+}
+
 sref<mnode>
 namei(sref<mnode> cwd, const char* path)
 {
@@ -99,46 +219,161 @@ nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf)
   return namex(cwd, path, true, buf);
 }
 
+// Collect the pages backing up to npages pages of m starting at the
+// page containing pos, stopping at the end of file.  Holes are backed
+// by the shared zero page.  Shrinks
+// *end to the file size if the last page is partial.  Returns the
+// number of pages collected.
+static size_t
+get_pages(sref<mnode> m, u64 pos, u64* end, sref<page_info>* pis,
+          paddr* pas, size_t npages)
+{
+  size_t n = 0;
+  for (u64 pg = PGROUNDDOWN(pos); n < npages && pg < *end; pg += PGSIZE) {
+    mfile::page_state ps = m->as_file()->get_page_or_zero(pg / PGSIZE);
+    sref<page_info> pi = ps.get_page_info();
+    if (!pi)
+      break;
+
+    if (ps.is_partial_page()) {
+      u64 msize = m->as_file()->size();
+      if (*end > msize)
+        *end = msize;
+      // Re-check loop condition, since end changed
+      if (pg >= *end || pos >= *end)
+        break;
+    }
+
+    if (pas)
+      pas[n] = pi->pa();
+    pis[n++] = std::move(pi);
+  }
+  return n;
+}
+
 s64
 readi(sref<mnode> m, char* buf, u64 start, u64 nbytes)
 {
   if (m->type() != mnode::types::file)
     return -1;
 
+  // Without secrets mapped, a run of up to READ_BATCH pages is
+  // mapped with one kmap_local and copied with one memmove.
+  enum { READ_BATCH = 16 };
+  sref<page_info> pis[READ_BATCH];
+  paddr pas[READ_BATCH];
+
+  // Pages past the end of the file may already exist while appends
+  // are in flight, so clamp to the size up front.
   u64 end = start + nbytes;
+  u64 msize = m->as_file()->size();
+  if (end > msize)
+    end = msize;
   u64 off = 0;
   while (start + off < end) {
     u64 pos = start + off;
     u64 pgbase = PGROUNDDOWN(pos);
 
-    mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE);
-    sref<page_info> pi = ps.get_page_info();
-    if (!pi)
+    size_t npages = get_pages(m, pos, &end, pis, pas, READ_BATCH);
+    if (npages == 0 || pos >= end)
       break;
 
-    if (ps.is_partial_page()) {
-      u64 msize = m->as_file()->size();
-      if (end > msize)
-        end = msize;
-      // Re-check loop condition, since end changed
-      if (pos >= end)
-        break;
-    }
-
     u64 pgoff = pos - pgbase;
-    u64 pgend = end - pgbase;
-    if (pgend > PGSIZE)
-      pgend = PGSIZE;
+    u64 runend = end - pgbase;
+    if (runend > npages * PGSIZE)
+      runend = npages * PGSIZE;
 
     if (secrets_mapped) {
-      memmove(buf + off, (const char*) pi->va() + pgoff, pgend - pgoff);
+      for (size_t i = 0; i < npages; i++) {
+        u64 b = i ? i * PGSIZE : pgoff;
+        u64 e = (i + 1) * PGSIZE < runend ? (i + 1) * PGSIZE : runend;
+        memmove(buf + off + b - pgoff,
+                (const char*) pis[i]->va() + b - i * PGSIZE, e - b);
+      }
     } else {
-      void* va = myproc()->vmap->map_temporary(pi->pa());
-      memmove(buf + off, (const char*) va + pgoff, pgend - pgoff);
-      myproc()->vmap->unmap_temporary(va);
+      char* va = (char*) kmap_local(pas, npages);
+      memmove(buf + off, va + pgoff, runend - pgoff);
+      kunmap_local(va, npages);
     }
 
-    off += (pgend - pgoff);
+    off += runend - pgoff;
+  }
+
+  return off;
+}
+
+// Copy n bytes at pgoff in the file page pi to user memory.  With
+// secrets mapped this is a single copy straight out of the direct
+// map; otherwise the page can only be reached through kmap_local,
+// which cannot take user faults, so bounce through the stack.
+static bool
+copy_page_out(userptr<void> dst, const sref<page_info>& pi, u64 pgoff, u64 n)
+{
+  if (secrets_mapped)
+    return dst.store_bytes((const char*) pi->va() + pgoff, n);
+
+  char buf[PGSIZE];
+  {
+    scoped_kmap k(pi->pa());
+    memmove(buf, k.va() + pgoff, n);
+  }
+  return dst.store_bytes(buf, n);
+}
+
+// Like copy_page_out, in the other direction.  The page is va if it
+// is not yet part of a file.
+static bool
+copy_page_in(char* va, paddr pa, u64 pgoff, userptr<void> src, u64 n)
+{
+  if (secrets_mapped)
+    return src.load_bytes(va + pgoff, n);
+
+  char buf[PGSIZE];
+  if (!src.load_bytes(buf, n))
+    return false;
+  scoped_kmap k(pa);
+  memmove(k.va() + pgoff, buf, n);
+  return true;
+}
+
+s64
+readi(sref<mnode> m, userptr<void> data, u64 start, u64 nbytes)
+{
+  if (m->type() != mnode::types::file)
+    return -1;
+
+  enum { READ_BATCH = 16 };
+  sref<page_info> pis[READ_BATCH];
+
+  // Pages past the end of the file may already exist while appends
+  // are in flight, so clamp to the size up front.
+  u64 end = start + nbytes;
+  u64 msize = m->as_file()->size();
+  if (end > msize)
+    end = msize;
+  u64 off = 0;
+  while (start + off < end) {
+    u64 pos = start + off;
+    u64 pgbase = PGROUNDDOWN(pos);
+
+    size_t npages = get_pages(m, pos, &end, pis, nullptr, READ_BATCH);
+    if (npages == 0 || pos >= end)
+      break;
+
+    u64 pgoff = pos - pgbase;
+    u64 runend = end - pgbase;
+    if (runend > npages * PGSIZE)
+      runend = npages * PGSIZE;
+
+    for (size_t i = 0; i < npages; i++) {
+      u64 b = i ? i * PGSIZE : pgoff;
+      u64 e = (i + 1) * PGSIZE < runend ? (i + 1) * PGSIZE : runend;
+      if (!copy_page_out(data + (off + b - pgoff), pis[i], b - i * PGSIZE,
+                         e - b))
+        return off + b - pgoff ? off + b - pgoff : -1;
+    }
+
+    off += runend - pgoff;
   }
 
   return off;
@@ -151,8 +386,12 @@ writei(sref<mnode> m, const userptr<void> data, u64 start, u64 nbytes,
   if (m->type() != mnode::types::file)
     return -1;
 
-  char buf[PGSIZE];
+  // Pages past the end of the file are allocated and filled from user
+  // memory before taking the resizer, and then appended in batches of
+  // up to WRITE_BATCH pages under a single acquisition.
+  enum { WRITE_BATCH = 16 };
 
+  mfile* mf = m->as_file();
   u64 end = start + nbytes;
   u64 off = 0;
   while (start + off < end) {
@@ -163,90 +402,143 @@ writei(sref<mnode> m, const userptr<void> data, u64 start, u64 nbytes,
     if (pgend > PGSIZE)
       pgend = PGSIZE;
 
-    if (!(data + off).load_bytes(buf, pgend - pgoff))
-      break;
-
-    mfile::resizer *resize = parentresize;
-    mfile::resizer scoped_resize;
-
-    mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE);
+    mfile::page_state ps = mf->get_page(pgbase / PGSIZE);
+    if ((!ps || ps.is_zero_page()) && pgbase < mf->size()) {
+      /* A hole inside the file gets a page of its own */
+      ps = mf->fill_hole(pgbase / PGSIZE);
+      if (!ps && pgbase < mf->size())
+        break;
+    }
     if (ps) {
-      sref<page_info> pi = ps.get_page_info();
       /* File already has the page we are about to update */
-      if (ps.is_partial_page() && resize == nullptr) {
-        if (pos + pgend - pgoff > m->as_file()->size()) {
-          scoped_resize = m->as_file()->write_size();
-          resize = &scoped_resize;
-        }
-      }
+      sref<page_info> pi = ps.get_page_info();
 
       /*
        * What happens when writing past the end of the file but within
        * the file's last page?  One worry might be that we're exposing
        * some non-zero bytes left over in the part of the last page that
-       * is past the end of the file.  Our plan is to ensure that any
-       * file truncate zeroes out any partial pages.  Currently, we only
-       * have O_TRUNC, which discards all pages.
+       * is past the end of the file.  Shrinking the file zeroes the tail
+       * of the new last page (see resize_nogrow), so there are none.
        */
+      if (!copy_page_in((char*) pi->va(), pi->pa(), pgoff, data + off,
+                        pgend - pgoff))
+        break;
+      mf->mark_page_dirty(pgbase / PGSIZE);
 
-      if (secrets_mapped) {
-        memmove((char*) pi->va() + pgoff, buf, pgend - pgoff);
-      } else {
-        void* va = myproc()->vmap->map_temporary(pi->pa());
-        memmove((char*) va + pgoff, buf, pgend - pgoff);
-        myproc()->vmap->unmap_temporary(va);
-      }
-
-      if (resize && *resize)
-        resize->resize_nogrow(pos + pgend - pgoff);
-    } else {
-      /* File does not yet have the page we are about to update */
-      if (!resize) {
-        scoped_resize = m->as_file()->write_size();
-        resize = &scoped_resize;
+      if (ps.is_partial_page() || parentresize) {
+        mfile::resizer scoped_resize;
+        mfile::resizer *resize = parentresize;
+        if (!resize && pos + pgend - pgoff > mf->size()) {
+          scoped_resize = mf->write_size();
+          resize = &scoped_resize;
+        }
+        if (resize && pos + pgend - pgoff > resize->size())
+          resize->resize(pos + pgend - pgoff);
       }
 
-      /*
-       * If this is a write past the end of the file, we may need
-       * to first zero out some memory locations, or even fill in
-       * a few zero pages.  We do not support sparse files -- the
-       * holes are filled in with zeroed pages.
-       */
-      u64 msize = resize->size();
-      while (msize < pgbase) {
-        if (msize % PGSIZE) {
-          resize->resize_nogrow(msize - (msize % PGSIZE) + PGSIZE);
-        } else {
-          char* p = zalloc("file page");
-          if (!p)
-            break;
-
-          sref<page_info> pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-          resize->resize_append(msize + PGSIZE, pi);
-        }
+      off += pgend - pgoff;
+      continue;
+    }
 
-        msize = resize->size();
-      }
+    /*
+     * File does not yet have the page we are about to update.  Fill
+     * new pages for as much of the rest of the write as fits in a
+     * batch.
+     */
+    sref<page_info> pis[WRITE_BATCH];
+    u64 ends[WRITE_BATCH];
+    size_t npages = 0;
+    u64 boff = off;
+    while (npages < WRITE_BATCH && start + boff < end) {
+      u64 bpos = start + boff;
+      u64 bbase = PGROUNDDOWN(bpos);
+      u64 bend = end - bbase;
+      if (bend > PGSIZE)
+        bend = PGSIZE;
 
       char* p = zalloc("file page");
       if (!p)
         break;
+      sref<page_info> pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+      if (!copy_page_in(p, v2p(p), bpos - bbase, data + boff,
+                        bend - (bpos - bbase)))
+        break;
 
-      if (secrets_mapped) {
-        memmove((char*) p + pgoff, buf, pgend - pgoff);
-      } else {
-        void* va = myproc()->vmap->map_temporary(v2p(p));
-        memmove((char*) va + pgoff, buf, pgend - pgoff);
-        myproc()->vmap->unmap_temporary(va);
-      }
+      ends[npages] = bbase + bend;
+      pis[npages++] = std::move(pi);
+      boff += bend - (bpos - bbase);
+    }
+    if (npages == 0)
+      break;
 
-      sref<page_info> pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-      resize->resize_append(pos + pgend - pgoff, pi);
+    mfile::resizer *resize = parentresize;
+    mfile::resizer scoped_resize;
+    if (!resize) {
+      scoped_resize = mf->write_size();
+      resize = &scoped_resize;
     }
 
-    off += (pgend - pgoff);
+    /*
+     * A write past the end of the file leaves a hole between the old
+     * end and the first page written, which reads as zeros.
+     */
+    if (resize->size() < pgbase)
+      resize->resize(pgbase);
+
+    /*
+     * Another writer may have extended the file since we looked.
+     * Append our pages up to the first one that now exists; the
+     * outer loop then writes the rest in place.
+     */
+    for (size_t i = 0; i < npages; i++) {
+      u64 base = PGROUNDDOWN(ends[i] - 1);
+      if (PGROUNDUP(resize->size()) > base)
+        break;
+      resize->resize_append(ends[i], std::move(pis[i]));
+      off = ends[i] - start;
+    }
+  }
+
+  return off ? off : -1;
+}
+
+// Append nbytes from data to the end of m.  Concurrent appenders
+// reserve disjoint ranges, fill their pages in parallel, and publish
+// them in reservation order, without taking the resizer.
+s64
+appendi(sref<mnode> m, const userptr<void> data, u64 nbytes)
+{
+  if (m->type() != mnode::types::file)
+    return -1;
+  if (nbytes == 0)
+    return 0;
+
+  mfile* mf = m->as_file();
+  u64 start;
+  if (!mf->reserve_append(nbytes, &start))
+    return -EFBIG;
+  u64 end = start + nbytes;
+  u64 off = 0;
+  while (start + off < end) {
+    u64 pos = start + off;
+    u64 pgbase = PGROUNDDOWN(pos);
+    u64 pgoff = pos - pgbase;
+    u64 pgend = end - pgbase;
+    if (pgend > PGSIZE)
+      pgend = PGSIZE;
+
+    sref<page_info> pi = mf->append_page(pgbase / PGSIZE).get_page_info();
+    if (!pi || !copy_page_in((char*) pi->va(), pi->pa(), pgoff, data + off,
+                             pgend - pgoff))
+      break;
+    mf->mark_page_dirty(pgbase / PGSIZE);
+
+    off += pgend - pgoff;
   }
 
+  // Publish only what was copied.  Later appenders shift down over
+  // the rest.
+  off = mf->publish_append(start, nbytes, off);
   return off ? off : -1;
 }
 
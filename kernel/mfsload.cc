@@ -3,93 +3,174 @@
 #include "fs.h"
 #include "file.hh"
 #include "mnode.hh"
-#include "linearhash.hh"
 #include "mfs.hh"
 #include "cmdline.hh"
 #include "disk.hh"
+#include "kstats.hh"
 
-static sref<mnode> load_inum(linearhash<u64, sref<mnode>> *inum_to_mnode, u32 dev, u64 inum);
+// mfs is populated lazily from the on-disk file system.  At boot we
+// only read the root directory; every other directory and file starts
+// out as a stub that remembers its on-disk inode.  A directory reads
+// its entries the first time anything looks at them, and a file reads
+// each page the first time mfile::get_page asks for it.  The on-disk
+// tree built by mkfs has no hard links, so each on-disk inode becomes
+// exactly one mnode, created when its parent directory is loaded.
 
-static void
-load_dir(linearhash<u64, sref<mnode>> *inum_to_mnode, sref<inode> i, sref<mnode> m)
+u64 mfsload_nsec;
+
+static mlinkref
+load_stub(mfs *fs, u32 inum, u64 parent_inum)
+{
+  sref<inode> i = iget(fs->disk_dev_, inum);
+  mlinkref ilink;
+  switch (i->type.load()) {
+  case T_DIR:
+    ilink = fs->alloc(mnode::types::dir);
+    ilink.mn()->as_dir()->set_disk_inode(inum, parent_inum);
+    break;
+
+  case T_FILE:
+    ilink = fs->alloc(mnode::types::file);
+    ilink.mn()->as_file()->set_disk_inode(inum, i->size);
+    break;
+
+  default:
+    panic("unhandled inode %d type %d\n", inum, i->type.load());
+  }
+  return ilink;
+}
+
+void
+mdir::load_from_disk()
 {
+  auto l = load_lock_.guard();
+  if (!on_disk_)
+    return;
+
+  kstats::timer timer(&kstats::mfs_load_cycles);
+  ensure_secrets();
+
+  sref<inode> i = iget(fs_->disk_dev_, disk_inum_);
   ward_dirent de;
   for (size_t pos = 0; pos < i->size; pos += sizeof(de)) {
     assert(sizeof(de) == readi(i, (char*) &de, pos, sizeof(de)));
     if (!de.inum)
       continue;
 
-    sref<mnode> mf = load_inum(inum_to_mnode, i->dev, de.inum);
     strbuf<DIRSIZ> name(de.name);
     if (name == ".")
       continue;
 
-    mlinkref ilink(mf);
-    ilink.acquire();
-    m->as_dir()->insert(name, &ilink);
+    if (name == "..") {
+      mlinkref parent(fs_->get(parent_inum_));
+      parent.acquire();
+      insert_loaded(name, &parent);
+      continue;
+    }
+
+    mlinkref ilink = load_stub(fs_, de.inum, inum_);
+    insert_loaded(name, &ilink);
   }
+
+  kstats::inc(&kstats::mfs_dir_load_count);
+  on_disk_.store(false, std::memory_order_release);
 }
 
-static void
-load_file(linearhash<u64, sref<mnode>> *inum_to_mnode, sref<inode> i, sref<mnode> m)
+mfile::page_state
+mfile::load_page(u64 pageidx)
 {
-  for (size_t pos = 0; pos < i->size; pos += PGSIZE) {
-    char* p = zalloc("load_file");
-    assert(p);
-
-    auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-
-    size_t nbytes = i->size - pos;
-    if (nbytes > PGSIZE)
-      nbytes = PGSIZE;
-
-    assert(nbytes == readi(i, p, pos, nbytes));
-    auto resize = m->as_file()->write_size();
-    resize.resize_append(pos + nbytes, pi);
+  u64 pos = pageidx * PGSIZE;
+  u64 disk_size = disk_size_;
+  if (pos >= disk_size)
+    return page_state();
+  u64 nbytes = disk_size - pos;
+  if (nbytes > PGSIZE)
+    nbytes = PGSIZE;
+
+  kstats::timer timer(&kstats::mfs_load_cycles);
+  ensure_secrets();
+
+  char* p = zalloc("file page");
+  if (!p)
+    return page_state();
+  auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+
+  // Read outside of lock_, since the disk may sleep.  If another
+  // core loads the same page first, we drop ours.
+  assert(nbytes == readi(iget(fs_->disk_dev_, disk_inum_), p, pos, nbytes));
+
+  lock_guard<spinlock> l(&lock_);
+  auto it = pages_.find(pageidx);
+  if (!it.is_set() && pos < disk_size_) {
+    // A concurrent truncate may have cut into the page we read
+    if (pos + nbytes > disk_size_)
+      memset(p + (disk_size_ - pos), 0, pos + nbytes - disk_size_);
+
+    auto lock = pages_.acquire(it);
+    page_state ps(pi);
+    if (pos + PGSIZE > size_ && PGOFFSET(size_))
+      ps.set_partial_page(true);
+    pages_.fill(it, ps);
+    kstats::inc(&kstats::mfs_page_load_count);
+    return ps;
   }
-}
 
-static sref<mnode>
-mnode_alloc(linearhash<u64, sref<mnode>> *inum_to_mnode, u64 inum, u8 mtype)
-{
-  auto m = root_fs->alloc(mtype);
-  inum_to_mnode->insert(inum, m.mn());
-  return m.mn();
+  if (!it.is_set())
+    return page_state();
+  return it->copy_consistent();
 }
 
-static sref<mnode>
-load_inum(linearhash<u64, sref<mnode>> *inum_to_mnode, u32 dev, u64 inum)
+// Read in the directories listed in the mfs_prefetch boot parameter,
+// and the pages of the files directly in them, so that the first exec
+// from a hot directory does not wait for the disk.
+static void
+mfsprefetch(void *)
 {
-  sref<mnode> m;
-  if (inum_to_mnode->lookup(inum, &m))
-    return m;
-
-  sref<inode> i = iget(dev, inum);
-  switch (i->type.load()) {
-  case T_DIR:
-    m = mnode_alloc(inum_to_mnode, inum, mnode::types::dir);
-    load_dir(inum_to_mnode, i, m);
-    break;
-
-  case T_FILE:
-    m = mnode_alloc(inum_to_mnode, inum, mnode::types::file);
-    load_file(inum_to_mnode, i, m);
-    break;
+  sref<mnode> root = root_fs->get(root_inum);
+  const char *p = cmdline_params.mfs_prefetch;
+  while (*p) {
+    char path[CMDLINE_VALUE+1];
+    size_t n = 0;
+    while (*p && *p != ',')
+      path[n++] = *p++;
+    path[n] = 0;
+    if (*p == ',')
+      p++;
+
+    sref<mnode> m = namei(root, path);
+    if (!m || m->type() != mnode::types::dir)
+      continue;
 
-  default:
-    panic("unhandled inode %ld type %d\n", inum, i->type.load());
+    strbuf<DIRSIZ> name, prev;
+    for (bool first = true;
+         m->as_dir()->enumerate(first ? nullptr : &prev, &name);
+         first = false, prev = name) {
+      sref<mnode> child = m->as_dir()->lookup(name);
+      if (!child || child->type() != mnode::types::file)
+        continue;
+      mfile *f = child->as_file();
+      for (u64 idx = 0; idx < PGROUNDUP(f->size()) / PGSIZE; idx++)
+        f->get_page(idx);
+    }
   }
-
-  return m;
 }
 
 void
 mfsload()
 {
+  u64 start = nsectime();
   root_fs = new mfs();
 
-  auto inum_to_mnode = new linearhash<u64, sref<mnode>>(4099);
-  root_inum = load_inum(inum_to_mnode, disk_find_root(), 1)->inum_;
-  /* the root inode gets an extra reference because of its own ".." */
-  delete inum_to_mnode;
+  root_fs->disk_dev_ = disk_find_root();
+  mlinkref root = root_fs->alloc(mnode::types::dir);
+  root_inum = root.mn()->inum_;
+  root.mn()->as_dir()->set_disk_inode(1, root_inum);
+
+  /* the root inode gets an extra reference because of its own "..",
+   * so load it while our link count still holds it */
+  root.mn()->as_dir()->load();
+  mfsload_nsec = nsectime() - start;
+
+  if (cmdline_params.mfs_prefetch[0])
+    threadrun(mfsprefetch, nullptr, "mfsprefetch");
 }
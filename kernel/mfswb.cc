@@ -0,0 +1,402 @@
+// Asynchronous write-back of mfs to the on-disk file system.
+//
+// Modifying an mnode marks it dirty, which pushes it (holding a
+// reference) on the current CPU's write-back queue; marking an mnode
+// that is already queued costs one load.  File pages carry their own
+// dirty bit in mfile::page_state.  Every mfs_writeback_ms a kernel
+// thread drains the queues.  For each file it copies the dirty pages,
+// in offset order, through the inode layer into the buffer cache, and
+// then sends the inode's dirty buffers to the disk sorted by block
+// number, merging consecutive blocks into large requests.  A
+// directory is rewritten in full, allocating on-disk inodes for
+// children that do not have one yet.  fsync flushes a single mnode in
+// the caller's context, or drains everything if the mnode has no
+// on-disk inode yet, and sync drains everything.
+//
+// The inode layer has no holes, so holes in a file are written out as
+// zeros where the disk may still hold data: past the end of the
+// on-disk inode, and in the ranges punched or truncated away since the
+// last write-back.
+//
+// Page writes through shared file mappings are not tracked.
+
+#include "types.h"
+#include "kernel.hh"
+#include "fs.h"
+#include "file.hh"
+#include "mnode.hh"
+#include "mfs.hh"
+#include "buf.hh"
+#include "cmdline.hh"
+#include "percpu.hh"
+#include "kstream.hh"
+
+#include <vector>
+
+namespace {
+  struct wb_queue {
+    spinlock lock;
+    mnode *head;
+
+    wb_queue() : lock("mfs writeback queue", LOCKSTAT_FS), head(nullptr) {}
+  };
+
+  // An on-disk inode whose mnode has been freed
+  struct wb_free {
+    mfs *fs;
+    u32 inum;
+    wb_free *next;
+  };
+
+  percpu<wb_queue> wb_queues;
+
+  spinlock wb_free_lock("mfs writeback free", LOCKSTAT_FS);
+  wb_free *wb_free_head;
+
+  // Serializes full passes over the queues
+  sleeplock wb_drain_lock;
+
+  std::atomic<u64> wb_inodes, wb_bytes, wb_requests, wb_nsec;
+};
+
+class mfs_writeback
+{
+public:
+  static void enqueue(mnode *m);
+  static u64 flush(mnode *m);
+  static int fsync(mnode *m);
+  static void drain(mfs *fs);
+
+private:
+  static u32 disk_inode(mnode *m);
+  static u64 flush_file(mfile *mf, sref<inode> ip, u64 *requests);
+  static u64 flush_dir(mdir *md, sref<inode> ip, u64 *requests);
+};
+
+void
+mnode::mark_dirty()
+{
+  if (!fs_->persist_ || (transient_ && !disk_inum_))
+    return;
+  if (dirty_ || !cmpxch(&dirty_, false, true))
+    return;
+  mfs_writeback::enqueue(this);
+}
+
+void
+mfs_writeback::enqueue(mnode *m)
+{
+  // The queue's reference is dropped by drain()
+  m->inc();
+  wb_queue *q = &wb_queues[myid()];
+  scoped_acquire l(&q->lock);
+  m->wb_next_ = q->head;
+  q->head = m;
+}
+
+// Return m's on-disk inode number, allocating an inode if m has none.
+// Returns 0 for transient mnodes or if the disk is out of inodes.
+u32
+mfs_writeback::disk_inode(mnode *m)
+{
+  u32 inum = m->disk_inum_;
+  if (inum || m->transient_)
+    return inum;
+
+  sref<inode> ip = ialloc(m->fs_->disk_dev_,
+                          m->type() == mnode::types::dir ? T_DIR : T_FILE);
+  if (!ip)
+    return 0;
+  ip->link();
+  iupdate(ip);
+  iunlock(ip);
+
+  if (!cmpxch(&m->disk_inum_, (u32)0, ip->inum)) {
+    ifree(ip);
+    return m->disk_inum_;
+  }
+
+  // The directory entry we are about to write must not point to an
+  // uninitialized inode.  The contents follow with m's own flush.
+  iwriteback(ip, 0, 0);
+  m->mark_dirty();
+  return ip->inum;
+}
+
+u64
+mfs_writeback::flush_file(mfile *mf, sref<inode> ip, u64 *requests)
+{
+  // Take the holes made so far together with the size they apply to
+  u64 size, hole_lo, hole_hi;
+  {
+    lock_guard<spinlock> l(&mf->lock_);
+    size = mf->size_;
+    hole_lo = mf->wb_hole_lo_;
+    hole_hi = mf->wb_hole_hi_;
+    mf->wb_hole_lo_ = mf->wb_hole_hi_ = 0;
+  }
+  u64 npages = PGROUNDUP(size) / PGSIZE;
+  bool rewrite = false;
+
+  if (size < ip->size) {
+    // The inode layer can only truncate to zero, so read in whatever
+    // is still only on disk and write the whole file again.
+    for (u64 idx = 0; idx < npages; idx++)
+      mf->get_page(idx);
+    {
+      lock_guard<spinlock> l(&mf->lock_);
+      mf->disk_size_ = 0;
+    }
+    ilock(ip, 1);
+    itrunc(ip.get());
+    iunlock(ip);
+    rewrite = true;
+  }
+
+  u64 bytes = 0;
+  u64 lo = npages, hi = 0;
+  sref<page_info> zero;
+  for (u64 idx = 0; idx < npages; idx++) {
+    u64 pos = idx * PGSIZE;
+    u64 n = size - pos < PGSIZE ? size - pos : PGSIZE;
+
+    auto it = mf->pages_.find(idx);
+    bool dirty = false;
+    sref<page_info> pi;
+    if (!it.is_set()) {
+      if (pos < mf->disk_size_)
+        continue;               // never read in, so unchanged on disk
+      // A hole
+      if (!rewrite && pos + n <= ip->size &&
+          (pos + n <= hole_lo || pos >= hole_hi))
+        continue;
+      if (!zero)
+        zero = mfile::zero_page();
+      pi = zero;
+    } else {
+      // Clear the dirty bit before copying, so a concurrent write
+      // either lands in this copy or dirties the page again.
+      dirty = it->test_and_clear_dirty();
+      if (!dirty && !rewrite && pos + n <= ip->size)
+        continue;
+      pi = it->copy_consistent().get_page_info();
+    }
+    if (!pi)
+      continue;
+    if (writei(ip, (const char*) pi->va(), pos, n) != (int) n) {
+      if (dirty)
+        it->set_dirty();
+      break;
+    }
+
+    bytes += n;
+    if (idx < lo)
+      lo = idx;
+    hi = idx + 1;
+  }
+
+  iupdate(ip);
+  if (lo < hi)
+    *requests += iwriteback(ip, lo * PGSIZE, (hi - lo) * PGSIZE);
+  else
+    *requests += iwriteback(ip, 0, 0);
+  return bytes;
+}
+
+u64
+mfs_writeback::flush_dir(mdir *md, sref<inode> ip, u64 *requests)
+{
+  // A stub is unchanged from disk, and a killed directory will be
+  // freed once its mnode goes away.
+  if (!md->loaded() || md->killed())
+    return 0;
+
+  std::vector<ward_dirent> ents;
+  auto add = [&ents](const strbuf<DIRSIZ> &name, u32 inum) {
+    ward_dirent de;
+    memset(&de, 0, sizeof(de));
+    strncpy(de.name, name.buf_, DIRSIZ);
+    de.inum = inum;
+    ents.push_back(de);
+  };
+
+  add(".", md->disk_inum_);
+  strbuf<DIRSIZ> name, prev;
+  for (bool first = true; md->enumerate(first ? nullptr : &prev, &name);
+       first = false, prev = name) {
+    if (name == ".")
+      continue;
+    sref<mnode> m = md->lookup(name);
+    if (!m)
+      continue;
+    if (m->type() != mnode::types::dir && m->type() != mnode::types::file)
+      continue;                 // devices and sockets live only in memory
+    u32 inum = disk_inode(m.get());
+    if (inum)
+      add(name, inum);
+  }
+
+  u32 n = ents.size() * sizeof(ward_dirent);
+  if (writei(ip, (const char*) ents.data(), 0, n) != (int) n)
+    return 0;
+  if (ip->size > n) {
+    auto w = ip->seq.write_begin();
+    ip->size = n;
+  }
+  iupdate(ip);
+  *requests += iwriteback(ip, 0, n);
+  return n;
+}
+
+// Write m back to its on-disk inode.  Returns the number of bytes
+// written.
+u64
+mfs_writeback::flush(mnode *m)
+{
+  u32 inum = m->disk_inum_;
+  if (!inum)
+    return 0;
+
+  auto l = m->wb_lock_.guard();
+  u64 start = nsectime();
+  ensure_secrets();
+
+  sref<inode> ip = iget(m->fs_->disk_dev_, inum);
+  u64 bytes = 0, requests = 0;
+  switch (m->type()) {
+  case mnode::types::file:
+    bytes = flush_file(m->as_file(), ip, &requests);
+    break;
+  case mnode::types::dir:
+    bytes = flush_dir(m->as_dir(), ip, &requests);
+    break;
+  }
+
+  wb_inodes++;
+  wb_bytes += bytes;
+  wb_requests += requests;
+  wb_nsec += nsectime() - start;
+  return bytes;
+}
+
+// Write m and everything needed to find it on disk.  A new mnode gets
+// its on-disk inode only when its parent directory is written back, so
+// if m has none yet, drain everything, which writes the parent's entry
+// for m and then m itself.
+int
+mfs_writeback::fsync(mnode *m)
+{
+  if (!m->disk_inum_ && !m->transient_ && m->fs_->persist_) {
+    drain(m->fs_);
+    // An unlinked mnode never gets one, and has nothing to persist
+    if (!m->disk_inum_)
+      return m->nlink_.get_consistent() ? -ENOSPC : 0;
+  }
+  flush(m);
+  return 0;
+}
+
+void
+mfs_writeback::drain(mfs *fs)
+{
+  auto l = wb_drain_lock.guard();
+
+  // Inodes freed before this pass are released after the directories
+  // that dropped them, which are already queued, have been rewritten.
+  wb_free *frees;
+  {
+    scoped_acquire fl(&wb_free_lock);
+    frees = wb_free_head;
+    wb_free_head = nullptr;
+  }
+
+  // Flushing a directory can queue children that just got an inode,
+  // so keep going until the queues stay empty.
+  for (bool any = true; any; ) {
+    any = false;
+    for (int c = 0; c < ncpu; c++) {
+      mnode *m;
+      {
+        scoped_acquire ql(&wb_queues[c].lock);
+        m = wb_queues[c].head;
+        wb_queues[c].head = nullptr;
+      }
+
+      while (m) {
+        mnode *next = m->wb_next_;
+        m->dirty_ = false;
+        flush(m);
+        m->dec();
+        m = next;
+        any = true;
+      }
+    }
+  }
+
+  while (frees) {
+    wb_free *next = frees->next;
+    ifree(iget(frees->fs->disk_dev_, frees->inum));
+    kmfree(frees, sizeof(*frees));
+    frees = next;
+  }
+
+  wb_requests += bitmap_writeback(fs->disk_dev_);
+}
+
+void
+mfs_free_disk_inode(mfs *fs, u32 inum)
+{
+  wb_free *f = (wb_free*) kmalloc(sizeof(*f), "mfs writeback free");
+  if (!f)
+    return;                     // the on-disk inode leaks
+  f->fs = fs;
+  f->inum = inum;
+  scoped_acquire l(&wb_free_lock);
+  f->next = wb_free_head;
+  wb_free_head = f;
+}
+
+int
+mfs_fsync(sref<mnode> m)
+{
+  return mfs_writeback::fsync(m.get());
+}
+
+void
+mfs_sync()
+{
+  mfs_writeback::drain(root_fs);
+}
+
+void
+mfswb_print(print_stream *s)
+{
+  u64 nsec = wb_nsec;
+  s->println("mfs write-back: ", wb_inodes.load(), " inodes, ",
+             wb_bytes / 1024, " KB, ", wb_requests.load(), " disk writes, ",
+             nsec ? wb_bytes * 1000000000 / 1024 / nsec : 0, " KB/s");
+}
+
+static void
+mfswb_thread(void *)
+{
+  condvar v("mfs writeback sleeper");
+  spinlock s;
+
+  for (;;) {
+    u64 cur = nsectime();
+    mfs_writeback::drain(root_fs);
+
+    s.acquire();
+    v.sleep_to(&s, cur + cmdline_params.mfs_writeback_ms * 1000000);
+    s.release();
+  }
+}
+
+void
+initmfswb()
+{
+  root_fs->persist_ = true;
+  if (cmdline_params.mfs_writeback_ms)
+    threadrun(mfswb_thread, nullptr, "mfs writeback");
+}
@@ -1,30 +1,52 @@
 #include "types.h"
 #include "kernel.hh"
 #include "mnode.hh"
+#include "mfs.hh"
 #include "weakcache.hh"
 #include "atomic_util.hh"
 #include "percpu.hh"
+#include "kmap.hh"
+
+#include <algorithm>
 
 namespace {
   // 32MB icache (XXX make this proportional to physical RAM)
   public_weakcache<pair<mfs*, u64>, mnode> mnode_cache __attribute__((section (".qdata"))) (32 << 20);
 };
 
+std::atomic<page_info*> mfile::zero_page_ __attribute__((section (".qdata")));
+
 sref<mnode>
 mfs::get(u64 inum)
 {
-  for (;;) {
-    sref<mnode> m = mnode_cache.lookup(make_pair(this, inum));
-    if (m) {
-      // wait for the mnode to be loaded from disk
-      while (!m->valid_) {
-        /* spin */
-      }
-      return m;
-    }
-
+  sref<mnode> m = get_cached(inum);
+  if (!m)
     panic("read in from disk not implemented");
+  return m;
+}
+
+sref<mnode>
+mfs::get_cached(u64 inum)
+{
+  sref<mnode> m = mnode_cache.lookup(make_pair(this, inum));
+  if (m) {
+    // wait for the mnode to be loaded from disk
+    while (!m->valid_) {
+      /* spin */
+    }
   }
+  return m;
+}
+
+const mdir*
+mfs::get_dir_rcu(u64 inum)
+{
+  if (mnode::inumber(inum).type() != mnode::types::dir)
+    return nullptr;
+  mnode* m = mnode_cache.peek(make_pair(this, inum));
+  if (!m || !m->valid_)
+    return nullptr;
+  return m->as_dir();
 }
 
 mlinkref
@@ -66,7 +88,8 @@ mfs::alloc(u8 type)
 }
 
 mnode::mnode(mfs* fs, u64 inum)
-  : fs_(fs), inum_(inum), mtime_(0), cache_pin_(false), valid_(false)
+  : fs_(fs), inum_(inum), disk_inum_(0), mtime_(0), cache_pin_(false),
+    dirty_(false), valid_(false), transient_(!fs->persist_), wb_next_(nullptr)
 {
   kstats::inc(&kstats::mnode_alloc);
 }
@@ -86,9 +109,15 @@ mnode::cache_pin(bool flag)
 void
 mnode::onzero()
 {
+  if (disk_inum_ && fs_->persist_)
+    mfs_free_disk_inode(fs_, disk_inum_);
   mnode_cache.cleanup(weakref_);
   kstats::inc(&kstats::mnode_free);
-  delete this;
+  if (type() == types::dir)
+    // Path walks may still be stepping through this directory
+    gc_delayed(as_dir());
+  else
+    delete this;
 }
 
 void
@@ -102,6 +131,29 @@ mnode::linkcount::onzero()
   m->cache_pin(false);
 }
 
+void
+mfile::resizer::resize(u64 newsize)
+{
+  u64 oldsize = mf_->size_;
+  if (PGROUNDUP(newsize) <= PGROUNDUP(oldsize)) {
+    resize_nogrow(newsize);
+    return;
+  }
+
+  /*
+   * Grow, leaving a hole from the old end of file.  The tail of the
+   * old last page is already zero, since shrinking zeroes it.
+   */
+  mf_->size_ = newsize;
+  if (PGOFFSET(oldsize)) {
+    auto last = mf_->pages_.find(oldsize / PGSIZE);
+    if (last.is_set())
+      last->set_partial_page(false);
+  }
+  mf_->add_wb_hole(oldsize, newsize);
+  mf_->mark_dirty();
+}
+
 void
 mfile::resizer::resize_nogrow(u64 newsize)
 {
@@ -113,14 +165,34 @@ mfile::resizer::resize_nogrow(u64 newsize)
   auto lock = mf_->pages_.acquire(begin, end);
   mf_->pages_.unset(begin, end);
 
+  if (newsize < mf_->disk_size_)
+    mf_->disk_size_ = newsize;
+  mf_->mark_dirty();
+
+  /*
+   * Writes past the end of file and later growth expose the rest of
+   * the last page, so it must read as zeros.
+   */
+  if (newsize < oldsize && PGOFFSET(newsize))
+    mf_->zero_bytes(newsize / PGSIZE, PGOFFSET(newsize),
+                    PGSIZE - PGOFFSET(newsize));
+
+  /*
+   * Pages that have not been read in from disk yet get their
+   * partial flag from size_ when they are loaded.
+   */
   if (PGROUNDDOWN(newsize) > PGROUNDDOWN(oldsize)) {
     /* Grew to a multiple of PGSIZE */
-    mf_->pages_.find(oldsize / PGSIZE)->set_partial_page(false);
+    auto last = mf_->pages_.find(oldsize / PGSIZE);
+    if (last.is_set())
+      last->set_partial_page(false);
   }
 
   if (PGROUNDDOWN(newsize) < PGROUNDDOWN(oldsize) && PGOFFSET(newsize)) {
     /* Shrunk, and last page is partial */
-    mf_->pages_.find(newsize / PGSIZE)->set_partial_page(true);
+    auto last = mf_->pages_.find(newsize / PGSIZE);
+    if (last.is_set())
+      last->set_partial_page(true);
   }
 }
 
@@ -131,7 +203,9 @@ mfile::resizer::resize_append(u64 size, sref<page_info> pi)
 
   if (PGOFFSET(mf_->size_)) {
     /* Also filled out last partial page */
-    mf_->pages_.find(mf_->size_ / PGSIZE)->set_partial_page(false);
+    auto last = mf_->pages_.find(mf_->size_ / PGSIZE);
+    if (last.is_set())
+      last->set_partial_page(false);
   }
 
   auto it = mf_->pages_.find(PGROUNDUP(mf_->size_) / PGSIZE);
@@ -142,8 +216,10 @@ mfile::resizer::resize_append(u64 size, sref<page_info> pi)
   page_state ps(pi);
   if (PGOFFSET(size))
     ps.set_partial_page(true);
+  ps.set_dirty();
   mf_->pages_.fill(it, ps);
   mf_->size_ = size;
+  mf_->mark_dirty();
 }
 
 mfile::page_state
@@ -151,18 +227,391 @@ mfile::get_page(u64 pageidx)
 {
   auto it = pages_.find(pageidx);
   if (!it.is_set()) {
-    // cprintf("WARN: attempted to get page beyond end of file\n");
-    if (pageidx < PGROUNDUP(size_) / PGSIZE) {
-      // XXX read from disk
-      cprintf("WARN: disk read needed?!\n");
-    }
-
+    if (page_on_disk(pageidx))
+      return load_page(pageidx);
     return mfile::page_state();
   }
 
   return it->copy_consistent();
 }
 
+sref<page_info>
+mfile::zero_page()
+{
+  page_info* zp = zero_page_;
+  if (!zp) {
+    char* p = zalloc("file zero page");
+    if (!p)
+      return sref<page_info>();
+    // The initial reference is never dropped
+    page_info* pi = new (page_info::of(p)) page_info();
+    if (!cmpxch(&zero_page_, (page_info*) nullptr, pi))
+      sref<page_info>::transfer(pi);
+    zp = zero_page_;
+  }
+  return sref<page_info>::newref(zp);
+}
+
+mfile::page_state
+mfile::get_page_or_zero(u64 pageidx)
+{
+  page_state ps = get_page(pageidx);
+  if (ps)
+    return ps;
+
+  u64 size = this->size();
+  if (pageidx >= PGROUNDUP(size) / PGSIZE)
+    return ps;
+  page_state zps(zero_page());
+  if (zps && pageidx == size / PGSIZE && PGOFFSET(size))
+    zps.set_partial_page(true);
+  return zps;
+}
+
+mfile::page_state
+mfile::fill_hole(u64 pageidx)
+{
+  char* p = zalloc("file page");
+  if (!p)
+    return page_state();
+  auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+
+  // lock_ keeps the file from shrinking past pageidx under us
+  lock_guard<spinlock> l(&lock_);
+  if (pageidx >= PGROUNDUP(size_) / PGSIZE)
+    return page_state();
+  auto it = pages_.find(pageidx);
+  auto lock = pages_.acquire(it);
+  if (it.is_set() && !it->is_zero_page())
+    return it->copy_consistent();
+  page_state ps(pi);
+  if (pageidx == size_ / PGSIZE && PGOFFSET(size_))
+    ps.set_partial_page(true);
+  ps.set_dirty();
+  pages_.fill(it, ps);
+  return ps;
+}
+
+// Zero n bytes at pgoff in page pageidx, if it is in memory.  Called
+// under lock_.
+void
+mfile::zero_bytes(u64 pageidx, u64 pgoff, u64 n)
+{
+  auto it = pages_.find(pageidx);
+  if (!it.is_set() || it->is_zero_page())
+    return;
+
+  sref<page_info> pi = it->get_page_info();
+  if (secrets_mapped) {
+    memset((char*) pi->va() + pgoff, 0, n);
+  } else {
+    scoped_kmap k(pi->pa());
+    memset(k.va() + pgoff, 0, n);
+  }
+  it->set_dirty();
+}
+
+// Called under lock_
+void
+mfile::add_wb_hole(u64 lo, u64 hi)
+{
+  if (wb_hole_lo_ >= wb_hole_hi_) {
+    wb_hole_lo_ = lo;
+    wb_hole_hi_ = hi;
+    return;
+  }
+  if (lo < wb_hole_lo_)
+    wb_hole_lo_ = lo;
+  if (hi > wb_hole_hi_)
+    wb_hole_hi_ = hi;
+}
+
+bool
+mfile::punch_hole(u64 off, u64 len)
+{
+  u64 end = off + len;
+  if (end < off)
+    end = ~0ull;
+
+  // Read in the edge pages first, since the disk may sleep
+  if (PGOFFSET(off))
+    get_page(off / PGSIZE);
+  if (PGOFFSET(end))
+    get_page(end / PGSIZE);
+  sref<page_info> zero = zero_page();
+  if (!zero)
+    return false;
+
+  resizer r = write_size();
+  u64 size = size_;
+  if (end > size)
+    end = size;
+  if (off >= end)
+    return true;
+
+  // Whole pages to drop.  The last page counts as whole if the range
+  // runs to the end of file.
+  u64 lo = PGROUNDUP(off);
+  u64 hi = end == size ? PGROUNDUP(end) : PGROUNDDOWN(end);
+  if (lo > hi) {
+    zero_bytes(off / PGSIZE, PGOFFSET(off), end - off);
+  } else {
+    if (PGOFFSET(off))
+      zero_bytes(off / PGSIZE, PGOFFSET(off), PGSIZE - PGOFFSET(off));
+    if (end != size && PGOFFSET(end))
+      zero_bytes(end / PGSIZE, 0, PGOFFSET(end));
+  }
+
+  if (lo < hi) {
+    u64 disk = PGROUNDUP(disk_size_.load());
+    u64 mid = hi < disk ? hi : disk;
+    for (u64 pg = lo; pg < mid; pg += PGSIZE) {
+      auto it = pages_.find(pg / PGSIZE);
+      auto lock = pages_.acquire(it);
+      page_state zps(zero);
+      if (pg + PGSIZE > size && PGOFFSET(size))
+        zps.set_partial_page(true);
+      zps.set_dirty();
+      pages_.fill(it, zps);
+    }
+
+    if (mid < lo)
+      mid = lo;
+    if (mid < hi) {
+      auto begin = pages_.find(mid / PGSIZE);
+      auto last = pages_.find(hi / PGSIZE);
+      auto lock = pages_.acquire(begin, last);
+      pages_.unset(begin, last);
+    }
+    add_wb_hole(lo, hi);
+    kstats::inc(&kstats::mfs_punch_page_count, (hi - lo) / PGSIZE);
+  }
+
+  mark_dirty();
+  return true;
+}
+
+s64
+mfile::seek_data(u64 off, bool hole)
+{
+  u64 size = this->size();
+  if (off >= size)
+    return -1;
+
+  // Unset slots below disk_size_ are still on disk, which has no holes
+  u64 disk = PGROUNDUP(disk_size_.load()) / PGSIZE;
+  u64 npages = PGROUNDUP(size) / PGSIZE;
+  auto it = pages_.find(off / PGSIZE), end = pages_.find(npages);
+  for (; it < end; it += it.span()) {
+    u64 idx = it.index();
+    u64 found;
+    if (it.is_set()) {
+      if (it->is_zero_page() != hole)
+        continue;
+      found = idx;
+    } else if (!hole) {
+      if (idx >= disk)
+        continue;
+      found = idx;
+    } else {
+      found = idx > disk ? idx : disk;
+      if (found >= idx + it.span() || found >= npages)
+        continue;
+    }
+    return found * PGSIZE > off ? found * PGSIZE : off;
+  }
+  return hole ? size : -1;
+}
+
+// Spin briefly, then yield, until cond() holds.
+template<class Cond>
+static void
+append_wait(Cond cond)
+{
+  for (int spins = 0; !cond(); spins++) {
+    if (spins < 128)
+      nop_pause();
+    else
+      yield();
+  }
+}
+
+void
+mfile::begin_resize()
+{
+  append_state_.fetch_add(APPEND_RESIZER);
+  // No new reservations can succeed now; wait for the ones already
+  // made to be published.
+  append_wait([this]() {
+      return append_done_.load(std::memory_order_acquire) ==
+        (append_state_.load() & APPEND_END_MASK);
+    });
+}
+
+void
+mfile::end_resize()
+{
+  // Called under lock_ with no appends in flight
+  u64 old = append_state_.load();
+  append_shift_ = 0;
+  append_done_.store(size_, std::memory_order_release);
+  while (!cmpxch_update(&append_state_, &old,
+                        (old & ~APPEND_END_MASK) - APPEND_RESIZER + size_))
+    ;
+}
+
+bool
+mfile::reserve_append(u64 nbytes, u64 *off)
+{
+  u64 old = append_state_.load();
+  for (;;) {
+    if (old & ~APPEND_END_MASK) {
+      append_wait([&]() {
+          old = append_state_.load();
+          return !(old & ~APPEND_END_MASK);
+        });
+      continue;
+    }
+    if (nbytes > max_size() - old)
+      return false;
+    if (cmpxch_update(&append_state_, &old, old + nbytes)) {
+      *off = old;
+      return true;
+    }
+  }
+}
+
+mfile::page_state
+mfile::append_page(u64 pageidx)
+{
+  // The page holding the old end of file may still be on disk, or
+  // may have been punched
+  page_state ps = get_page(pageidx);
+  if (ps && !ps.is_zero_page())
+    return ps;
+
+  char* p = zalloc("file page");
+  if (!p)
+    return page_state();
+  auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+
+  // Neighboring appends may race to create a page they share
+  auto it = pages_.find(pageidx);
+  auto lock = pages_.acquire(it);
+  if (it.is_set() && !it->is_zero_page())
+    return it->copy_consistent();
+  page_state nps(pi);
+  pages_.fill(it, nps);
+  return nps;
+}
+
+// Move n bytes of file data at src down to dst, creating pages at dst
+// as needed.  Returns how many bytes were moved, which is fewer only if
+// out of memory.  Called by the appender whose turn it is to publish,
+// so nothing else writes either range.
+u64
+mfile::move_append(u64 dst, u64 src, u64 n)
+{
+  u64 done = 0;
+  while (done < n) {
+    u64 s = src + done, d = dst + done;
+    u64 len = n - done;
+    len = std::min(len, PGSIZE - PGOFFSET(s));
+    len = std::min(len, PGSIZE - PGOFFSET(d));
+
+    sref<page_info> spi = get_page(s / PGSIZE).get_page_info();
+    sref<page_info> dpi = append_page(d / PGSIZE).get_page_info();
+    if (!spi || !dpi)
+      break;
+    if (spi == dpi) {
+      // dst is below src, so one mapping keeps memmove's overlap
+      // handling correct
+      scoped_kmap k(spi->pa());
+      memmove(k.va() + PGOFFSET(d), k.va() + PGOFFSET(s), len);
+    } else {
+      scoped_kmap ks(spi->pa());
+      scoped_kmap kd(dpi->pa());
+      memmove(kd.va() + PGOFFSET(d), ks.va() + PGOFFSET(s), len);
+    }
+    mark_page_dirty(d / PGSIZE);
+    done += len;
+  }
+  return done;
+}
+
+u64
+mfile::publish_append(u64 off, u64 nbytes, u64 written)
+{
+  append_wait([&]() {
+      return append_done_.load(std::memory_order_acquire) == off;
+    });
+
+  // Earlier appends that faulted left part of their ranges
+  // unpublished, so this one lands lower.  Nothing else writes either
+  // range until we publish, so move it without lock_.
+  u64 shift = append_shift_;
+  u64 dst = off - shift;
+  if (shift && written)
+    written = move_append(dst, off, written);
+
+  u64 done = off + nbytes;
+  {
+    lock_guard<spinlock> l(&lock_);
+    seq_writer w(&seq_);
+    u64 oldsize = size_;
+    u64 newsize = dst + written;
+    assert(oldsize == dst);
+    size_ = newsize;
+
+    // Same partial-page bookkeeping as resize_nogrow
+    if (PGROUNDDOWN(newsize) > PGROUNDDOWN(oldsize) && PGOFFSET(oldsize)) {
+      auto last = pages_.find(oldsize / PGSIZE);
+      if (last.is_set())
+        last->set_partial_page(false);
+    }
+    if (PGOFFSET(newsize)) {
+      auto last = pages_.find(newsize / PGSIZE);
+      if (last.is_set())
+        last->set_partial_page(true);
+    }
+
+    if (newsize != done) {
+      // Clear what the faulted copy or the move left past the new end
+      // of file, which the file may grow over later.
+      for (u64 pos = newsize; pos < done; ) {
+        u64 n = std::min(done - pos, PGSIZE - PGOFFSET(pos));
+        zero_bytes(pos / PGSIZE, PGOFFSET(pos), n);
+        pos += n;
+      }
+
+      // If nobody reserved after us, give the unused space back
+      append_shift_ = done - newsize;
+      u64 old = append_state_.load();
+      while ((old & APPEND_END_MASK) == done) {
+        if (cmpxch_update(&append_state_, &old, old - append_shift_)) {
+          append_shift_ = 0;
+          done = newsize;
+          break;
+        }
+      }
+    }
+  }
+
+  if (written)
+    mark_dirty();
+  append_done_.store(done, std::memory_order_release);
+  return written;
+}
+
+void
+mfile::mark_page_dirty(u64 pageidx)
+{
+  auto it = pages_.find(pageidx);
+  if (it.is_set())
+    it->set_dirty();
+  mark_dirty();
+}
+
 void
 mfsprint(print_stream *s)
 {
@@ -176,4 +625,6 @@ mfsprint(print_stream *s)
   s->println("  ", stats.items / stats.total_buckets, " avg chain length");
   if (stats.used_buckets)
     s->println("  ", stats.items / stats.used_buckets, " avg used chain length");
+  s->println("mfs load from disk at boot: ", mfsload_nsec / 1000, " us");
+  mfswb_print(s);
 }
@@ -8,6 +8,8 @@
 #include "net.hh"
 #include "major.h"
 #include "netdev.hh"
+#include "ilist.hh"
+#include "kstats.hh"
 #include <uk/socket.h>
 
 extern "C" {
@@ -53,18 +55,151 @@ nethwaddr(u8 *hwaddr)
   the_netdev->get_hwaddr(hwaddr);
 }
 
+// Writes at least this large are sent without lwIP copying the data
+// into its own buffers.
+#define ZEROCOPY_MIN 1024
+
+// A page referenced by TCP segments queued by a zero-copy send.  lwIP
+// doesn't tell us when it frees a segment, so we hold a reference to
+// the page until the peer has acknowledged everything up to end or the
+// pcb is gone.  Protected by the lwIP core lock.
+struct zc_page
+{
+  sref<page_info> page;
+  struct tcp_pcb *pcb;
+  u32_t end;
+  islink<zc_page> link;
+  typedef isqueue<zc_page, &zc_page::link> list_t;
+
+  zc_page(const sref<page_info> &page, struct tcp_pcb *pcb, u32_t end)
+    : page(page), pcb(pcb), end(end) { }
+  NEW_DELETE_OPS(zc_page);
+};
+
+// Pages still referenced by closed sockets' pcbs.  Reaped by the TCP
+// slow timer.
+static zc_page::list_t zc_orphans;
+
+static bool
+tcp_pcb_active(struct tcp_pcb *pcb)
+{
+  for (struct tcp_pcb *p = tcp_active_pcbs; p; p = p->next)
+    if (p == pcb)
+      return true;
+  return false;
+}
+
+static void
+zc_reap_orphans(void)
+{
+  auto prev = zc_orphans.before_begin();
+  for (auto it = zc_orphans.begin(); it != zc_orphans.end(); ) {
+    zc_page *z = &*it;
+    if (tcp_pcb_active(z->pcb) && !TCP_SEQ_LEQ(z->end, z->pcb->lastack)) {
+      prev = it++;
+      continue;
+    }
+    it = zc_orphans.erase_after(prev);
+    delete z;
+  }
+}
+
+static void
+tcp_slowtmr_zc(void)
+{
+  tcp_slowtmr();
+  zc_reap_orphans();
+}
+
+// User programs use Linux's SOL_SOCKET option numbers, which differ
+// from lwIP's.  Other levels (IPPROTO_TCP, IPPROTO_IP) agree.
+static bool
+lwip_sockopt(int *level, int *optname)
+{
+  static const struct { int user, lwip; } sol_socket[] = {
+    { 2, SO_REUSEADDR }, { 3, SO_TYPE }, { 4, SO_ERROR },
+    { 7, SO_SNDBUF }, { 8, SO_RCVBUF }, { 9, SO_KEEPALIVE },
+  };
+
+  if (*level != 1)
+    return true;
+  *level = SOL_SOCKET;
+  for (auto &o : sol_socket) {
+    if (o.user == *optname) {
+      *optname = o.lwip;
+      return true;
+    }
+  }
+  return false;
+}
+
 class file_lwip_socket : public refcache::referenced, public file
 {
   int socket_;
   semaphore wsem_, rsem_;
+  zc_page::list_t pinned_;
 
   ~file_lwip_socket()
   {
     lwip_core_lock();
+    struct tcp_pcb *pcb = lwip_socket_tcp_pcb(socket_);
+    if (pcb)
+      release_acked(pcb);
     lwip_close(socket_);
+    // A closing pcb keeps transmitting its queued segments, so the
+    // pages they reference must outlive the socket.
+    while (!pinned_.empty()) {
+      zc_page *z = &pinned_.front();
+      pinned_.pop_front();
+      if (pcb)
+        zc_orphans.push_back(z);
+      else
+        delete z;
+    }
     lwip_core_unlock();
   }
 
+  // Drop the pages the peer has acknowledged.  Caller must hold the
+  // core lock.
+  void release_acked(struct tcp_pcb *pcb)
+  {
+    while (!pinned_.empty() && TCP_SEQ_LEQ(pinned_.front().end, pcb->lastack)) {
+      zc_page *z = &pinned_.front();
+      pinned_.pop_front();
+      delete z;
+    }
+  }
+
+  // Queue n bytes of page at off for transmission without copying
+  // them.  Caller must hold wsem_.
+  ssize_t send_page(const sref<page_info> &page, size_t off, size_t n)
+  {
+    char *va = (char*)page->va() + off;
+
+    lwip_core_lock();
+    struct tcp_pcb *pcb = lwip_socket_tcp_pcb(socket_);
+    if (!pcb) {
+      // Not a connected TCP socket; fall back to a copying send.
+      int r = lwip_write(socket_, va, n);
+      lwip_core_unlock();
+      return r;
+    }
+    release_acked(pcb);
+    int r = lwip_send_nocopy(socket_, va, n, 0);
+    // The send may have blocked and dropped the core lock.  If the
+    // connection was aborted meanwhile, lwIP has already freed every
+    // segment that referenced the page.  Otherwise, some of the data
+    // may be queued even if the send failed.
+    pcb = lwip_socket_tcp_pcb(socket_);
+    if (pcb)
+      pinned_.push_back(new zc_page(page, pcb, pcb->snd_lbb));
+    lwip_core_unlock();
+
+    if (r > 0)
+      kstats::inc(&kstats::socket_zerocopy_bytes, (u64)r);
+    return r;
+  }
+
 public:
   file_lwip_socket(int socket)
     : socket_(socket), wsem_("file_lwip_socket::wsem", 1),
@@ -85,17 +220,44 @@ public:
 
   ssize_t write(const userptr<void> data, size_t n) override
   {
-    char buf[PGSIZE];
-    if (n > PGSIZE)
-      n = PGSIZE;
-    if (!data.load_bytes(buf, n))
-      return -1;
+    if (n < ZEROCOPY_MIN) {
+      char buf[ZEROCOPY_MIN];
+      if (!data.load_bytes(buf, n))
+        return -1;
+
+      auto l = wsem_.guard();
+      lwip_core_lock();
+      int r = lwip_write(socket_, buf, n);
+      lwip_core_unlock();
+      return r;
+    }
 
+    // Copy the user data once, into pages that lwIP sends from
+    // directly.
     auto l = wsem_.guard();
-    lwip_core_lock();
-    int r = lwip_write(socket_, buf, n);
-    lwip_core_unlock();
-    return r;
+    size_t sent = 0;
+    while (sent < n) {
+      size_t len = MIN(n - sent, PGSIZE);
+      char *p = kalloc("sockbuf");
+      if (!p)
+        break;
+      auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+      if (!(data + sent).load_bytes(p, len))
+        return sent ? sent : -1;
+      ssize_t r = send_page(pi, 0, len);
+      if (r < 0)
+        return sent ? sent : r;
+      sent += r;
+      if ((size_t)r < len)
+        break;
+    }
+    return sent ? sent : -1;
+  }
+
+  ssize_t sendpage(const sref<page_info> &page, size_t off, size_t n) override
+  {
+    auto l = wsem_.guard();
+    return send_page(page, off, n);
   }
 
   int bind(const struct sockaddr *addr, size_t addrlen) override
@@ -114,6 +276,30 @@ public:
     return r;
   }
 
+  int setsockopt(int level, int optname, const void *optval, size_t optlen)
+    override
+  {
+    if (!lwip_sockopt(&level, &optname))
+      return -1;
+    lwip_core_lock();
+    int r = lwip_setsockopt(socket_, level, optname, optval, optlen);
+    lwip_core_unlock();
+    return r;
+  }
+
+  int getsockopt(int level, int optname, void *optval, size_t *optlen)
+    override
+  {
+    if (!lwip_sockopt(&level, &optname))
+      return -1;
+    lwip_core_lock();
+    socklen_t len = *optlen;
+    int r = lwip_getsockopt(socket_, level, optname, optval, &len);
+    lwip_core_unlock();
+    *optlen = len;
+    return r;
+  }
+
   int accept(struct sockaddr_storage* addr, size_t *addrlen, file **out)
     override
   {
@@ -210,8 +396,9 @@ tcpip_init_done(void *arg)
 static int
 netifread(char *dst, u32 off, u32 n)
 {
+  extern size_t lwip_mem_stats(char *buf, size_t n);
   u32 ip, nm, gw;
-  char buf[512];
+  char buf[2048];
   u32 len;
 
   ip = ntohl(nif.ip_addr.addr);
@@ -234,6 +421,7 @@ netifread(char *dst, u32 off, u32 n)
 #undef IP
 
   len = strlen(buf);
+  len += lwip_mem_stats(buf + len, sizeof(buf) - len);
 
   if (off >= len)
     return 0;
@@ -265,7 +453,7 @@ initnet_worker(void *x)
 
   start_timer(&t_arp, &etharp_tmr, "arp_timer", ARP_TMR_INTERVAL);
   start_timer(&t_tcpf, &tcp_fasttmr, "tcp_f_timer", TCP_FAST_INTERVAL);
-  start_timer(&t_tcps, &tcp_slowtmr, "tcp_s_timer", TCP_SLOW_INTERVAL);
+  start_timer(&t_tcps, &tcp_slowtmr_zc, "tcp_s_timer", TCP_SLOW_INTERVAL);
 
   start_timer(&t_dhcpf, &dhcp_fine_tmr,	"dhcp_f_timer",	DHCP_FINE_TIMER_MSECS);
   start_timer(&t_dhcpc, &dhcp_coarse_tmr, "dhcp_c_timer", DHCP_COARSE_TIMER_MSECS);
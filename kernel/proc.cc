@@ -13,6 +13,7 @@
 #include "ns.hh"
 #include "filetable.hh"
 #include "nospec-branch.hh"
+#include "kstats.hh"
 #include <fcntl.h>
 #include <uk/unistd.h>
 #include <uk/wait.h>
@@ -35,7 +36,7 @@ proc::proc(int tid_, int tgid_) :
   kstack(0), qstack(0), killed(0), tf(0), uaccess_(0), user_fs_(0),
   cv(nullptr), yield_(false),
   tsc(0), context(nullptr), on_qstack(false),
-  transparent_barriers(0), intentional_barriers(0),
+  transparent_barriers(0), intentional_barriers(0), syscall_num(-1),
   robust_list_ptr((robust_list_head*)USERTOP), tid_address((u32*)USERTOP),
   parent(0), unmap_tlbreq_(0), data_cpuid(-1),
   upath(nullptr), uargv(nullptr), exception_inuse(0)
@@ -152,6 +153,9 @@ procexit(int status)
   if(myproc() == bootproc)
     panic("init exiting");
 
+  // Ring pollers share the file table, so stop them before dropping it
+  if (myproc()->tid == myproc()->tgid)
+    uring_exit_group(myproc()->tgid);
   myproc()->ftable.reset();
   myproc()->cwd.reset();
   delete myproc()->gc;
@@ -227,6 +231,65 @@ procexit(int status)
   panic("zombie exit");
 }
 
+// Per-CPU cache of the memory and kernel stacks of exited procs.
+// Creating a thread otherwise takes a proc and two KSTACKSIZE stacks
+// from the buddy allocator and returns them when the thread exits,
+// which dominates thread create/exit in thread-heavy workloads.
+// Stacks are reused as they are; their contents are overwritten by
+// proc::alloc's initial frame.
+struct proc_cache {
+  enum { capacity = 8 };
+
+  struct bundle {
+    proc *mem;                  // Unconstructed proc
+    char *kstack;
+    char *qstack;
+  };
+
+  int count;
+  bundle bundles[capacity];
+};
+DEFINE_PERCPU(struct proc_cache, proc_caches);
+
+static bool
+proc_cache_get(proc_cache::bundle *b)
+{
+  scoped_cli cli;
+  proc_cache *c = proc_caches.get();
+  if (c->count == 0) {
+    kstats::inc(&kstats::proc_cache_miss_count);
+    return false;
+  }
+  *b = c->bundles[--c->count];
+  kstats::inc(&kstats::proc_cache_hit_count);
+  return true;
+}
+
+// Destroy p and return its memory and stacks to this CPU's proc
+// cache, or free them if the cache is full.  p must already be removed
+// from xnspid.
+static void
+proc_release(proc *p)
+{
+  char *kstack = p->kstack, *qstack = p->qstack;
+  p->~proc();
+
+  if (kstack && qstack) {
+    scoped_cli cli;
+    proc_cache *c = proc_caches.get();
+    if (c->count < proc_cache::capacity) {
+      c->bundles[c->count++] = proc_cache::bundle{p, kstack, qstack};
+      return;
+    }
+  }
+
+  if (kstack)
+    kfree(kstack, KSTACKSIZE);
+  if (qstack)
+    kfree(qstack, KSTACKSIZE);
+  kmfree(p, sizeof(proc));
+}
+
 proc*
 proc::alloc(int tgid)
 {
@@ -234,7 +297,12 @@ proc::alloc(int tgid)
   proc* p;
 
   int tid = xnspid->allockey();
-  p = new proc(tid, tgid == 0 ? tid : tgid);
+  proc_cache::bundle b;
+  bool cached = proc_cache_get(&b);
+  if (cached)
+    p = new (b.mem) proc(tid, tgid == 0 ? tid : tgid);
+  else
+    p = new proc(tid, tgid == 0 ? tid : tgid);
   if (p == nullptr)
     throw_bad_alloc();
 
@@ -244,11 +312,14 @@ proc::alloc(int tgid)
     panic("allocproc: ns_insert");
 
   // Allocate kernel stacks.
-  if(!(p->qstack = (char*) kalloc("qstack", KSTACKSIZE)) ||
-     !(p->kstack = (char*) kalloc("kstack", KSTACKSIZE))) {
+  if (cached) {
+    p->kstack = b.kstack;
+    p->qstack = b.qstack;
+  } else if(!(p->qstack = (char*) kalloc("qstack", KSTACKSIZE)) ||
+            !(p->kstack = (char*) kalloc("kstack", KSTACKSIZE))) {
     if (!xnspid->remove(p->tid, &p))
       panic("allocproc: ns_remove");
-    delete p;
+    proc_release(p);
     return nullptr;
   }
 
@@ -399,7 +470,7 @@ doclone(clone_flags flags)
   auto proc_cleanup = scoped_cleanup([&np]() {
     if (!xnspid->remove(np->tid, &np))
       panic("fork: ns_remove");
-    delete np;
+    proc_release(np);
   });
 
   if (flags & WARD_CLONE_SHARE_VMAP) {
@@ -458,11 +529,7 @@ finishproc(struct proc *p)
   p->vmap.reset();
   if (!xnspid->remove(p->tid, &p))
     panic("finishproc: ns_remove");
-  if (p->kstack)
-    kfree(p->kstack, KSTACKSIZE);
-  if (p->qstack)
-    kfree(p->qstack, KSTACKSIZE);
-  delete p;
+  proc_release(p);
 }
 
 // Wait for a child process to exit and return its pid.
@@ -519,7 +586,7 @@ threadalloc(void (*fn)(void *), void *arg)
   auto proc_cleanup = scoped_cleanup([&p]() {
     if (!xnspid->remove(p->tid, &p))
       panic("fork: ns_remove");
-    delete p;
+    proc_release(p);
   });
 
   // XXX can threadstub be deleted?
@@ -563,6 +630,27 @@ threadpin(void (*fn)(void*), void *arg, const char *name, int cpu)
   return p;
 }
 
+// Start a kernel thread in the current process.  It shares the
+// process's address space and file table, so fn can perform system
+// calls on the process's behalf.  Returns nullptr on failure.
+struct proc*
+threadclone(void (*fn)(void*), void *arg, const char *name)
+{
+  struct proc *p = doclone(WARD_CLONE_SHARE_VMAP | WARD_CLONE_SHARE_FTABLE |
+                           WARD_CLONE_THREAD | WARD_CLONE_NO_RUN);
+  if (p == nullptr)
+    return nullptr;
+
+  p->context->rip = (u64)threadstub;
+  p->context->r12 = (u64)fn;
+  p->context->r13 = (u64)arg;
+  snprintf(p->name, sizeof(p->name), "%s", name);
+  acquire(&p->lock);
+  addrun(p);
+  release(&p->lock);
+  return p;
+}
+
 bool
 proc::deliver_signal(int pid, int tid, int signo)
 {
@@ -92,6 +92,13 @@ initrtc(void)
   rtc_nsec0 = rtc_now * 1000000000ull - nsectime_now;
 }
 
+// Return the number of nanoseconds since the UNIX epoch at nsectime 0
+u64
+rtc_nsec_offset(void)
+{
+  return rtc_nsec0;
+}
+
 //SYSCALL
 uint64_t
 sys_time_nsec(void)
@@ -44,7 +44,7 @@ private:
 };
 
 schedule::schedule()
-  : balance_pool(1), lock_("schedule::lock_", LOCKSTAT_SCHED)
+  : balance_pool(1), lock_("schedule::lock_", LOCKSTAT_SCHED, QSPIN_SCHED)
 {
   ncansteal_ = 0;
   stats_.enqs = 0;
@@ -297,6 +297,8 @@ public:
       fxrstor(next->fpu_state);
 
     switchvm(prev->vmap.get(), next->vmap.get());
+    if (next->vmap)
+      next->vmap->publish_thread(next->tgid, next->tid);
     mycpu()->ts.rsp[0] = (u64) next->kstack + KSTACKSIZE;
 
     prev->on_qstack = !secrets_mapped;
@@ -10,6 +10,8 @@
 #include "fs.h"
 #include "file.hh"
 #include "major.h"
+#include "percpu.hh"
+#include "kmeta.hh"
 
 #if LOCKSTAT
 // The klockstat structure pointed to by spinlocks that want lockstat,
@@ -18,6 +20,10 @@ struct klockstat klockstat_lazy("<lazy>");
 
 static int lockstat_enable;
 
+// Set while a CPU is setting up a lock's class, so that locks taken
+// by the allocator along the way aren't profiled recursively.
+static bool lockstat_initializing[NCPU];
+
 void lockstat_init(struct spinlock *lk, bool lazy);
 
 static inline struct cpulockstat *
@@ -26,6 +32,33 @@ mylockstat(struct spinlock *lk)
   return &lk->stat->s.cpu[mycpu()->id];
 }
 
+static inline u32
+lockstat_bucket(u64 cycles)
+{
+  u32 b = 63 - __builtin_clzll(cycles | 1);
+  return b < LOCKSTAT_HIST ? b : LOCKSTAT_HIST - 1;
+}
+
+// Charge a contended acquire to its call site.  Each CPU tracks a few
+// sites per class, evicting the one with the least wait.
+static void
+lockstat_site(struct cpulockstat *s, uptr rip, u64 wait)
+{
+  struct lockstat_site *victim = &s->sites[0];
+  for (auto &site : s->sites) {
+    if (site.rip == rip) {
+      site.contends++;
+      site.wait += wait;
+      return;
+    }
+    if (site.wait < victim->wait)
+      victim = &site;
+  }
+  victim->rip = rip;
+  victim->contends = 1;
+  victim->wait = wait;
+}
+
 void*
 klockstat::operator new(unsigned long nbytes)
 {
@@ -43,7 +76,8 @@ klockstat::operator delete(void *p)
 }
 #endif
 
-static inline void
+// Returns the time the acquire started, if it is being profiled.
+static inline u64
 locking(struct spinlock *lk)
 {
 #if SPINLOCK_DEBUG
@@ -55,15 +89,19 @@ locking(struct spinlock *lk)
 
 #if LOCKSTAT
   if (lockstat_enable && lk->stat != nullptr) {
-    if (lk->stat == &klockstat_lazy)
+    if (lk->stat == &klockstat_lazy) {
+      if (lockstat_initializing[myid()])
+        return 0;
       lockstat_init(lk, true);
-    mylockstat(lk)->locking_ts = rdtsc();
+    }
+    return rdtsc();
   }
 #endif
+  return 0;
 }
 
 static inline void
-locked(struct spinlock *lk, u64 retries)
+locked(struct spinlock *lk, u64 retries, u64 start, uptr rip)
 {
 #if SPINLOCK_DEBUG
   // Record info about lock acquisition for debugging.
@@ -72,12 +110,20 @@ locked(struct spinlock *lk, u64 retries)
 #endif
 
 #if LOCKSTAT
-  if (lockstat_enable && lk->stat != nullptr) {
+  if (start && lk->stat != &klockstat_lazy && lk->stat != nullptr) {
     struct cpulockstat *s = mylockstat(lk);
-    if (retries > 0)
+    u64 ts = rdtsc();
+    u64 wait = ts - start;
+    if (retries > 0) {
       s->contends++;
+      lockstat_site(s, rip, wait);
+    }
     s->acquires++;
-    s->locked_ts = rdtsc();
+    s->wait += wait;
+    s->wait_hist[lockstat_bucket(wait)]++;
+    lk->locked_ts = ts;
+  } else {
+    lk->locked_ts = 0;
   }
 #endif
 }
@@ -98,11 +144,14 @@ releasing(struct spinlock *lk)
 #endif
 
 #if LOCKSTAT
-  if (lockstat_enable && lk->stat != nullptr) {
+  // locked_ts is only set if the acquire was profiled, so stopping
+  // lockstat mid-hold still accounts for it.
+  if (lk->locked_ts) {
     struct cpulockstat *s = mylockstat(lk);
-    u64 ts = rdtsc();
-    s->locking += ts - s->locking_ts;
-    s->locked += ts - s->locked_ts;
+    u64 hold = rdtsc() - lk->locked_ts;
+    s->hold += hold;
+    s->hold_hist[lockstat_bucket(hold)]++;
+    lk->locked_ts = 0;
   }
 #endif
 }
@@ -112,7 +161,7 @@ releasing(struct spinlock *lk)
 bool
 spinlock::holding()
 {
-  return locked && cpu == mycpu();
+  return (locked & SPINLOCK_LOCKED) && cpu == mycpu();
 }
 #endif
 
@@ -131,64 +180,111 @@ klockstat::klockstat(const char *name) :
   safestrcpy(s.name, name, sizeof(s.name));
 };
 
+// Point lk at the statistics for its class, creating them if this is
+// the first lock of the class to be profiled.
 void
 lockstat_init(struct spinlock *lk, bool lazy)
 {
-  klockstat *ls = new klockstat(lk->name);
-  if (!ls)
-    return;
+  const char *name = lk->name ? lk->name : "<unnamed>";
+  klockstat *ls = nullptr;
 
-  if (lazy) {
-    if (!__sync_bool_compare_and_swap(&lk->stat, &klockstat_lazy, ls)) {
-      delete ls;
-      return;
+  lockstat_initializing[myid()] = true;
+  acquire(&lockstat_lock);
+  for (auto &stat : lockstat_list) {
+    if (strncmp(stat.s.name, name, sizeof(stat.s.name) - 1) == 0) {
+      ls = &stat;
+      break;
     }
-  } else {
-    lk->stat = ls;
   }
-
-  acquire(&lockstat_lock);
-  lockstat_list.push_front(lk->stat);
-  //LIST_INSERT_HEAD(&lockstat_list, lk->stat, link);
+  if (!ls) {
+    ls = new klockstat(name);
+    lockstat_list.push_front(ls);
+    //LIST_INSERT_HEAD(&lockstat_list, lk->stat, link);
+  }
   release(&lockstat_lock);
+  lockstat_initializing[myid()] = false;
+
+  if (lazy)
+    __sync_bool_compare_and_swap(&lk->stat, &klockstat_lazy, ls);
+  else
+    lk->stat = ls;
 }
 
 static void
 lockstat_stop(struct spinlock *lk)
 {
-  if (lk->stat != nullptr) {
-    lk->stat->magic = 0;
-    lk->stat = nullptr;
-  }
+  // Classes are shared, so just detach this lock from its class
+  lk->stat = nullptr;
+  lk->locked_ts = 0;
 }
 
 void
 lockstat_clear(void)
 {
-  // struct klockstat *stat, *tmp;
-
   acquire(&lockstat_lock);
-  
-  //LIST_FOREACH_SAFE(stat, &lockstat_list, link, tmp) {
-  for (auto it = lockstat_list.begin(); it != lockstat_list.end(); it++) {
-    klockstat *stat = &(*it);
-    if (stat->magic == 0) {
-      lockstat_list.erase(it);
-      // LIST_REMOVE(stat, link);
-      // So verifyfree doesn't follow le_next
-      // stat->link.le_next = 0;
-      gc_delayed(stat);
-    } else {
-      memset(&stat->s.cpu, 0, sizeof(stat->s.cpu));
+  for (auto &stat : lockstat_list)
+    memset(&stat.s.cpu, 0, sizeof(stat.s.cpu));
+  release(&lockstat_lock);
+}
+
+// Sum a class's per-CPU statistics into a report.  The call sites
+// tracked by each CPU are merged and the ones with the most wait are
+// kept.  Caller must hold lockstat_lock.
+static void
+lockstat_summarize(struct lockstat *ls, struct lockstat_report *r)
+{
+  static struct lockstat_site sites[NCPU * LOCKSTAT_SITES];
+  int nsites = 0;
+
+  memset(r, 0, sizeof(*r));
+  safestrcpy(r->name, ls->name, sizeof(r->name));
+  for (int c = 0; c < ncpu; c++) {
+    struct cpulockstat *s = &ls->cpu[c];
+    r->acquires += s->acquires;
+    r->contends += s->contends;
+    r->wait += s->wait;
+    r->hold += s->hold;
+    for (int i = 0; i < LOCKSTAT_HIST; i++) {
+      r->wait_hist[i] += s->wait_hist[i];
+      r->hold_hist[i] += s->hold_hist[i];
+    }
+    for (auto &site : s->sites) {
+      if (!site.contends)
+        continue;
+      int i;
+      for (i = 0; i < nsites && sites[i].rip != site.rip; i++)
+        ;
+      if (i == nsites)
+        sites[nsites++] = site;
+      else {
+        sites[i].contends += site.contends;
+        sites[i].wait += site.wait;
+      }
     }
   }
-  release(&lockstat_lock);
+
+  for (auto &out : r->sites) {
+    struct lockstat_site *best = nullptr;
+    for (int i = 0; i < nsites; i++)
+      if (sites[i].contends && (!best || sites[i].wait > best->wait))
+        best = &sites[i];
+    if (!best)
+      break;
+    out.rip = best->rip;
+    out.contends = best->contends;
+    out.wait = best->wait;
+    u32 offset = 0;
+    const char *sym = kmeta::lookup((void*) best->rip, &offset);
+    if (sym)
+      snprintf(out.sym, sizeof(out.sym), "%s+%u", sym, offset);
+    best->contends = 0;
+  }
 }
 
 static int
 lockstat_read(char *dst, u32 off, u32 n)
 {
-  static const u64 sz = sizeof(struct lockstat);
+  static const u64 sz = sizeof(struct lockstat_report);
   static struct {
     struct klockstat *stat;
     u32 off;
@@ -209,19 +305,14 @@ lockstat_read(char *dst, u32 off, u32 n)
   } else {
     cur = 0;
     it = lockstat_list.begin();
-    // stat = LIST_FIRST(&lockstat_list);
-    // stat = lockstat_list.front();
-    
   }
   stat = &(*it);
-//  for (; stat != nullptr; stat = LIST_NEXT(stat, link)) {
   for (; it != lockstat_list.end(); it++) {
     stat = &(*it);
-    struct lockstat *ls = &stat->s;
-    if (n < sizeof(*ls))
+    if (n < sz)
       break;
     if (cur >= off) {
-      memmove(dst, ls, sz);
+      lockstat_summarize(&stat->s, (struct lockstat_report*) dst);
       dst += sz;
       n -= sz;
     }
@@ -281,13 +372,16 @@ spinlock::spinlock(spinlock &&o)
   : locked(o.locked.load())
 #endif
 
-#if SPINLOCK_DEBUG
+#if SPINLOCK_DEBUG || LOCKSTAT
     , name(o.name)
+#endif
+
+#if SPINLOCK_DEBUG
     , cpu(o.cpu)
 #endif
 
 #if LOCKSTAT
-    , stat(o.stat)
+    , stat(o.stat), locked_ts(0)
 #endif
 
 {
@@ -312,8 +406,10 @@ spinlock::operator=(spinlock &&o)
   locked = o.locked.load();
 #endif
 
-#if SPINLOCK_DEBUG
+#if SPINLOCK_DEBUG || LOCKSTAT
   name = o.name;
+#endif
+#if SPINLOCK_DEBUG
   cpu = o.cpu;
   memcpy(&pcs, &o.pcs, sizeof(pcs));
 #endif
@@ -362,16 +458,114 @@ spinlock::release()
   popcli();
 }
 #else
+// Queued spinlocks are MCS locks whose queue tail lives in the lock
+// word next to the locked bit.  A CPU that finds the lock held
+// appends one of its per-CPU queue nodes to the tail and spins on
+// that node until its predecessor hands over the head of the queue.
+// Only the head spins on the lock word, waiting for the owner to
+// release it.  Since a CPU waits with interrupts disabled, it rarely
+// needs more than one node; the rest cover NMI-style nesting.
+namespace {
+  enum { QSPIN_NODES = 4 };
+
+  struct qspin_node {
+    std::atomic<qspin_node*> next;
+    std::atomic<bool> head;
+  };
+
+  struct qspin_cpu {
+    qspin_node node[QSPIN_NODES];
+    int depth;
+  };
+}
+
+DEFINE_QPERCPU(qspin_cpu, qspin_nodes, NO_INT);
+
+static qspin_node *
+qspin_decode(u32 tail)
+{
+  tail >>= spinlock::SPINLOCK_TAIL_SHIFT;
+  return &qspin_nodes[(tail >> 2) - 1].node[tail & 3];
+}
+
+// Slow path of queued spinlock acquire.  Returns the number of times
+// the lock was found held.
+static u64
+qspin_acquire_slow(std::atomic<u32> *word)
+{
+  qspin_cpu *qn = qspin_nodes.get_unchecked();
+  int idx = qn->depth++;
+  assert(idx < QSPIN_NODES);
+  qspin_node *node = &qn->node[idx];
+  node->next.store(nullptr, std::memory_order_relaxed);
+  node->head.store(false, std::memory_order_relaxed);
+  u32 tail = ((myid() + 1) << 2 | idx) << spinlock::SPINLOCK_TAIL_SHIFT;
+
+  // Make this node the tail of the queue
+  u32 old = word->load(std::memory_order_relaxed);
+  while (!word->compare_exchange_weak(
+           old, (old & ~spinlock::SPINLOCK_TAIL_MASK) | tail,
+           std::memory_order_acq_rel))
+    ;
+
+  u64 retries = 1;
+  if (old & spinlock::SPINLOCK_TAIL_MASK) {
+    qspin_decode(old)->next.store(node, std::memory_order_release);
+    while (!node->head.load(std::memory_order_acquire)) {
+      retries++;
+      nop_pause();
+    }
+  }
+
+  // At the head of the queue, wait for the owner to let go
+  for (;;) {
+    u32 v = word->load(std::memory_order_acquire);
+    if (v & spinlock::SPINLOCK_LOCKED) {
+      retries++;
+      nop_pause();
+      continue;
+    }
+
+    if ((v & spinlock::SPINLOCK_TAIL_MASK) == tail) {
+      // Nobody queued behind us, so take the lock and empty the queue
+      if (word->compare_exchange_strong(
+            v, (v & ~spinlock::SPINLOCK_TAIL_MASK) | spinlock::SPINLOCK_LOCKED,
+            std::memory_order_acquire))
+        break;
+      continue;
+    }
+
+    // With a queue behind us, only the head can take the lock
+    word->fetch_or(spinlock::SPINLOCK_LOCKED, std::memory_order_acquire);
+    qspin_node *next;
+    while (!(next = node->next.load(std::memory_order_acquire)))
+      nop_pause();
+    next->head.store(true, std::memory_order_release);
+    break;
+  }
+
+  qn->depth--;
+  return retries;
+}
+
 bool
 spinlock::try_acquire()
 {
   pushcli();
-  locking(this);
-  if (locked.exchange(1, std::memory_order_acquire) != 0) {
+  u64 start = locking(this);
+  bool ok;
+  u32 v = locked.load(std::memory_order_relaxed);
+  if (v & SPINLOCK_QUEUED) {
+    v = SPINLOCK_QUEUED;
+    ok = locked.compare_exchange_strong(v, SPINLOCK_QUEUED | SPINLOCK_LOCKED,
+                                        std::memory_order_acquire);
+  } else
+    ok = locked.exchange(SPINLOCK_LOCKED, std::memory_order_acquire) == 0;
+  if (!ok) {
       popcli();
       return false;
   }
-  ::locked(this, 0);
+  ::locked(this, 0, start, (uptr) __builtin_return_address(0));
   return true;
 }
 
@@ -385,14 +579,22 @@ spinlock::acquire()
   u64 retries;
 
   pushcli();
-  locking(this);
+  u64 start = locking(this);
 
   retries = 0;
-  while (locked.exchange(1, std::memory_order_acquire) != 0) {
-    retries++;
-    nop_pause();
+  u32 v = locked.load(std::memory_order_relaxed);
+  if (v & SPINLOCK_QUEUED) {
+    v = SPINLOCK_QUEUED;
+    if (!locked.compare_exchange_strong(v, SPINLOCK_QUEUED | SPINLOCK_LOCKED,
+                                        std::memory_order_acquire))
+      retries = qspin_acquire_slow(&locked);
+  } else {
+    while (locked.exchange(SPINLOCK_LOCKED, std::memory_order_acquire) != 0) {
+      retries++;
+      nop_pause();
+    }
   }
-  ::locked(this, retries);
+  ::locked(this, retries, start, (uptr) __builtin_return_address(0));
 }
 
 // Release the lock.
@@ -401,7 +603,12 @@ spinlock::release()
 {
   releasing(this);
 
-  locked.store(0, std::memory_order_release);
+  // Waiters may be changing the queue tail of a queued lock, so only
+  // clear the locked bit.
+  if (locked.load(std::memory_order_relaxed) & SPINLOCK_QUEUED)
+    locked.fetch_and(~SPINLOCK_LOCKED, std::memory_order_release);
+  else
+    locked.store(0, std::memory_order_release);
 
   popcli();
 }
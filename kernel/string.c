@@ -4,12 +4,7 @@
 #include <string.h>
 #include <strings.h>
 
-void*
-memset(void *dst, int c, size_t n)
-{
-  stosb(dst, c, n);
-  return dst;
-}
+// memset and memcpy are in stringasm.S
 
 int
 memcmp(const void* s1, const void* s2, size_t n)
@@ -42,23 +37,11 @@ memmove(void *dst, const void *src, size_t n)
     // Some versions of GCC rely on DF being clear
     __asm volatile("cld" ::: "cc");
   } else {
-    if ((intptr_t)s%4 == 0 && (intptr_t)d%4 == 0 && n%4 == 0)
-      __asm volatile("cld; rep movsl\n"
-              :: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-    else
-      __asm volatile("cld; rep movsb\n"
-              :: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+    memcpy(dst, src, n);
   }
   return dst;
 }
 
-// memcpy exists to placate GCC.  Use memmove.
-void*
-memcpy(void *dst, const void *src, size_t n)
-{
-  return memmove(dst, src, n);
-}
-
 void*
 mempcpy(void *dst, const void *src, size_t n)
 {
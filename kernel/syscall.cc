@@ -8,6 +8,7 @@
 #include "cpu.hh"
 #include "errno.h"
 #include "nospec-branch.hh"
+#include "wbstat.hh"
 
 #define KERNEL_STRACE_UNKNOWN 0
 
@@ -116,7 +117,6 @@ userptr_str::load_alloc(std::size_t limit, std::size_t *len_out) const
 
 extern u64 (*const syscalls[])(u64, u64, u64, u64, u64, u64);
 extern const char* syscall_names[];
-extern const bool syscall_needs_secrets[];
 extern const int nsyscalls;
 
 u64
@@ -132,7 +132,9 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
 #if KERNEL_STRACE
           myproc()->syscall_param_string[0] = '\0';
 #endif
+          u64 wb = wbstat_syscall_begin(num);
           u64 r = fn(a0, a1, a2, a3, a4, a5);
+          wbstat_syscall_end(num, wb);
 #if KERNEL_STRACE
           if (strcmp(myproc()->name, STRACE_BINARY_NAME) == 0) {
             if (myproc()->syscall_param_string[0]) {
@@ -6,6 +6,7 @@
 #include "proc.hh"
 #include "fs.h"
 #include "file.hh"
+#include "mfs.hh"
 #include "cpu.hh"
 #include "net.hh"
 #include "dirns.hh"
@@ -58,6 +59,12 @@ compute_offset(file_inode *fi, off_t *fioffp, off_t offset, int whence)
       return -1;
 
     return offset + fi->ip->file_size();
+
+  case SEEK_DATA:
+  case SEEK_HOLE:
+    if (offset < 0)
+      return -1;
+    return fi->ip->seek_data(offset, whence == SEEK_HOLE);
   }
   return -1;
 }
@@ -112,39 +119,86 @@ sys_close(int fd)
 long
 sys_sync(void)
 {
-  // Not implemented
-  return -ENOSYS;
+  mfs_sync();
+  return 0;
 }
 
 //SYSCALL
 long
 sys_fsync(int fd)
 {
-  // Not implemented
-  return -ENOSYS;
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -EBADF;
+
+  sref<vnode> vn = f->get_vnode();
+  if (!vn)
+    return -EINVAL;
+  return vn->sync();
 }
 
-ssize_t
-impl_read(sref<file>&& f, userptr<void> p, size_t total_bytes)
+// Return the writable regular file open as fd, or null with the error
+// in *err.
+static file_inode*
+get_writable_file(sref<file> f, long *err)
 {
-  char b[PGSIZE];
-  ssize_t bytes = 0;
-  while (bytes < total_bytes) {
-    size_t n = total_bytes - bytes;
-    if (n > PGSIZE)
-      n = PGSIZE;
+  file* ff = f.get();
+  if (!ff) {
+    *err = -EBADF;
+    return nullptr;
+  }
+  if (&typeid(*ff) != &typeid(file_inode) ||
+      !static_cast<file_inode*>(ff)->ip->is_regular_file()) {
+    *err = -EINVAL;
+    return nullptr;
+  }
+  file_inode* fi = static_cast<file_inode*>(ff);
+  if (!fi->writable) {
+    *err = -EBADF;
+    return nullptr;
+  }
+  return fi;
+}
 
-    ssize_t ret = f->read(b, n);
-    if (ret <= 0){
-      return bytes ? bytes : ret;
-    }
-    if (!(p+bytes).store_bytes(b, ret)) {
-      return bytes ? bytes : -1;
-    }
+//SYSCALL
+long
+sys_ftruncate(int fd, off_t length)
+{
+  if (length < 0)
+    return -EINVAL;
 
-    bytes += ret;
+  long err;
+  sref<file> f = getfile(fd);
+  file_inode* fi = get_writable_file(f, &err);
+  if (!fi)
+    return err;
+  return fi->ip->set_size(length);
+}
+
+//SYSCALL
+long
+sys_fallocate(int fd, int mode, off_t offset, off_t len)
+{
+  if (offset < 0 || len <= 0)
+    return -EINVAL;
+
+  long err;
+  sref<file> f = getfile(fd);
+  file_inode* fi = get_writable_file(f, &err);
+  if (!fi)
+    return err;
+
+  switch (mode) {
+  case 0:
+    return fi->ip->allocate(offset, len);
+
+  case FALLOC_FL_KEEP_SIZE:
+    return 0;
+
+  case FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE:
+    return fi->ip->punch_hole(offset, len);
   }
-  return bytes;
+  return -EOPNOTSUPP;
 }
 
 //SYSCALL
@@ -165,7 +219,7 @@ sys_read(int fd, userptr<void> p, size_t total_bytes)
   //   ensure_secrets();
   }
 
-  return impl_read(std::move(f), p, total_bytes);
+  return f->read_user(p, total_bytes);
 }
 
 //SYSCALL
@@ -179,12 +233,7 @@ sys_pread(int fd, void *ubuf, size_t count, off_t offset)
   if (count > 4*1024*1024)
     count = 4*1024*1024;
 
-  char* b = (char*) kmalloc(count, "preadbuf");
-  auto cleanup = scoped_cleanup([&](){kmfree(b, count);});
-  ssize_t r = f->pread(b, count, offset);
-  if (r > 0)
-    putmem(ubuf, b, r);
-  return r;
+  return f->pread_user(userptr<void>(ubuf), count, offset);
 }
 
 //SYSCALL
@@ -218,6 +267,77 @@ sys_pwrite(int fd, const userptr<void> ubuf, size_t count, off_t offset)
   return f->pwrite(ubuf, count, offset);
 }
 
+//SYSCALL
+ssize_t
+sys_sendfile(int out_fd, int in_fd, userptr<off_t> offset, size_t count)
+{
+  sref<file> out = getfile(out_fd);
+  sref<file> in = getfile(in_fd);
+  if (!out || !in)
+    return -EBADF;
+
+  file* inf = in.get();
+  if (&typeid(*inf) != &typeid(file_inode))
+    return -EINVAL;
+
+  file_inode* fi = static_cast<file_inode*>(inf);
+  if (!fi->readable)
+    return -EBADF;
+  if (!fi->ip->is_regular_file())
+    return -EINVAL;
+
+  // Without an explicit offset, sendfile reads from and advances the
+  // file offset.
+  lock_guard<sleeplock> l;
+  off_t off;
+  if (offset) {
+    if (!offset.load(&off))
+      return -EFAULT;
+    if (off < 0)
+      return -EINVAL;
+  } else {
+    l = fi->off_lock.guard();
+    off = fi->off;
+  }
+
+  // Hand the file's pages to the socket directly; it holds a reference
+  // to each page until the data is acknowledged.
+  u64 size = fi->ip->file_size();
+  size_t sent = 0;
+  ssize_t r = 0;
+  while (sent < count && off + sent < size) {
+    u64 pos = off + sent;
+    sref<page_info> pi = fi->ip->get_page_info(pos / PGSIZE);
+    if (!pi) {
+      // The page is still on disk; read it in and retry
+      if (fi->ip->needs_load(pos / PGSIZE) &&
+          fi->ip->load_page(pos / PGSIZE))
+        continue;
+      break;
+    }
+    size_t pgoff = pos % PGSIZE;
+    size_t n = MIN(MIN(PGSIZE - pgoff, count - sent), size - pos);
+    r = out->sendpage(pi, pgoff, n);
+    if (r <= 0)
+      break;
+    sent += r;
+    if ((size_t)r < n)
+      break;
+  }
+
+  if (sent == 0 && r < 0)
+    return r;
+
+  if (offset) {
+    off += sent;
+    if (!offset.store(&off))
+      return -EFAULT;
+  } else {
+    fi->off = off + sent;
+  }
+  return sent;
+}
+
 //SYSCALL
 ssize_t
 sys_writev(int fd, const void* iov, int count) {
@@ -16,8 +16,10 @@
 #include "kmeta.hh"
 #include "nospec-branch.hh"
 #include "errno.h"
+#include "numa.hh"
 
 #include <uk/mman.h>
+#include <uk/mempolicy.h>
 #include <uk/utsname.h>
 #include <uk/unistd.h>
 
@@ -332,6 +334,86 @@ sys_mprotect(userptr<void> addr, size_t len, int prot)
   return myproc()->vmap->mprotect(align_addr, align_len, flags);
 }
 
+// Check a memory policy and encode it as vmdesc::FLAG_MPOL bits in
+// *out.  nodemask is a bit array of maxnode bits; since there are at
+// most MAX_NUMA_NODES nodes, only its first word matters.
+static int
+load_mempolicy(int mode, userptr<unsigned long> nodemask,
+               unsigned long maxnode, u64 *out)
+{
+  if (mode < MPOL_DEFAULT || mode > MPOL_LOCAL)
+    return -EINVAL;
+
+  unsigned long mask = 0;
+  if (mode != MPOL_DEFAULT && mode != MPOL_LOCAL) {
+    if (nodemask && maxnode) {
+      if (!nodemask.load(&mask))
+        return -EFAULT;
+      if (maxnode < 64)
+        mask &= (1ul << maxnode) - 1;
+    }
+    if (mask & ~((1ul << numa_nodes.size()) - 1))
+      return -EINVAL;
+    // An empty preferred set means local allocation
+    if (!mask && mode != MPOL_PREFERRED)
+      return -EINVAL;
+  }
+  *out = vmdesc::mpol_flags(mode, mask);
+  return 0;
+}
+
+//SYSCALL
+long
+sys_set_mempolicy(int mode, userptr<unsigned long> nodemask,
+                  unsigned long maxnode)
+{
+  u64 mpol;
+  long r = load_mempolicy(mode, nodemask, maxnode, &mpol);
+  if (r < 0)
+    return r;
+  myproc()->vmap->set_mempolicy(mpol);
+  return 0;
+}
+
+//SYSCALL
+long
+sys_mbind(userptr<void> addr, unsigned long len, int mode,
+          userptr<unsigned long> nodemask, unsigned long maxnode,
+          unsigned flags)
+{
+  // We never migrate pages that are already allocated, so none of
+  // the MPOL_MF_* flags apply
+  if ((uptr)addr % PGSIZE || flags)
+    return -EINVAL;
+  if ((uptr)addr + len >= USERTOP || (uptr)addr + len < (uptr)addr)
+    return -EFAULT;
+
+  u64 mpol;
+  long r = load_mempolicy(mode, nodemask, maxnode, &mpol);
+  if (r < 0)
+    return r;
+
+  uptr align_len = PGROUNDUP((uptr)addr + len) - (uptr)addr;
+  if (myproc()->vmap->mbind((uptr)addr, align_len, mpol) < 0)
+    return -EFAULT;
+  return 0;
+}
+
+//SYSCALL
+long
+sys_getcpu(userptr<unsigned> cpu, userptr<unsigned> node)
+{
+  unsigned c, n;
+  {
+    scoped_cli cli;
+    c = myid();
+    n = mycpu()->node ? mycpu()->node->id : 0;
+  }
+  if ((cpu && !cpu.store(&c)) || (node && !node.store(&n)))
+    return -EFAULT;
+  return 0;
+}
+
 //SYSCALL {"noret":true}
 void
 sys_halt(int code)
@@ -5,6 +5,8 @@
 #include <fcntl.h>
 #include <uk/stat.h>
 #include <uk/socket.h>
+#include <uk/time.h>
+#include <memory>
 
 // Copy *sa into *ss, where sa is sa_len bytes long, and make sure
 // there's a NUL after the end of the copied sockaddr.
@@ -184,3 +186,176 @@ sys_recv(int sockfd, userptr<void> buf, size_t len, int flags)
 {
   return sys_recvfrom(sockfd, buf, len, flags, nullptr, nullptr);
 }
+
+//SYSCALL
+long
+sys_setsockopt(int sockfd, int level, int optname,
+               const userptr<void> optval, uint32_t optlen)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  char buf[64];
+  if (optlen > sizeof(buf) || !optval.load_bytes(buf, optlen))
+    return -1;
+  return f->setsockopt(level, optname, buf, optlen);
+}
+
+//SYSCALL
+long
+sys_getsockopt(int sockfd, int level, int optname,
+               userptr<void> optval, userptr<uint32_t> optlen)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  char buf[64];
+  uint32_t len;
+  if (!optlen.load(&len))
+    return -1;
+  size_t n = MIN(len, sizeof(buf));
+  int r = f->getsockopt(level, optname, buf, &n);
+  if (r < 0)
+    return r;
+  len = MIN(n, (size_t)len);
+  if (!optval.store_bytes(buf, len) || !optlen.store(&len))
+    return -1;
+  return 0;
+}
+
+// Load msgvec[i] into *m.  The address, if any, is copied to *ss for
+// sends; for receives, *ss is just where it will be stored.
+static int
+kmmsg_from_user(userptr<struct mmsghdr> msgvec, unsigned int i,
+                struct kmmsg *m, struct sockaddr_storage *ss, bool send)
+{
+  struct mmsghdr h;
+  if (!(msgvec + i).load(&h))
+    return -1;
+  if (h.msg_hdr.msg_iovlen > KMMSG_IOV)
+    return -1;
+  m->iovcnt = h.msg_hdr.msg_iovlen;
+  if (!userptr<kernel_iovec>((kernel_iovec*)h.msg_hdr.msg_iov)
+      .load(m->iov, m->iovcnt))
+    return -1;
+  m->addr = nullptr;
+  m->addrlen = 0;
+  m->len = 0;
+  if (h.msg_hdr.msg_name) {
+    m->addr = ss;
+    if (send) {
+      m->addrlen = h.msg_hdr.msg_namelen;
+      userptr<struct sockaddr> name((struct sockaddr*)h.msg_hdr.msg_name);
+      if (sockaddr_from_user(ss, name, h.msg_hdr.msg_namelen) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Store the results of msgs[i] back to msgvec[i].
+static int
+kmmsg_to_user(userptr<struct mmsghdr> msgvec, unsigned int i,
+              const struct kmmsg *m)
+{
+  struct mmsghdr h;
+  if (!(msgvec + i).load(&h))
+    return -1;
+  h.msg_len = m->len;
+  h.msg_hdr.msg_flags = 0;
+  if (m->addr && m->addrlen) {
+    if (h.msg_hdr.msg_namelen > m->addrlen)
+      h.msg_hdr.msg_namelen = m->addrlen;
+    if (!userptr<void>(h.msg_hdr.msg_name).store_bytes(
+          m->addr, h.msg_hdr.msg_namelen))
+      return -1;
+  }
+  if (!(msgvec + i).store(&h))
+    return -1;
+  return 0;
+}
+
+struct mmsg_batch {
+  struct kmmsg msgs[KMMSG_BATCH];
+  struct sockaddr_storage addrs[KMMSG_BATCH];
+  NEW_DELETE_OPS(mmsg_batch);
+};
+
+// Linux caps vlen at UIO_MAXIOV.
+#define MMSG_VLEN_MAX 1024
+
+//SYSCALL
+int
+sys_sendmmsg(int sockfd, userptr<struct mmsghdr> msgvec, unsigned int vlen,
+             int flags)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  std::unique_ptr<mmsg_batch> b(new mmsg_batch);
+  vlen = MIN(vlen, (unsigned int)MMSG_VLEN_MAX);
+  unsigned int done = 0;
+  int r = 0;
+  while (done < vlen) {
+    unsigned int n = MIN(vlen - done, (unsigned int)KMMSG_BATCH);
+    for (unsigned int i = 0; i < n; i++)
+      if (kmmsg_from_user(msgvec, done + i, &b->msgs[i], &b->addrs[i], true) < 0)
+        return done ? done : -1;
+    r = f->sendmmsg(b->msgs, n, flags);
+    if (r <= 0)
+      break;
+    for (int i = 0; i < r; i++)
+      if (kmmsg_to_user(msgvec, done + i, &b->msgs[i]) < 0)
+        return done ? done : -1;
+    done += r;
+    if ((unsigned int)r < n)
+      break;
+  }
+  return done ? done : r;
+}
+
+//SYSCALL
+int
+sys_recvmmsg(int sockfd, userptr<struct mmsghdr> msgvec, unsigned int vlen,
+             int flags, userptr<struct timespec> timeout)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  u64 deadline = ~0ull;
+  if (timeout) {
+    struct timespec ts;
+    if (!timeout.load(&ts) || ts.tv_sec < 0 || ts.tv_nsec < 0)
+      return -1;
+    deadline = nsectime() + ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  }
+
+  std::unique_ptr<mmsg_batch> b(new mmsg_batch);
+  vlen = MIN(vlen, (unsigned int)MMSG_VLEN_MAX);
+  unsigned int done = 0;
+  int r = 0;
+  while (done < vlen) {
+    unsigned int n = MIN(vlen - done, (unsigned int)KMMSG_BATCH);
+    for (unsigned int i = 0; i < n; i++)
+      if (kmmsg_from_user(msgvec, done + i, &b->msgs[i], &b->addrs[i], false) < 0)
+        return done ? done : -1;
+    r = f->recvmmsg(b->msgs, n, flags, deadline);
+    if (r <= 0)
+      break;
+    for (int i = 0; i < r; i++)
+      if (kmmsg_to_user(msgvec, done + i, &b->msgs[i]) < 0)
+        return done ? done : -1;
+    done += r;
+    // Once something has arrived, MSG_WAITFORONE only takes what is
+    // already queued.
+    if (flags & LINUX_MSG_WAITFORONE)
+      flags |= LINUX_MSG_DONTWAIT;
+    if ((unsigned int)r < n)
+      break;
+  }
+  return done ? done : r;
+}
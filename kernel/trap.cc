@@ -15,9 +15,8 @@
 #include "hwvm.hh"
 #include "refcache.hh"
 #include "cpuid.hh"
-#include "linearhash.hh"
+#include "wbstat.hh"
 #include "vm.hh"
-#include "cmdline.hh"
 
 extern "C" void __uaccess_end(void);
 
@@ -62,10 +61,6 @@ static struct irq_info
   bool in_use;
 } irq_info[256 - T_IRQ0];
 
-// Instruction pointers that cause transparent world barriers.
-linearhash<u64, u64> transparent_wb_rips(10240);
-linearhash<u64, u64> intentional_wb_rips(10240);
-
 static void trap(struct trapframe *tf, bool had_secrets);
 
 void
@@ -73,14 +68,17 @@ ensure_secrets()
 {
   pushcli();
   bool had_secrets = secrets_mapped;
+  u64 start = rdtsc();
   switch_to_kstack();
+  u64 cycles = rdtsc() - start;
   popcli();
 
-  if (cmdline_params.track_wbs && !had_secrets) {
-    intentional_wb_rips.increment((u64)__builtin_return_address(0) - 1);
-  }
-  if (!had_secrets && myproc()) {
-    myproc()->intentional_barriers++;
+  if (!had_secrets) {
+    wbstat_barrier(wb_kind::intentional, cycles,
+                   (uptr)__builtin_return_address(0) - 1,
+                   __builtin_frame_address(1));
+    if (myproc())
+      myproc()->intentional_barriers++;
   }
 }
 
@@ -111,15 +109,12 @@ do_pagefault(struct trapframe *tf, bool had_secrets)
       !had_secrets && addr >= KGLOBAL) {
     // Page fault was probably caused by trying to access secret
     // data so map all secrets in now and record where this happened.
+    u64 start = rdtsc();
     switch_to_kstack();
+    u64 cycles = rdtsc() - start;
 
-    if (cmdline_params.track_wbs) {
-      uptr pc[2];
-      getcallerpcs((void *) tf->rbp, pc, NELEM(pc));
-      u64 bt = (tf->rip & 0x1fffff) | ((pc[0] & 0x1fffff) << 21) | ((pc[1] & 0x1fffff) << 42);
-      transparent_wb_rips.increment(bt);
-    }
-    if (!had_secrets && myproc()) {
+    wbstat_barrier(wb_kind::transparent, cycles, tf->rip, (void*)tf->rbp);
+    if (myproc()) {
       myproc()->transparent_barriers++;
     }
     return 0;
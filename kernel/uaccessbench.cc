@@ -0,0 +1,90 @@
+// User memory access microbenchmark, driven by bin/uaccessbench
+// through /dev/uaccessbench.
+//
+// Each request names a user buffer of size bytes holding a string of
+// size - 1 characters, and makes the kernel copy it in with fetchmem,
+// copy it out with putmem, copy it in as a string with fetchstr, and
+// find its end with the scan behind userptr_str::load_alloc, each
+// iters times.  The total nanoseconds spent in each are written back
+// to the request's out array.
+
+#include "types.h"
+#include "kernel.hh"
+#include "condvar.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+
+#include <memory>
+
+extern "C" uptr __uaccess_strend(uptr src, u64 limit);
+
+namespace {
+  enum {
+    OP_FETCHMEM,
+    OP_PUTMEM,
+    OP_FETCHSTR,
+    OP_STREND,
+    NOPS
+  };
+
+  // The request written to /dev/uaccessbench
+  struct uaccessbench_req {
+    u64 buf;                    // User buffer
+    u64 out;                    // User u64[NOPS] for the results
+    u32 size;                   // Size of buf, including the NUL
+    u32 iters;
+  };
+
+  const u32 max_size = 1 << 20;
+};
+
+static int
+uaccessbench_write(const char *buf, u32 n)
+{
+  uaccessbench_req req;
+  if (n != sizeof(req))
+    return -1;
+  memcpy(&req, buf, sizeof(req));
+  if (req.size == 0 || req.size > max_size || req.buf >= USERTOP ||
+      req.size > USERTOP - req.buf)
+    return -1;
+
+  std::unique_ptr<char[]> kbuf(new char[req.size]);
+  char *ubuf = (char*)req.buf;
+  u64 nsec[NOPS];
+
+  u64 start = nsectime();
+  for (u32 i = 0; i < req.iters; i++)
+    if (fetchmem(kbuf.get(), ubuf, req.size) < 0)
+      return -1;
+  nsec[OP_FETCHMEM] = nsectime() - start;
+
+  start = nsectime();
+  for (u32 i = 0; i < req.iters; i++)
+    if (putmem(ubuf, kbuf.get(), req.size) < 0)
+      return -1;
+  nsec[OP_PUTMEM] = nsectime() - start;
+
+  start = nsectime();
+  for (u32 i = 0; i < req.iters; i++)
+    if (fetchstr(kbuf.get(), ubuf, req.size) < 0)
+      return -1;
+  nsec[OP_FETCHSTR] = nsectime() - start;
+
+  start = nsectime();
+  for (u32 i = 0; i < req.iters; i++)
+    if (__uaccess_strend(req.buf, req.size) == (uptr)-1)
+      return -1;
+  nsec[OP_STREND] = nsectime() - start;
+
+  if (putmem((void*)req.out, nsec, sizeof(nsec)) < 0)
+    return -1;
+  return n;
+}
+
+void
+inituaccessbench(void)
+{
+  devsw[MAJ_UACCESSBENCH].write = uaccessbench_write;
+}
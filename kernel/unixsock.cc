@@ -7,33 +7,206 @@
 #include "atomic_util.hh"
 #include "proc.hh"
 #include "file.hh"
+#include "vm.hh"
+#include "cmdline.hh"
+#include <errno.h>
 #include <uk/socket.h>
 #include <uk/un.h>
 
-#define QUEUELEN 10   // Number of message per queue of a local socket
 #define LB 0          // Run with load balancer?
 
-struct msghdr {
+// Messages at least this long are carried in whole pages, which are
+// remapped instead of copied where the user buffers are page-aligned.
+// Shorter messages are copied through a kmalloc'd buffer.
+#define UNIX_PAGE_MIN  PGSIZE
+#define UNIX_MSG_MAX   (16 * PGSIZE)  // Longer messages are truncated
+
+// How long a blocked reader or writer sleeps before rechecking for
+// signals and, for unordered sockets, which CPU it is on.
+#define UNIX_POLL_NS   10000000
+
+struct unixmsg {
   u32 len;
   struct sockaddr_un uaddr;
   char *data;
-  islink<msghdr> link;
-  typedef isqueue<msghdr, &msghdr::link> list_t;
+  page_info_ref pages[UNIX_MSG_MAX / PGSIZE];
+  islink<unixmsg> link;
+  typedef isqueue<unixmsg, &unixmsg::link> list_t;
+
+  unixmsg() : len(0), data(nullptr) {}
+  ~unixmsg() {
+    if (data)
+      kmfree(data, len);
+  }
 
-  msghdr() {}
-  ~msghdr() {}
+  NEW_DELETE_OPS(unixmsg);
 
-  NEW_DELETE_OPS(msghdr);
+  bool paged() const {
+    return len >= UNIX_PAGE_MIN;
+  }
 };
 
+// Walks a user scatter/gather list.
+struct iov_cursor {
+  const kernel_iovec *iov;
+  int iovcnt;
+  int i;
+  size_t off;
+
+  iov_cursor(const kernel_iovec *iov, int iovcnt)
+    : iov(iov), iovcnt(iovcnt), i(0), off(0) {
+    skip_empty();
+  }
+
+  void skip_empty() {
+    while (i < iovcnt && off == iov[i].len) {
+      i++;
+      off = 0;
+    }
+  }
+
+  uptr va() const {
+    return (uptr)iov[i].base + off;
+  }
+
+  // True if the next n bytes are one contiguous page-aligned page.
+  bool whole_page(size_t n) const {
+    return n == PGSIZE && i < iovcnt && va() % PGSIZE == 0 &&
+      iov[i].len - off >= PGSIZE;
+  }
+
+  void advance(size_t n) {
+    off += n;
+    skip_empty();
+  }
+
+  // Copy n bytes from the user buffers to dst.
+  bool load(char *dst, size_t n) {
+    while (n) {
+      if (i == iovcnt)
+        return false;
+      size_t c = MIN(n, iov[i].len - off);
+      if (!userptr<void>((void*)va()).load_bytes(dst, c))
+        return false;
+      dst += c;
+      n -= c;
+      advance(c);
+    }
+    return true;
+  }
+
+  // Copy n bytes from src to the user buffers.
+  bool store(const char *src, size_t n) {
+    while (n) {
+      if (i == iovcnt)
+        return false;
+      size_t c = MIN(n, iov[i].len - off);
+      if (!userptr<void>((void*)va()).store_bytes(src, c))
+        return false;
+      src += c;
+      n -= c;
+      advance(c);
+    }
+    return true;
+  }
+};
+
+static size_t
+iov_length(const kernel_iovec *iov, int iovcnt)
+{
+  size_t n = 0;
+  for (int i = 0; i < iovcnt; i++)
+    n += iov[i].len;
+  return n;
+}
+
+// Build a message from the user's buffers.  Full, aligned pages are
+// shared copy-on-write with the sender rather than copied.
+static unixmsg *
+unixmsg_load(const kernel_iovec *iov, int iovcnt, const char *path)
+{
+  size_t len = MIN(iov_length(iov, iovcnt), (size_t)UNIX_MSG_MAX);
+  std::unique_ptr<unixmsg> m(new unixmsg());
+  iov_cursor c(iov, iovcnt);
+
+  if (len < UNIX_PAGE_MIN) {
+    if (len) {
+      m->data = (char*)kmalloc(len, "unixmsg");
+      if (!m->data)
+        return nullptr;
+    }
+    m->len = len;
+    if (!c.load(m->data, len))
+      return nullptr;
+  } else {
+    m->len = len;
+    for (size_t pos = 0, p = 0; pos < len; pos += PGSIZE, p++) {
+      size_t n = MIN(len - pos, (size_t)PGSIZE);
+      if (c.whole_page(n) &&
+          myproc()->vmap->share_page(c.va(), &m->pages[p])) {
+        kstats::inc(&kstats::socket_local_remap_pages);
+        c.advance(n);
+        continue;
+      }
+      char *b = kalloc("unixmsg");
+      if (!b)
+        return nullptr;
+      m->pages[p] = page_info_ref(page_info::of(b));
+      if (!c.load(b, n))
+        return nullptr;
+    }
+  }
+
+  m->uaddr.sun_family = AF_UNIX;
+  strncpy(m->uaddr.sun_path, path, UNIX_PATH_MAX);
+  return m.release();
+}
+
+// Deliver m to the user's buffers, remapping its pages into full,
+// aligned destination pages.  Returns the message length, or -1 if
+// it doesn't fit.
+static ssize_t
+unixmsg_store(const unixmsg *m, const kernel_iovec *iov, int iovcnt)
+{
+  if (m->len > iov_length(iov, iovcnt))
+    return -1;
+
+  iov_cursor c(iov, iovcnt);
+  if (!m->paged())
+    return c.store(m->data, m->len) ? m->len : -1;
+
+  for (size_t pos = 0, p = 0; pos < m->len; pos += PGSIZE, p++) {
+    size_t n = MIN(m->len - pos, (size_t)PGSIZE);
+    if (c.whole_page(n) && myproc()->vmap->map_page(c.va(), m->pages[p])) {
+      kstats::inc(&kstats::socket_local_remap_pages);
+      c.advance(n);
+      continue;
+    }
+    if (!c.store((const char*)m->pages[p].va(), n))
+      return -1;
+  }
+  return m->len;
+}
+
 struct coresocket : public balance_pool<coresocket> {
   int len;
+  int max;
   struct spinlock lock;
-  msghdr::list_t messages;
-
-  coresocket() : balance_pool(QUEUELEN), len(0),
-                 lock("coresocket", LOCKSTAT_LOCALSOCK) {}
-  ~coresocket() {}
+  struct condvar readable;
+  struct condvar writable;
+  unixmsg::list_t messages;
+
+  coresocket(int max) : balance_pool(max), len(0), max(max),
+                        lock("coresocket", LOCKSTAT_LOCALSOCK),
+                        readable("coresocket::readable"),
+                        writable("coresocket::writable") {}
+  ~coresocket() {
+    while (!messages.empty()) {
+      unixmsg *m = &messages.front();
+      messages.pop_front();
+      delete m;
+    }
+  }
   NEW_DELETE_OPS(coresocket);
 
   u64 balance_count() const {
@@ -57,13 +230,15 @@ struct coresocket : public balance_pool<coresocket> {
       n++;
       target->len++;
       len--;
-      msghdr& m = messages.front();
+      unixmsg& m = messages.front();
       messages.pop_front();
       target->messages.push_back(&m);
     }
 
     if (n > 0) {
       kstats::inc(&kstats::socket_load_balance);
+      writable.wake_all();
+      target->readable.wake_all();
     }
 
     lock.release();
@@ -73,15 +248,19 @@ struct coresocket : public balance_pool<coresocket> {
 
 struct localsock {
   bool ordered_;
+  int qlen_;
   atomic<coresocket*> pipes[NCPU];
   balancer<localsock, coresocket> b;
   atomic<int> nreader;
 
-  localsock(bool ordered) : ordered_(ordered), b(this), nreader(0) {
+  localsock(bool ordered)
+    : ordered_(ordered),
+      qlen_(MAX(cmdline_params.unix_dgram_qlen, (u64)1)), b(this),
+      nreader(0) {
     for (int i = 0; i < NCPU; i++)
       pipes[i] = 0;
     if (ordered)
-      pipes[0] = new coresocket;
+      pipes[0] = new coresocket(qlen_);
   }
 
   ~localsock() {
@@ -114,7 +293,7 @@ struct localsock {
       if (c)
         return c;
 
-      c = new coresocket;
+      c = new coresocket(qlen_);
       if (cmpxch(&pipes[id], (coresocket*) 0, c)) {
         nreader++;
         return c;
@@ -133,79 +312,77 @@ struct localsock {
 #endif
   }
 
-  int write(msghdr *m) {
-    bool toyield = true;
-    for (;;) {
+  // Queue ms[0..n).  Blocks while the queue is full unless nonblock
+  // is set.  Returns the number of messages queued, or a negative
+  // error if none were.
+  int write(unixmsg **ms, int n, bool nonblock) {
+    int sent = 0;
+    while (sent < n) {
       if (myproc()->killed)
-        return -1;
-
-      coresocket *cp;
-#if 0
-      // if there is only reader, deliver message to reader
-      // perhaps useful if sender and receiver are not on the same core
-      if (nreader > 1) {
-        cp = mycoresocket();
-        if (cp->len >= QUEUELEN)
-          balance();
-      } else {
-        cp = reader();
-      }
-      if (cp == NULL)
-        continue;
-#else
-      cp = mycoresocket();
-      if (cp->len >= QUEUELEN && toyield) {
-        yield();
-        toyield = false;
-        continue;
-      }
+        break;
 
-      if (cp->len >= QUEUELEN)
+      coresocket *cp = mycoresocket();
+      if (cp->len >= cp->max)
         balance();
-#endif
 
       scoped_acquire l(&cp->lock);
-      if (cp->len < QUEUELEN) {
-        // cprintf("w %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        cp->messages.push_back(m);
+      int queued = 0;
+      while (sent < n && cp->len < cp->max) {
+        cp->messages.push_back(ms[sent++]);
         cp->len++;
-        return 0;
+        queued++;
       }
+      if (queued) {
+        cp->readable.wake_all();
+        continue;
+      }
+      if (nonblock)
+        break;
+      cp->writable.sleep_to(&cp->lock, nsectime() + UNIX_POLL_NS);
     }
+    if (sent)
+      return sent;
+    return nonblock ? -EAGAIN : -1;
   }
 
-  msghdr* read() {
-    bool toyield = true;
+  // Dequeue up to n messages into ms, blocking until at least min
+  // have arrived, deadline passes, or the process is killed.
+  // Returns the number of messages dequeued, or a negative error if
+  // none were.
+  int read(unixmsg **ms, int n, int min, u64 deadline) {
+    int got = 0;
     for (;;) {
       if (myproc()->killed)
-        return NULL;
+        break;
 
       coresocket* cp = mycoresocket();
-
-      if (cp->len <= 0 && toyield) {
-        // in case another proc is running on hopefully this processor,
-        // let's give them a chance to send a message
-        // cprintf("yield %d (id %d)\n", myproc()->pid, id);
-        yield();   // yields to another process on this core, if there is one
-        toyield = false;
-        continue;
-      }
-
       if (cp->len <= 0)
         balance();
-      else
-        kstats::inc(&kstats::socket_local_read);
 
       scoped_acquire l(&cp->lock);
-      if (cp->len > 0) {
-        // cprintf("r %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        msghdr &m = cp->messages.front();
+      int taken = 0;
+      while (got < n && cp->len > 0) {
+        unixmsg &m = cp->messages.front();
         cp->messages.pop_front();
         cp->len--;
-        return &m;
+        ms[got++] = &m;
+        taken++;
+      }
+      if (taken) {
+        kstats::inc(&kstats::socket_local_read, (u64)taken);
+        cp->writable.wake_all();
       }
-      toyield = true;   // iterate between yielding and balancing
+      if (got >= min || got == n)
+        break;
+
+      u64 now = nsectime();
+      if (now >= deadline)
+        break;
+      cp->readable.sleep_to(&cp->lock, MIN(deadline, now + UNIX_POLL_NS));
     }
+    if (got)
+      return got;
+    return min == 0 ? -EAGAIN : -1;
   }
 };
 
@@ -236,6 +413,19 @@ struct file_unix_dgram : public refcache::referenced, public file
     return sun;
   }
 
+  static localsock *
+  lookup(const struct sockaddr *dest_addr, size_t addrlen)
+  {
+    auto uaddr = check_sockaddr(dest_addr, addrlen);
+    if (!uaddr)
+      return nullptr;
+
+    sref<vnode> ip = vfs_root()->resolve(myproc()->cwd, uaddr->sun_path);
+    if (!ip)
+      return nullptr;
+    return ip->get_socket();
+  }
+
 public:
   file_unix_dgram(bool ordered) : localsock_(new localsock(ordered)) {}
   NEW_DELETE_OPS(file_unix_dgram);
@@ -266,42 +456,23 @@ public:
     kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
     kstats::inc(&kstats::socket_local_sendto_cnt);
 
-    auto uaddr = check_sockaddr(dest_addr, addrlen);
-    if (!uaddr)
-      return -1;
-
-    sref<vnode> ip = vfs_root()->resolve(myproc()->cwd, uaddr->sun_path);
-    if (!ip)
-      return -1;
-
-    localsock *sock = ip->get_socket();
+    localsock *sock = lookup(dest_addr, addrlen);
     if (!sock)
       return -1;
 
-    char *b = kalloc("writebuf");
-    if (!b)
+    kernel_iovec iov = { buf.unsafe_get(), len };
+    unixmsg *m = unixmsg_load(&iov, 1, socketpath_);
+    if (!m)
       return -1;
 
-    if (len > PGSIZE)
-      len = PGSIZE;
-    if (!buf.load_bytes(b, len)) {
-      kfree(b);
-      return -1;
-    }
-
-    msghdr *m = new msghdr();
-    m->data = b;
-    m->len = len;
-    m->uaddr.sun_family = AF_UNIX;
-    strncpy(m->uaddr.sun_path, socketpath_, UNIX_PATH_MAX);
-
-    int r = sock->write(m);
+    // Once queued, m belongs to the reader.
+    ssize_t n = m->len;
+    int r = sock->write(&m, 1, flags & LINUX_MSG_DONTWAIT);
     if (r < 0) {
-      kfree(b);
       delete m;
-      return -1;
+      return r;
     }
-    return len;
+    return n;
   }
 
   ssize_t
@@ -311,25 +482,101 @@ public:
     kstats::timer timer_fill(&kstats::socket_local_recvfrom_cycles);
     kstats::inc(&kstats::socket_local_recvfrom_cnt);
 
-    ssize_t r = -1;
+    unixmsg *m;
+    int min = (flags & LINUX_MSG_DONTWAIT) ? 0 : 1;
+    int r = localsock_->read(&m, 1, min, ~0ull);
+    if (r < 0)
+      return r;
 
-    msghdr *m = localsock_->read();
     if (src_addr) {
       *(struct sockaddr_un*)src_addr = m->uaddr;
       *addrlen = sizeof(m->uaddr);
     }
-    if (m->len > len)
-      goto done;
+    kernel_iovec iov = { buf.unsafe_get(), len };
+    ssize_t n = unixmsg_store(m, &iov, 1);
+    delete m;
+    return n;
+  }
 
-    if (!buf.store_bytes(m->data, m->len))
-      goto done;
+  int
+  sendmmsg(struct kmmsg *msgs, unsigned int n, int flags) override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_sendto_cycles);
+    kstats::inc(&kstats::socket_local_sendto_cnt, (u64)n);
+
+    // Build messages for each run of consecutive messages to the same
+    // socket and queue each run with a single wakeup.
+    unixmsg *ms[KMMSG_BATCH];
+    unsigned int done = 0;
+    int r = 0;
+    while (done < n) {
+      localsock *sock = lookup((struct sockaddr*)msgs[done].addr,
+                               msgs[done].addrlen);
+      if (!sock) {
+        r = -1;
+        break;
+      }
+      unsigned int k = 0;
+      while (done + k < n && k < KMMSG_BATCH) {
+        kmmsg *km = &msgs[done + k];
+        if (k && (km->addrlen != msgs[done].addrlen ||
+                  memcmp(km->addr, msgs[done].addr, km->addrlen)))
+          break;
+        if (!(ms[k] = unixmsg_load(km->iov, km->iovcnt, socketpath_)))
+          break;
+        km->len = ms[k]->len;
+        k++;
+      }
+      if (k == 0) {
+        r = -1;
+        break;
+      }
 
-    r = m->len;
+      r = sock->write(ms, k, flags & LINUX_MSG_DONTWAIT);
+      int queued = r < 0 ? 0 : r;
+      for (unsigned int i = queued; i < k; i++)
+        delete ms[i];
+      done += queued;
+      if (queued < (int)k)
+        break;
+    }
+    return done ? done : r;
+  }
 
-  done:
-    kfree(m->data);
-    delete m;
-    return r;
+  int
+  recvmmsg(struct kmmsg *msgs, unsigned int n, int flags, u64 deadline)
+    override
+  {
+    kstats::timer timer_fill(&kstats::socket_local_recvfrom_cycles);
+
+    unixmsg *ms[KMMSG_BATCH];
+    n = MIN(n, (unsigned int)KMMSG_BATCH);
+    int min = n;
+    if (flags & LINUX_MSG_DONTWAIT)
+      min = 0;
+    else if (flags & LINUX_MSG_WAITFORONE)
+      min = 1;
+    int r = localsock_->read(ms, n, min, deadline);
+    if (r < 0)
+      return r;
+    kstats::inc(&kstats::socket_local_recvfrom_cnt, (u64)r);
+
+    // As with recvfrom, a message that doesn't fit is dropped.
+    int done = 0;
+    for (int i = 0; i < r; i++) {
+      kmmsg *km = &msgs[done];
+      ssize_t len = unixmsg_store(ms[i], km->iov, km->iovcnt);
+      if (len >= 0) {
+        if (km->addr) {
+          *(struct sockaddr_un*)km->addr = ms[i]->uaddr;
+          km->addrlen = sizeof(ms[i]->uaddr);
+        }
+        km->len = len;
+        done++;
+      }
+      delete ms[i];
+    }
+    return done ? done : -1;
   }
 
   void
@@ -0,0 +1,498 @@
+// Submission and completion rings for batching system calls.  See
+// include/uk/uring.h for the user-visible protocol.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "spinlock.hh"
+#include "sleeplock.hh"
+#include "condvar.hh"
+#include "proc.hh"
+#include "cpu.hh"
+#include "vm.hh"
+#include "file.hh"
+#include "filetable.hh"
+#include "errno.h"
+#include <uk/stat.h>
+#include <uk/uring.h>
+#include <atomic>
+
+// How long the poller spins on an empty ring before it goes to sleep
+#define URING_DEFAULT_IDLE_MS 10
+// The longest idle time user space may ask for
+#define URING_MAX_IDLE_MS 5000
+
+// The operations a ring can perform are their system calls
+ssize_t sys_read(int fd, userptr<void> p, size_t total_bytes);
+ssize_t sys_write(int fd, const userptr<void> p, size_t total_bytes);
+ssize_t sys_pread(int fd, void *ubuf, size_t count, off_t offset);
+ssize_t sys_pwrite(int fd, const userptr<void> ubuf, size_t count, off_t offset);
+long sys_openat(int dirfd, userptr_str path, int omode, ...);
+long sys_close(int fd);
+long sys_stat(userptr_str path, userptr<struct kernel_stat> st);
+long sys_fstat(int fd, userptr<struct kernel_stat> st);
+long sys_fsync(int fd);
+long sys_accept(int xsock, userptr<struct sockaddr> xaddr,
+                userptr<uint32_t> xaddrlen);
+ssize_t sys_sendto(int sockfd, const userptr<void> buf, size_t len, int flags,
+                   const userptr<struct sockaddr> dest_addr, uint32_t addrlen);
+ssize_t sys_recvfrom(int sockfd, userptr<void> buf, size_t len, int flags,
+                     userptr<struct sockaddr> src_addr, userptr<uint32_t> addrlen);
+
+static_assert(sizeof(uring_sqe) == 64, "uring_sqe must be 64 bytes");
+static_assert(sizeof(uring_cqe) == 16, "uring_cqe must be 16 bytes");
+static_assert(sizeof(uring_shared) <= PGSIZE, "uring_shared too big");
+
+// Indexes shared with user space are written by one side and read by
+// the other, so each access is a single atomic load or store.
+static u32
+load_acquire(const u32 *p)
+{
+  return reinterpret_cast<const std::atomic<u32>*>(p)->load(std::memory_order_acquire);
+}
+
+static void
+store_release(u32 *p, u32 v)
+{
+  reinterpret_cast<std::atomic<u32>*>(p)->store(v, std::memory_order_release);
+}
+
+class uring : public referenced
+{
+public:
+  static sref<uring> alloc(u32 sq_entries, u32 flags, u32 sq_idle_ms);
+
+  // Map the shared region into vmap at an unused address and return
+  // that address, or (uptr)-1 on failure.
+  uptr map(vmap *vmap);
+
+  // Perform up to max queued submissions.  Returns the number
+  // performed.
+  u32 submit(u32 max);
+
+  // Wait until at least min completions are queued or this thread is
+  // killed.
+  void wait_cq(u32 min);
+
+  // Restart the poller if it exited while idle.
+  int wake_poller();
+
+  // The file descriptor was closed, so stop the poller.
+  void close();
+
+  // The thread group tgid is exiting, so stop the pollers of the rings
+  // it set up.  Pollers share the group's file table, so the ring's
+  // file descriptor is not closed until its poller exits.
+  static void exit_group(int tgid);
+
+  const u32 sq_entries;
+  const u32 cq_entries;
+  const bool sqpoll;
+
+  NEW_DELETE_OPS(uring);
+
+private:
+  uring(u32 sq_entries, u32 flags, u32 sq_idle_ms);
+  ~uring();
+  void onzero() override { delete this; }
+
+  uring_sqe *sqe(u32 idx);
+  uring_cqe *cqe(u32 idx);
+  std::atomic<u32> *flags()
+  {
+    return reinterpret_cast<std::atomic<u32>*>(&shared_->flags);
+  }
+  s64 perform(const uring_sqe &sqe);
+  static void poller(void *arg);
+  void poll();
+
+  // The region holds the uring_shared page, then the SQEs, then the
+  // CQEs.  Entries never straddle pages, so the kernel reaches them
+  // through the direct map of each page.
+  sref<pageable> region_;
+  u32 npages_;
+  char **pages_;
+  u32 sqe_page0_, cqe_page0_;
+  uring_shared *shared_;
+
+  // Serializes consumers of the submission ring, which may sleep in
+  // the middle of an operation.
+  sleeplock submit_lock_;
+
+  // Protects poller_running_, closed_ and poller_, and waiters for
+  // completions sleep on cq_cv_.
+  spinlock lock_;
+  condvar cq_cv_;
+  bool poller_running_;
+  bool closed_;
+  proc *poller_;
+  u64 idle_nsec_;
+
+  // The thread group that set up the ring, and its link on the list of
+  // rings with a poller
+  const int tgid_;
+  ilink<uring> sqpoll_link_;
+  typedef ilist<uring, &uring::sqpoll_link_> sqpoll_list;
+  static spinlock sqpoll_lock_;
+  static sqpoll_list sqpoll_rings_;
+};
+
+spinlock uring::sqpoll_lock_("uring sqpoll");
+uring::sqpoll_list uring::sqpoll_rings_;
+
+uring::uring(u32 sq_entries, u32 flags, u32 sq_idle_ms)
+  : sq_entries(sq_entries), cq_entries(2 * sq_entries),
+    sqpoll(flags & URING_SETUP_SQPOLL), npages_(0), pages_(nullptr),
+    shared_(nullptr), lock_("uring"), cq_cv_("uring::cq_cv"),
+    poller_running_(false), closed_(false), poller_(nullptr),
+    idle_nsec_((sq_idle_ms ? MIN(sq_idle_ms, URING_MAX_IDLE_MS) :
+                URING_DEFAULT_IDLE_MS) * 1000000ull),
+    tgid_(myproc()->tgid)
+{
+  sqe_page0_ = 1;
+  cqe_page0_ = sqe_page0_ + (sq_entries * sizeof(uring_sqe) + PGSIZE - 1) / PGSIZE;
+  npages_ = cqe_page0_ + (cq_entries * sizeof(uring_cqe) + PGSIZE - 1) / PGSIZE;
+  region_ = new_shared_memory_region(npages_);
+  pages_ = (char**)kmalloc(npages_ * sizeof(char*), "uring pages");
+  if (!pages_)
+    throw_bad_alloc();
+  for (u32 i = 0; i < npages_; i++)
+    pages_[i] = (char*)region_->get_page_info(i)->va();
+
+  shared_ = (uring_shared*)pages_[0];
+  shared_->sq_mask = sq_entries - 1;
+  shared_->cq_mask = cq_entries - 1;
+
+  if (sqpoll) {
+    scoped_acquire x(&sqpoll_lock_);
+    sqpoll_rings_.push_back(this);
+  }
+}
+
+uring::~uring()
+{
+  if (sqpoll) {
+    scoped_acquire x(&sqpoll_lock_);
+    sqpoll_rings_.erase(sqpoll_rings_.iterator_to(this));
+  }
+  kmfree(pages_, npages_ * sizeof(char*));
+}
+
+sref<uring>
+uring::alloc(u32 sq_entries, u32 flags, u32 sq_idle_ms)
+{
+  return sref<uring>::transfer(new uring(sq_entries, flags, sq_idle_ms));
+}
+
+uptr
+uring::map(vmap *vmap)
+{
+  vmdesc desc(region_, 0);
+  desc.flags |= vmdesc::FLAG_SHARED;
+  return vmap->insert(std::move(desc), 0, npages_ * PGSIZE);
+}
+
+uring_sqe *
+uring::sqe(u32 idx)
+{
+  u64 off = (u64)(idx & (sq_entries - 1)) * sizeof(uring_sqe);
+  return (uring_sqe*)(pages_[sqe_page0_ + off / PGSIZE] + off % PGSIZE);
+}
+
+uring_cqe *
+uring::cqe(u32 idx)
+{
+  u64 off = (u64)(idx & (cq_entries - 1)) * sizeof(uring_cqe);
+  return (uring_cqe*)(pages_[cqe_page0_ + off / PGSIZE] + off % PGSIZE);
+}
+
+s64
+uring::perform(const uring_sqe &sqe)
+{
+  switch (sqe.opcode) {
+  case URING_OP_NOP:
+    return 0;
+  case URING_OP_READ:
+    return sys_read(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len);
+  case URING_OP_WRITE:
+    return sys_write(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len);
+  case URING_OP_PREAD:
+    return sys_pread(sqe.fd, (void*)sqe.addr, sqe.len, sqe.off);
+  case URING_OP_PWRITE:
+    return sys_pwrite(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len, sqe.off);
+  case URING_OP_OPENAT:
+    return sys_openat(sqe.fd, userptr_str((const char*)sqe.addr), sqe.op_flags);
+  case URING_OP_CLOSE:
+    return sys_close(sqe.fd);
+  case URING_OP_STAT:
+    return sys_stat(userptr_str((const char*)sqe.addr),
+                    userptr<struct kernel_stat>((struct kernel_stat*)sqe.addr2));
+  case URING_OP_FSTAT:
+    return sys_fstat(sqe.fd,
+                     userptr<struct kernel_stat>((struct kernel_stat*)sqe.addr2));
+  case URING_OP_FSYNC:
+    return sys_fsync(sqe.fd);
+  case URING_OP_ACCEPT:
+    return sys_accept(sqe.fd, userptr<struct sockaddr>((struct sockaddr*)sqe.addr),
+                      userptr<uint32_t>((uint32_t*)sqe.addr2));
+  case URING_OP_SEND:
+    return sys_sendto(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len,
+                      sqe.op_flags, nullptr, 0);
+  case URING_OP_RECV:
+    return sys_recvfrom(sqe.fd, userptr<void>((void*)sqe.addr), sqe.len,
+                        sqe.op_flags, nullptr, nullptr);
+  default:
+    return -EINVAL;
+  }
+}
+
+u32
+uring::submit(u32 max)
+{
+  auto l = submit_lock_.guard();
+  u32 head = shared_->sq_head;
+  u32 tail = load_acquire(&shared_->sq_tail);
+  u32 cq_tail = shared_->cq_tail;
+  // A bogus tail from user space can't make us run more than a ring's
+  // worth of entries.
+  if (tail - head > sq_entries)
+    tail = head + sq_entries;
+
+  u32 n = 0;
+  bool skip = false;
+  for (; n < max && head != tail; n++, head++) {
+    // Leave the submission queued if there's no room for its
+    // completion.
+    if (cq_tail - load_acquire(&shared_->cq_head) >= cq_entries)
+      break;
+
+    // Copy the entry so user space can't change it under us
+    uring_sqe sqe = *this->sqe(head);
+    barrier();
+    s64 res;
+    if (skip) {
+      res = -ECANCELED;
+    } else {
+#if EXCEPTIONS
+      try {
+#endif
+        res = perform(sqe);
+#if EXCEPTIONS
+      } catch (std::bad_alloc &e) {
+        res = -ENOMEM;
+      }
+#endif
+    }
+    skip = (sqe.flags & URING_SQE_LINK) && res < 0;
+
+    uring_cqe *c = cqe(cq_tail);
+    c->user_data = sqe.user_data;
+    c->res = res;
+    store_release(&shared_->cq_tail, ++cq_tail);
+    store_release(&shared_->sq_head, head + 1);
+  }
+
+  if (n) {
+    scoped_acquire x(&lock_);
+    cq_cv_.wake_all();
+  }
+  return n;
+}
+
+void
+uring::wait_cq(u32 min)
+{
+  if (min > cq_entries)
+    min = cq_entries;
+  scoped_acquire x(&lock_);
+  while (load_acquire(&shared_->cq_tail) - load_acquire(&shared_->cq_head) < min) {
+    // Without a running poller, nothing will post more completions
+    if (myproc()->killed || !sqpoll || !poller_running_)
+      break;
+    cq_cv_.sleep(&lock_);
+  }
+}
+
+int
+uring::wake_poller()
+{
+  {
+    scoped_acquire x(&lock_);
+    if (poller_running_ || closed_)
+      return 0;
+    poller_running_ = true;
+    flags()->fetch_and(~URING_SQ_NEED_WAKEUP);
+  }
+
+  // The poller's reference
+  inc();
+  if (!threadclone(poller, this, "uring_poll")) {
+    dec();
+    scoped_acquire x(&lock_);
+    poller_running_ = false;
+    flags()->fetch_or(URING_SQ_NEED_WAKEUP);
+    cq_cv_.wake_all();
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void
+uring::close()
+{
+  scoped_acquire x(&lock_);
+  closed_ = true;
+  // Wake the poller if it's sleeping in an operation
+  if (poller_)
+    poller_->kill();
+}
+
+void
+uring::exit_group(int tgid)
+{
+  scoped_acquire x(&sqpoll_lock_);
+  for (auto &r : sqpoll_rings_)
+    if (r.tgid_ == tgid)
+      r.close();
+}
+
+void
+uring::poller(void *arg)
+{
+  uring *r = (uring*)arg;
+  ensure_secrets();
+  r->poll();
+  r->dec();
+}
+
+void
+uring::poll()
+{
+  {
+    scoped_acquire x(&lock_);
+    poller_ = myproc();
+  }
+
+  u64 idle_start = nsectime();
+  for (;;) {
+    if (submit(sq_entries)) {
+      idle_start = nsectime();
+      continue;
+    }
+    bool stop = closed_ || myproc()->killed;
+    if (!stop && nsectime() - idle_start < idle_nsec_) {
+      yield();
+      continue;
+    }
+
+    // Tell user space to wake us, then check once more for a
+    // submission that raced with the flag.  This pairs with the fence
+    // between user space's tail store and its flag load.
+    scoped_acquire x(&lock_);
+    flags()->fetch_or(URING_SQ_NEED_WAKEUP);
+    if (!stop && load_acquire(&shared_->sq_tail) != shared_->sq_head) {
+      flags()->fetch_and(~URING_SQ_NEED_WAKEUP);
+      continue;
+    }
+    poller_running_ = false;
+    poller_ = nullptr;
+    // Waiters for completions must not wait for us
+    cq_cv_.wake_all();
+    return;
+  }
+}
+
+struct file_uring : public referenced, public file {
+public:
+  file_uring(sref<uring> r) : ring(std::move(r)) {}
+  PUBLIC_NEW_DELETE_OPS(file_uring);
+
+  void inc() override { referenced::inc(); }
+  void dec() override { referenced::dec(); }
+
+  void onzero() override
+  {
+    ring->close();
+    delete this;
+  }
+
+  const sref<uring> ring;
+};
+
+void
+uring_exit_group(int tgid)
+{
+  uring::exit_group(tgid);
+}
+
+//SYSCALL
+long
+sys_uring_setup(userptr<struct uring_params> uparams)
+{
+  uring_params params;
+  if (!uparams.load(&params))
+    return -EFAULT;
+  if (params.sq_entries == 0 || params.sq_entries > URING_MAX_ENTRIES ||
+      (params.flags & ~URING_SETUP_SQPOLL))
+    return -EINVAL;
+  u32 entries = 1;
+  while (entries < params.sq_entries)
+    entries *= 2;
+
+  sref<uring> r = uring::alloc(entries, params.flags, params.sq_idle_ms);
+  uptr base = r->map(myproc()->vmap.get());
+  if (base == (uptr)-1)
+    return -ENOMEM;
+
+  params.sq_entries = r->sq_entries;
+  params.cq_entries = r->cq_entries;
+  params.shared = base;
+  params.sqes = base + PGSIZE;
+  params.cqes = base + PGSIZE + PGROUNDUP(r->sq_entries * sizeof(uring_sqe));
+  auto unmap = scoped_cleanup([&]() {
+    myproc()->vmap->remove(base, params.cqes - base +
+                           PGROUNDUP(r->cq_entries * sizeof(uring_cqe)));
+  });
+
+  if (r->sqpoll && r->wake_poller() < 0)
+    return -ENOMEM;
+
+  sref<file> f = make_sref<file_uring>(r);
+  int fd = myproc()->ftable->allocfd(std::move(f), 0, false);
+  if (fd < 0)
+    return -EMFILE;
+  if (!uparams.store(&params)) {
+    myproc()->ftable->close(fd);
+    return -EFAULT;
+  }
+  unmap.dismiss();
+  return fd;
+}
+
+//SYSCALL
+long
+sys_uring_enter(int fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -EBADF;
+  file *ff = f.get();
+  if (&typeid(*ff) != &typeid(file_uring))
+    return -EINVAL;
+  uring *r = static_cast<file_uring*>(ff)->ring.get();
+
+  long submitted = 0;
+  if (r->sqpoll) {
+    if (flags & URING_ENTER_SQ_WAKEUP) {
+      int err = r->wake_poller();
+      if (err < 0)
+        return err;
+    }
+  } else if (to_submit) {
+    submitted = r->submit(to_submit);
+  }
+
+  if (flags & URING_ENTER_GETEVENTS)
+    r->wait_cq(min_complete);
+  return submitted;
+}
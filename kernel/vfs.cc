@@ -9,6 +9,35 @@ static console_stream verbose(false);
 
 static sref<virtual_filesystem> mounts __attribute__((section (".qdata")));
 
+int
+vnode::read_at_user(userptr<void> data, u64 offset, size_t len)
+{
+  char buf[PGSIZE];
+  size_t done = 0;
+  while (done < len) {
+    size_t n = len - done < PGSIZE ? len - done : PGSIZE;
+    int r = read_at(buf, offset + done, n);
+    if (r <= 0)
+      return done ? done : r;
+    if (!(data + done).store_bytes(buf, r))
+      return done ? done : -1;
+    done += r;
+    if ((size_t)r < n)
+      break;
+  }
+  return done;
+}
+
+s64
+vnode::seek_data(u64 offset, bool hole)
+{
+  // Without holes, all of the file is data
+  u64 size = file_size();
+  if (offset >= size)
+    return -ENXIO;
+  return hole ? size : offset;
+}
+
 void
 vfs_mount(const sref<filesystem> &fs, const char *path)
 {
@@ -72,6 +101,12 @@ initvfs()
   dev->create_device("mfsstats", MAJ_MFSSTATS, 0);
   dev->create_device("qstats", MAJ_QSTATS, 0);
   dev->create_device("null", MAJ_NULL, 0);
+  dev->create_device("lockbench", MAJ_LOCKBENCH, 0);
+  dev->create_device("kmsg", MAJ_KMSG, 0);
+  dev->create_device("wbstat", MAJ_WBSTAT, 0);
+  dev->create_device("uaccessbench", MAJ_UACCESSBENCH, 0);
+  dev->create_device("membench", MAJ_MEMBENCH, 0);
+  dev->create_device("numastat", MAJ_NUMASTAT, 0);
 }
 
 int
@@ -223,6 +258,7 @@ step_resolved_filesystem::resolve(const sref<vnode>& base, const char *path)
   else
     cur = base;
   while (cur) {
+    cur = this->resolve_prefix(cur, &path, false);
     rc = skipelem(&path, &name);
     if (rc < 0)
       return sref<vnode>();
@@ -246,6 +282,7 @@ step_resolved_filesystem::resolveparent(const sref<vnode>& base, const char *pat
   else
     cur = base;
   while (cur) {
+    cur = this->resolve_prefix(cur, &path, true);
     rc = skipelem(&path, name);
     if (rc <= 0) // if rc == 0, that means there wasn't even a single name element, so we can't provide an output
       return sref<vnode>();
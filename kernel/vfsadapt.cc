@@ -18,9 +18,18 @@ public:
   u64 file_size() override;
   bool is_offset_in_file(u64 offset) override;
   int read_at(char *addr, u64 off, size_t len) override;
+  int read_at_user(userptr<void> data, u64 off, size_t len) override;
   int write_at(const userptr<void>, u64 off, size_t len, bool append) override;
   int truncate() override;
+  int set_size(u64 size) override;
+  int allocate(u64 off, u64 len) override;
+  int punch_hole(u64 off, u64 len) override;
+  s64 seek_data(u64 off, bool hole) override;
+  int sync() override;
   sref<page_info> get_page_info(u64 page_idx) override;
+  sref<page_info> get_page_info_for_write(u64 page_idx) override;
+  bool needs_load(u64 page_idx) override;
+  bool load_page(u64 page_idx) override;
   u64 mtime() override;
   bool set_mtime(u64 mtime) override;
 
@@ -69,6 +78,7 @@ public:
   sref<vnode> root() override;
   sref<vnode> resolve(const sref<vnode>& base, const char *path) override;
   sref<vnode> resolveparent(const sref<vnode>& base, const char *path, strbuf<FILENAME_MAX> *name) override;
+  sref<vnode> resolve_prefix(const sref<vnode>& base, const char **path, bool keep_last) override;
 
   static sref<filesystem_mfs> singleton() {
     return sref<filesystem_mfs>::newref(&_singleton);
@@ -84,10 +94,42 @@ vnode_mfs::vnode_mfs(sref<mnode> node)
 {
 }
 
+// The vmap calls these under vpfs_lock_, so pages still on disk are
+// left to load_page.
 sref<page_info>
 vnode_mfs::get_page_info(u64 page_idx)
 {
-  return this->node->as_file()->get_page(page_idx).get_page_info();
+  mfile* mf = this->node->as_file();
+  if (mf->page_on_disk(page_idx))
+    return sref<page_info>();
+  return mf->get_page_or_zero(page_idx).get_page_info();
+}
+
+sref<page_info>
+vnode_mfs::get_page_info_for_write(u64 page_idx)
+{
+  mfile* mf = this->node->as_file();
+  if (mf->page_on_disk(page_idx))
+    return sref<page_info>();
+  mfile::page_state ps = mf->get_page(page_idx);
+  if (!ps || ps.is_zero_page())
+    ps = mf->fill_hole(page_idx);
+  return ps.get_page_info();
+}
+
+bool
+vnode_mfs::needs_load(u64 page_idx)
+{
+  return this->node->as_file()->page_on_disk(page_idx);
+}
+
+bool
+vnode_mfs::load_page(u64 page_idx)
+{
+  // Fails only if the page is still on disk, that is, out of memory
+  mfile* mf = this->node->as_file();
+  mf->get_page(page_idx);
+  return !mf->page_on_disk(page_idx);
 }
 
 void
@@ -171,7 +213,7 @@ vnode_mfs::child_exists(const char *name)
 bool
 vnode_mfs::is_offset_in_file(u64 off)
 {
-  mfile::page_state ps = node->as_file()->get_page(off / PGSIZE);
+  mfile::page_state ps = node->as_file()->get_page_or_zero(off / PGSIZE);
   if (!ps.get_page_info())
     return false;
   if (!ps.is_partial_page())
@@ -186,15 +228,19 @@ vnode_mfs::read_at(char *addr, u64 off, size_t n)
 }
 
 int
-vnode_mfs::write_at(const userptr<void> data, u64 off, size_t n, bool append)
+vnode_mfs::read_at_user(userptr<void> data, u64 off, size_t n)
 {
-  mfile::resizer resize;
-  if (append) {
-    resize = node->as_file()->write_size();
-    off = resize.size();
-  }
+  return readi(node, data, off, n);
+}
 
-  return writei(node, data, off, n, append ? &resize : nullptr);
+int
+vnode_mfs::write_at(const userptr<void> data, u64 off, size_t n, bool append)
+{
+  if (append)
+    return appendi(node, data, n);
+  if (off > mfile::max_size() || n > mfile::max_size() - off)
+    return -EFBIG;
+  return writei(node, data, off, n);
 }
 
 int
@@ -205,6 +251,53 @@ vnode_mfs::truncate()
   return 0;
 }
 
+int
+vnode_mfs::set_size(u64 size)
+{
+  mfile* mf = this->node->as_file();
+  if (size > mfile::max_size())
+    return -EFBIG;
+  if (size == mf->size())
+    return 0;
+  mf->write_size().resize(size);
+  return 0;
+}
+
+int
+vnode_mfs::allocate(u64 off, u64 len)
+{
+  // Files are sparse, so there is nothing to reserve; just extend
+  // the file over the range.
+  mfile* mf = this->node->as_file();
+  if (off > mfile::max_size() || len > mfile::max_size() - off)
+    return -EFBIG;
+  if (off + len <= mf->size())
+    return 0;
+  auto r = mf->write_size();
+  if (off + len > r.size())
+    r.resize(off + len);
+  return 0;
+}
+
+int
+vnode_mfs::punch_hole(u64 off, u64 len)
+{
+  return this->node->as_file()->punch_hole(off, len) ? 0 : -ENOMEM;
+}
+
+s64
+vnode_mfs::seek_data(u64 off, bool hole)
+{
+  s64 r = this->node->as_file()->seek_data(off, hole);
+  return r < 0 ? -ENXIO : r;
+}
+
+int
+vnode_mfs::sync()
+{
+  return mfs_fsync(this->node);
+}
+
 u64
 vnode_mfs::mtime()
 {
@@ -520,6 +613,22 @@ filesystem_mfs::resolveparent(const sref<vnode>& base, const char *path, strbuf<
   return out;
 }
 
+sref<vnode>
+filesystem_mfs::resolve_prefix(const sref<vnode>& base, const char **path, bool keep_last)
+{
+  const char *start = *path;
+  sref<mnode> m = namei_prefix(vnode_mfs::unwrap(base), path, keep_last);
+  if (*path == start)
+    return base;
+  sref<vnode> out = vnode_mfs::wrap(m);
+  if (!out) {
+    // a killed directory; let the one-step walk report it
+    *path = start;
+    return base;
+  }
+  return out;
+}
+
 sref<filesystem>
 vfs_get_mfs()
 {
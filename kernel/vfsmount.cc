@@ -16,6 +16,26 @@ virtual_filesystem::root()
   return root_filesystem->root();
 }
 
+sref<vnode>
+virtual_filesystem::resolve_prefix(const sref<vnode>& base, const char **path, bool keep_last)
+{
+  assert(base);
+  sref<filesystem> basefs = base->get_fs();
+  if (!basefs)
+    return base; // let resolve_child report it
+  const char *start = *path;
+  sref<vnode> next = basefs->resolve_prefix(base, path, keep_last);
+  if (*path == start || !next->is_directory())
+    return next;
+  sref<virtual_mount> mountdata = next->get_mount_data();
+  if (!mountdata)
+    return next;
+  // the run stopped at a mountpoint, so continue from the root of the underlying filesystem
+  assert(mountdata->mountpoint->is_same(next));
+  assert(mountdata->mountpoint_filesystem == basefs);
+  return mountdata->mounted_filesystem->root();
+}
+
 sref<vnode>
 virtual_filesystem::resolve_child(const sref<vnode>& base, const char *filename)
 {
@@ -16,6 +16,9 @@
 #include <algorithm>
 #include "kstats.hh"
 #include "heapprof.hh"
+#include "cpuid.hh"
+#include <uk/timepage.h>
+#include <uk/mempolicy.h>
 
 extern char __qdata_start[], __qdata_end[];
 extern char __qpercpu_start[], __qpercpu_end[];
@@ -53,6 +56,9 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
         {"WRITE", vmdesc::FLAG_WRITE},
         {"SHARED", vmdesc::FLAG_SHARED},
       }), " ");
+  if (vmd.flags & vmdesc::FLAG_MPOL)
+    s->print("mpol ", vmdesc::mpol_mode(vmd.flags), "/",
+             shex(vmdesc::mpol_nodes(vmd.flags)), " ");
   if (vmd.page)
     s->print((void*)vmd.page.pa(), "}");
   else
@@ -154,11 +160,30 @@ vmap::alloc(void)
     v->qinsert(cpus[c].percpu_base, cpus[c].percpu_base, __qpercpu_end - __qpercpu_start);
   }
 
+  static_assert(sizeof(timepage) == PGSIZE, "timepage must fill a page");
+  static_assert(NCPU <= TIMEPAGE_NCPU, "timepage too small for NCPU");
+  v->timepage_region_ = new_shared_memory_region(1);
+  v->timepage_ = (timepage*)v->timepage_region_->get_page_info(0)->va();
+  v->qinsert(v->timepage_);
+  v->timepage_->version = TIMEPAGE_VERSION;
+  v->timepage_->flags = cpuid::features().rdtscp ? TIMEPAGE_RDTSCP : 0;
+  v->timepage_->ncpu = ncpu;
+  v->timepage_->tsc_scale = TSC_PERIOD_SCALE;
+  v->timepage_->realtime_offset = rtc_nsec_offset();
+  for (int c = 0; c < ncpu; c++)
+    v->timepage_->cpus[c].tsc_period = cpus[c].tsc_period;
+  // Shared, so that fork doesn't make it copy-on-write; copy() gives
+  // the child its own time page instead.
+  vmdesc desc(v->timepage_region_, TIMEPAGE_VA);
+  desc.flags = vmdesc::FLAG_MAPPED | vmdesc::FLAG_SHARED;
+  v->insert(std::move(desc), TIMEPAGE_VA, PGSIZE);
+
   return v;
 }
 
 vmap::vmap() :
-  brk_(0), cache(this), vpfs_(this), unmapped_hint(0), brklock_("brk_lock", LOCKSTAT_VM)
+  brk_(0), cache(this), vpfs_(this), unmapped_hint(0), brklock_("brk_lock", LOCKSTAT_VM),
+  mempolicy_(0)
 {
 }
 
@@ -196,6 +221,12 @@ vmap::copy()
         it += it.base_span();
         continue;
       }
+      // alloc() already mapped the child's own time page
+      if (it.index() == TIMEPAGE_VA / PGSIZE) {
+        ++out;
+        ++it;
+        continue;
+      }
       if (SDEBUG)
         sdebug.println("vm: dup ", *it, " at ", shex(it.index() * PGSIZE));
 
@@ -221,6 +252,7 @@ vmap::copy()
   }
 
   nm->brk_ = brk_;
+  nm->mempolicy_ = mempolicy_.load();
   return nm;
 }
 
@@ -284,6 +316,24 @@ vmap::qinsert(void* qptr, void* kptr, size_t len)
   }
 }
 
+void
+vmap::publish_thread(u32 pid, u32 tid)
+{
+  if (timepage_->pid != pid)
+    timepage_->pid = pid;
+  timepage_cpu *c = &timepage_->cpus[myid()];
+  // If tid is unchanged, a reader can't observe any difference, so
+  // skip the write.
+  if (c->tid == tid)
+    return;
+  // See ward_fast_gettid in uk/timepage.h for the other side
+  c->seq++;
+  barrier();
+  c->tid = tid;
+  barrier();
+  c->seq++;
+}
+
 int
 vmap::remove(uptr start, uptr len)
 {
@@ -425,6 +475,14 @@ vmap::mprotect(uptr start, uptr len, uint64_t flags)
 
       // XXX This should fail if this is a mapped file that was opened
       // O_RDONLY (we don't check this in mmap either).
+
+      // A read-only file page may be shared with other offsets (such
+      // as the zero page backing a hole), so drop it and ask the file
+      // for a writable one on the next fault.
+      if (it->inode && it->page && !(it->flags & vmdesc::FLAG_COW)) {
+        cache.invalidate(it.index() * PGSIZE, PGSIZE, &shootdown);
+        it->page = page_info_ref();
+      }
     }
 
     it->flags = nflags;
@@ -434,6 +492,21 @@ vmap::mprotect(uptr start, uptr len, uint64_t flags)
   return 0;
 }
 
+int
+vmap::mbind(uptr start, uptr len, u64 mpol)
+{
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  scoped_acquire l(&vpfs_lock_);
+
+  for (auto it = begin; it < end; it += it.span()) {
+    if (!it.is_set())
+      return -1;                // EFAULT
+    it->flags = (it->flags & ~vmdesc::FLAG_MPOL) | mpol;
+  }
+  return 0;
+}
+
 int
 vmap::dup_page(uptr dest, uptr src)
 {
@@ -482,56 +555,67 @@ vmap::pagefault(uptr va, u32 err)
   // page.
   va = PGROUNDDOWN(va);
 
-  {
-    auto it = vpfs_.find(va / PGSIZE);
-    scoped_acquire l(&vpfs_lock_);
-    if (!it.is_set())
-      return -1;
-    if (SDEBUG)
-      sdebug.println("vm: pagefault err ", shex(err), " va ", shex(va),
-                     " desc ", *it, " tid ", myproc()->tid);
-
-    auto &desc = *it;
-    // Check for write protection violation
-    if (type == access_type::WRITE && !(desc.flags & vmdesc::FLAG_WRITE)) {
-      return -1;
-    }
+  for (;;) {
+    sref<pageable> load;
+    u64 load_idx;
+    {
+      auto it = vpfs_.find(va / PGSIZE);
+      scoped_acquire l(&vpfs_lock_);
+      if (!it.is_set())
+        return -1;
+      if (SDEBUG)
+        sdebug.println("vm: pagefault err ", shex(err), " va ", shex(va),
+                       " desc ", *it, " tid ", myproc()->tid);
 
-    // If this is a COW fault, we need to hold a reference to the old
-    // physical page until we've cleared the PTE and done TLB shoot
-    // down.
-    if (type == access_type::WRITE && (desc.flags & vmdesc::FLAG_COW)) {
-      old_page = page_info_ref(desc.page);
-      cache.invalidate(va, PGSIZE, &shootdown);
-    }
+      auto &desc = *it;
+      // Check for write protection violation
+      if (type == access_type::WRITE && !(desc.flags & vmdesc::FLAG_WRITE)) {
+        return -1;
+      }
 
-    // Ensure we have a backing page and copy COW pages
-    bool allocated;
-    paddr pa = ensure_page(it, type, &allocated);
-    if (allocated) {
-      kstats::inc(&kstats::page_fault_alloc_count);
-      timer_fill.abort();
-    } else {
-      kstats::inc(&kstats::page_fault_fill_count);
-      timer_alloc.abort();
-    }
-    if (!pa)
-      return -1;
+      // If this is a COW fault, we need to hold a reference to the old
+      // physical page until we've cleared the PTE and done TLB shoot
+      // down.
+      if (type == access_type::WRITE && (desc.flags & vmdesc::FLAG_COW)) {
+        old_page = page_info_ref(desc.page);
+        cache.invalidate(va, PGSIZE, &shootdown);
+      }
 
-    // If this is a read COW fault, we can reuse the COW page, but
-    // don't mark it writable!
-    if (desc.flags & vmdesc::FLAG_COW)
-      cache.insert(va, pa | PTE_P | PTE_U);
-    else {
-      if (desc.flags & vmdesc::FLAG_WRITE)
-        cache.insert(va, pa | PTE_P | PTE_U | PTE_W);
-      else
-        cache.insert(va, pa | PTE_P | PTE_U);
+      // Ensure we have a backing page and copy COW pages
+      bool allocated;
+      paddr pa = ensure_page(it, type, &allocated);
+      if (allocated) {
+        kstats::inc(&kstats::page_fault_alloc_count);
+        timer_fill.abort();
+      } else {
+        kstats::inc(&kstats::page_fault_fill_count);
+        timer_alloc.abort();
+      }
+      if (!pa) {
+        load = needs_load(it, &load_idx);
+        if (!load)
+          return -1;
+      } else {
+        // If this is a read COW fault, we can reuse the COW page, but
+        // don't mark it writable!
+        if (desc.flags & vmdesc::FLAG_COW)
+          cache.insert(va, pa | PTE_P | PTE_U);
+        else {
+          if (desc.flags & vmdesc::FLAG_WRITE)
+            cache.insert(va, pa | PTE_P | PTE_U | PTE_W);
+          else
+            cache.insert(va, pa | PTE_P | PTE_U);
+        }
+
+        shootdown.perform();
+        return 1;
+      }
     }
 
-    shootdown.perform();
+    // Read the page in without vpfs_lock_, since that may sleep
+    if (!load->load_page(load_idx))
+      return -1;
   }
-  return 1;
 }
 
 int
@@ -563,19 +647,30 @@ vmap::pagelookup(uptr va)
   // atomically assignable, so I could observe a half-updated vmdesc
   // if I try.  Could use a seqlock.
 
-  auto it = vpfs_.find(va / PGSIZE);
-  if (!it.is_set())
-    return nullptr;
-  scoped_acquire l(&vpfs_lock_);
-  if (!it.is_set())
-    return nullptr;
-
-  paddr pa = ensure_page(it, access_type::READ);
-  if (!pa)
-    return nullptr;
+  for (;;) {
+    sref<pageable> load;
+    u64 load_idx;
+    {
+      auto it = vpfs_.find(va / PGSIZE);
+      if (!it.is_set())
+        return nullptr;
+      scoped_acquire l(&vpfs_lock_);
+      if (!it.is_set())
+        return nullptr;
+
+      paddr pa = ensure_page(it, access_type::READ);
+      if (pa) {
+        char* kptr = (char*)p2v(pa);
+        return &kptr[va & (PGSIZE-1)];
+      }
+      load = needs_load(it, &load_idx);
+      if (!load)
+        return nullptr;
+    }
 
-  char* kptr = (char*)p2v(pa);
-  return &kptr[va & (PGSIZE-1)];
+    if (!load->load_page(load_idx))
+      return nullptr;
+  }
 }
 
 void*
@@ -596,6 +691,66 @@ pagelookup(vmap* vmap, uptr va)
   }
 }
 
+bool
+vmap::share_page(uptr va, page_info_ref *out)
+{
+  assert(va % PGSIZE == 0);
+  if (va >= USERTOP)
+    return false;
+
+  tlb_shootdown shootdown;
+  auto it = vpfs_.find(va / PGSIZE);
+  scoped_acquire l(&vpfs_lock_);
+  if (!it.is_set())
+    return false;
+  if ((it->flags & (vmdesc::FLAG_ANON | vmdesc::FLAG_SHARED)) !=
+      vmdesc::FLAG_ANON)
+    return false;
+  if (!ensure_page(it, access_type::READ))
+    return false;
+
+  // Once the page is shared, a write must copy it rather than change
+  // what the other side sees.
+  if ((it->flags & vmdesc::FLAG_WRITE) && !(it->flags & vmdesc::FLAG_COW)) {
+    vmdesc n(it->dup());
+    n.flags |= vmdesc::FLAG_COW;
+    vpfs_.fill(it, std::move(n));
+    cache.invalidate(va, PGSIZE, &shootdown);
+  }
+  *out = it->page;
+  shootdown.perform();
+  return true;
+}
+
+bool
+vmap::map_page(uptr va, const page_info_ref &page)
+{
+  assert(va % PGSIZE == 0);
+  if (va >= USERTOP)
+    return false;
+
+  page_holder pages(this);
+  tlb_shootdown shootdown;
+  auto it = vpfs_.find(va / PGSIZE);
+  scoped_acquire l(&vpfs_lock_);
+  if (!it.is_set())
+    return false;
+  if ((it->flags & (vmdesc::FLAG_ANON | vmdesc::FLAG_SHARED |
+                    vmdesc::FLAG_WRITE)) !=
+      (vmdesc::FLAG_ANON | vmdesc::FLAG_WRITE))
+    return false;
+
+  vmdesc n(it->dup());
+  n.page = page;
+  n.flags |= vmdesc::FLAG_COW;
+  if (it.base_span() == 1 && it->page)
+    pages.add(std::move(it->page));
+  vpfs_.fill(it, std::move(n));
+  cache.invalidate(va, PGSIZE, &shootdown);
+  shootdown.perform();
+  return true;
+}
+
 sref<pageable>
 vmap::lookup_pageable(uptr va, u64* pageidx)
 {
@@ -620,24 +775,38 @@ int
 vmap::copyout(uptr va, const void *p, u64 len)
 {
   char *buf = (char*)p;
-  auto it = vpfs_.find(va / PGSIZE);
-  auto end = vpfs_.find(PGROUNDUP(va + len) / PGSIZE);
-  scoped_acquire l(&vpfs_lock_);
-  for (; it != end; ++it) {
-    if (!it.is_set())
-      return -1;
-    uptr va0 = (uptr)PGROUNDDOWN(va);
-    paddr pa = ensure_page(it, access_type::READ);
-    if (!pa)
+  while (len) {
+    sref<pageable> load;
+    u64 load_idx;
+    {
+      auto it = vpfs_.find(va / PGSIZE);
+      auto end = vpfs_.find(PGROUNDUP(va + len) / PGSIZE);
+      scoped_acquire l(&vpfs_lock_);
+      for (; it != end; ++it) {
+        if (!it.is_set())
+          return -1;
+        uptr va0 = (uptr)PGROUNDDOWN(va);
+        paddr pa = ensure_page(it, access_type::READ);
+        if (!pa) {
+          load = needs_load(it, &load_idx);
+          if (!load)
+            return -1;
+          break;
+        }
+        char *p0 = (char*)p2v(pa);
+        uptr n = PGSIZE - (va - va0);
+        if(n > len)
+          n = len;
+        memmove(p0 + (va - va0), buf, n);
+        len -= n;
+        buf += n;
+        va = va0 + PGSIZE;
+      }
+    }
+
+    // Pick up where we stopped once the page is in memory
+    if (load && !load->load_page(load_idx))
       return -1;
-    char *p0 = (char*)p2v(pa);
-    uptr n = PGSIZE - (va - va0);
-    if(n > len)
-      n = len;
-    memmove(p0 + (va - va0), buf, n);
-    len -= n;
-    buf += n;
-    va = va0 + PGSIZE;
   }
   return 0;
 }
@@ -785,13 +954,16 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
       assert(!(desc.flags & vmdesc::FLAG_COW));
       if (allocated)
         *allocated = true;
-      char *p = zalloc("(vmap::pagelookup)");
+      char *p = alloc_anon_page(it);
       if (!p)
         throw_bad_alloc();
       page = page_info_ref(page_info::of(p));
     } else {
       u64 page_idx = (it.index() * PGSIZE - desc.start) / PGSIZE;
-      page = page_info_ref(std::move(desc.inode->get_page_info(page_idx)));
+      if ((desc.flags & vmdesc::FLAG_WRITE) && !(desc.flags & vmdesc::FLAG_COW))
+        page = page_info_ref(std::move(desc.inode->get_page_info_for_write(page_idx)));
+      else
+        page = page_info_ref(std::move(desc.inode->get_page_info(page_idx)));
       if (!page)
         return 0;
     }
@@ -802,7 +974,7 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     // This is a COW fault; copy in to a new page
     if (allocated)
       *allocated = true;
-    char *p = zalloc("(vmap::pagelookup)");
+    char *p = alloc_anon_page(it);
     if (!p)
       throw_bad_alloc();
 
@@ -830,6 +1002,30 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
   return pa;
 }
 
+sref<pageable>
+vmap::needs_load(const vmap::vpf_array::iterator &it, u64 *page_idx)
+{
+  auto &desc = *it;
+  if (desc.flags & vmdesc::FLAG_ANON)
+    return sref<pageable>();
+  *page_idx = (it.index() * PGSIZE - desc.start) / PGSIZE;
+  if (!desc.inode->needs_load(*page_idx))
+    return sref<pageable>();
+  return desc.inode;
+}
+
+char*
+vmap::alloc_anon_page(const vmap::vpf_array::iterator &it)
+{
+  u64 mpol = it->flags & vmdesc::FLAG_MPOL;
+  if (vmdesc::mpol_mode(mpol) == MPOL_DEFAULT)
+    mpol = mempolicy_;
+  // Interleave by virtual page number, so a range's pages alternate
+  // nodes regardless of the order they're faulted in
+  return mempolicy_zalloc(vmdesc::mpol_mode(mpol), vmdesc::mpol_nodes(mpol),
+                          it.index());
+}
+
 void
 vmap::dump()
 {
@@ -888,22 +1084,6 @@ safe_read_vm(void *dst, uintptr_t src, size_t n)
   return myproc()->vmap->safe_read(dst, src, n);
 }
 
-void*
-vmap::map_temporary(paddr pa)
-{
-  cache.insert((uintptr_t)pa+KTEMPORARY, pa | PTE_P | PTE_NX | PTE_W);
-  return (void*)(pa + KTEMPORARY);
-}
-
-
-void
-vmap::unmap_temporary(void* va)
-{
-  tlb_shootdown shootdown;
-  cache.invalidate((uintptr_t)va, PGSIZE, &shootdown);
-  shootdown.perform();
-}
-
 void*
 vmap::qalloc(const char* name, bool cached_only)
 {
@@ -0,0 +1,281 @@
+// World barrier profiler.  See include/uk/wbstat.h and
+// include/wbstat.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "proc.hh"
+#include "spinlock.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "kstats.hh"
+#include "kstream.hh"
+#include "linearhash.hh"
+#include "kmeta.hh"
+#include "cmdline.hh"
+#include "wbstat.hh"
+#include <uk/wbstat.h>
+
+extern const char* syscall_names[];
+extern const int nsyscalls;
+
+DEFINE_QPERCPU(struct wbstat_cpu, wbstat_cpus, NO_CRITICAL);
+
+// Read by system call entry before secrets are mapped
+int wbstat_enable __attribute__((section (".qdata")));
+
+// Barrier totals by system call.  These are only updated once a
+// barrier has mapped secrets, so they needn't be Q-visible.
+struct wbstat_syscall_cpu {
+  u64 transparent[WBSTAT_SYSCALLS];
+  u64 intentional[WBSTAT_SYSCALLS];
+  u64 eager[WBSTAT_SYSCALLS];
+  u64 cycles[WBSTAT_SYSCALLS];
+};
+DEFINE_PERCPU(struct wbstat_syscall_cpu, wbstat_syscall_cpus, NO_CRITICAL);
+
+struct wbstat_site_key {
+  uptr rips[WBSTAT_DEPTH];
+  u32 sysno;
+  bool intentional;
+
+  bool operator==(const wbstat_site_key &o) const
+  {
+    for (int i = 0; i < WBSTAT_DEPTH; i++)
+      if (rips[i] != o.rips[i])
+        return false;
+    return sysno == o.sysno && intentional == o.intentional;
+  }
+};
+
+template<>
+inline u64
+hash(const wbstat_site_key &k)
+{
+  u64 h = k.sysno * 2 + k.intentional;
+  for (int i = 0; i < WBSTAT_DEPTH; i++)
+    h = h * 31 + k.rips[i];
+  return hash(h);
+}
+
+struct wbstat_cost {
+  u64 count;
+  u64 cycles;
+
+  wbstat_cost &operator+=(const wbstat_cost &o)
+  {
+    count += o.count;
+    cycles += o.cycles;
+    return *this;
+  }
+};
+
+// Barrier sites, keyed by backtrace and system call
+static linearhash<wbstat_site_key, wbstat_cost> wbstat_sites(16384);
+
+void
+eager_secrets()
+{
+  pushcli();
+  bool had_secrets = secrets_mapped;
+  u64 start = rdtsc();
+  switch_to_kstack();
+  u64 cycles = rdtsc() - start;
+  popcli();
+
+  if (!had_secrets)
+    wbstat_barrier(wb_kind::eager, cycles, 0, nullptr);
+}
+
+void
+wbstat_barrier(wb_kind kind, u64 cycles, uptr rip, void *rbp)
+{
+  switch (kind) {
+  case wb_kind::transparent:
+    kstats::inc(&kstats::wb_transparent_count);
+    break;
+  case wb_kind::intentional:
+    kstats::inc(&kstats::wb_intentional_count);
+    break;
+  case wb_kind::eager:
+    kstats::inc(&kstats::wb_eager_count);
+    break;
+  }
+  kstats::inc(&kstats::wb_cycles, cycles);
+  if (!wbstat_enable)
+    return;
+
+  proc *p = myproc();
+  u32 sysno = p && p->syscall_num >= 0 ? p->syscall_num : WBSTAT_NO_SYSCALL;
+  if (sysno < WBSTAT_SYSCALLS) {
+    wbstat_syscall_cpu *s = wbstat_syscall_cpus.get();
+    switch (kind) {
+    case wb_kind::transparent:
+      s->transparent[sysno]++;
+      break;
+    case wb_kind::intentional:
+      s->intentional[sysno]++;
+      break;
+    case wb_kind::eager:
+      s->eager[sysno]++;
+      break;
+    }
+    s->cycles[sysno] += cycles;
+  }
+
+  // Eager barriers are all at system call entry, so they have no
+  // interesting site.
+  if (kind == wb_kind::eager)
+    return;
+  wbstat_site_key k{};
+  k.rips[0] = rip;
+  getcallerpcs(rbp, k.rips + 1, WBSTAT_DEPTH - 1);
+  k.sysno = sysno;
+  k.intentional = kind == wb_kind::intentional;
+  // If the table fills up, later sites are just dropped
+  wbstat_sites.add(k, wbstat_cost{1, cycles});
+}
+
+static void
+wbstat_clear(void)
+{
+  for (size_t c = 0; c < ncpu; c++) {
+    memset(wbstat_cpus[c].calls, 0, sizeof(wbstat_cpus[c].calls));
+    memset(&wbstat_syscall_cpus[c], 0, sizeof(wbstat_syscall_cpus[c]));
+  }
+  wbstat_sites.clear();
+}
+
+static bool
+wbstat_syscall_record(u32 sysno, struct wbstat_record *r)
+{
+  memset(r, 0, sizeof(*r));
+  r->kind = WBSTAT_SYSCALL;
+  r->sysno = sysno;
+  for (size_t c = 0; c < ncpu; c++) {
+    r->calls += wbstat_cpus[c].calls[sysno];
+    r->transparent += wbstat_syscall_cpus[c].transparent[sysno];
+    r->intentional += wbstat_syscall_cpus[c].intentional[sysno];
+    r->eager += wbstat_syscall_cpus[c].eager[sysno];
+    r->cycles += wbstat_syscall_cpus[c].cycles[sysno];
+  }
+  if (!r->calls && !r->transparent && !r->intentional)
+    return false;
+  if (syscall_names[sysno])
+    safestrcpy(r->name, syscall_names[sysno], sizeof(r->name));
+  return true;
+}
+
+static void
+wbstat_site_record(const wbstat_site_key &k, const wbstat_cost &v,
+                   struct wbstat_record *r)
+{
+  memset(r, 0, sizeof(*r));
+  r->kind = WBSTAT_SITE;
+  r->sysno = k.sysno;
+  if (k.sysno < nsyscalls && syscall_names[k.sysno])
+    safestrcpy(r->name, syscall_names[k.sysno], sizeof(r->name));
+  if (k.intentional)
+    r->intentional = v.count;
+  else
+    r->transparent = v.count;
+  r->cycles = v.cycles;
+  for (int i = 0; i < WBSTAT_DEPTH; i++) {
+    r->rips[i] = k.rips[i];
+    u32 offset = 0;
+    const char *sym = k.rips[i] ? kmeta::lookup((void*)k.rips[i], &offset) : nullptr;
+    if (sym)
+      snprintf(r->sym[i], sizeof(r->sym[i]), "%s+%u", sym, offset);
+  }
+}
+
+static int
+wbstat_read(char *dst, u32 off, u32 n)
+{
+  static const u32 sz = sizeof(struct wbstat_record);
+  if (off % sz || n < sz)
+    return -1;
+
+  // Regenerate the records up to the ones requested.  This is
+  // quadratic in the number of reads, but reads are rare.
+  u32 skip = off / sz, max = n / sz, idx = 0, out = 0;
+  struct wbstat_record r;
+  u32 nsys = nsyscalls < WBSTAT_SYSCALLS ? nsyscalls : WBSTAT_SYSCALLS;
+  for (u32 sysno = 0; sysno < nsys && out < max; sysno++) {
+    if (!wbstat_syscall_record(sysno, &r))
+      continue;
+    if (idx++ >= skip)
+      memmove(dst + sz * out++, &r, sz);
+  }
+  for (auto it = wbstat_sites.begin(); it != wbstat_sites.end() && out < max; it++) {
+    wbstat_site_key k;
+    wbstat_cost v;
+    if (!it.get(&k, &v))
+      continue;
+    if (idx++ >= skip) {
+      wbstat_site_record(k, v, &r);
+      memmove(dst + sz * out++, &r, sz);
+    }
+  }
+  return out * sz;
+}
+
+static int
+wbstat_write(const char *buf, u32 n)
+{
+  int cmd = buf[0] - '0';
+
+  switch(cmd) {
+  case WBSTAT_START:
+    wbstat_enable = 1;
+    break;
+  case WBSTAT_STOP:
+    wbstat_enable = 0;
+    break;
+  case WBSTAT_CLEAR:
+    wbstat_clear();
+    break;
+  default:
+    return -1;
+  }
+  return n;
+}
+
+// The exit_triggers summary read by tools/warden
+static int
+qstatsread(char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+
+  s.println("exit_triggers = [");
+  for (auto it = wbstat_sites.begin(); it != wbstat_sites.end(); it++) {
+    wbstat_site_key k;
+    wbstat_cost v;
+    if (!it.get(&k, &v))
+      continue;
+    s.print("  { backtrace = [\"", shex(k.rips[0]));
+    for (int i = 1; i < WBSTAT_DEPTH && k.rips[i]; i++)
+      s.print("\", \"", shex(k.rips[i]));
+    s.println("\"], count = ", v.count, ", intentional = ",
+              k.intentional ? "true" : "false", " },");
+  }
+  s.println("]");
+  return s.get_used();
+}
+
+void
+wbstat_track_changed(void)
+{
+  wbstat_enable = cmdline_params.track_wbs;
+}
+
+void
+initwbstat(void)
+{
+  wbstat_track_changed();
+  devsw[MAJ_WBSTAT].write = wbstat_write;
+  devsw[MAJ_WBSTAT].pread = wbstat_read;
+  devsw[MAJ_QSTATS].pread = qstatsread;
+}
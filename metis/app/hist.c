@@ -201,6 +201,7 @@ hist_usage(char *prog)
     printf("  -r #reduce tasks : # of reduce tasks\n");
     printf("  -q : quiet output (for batch test)\n");
     printf("  -d : debug output\n");
+    printf("  -c : don't pre-aggregate map output in per-worker tables\n");
     exit(EXIT_FAILURE);
 }
 
@@ -213,11 +214,12 @@ main(int argc, char *argv[])
     struct stat finfo;
     char *fname;
     int nprocs = 0, map_tasks = 0, reduce_tasks = 0, quiet = 0;
+    int no_preagg = 0;
     if (argc < 2)
 	hist_usage(argv[0]);
     fname = argv[1];
     int c;
-    while ((c = getopt(argc - 1, argv + 1, "p:m:r:q")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:m:r:qc")) != -1) {
 	switch (c) {
 	case 'p':
 	    nprocs = atoi(optarg);
@@ -231,6 +233,9 @@ main(int argc, char *argv[])
 	case 'q':
 	    quiet = 1;
 	    break;
+	case 'c':
+	    no_preagg = 1;
+	    break;
 	default:
 	    hist_usage(argv[0]);
 	    exit(EXIT_FAILURE);
@@ -308,6 +313,7 @@ main(int argc, char *argv[])
     mr_param.key_cmp = myshortcmp;
     mr_param.part_func = NULL;	// use default
     mr_param.nr_cpus = nprocs;
+    mr_param.no_preagg = no_preagg;
     assert(mr_run_scheduler(&mr_param) == 0);
     mr_print_stats();
 
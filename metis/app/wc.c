@@ -68,6 +68,8 @@ typedef struct {
 } wc_data_t;
 
 static int alphanumeric;
+static int no_numa;
+static int no_preagg;
 FILE *fout = NULL;
 
 /* Comparison function to compare 2 words */
@@ -255,6 +257,8 @@ do_mapreduce(int nprocs, int map_tasks, int reduce_tasks,
     memset(&mr_param, 0, sizeof(mr_param_t));
     memset(wc_vals, 0, sizeof(*wc_vals));
     mr_param.nr_cpus = nprocs;
+    mr_param.no_numa = no_numa;
+    mr_param.no_preagg = no_preagg;
 
     mr_param.app_arg.atype = atype_mapreduce;
     mr_param.app_arg.mapreduce.results = wc_vals;
@@ -291,6 +295,8 @@ wc_usage(char *prog)
     printf("  -q : quiet output (for batch test)\n");
     printf("  -a : alphanumeric word count\n");
     printf("  -o filename : save output to a file\n");
+    printf("  -n : ignore NUMA when placing data and reduce tasks\n");
+    printf("  -c : don't pre-aggregate map output in per-worker tables\n");
     exit(EXIT_FAILURE);
 }
 
@@ -307,7 +313,7 @@ main(int argc, TCHAR * argv[])
 
     fn = argv[1];
 
-    while ((c = getopt(argc - 1, argv + 1, "p:s:l:m:r:qao:")) != -1) {
+    while ((c = getopt(argc - 1, argv + 1, "p:s:l:m:r:qao:nc")) != -1) {
 	switch (c) {
 	case 'p':
 	    nprocs = atoi(optarg);
@@ -327,6 +333,12 @@ main(int argc, TCHAR * argv[])
 	case 'a':
 	    alphanumeric = 1;
 	    break;
+	case 'n':
+	    no_numa = 1;
+	    break;
+	case 'c':
+	    no_preagg = 1;
+	    break;
 	case 'o':
 	    fout = fopen(optarg, "w+");
 	    if (!fout) {
@@ -154,6 +154,8 @@ keycopy(void *src, size_t s)
     return key;
 }
 
+static int no_numa;
+
 static void
 do_mapreduce(int nprocs, int nsplits, int reduce_tasks,
 	     void *fdata, size_t len, final_data_kvs_len_t * wr_vals)
@@ -169,6 +171,7 @@ do_mapreduce(int nprocs, int nsplits, int reduce_tasks,
     memset(&mr_param, 0, sizeof(mr_param_t));
     memset(wr_vals, 0, sizeof(*wr_vals));
     mr_param.nr_cpus = nprocs;
+    mr_param.no_numa = no_numa;
     mr_param.app_arg.atype = atype_mapgroup;
     mr_param.app_arg.mapgroup.results = wr_vals;
     mr_param.key_cmp = (key_cmp_t) strcmp;
@@ -197,6 +200,7 @@ wr_usage(char *prog)
     printf("  -l ntops : # of top key/value pairs to display\n");
     printf("  -s inputsize : size of input in MB\n");
     printf("  -q : quiet output (for batch test)\n");
+    printf("  -n : ignore NUMA when placing data and reduce tasks\n");
     exit(EXIT_FAILURE);
 }
 
@@ -219,7 +223,7 @@ main(int argc, char *argv[])
     uint64_t inputsize = 0x80000000;
     char buf[128];
     int c;
-    while ((c = getopt(argc, argv, "p:l:m:r:qs:a:")) != -1) {
+    while ((c = getopt(argc, argv, "p:l:m:r:qs:a:n")) != -1) {
 	switch (c) {
 	case 'p':
 	    nprocs = atoi(optarg);
@@ -241,6 +245,10 @@ main(int argc, char *argv[])
 	case 'q':
 	    quiet = 1;
 	    break;
+	case 'n':
+	    no_numa = 1;
+	    printf("# --no-numa\n");
+	    break;
 	case 'a':
 	    // xv6 malloc
 	    {
@@ -8,6 +8,7 @@
 #include "reduce.h"
 #include "estimation.h"
 #include "mr-conf.h"
+#include "numa.h"
 
 typedef struct {
     keyval_arr_t v;
@@ -32,9 +33,10 @@ mbm_mbks_init(int rows, int cols)
     mapper.map_rows = rows;
     mapper.map_cols = cols;
     mapper.mbks = (htable_entry_t **) malloc(rows * sizeof(htable_entry_t *));
+    // each mapper's buckets live on its node
     for (int i = 0; i < rows; i++) {
-	mapper.mbks[i] =
-	    (htable_entry_t *) malloc(cols * sizeof(htable_entry_t));
+	mapper.mbks[i] = (htable_entry_t *)
+	    numa_alloc_onnode(cols * sizeof(htable_entry_t), lcpu_to_node[i]);
 	for (int j = 0; j < cols; j++)
 	    hkvarr.pch_init(&mapper.mbks[i][j].v);
     }
@@ -109,6 +111,12 @@ mbm_map_get_output(const pc_handler_t ** phandler, int *ntasks)
     return map_out;
 }
 
+static uint64_t
+mbm_bucket_len(int row, int col)
+{
+    return hkvarr.pch_get_len(&mapper.mbks[row][col].v);
+}
+
 static void
 mbm_rehash_bak(int row)
 {
@@ -121,6 +129,9 @@ mbm_rehash_bak(int row)
 			0, bucket->v.arr[j].hash);
 	hkvarr.pch_shallow_free(&bucket->v);
     }
+    numa_free(mapper_bak.mbks[row],
+	      mapper_bak.map_cols * sizeof(htable_entry_t));
+    mapper_bak.mbks[row] = NULL;
 }
 
 static void
@@ -154,4 +165,5 @@ const mbkts_mgr_t appendbktmgr = {
     .mbm_map_prepare_merge = mbm_map_prepare_merge,
     .mbm_mbks_bak = mbm_mbks_bak,
     .mbm_rehash_bak = mbm_rehash_bak,
+    .mbm_bucket_len = mbm_bucket_len,
 };
@@ -7,6 +7,7 @@
 #include "bench.h"
 #include "reduce.h"
 #include "estimation.h"
+#include "numa.h"
 #ifdef JOS_USER
 // #include <inc/compiler.h>
 // #include <inc/lib.h>
@@ -35,8 +36,10 @@ mbm_mbks_init(int rows, int cols)
     mapper.map_cols = cols;
     htable_entry_t **buckets =
 	(htable_entry_t **) malloc(rows * sizeof(htable_entry_t *));
+    // each mapper's buckets live on its node
     for (int i = 0; i < rows; i++) {
-	buckets[i] = (htable_entry_t *) malloc(cols * sizeof(htable_entry_t));
+	buckets[i] = (htable_entry_t *)
+	    numa_alloc_onnode(cols * sizeof(htable_entry_t), lcpu_to_node[i]);
 	for (int j = 0; j < cols; j++)
 	    hkvsarr.pch_init(&buckets[i][j].v);
     }
@@ -62,7 +65,7 @@ mbm_mbks_destroy(void)
     for (int i = 0; i < mapper.map_rows; i++) {
 	for (int j = 0; j < mapper.map_cols; j++)
 	    hkvsarr.pch_shallow_free(&mapper.mbks[i][j].v);
-	free(mapper.mbks[i]);
+	numa_free(mapper.mbks[i], mapper.map_cols * sizeof(htable_entry_t));
     }
     free(mapper.mbks);
     mapper.mbks = NULL;
@@ -91,6 +94,12 @@ mbm_do_reduce_task(int col)
 	hkvsarr.pch_shallow_free(&mapper.mbks[i][col].v);
 }
 
+static uint64_t
+mbm_bucket_len(int row, int col)
+{
+    return hkvsarr.pch_get_len(&mapper.mbks[row][col].v);
+}
+
 static void
 mbm_rehash_bak(int row)
 {
@@ -145,5 +154,6 @@ const mbkts_mgr_t arraybktmgr = {
     .mbm_map_get_output = mbm_map_get_output,
     .mbm_map_prepare_merge = mbm_map_prepare_merge,
     .mbm_mbks_bak = mbm_mbks_bak,
+    .mbm_bucket_len = mbm_bucket_len,
     .mbm_rehash_bak = mbm_rehash_bak,
 };
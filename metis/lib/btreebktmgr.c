@@ -7,6 +7,7 @@
 #include "bench.h"
 #include "reduce.h"
 #include "estimation.h"
+#include "numa.h"
 
 typedef struct {
     btree_t v;
@@ -30,8 +31,10 @@ mbm_mbks_init(int rows, int cols)
 
     htable_entry_t **buckets =
 	(htable_entry_t **) malloc(rows * sizeof(htable_entry_t *));
+    // each mapper's buckets live on its node
     for (int i = 0; i < rows; i++) {
-	buckets[i] = (htable_entry_t *) malloc(cols * sizeof(htable_entry_t));
+	buckets[i] = (htable_entry_t *)
+	    numa_alloc_onnode(cols * sizeof(htable_entry_t), lcpu_to_node[i]);
 	for (int j = 0; j < cols; j++)
 	    hkvsbtree.pch_init(&buckets[i][j].v);
     }
@@ -60,7 +63,7 @@ mapper_destroy(mapper_t * m)
 	if (m->mbks[i]) {
 	    for (int j = 0; j < m->map_cols; j++)
 		hkvsbtree.pch_shallow_free(&m->mbks[i][j].v);
-	    free(m->mbks[i]);
+	    numa_free(m->mbks[i], m->map_cols * sizeof(htable_entry_t));
 	    m->mbks[i] = NULL;
 	}
     }
@@ -106,6 +109,12 @@ mbm_do_reduce_task(int col)
 	hkvsbtree.pch_shallow_free(&mapper.mbks[i][col].v);
 }
 
+static uint64_t
+mbm_bucket_len(int row, int col)
+{
+    return hkvsbtree.pch_get_len(&mapper.mbks[row][col].v);
+}
+
 static void
 bkt_rehash(htable_entry_t * entry, int row)
 {
@@ -127,7 +136,8 @@ mbm_rehash_bak(int row)
     assert(mapper_bak.mbks[row]);
     for (int i = 0; i < mapper_bak.map_cols; i++)
 	bkt_rehash(&mapper_bak.mbks[row][i], row);
-    free(mapper_bak.mbks[row]);
+    numa_free(mapper_bak.mbks[row],
+	      mapper_bak.map_cols * sizeof(htable_entry_t));
     mapper_bak.mbks[row] = NULL;
 }
 
@@ -169,4 +179,5 @@ const mbkts_mgr_t btreebktmgr = {
     .mbm_map_get_output = mbm_map_get_output,
     .mbm_mbks_bak = mbm_mbks_bak,
     .mbm_rehash_bak = mbm_rehash_bak,
+    .mbm_bucket_len = mbm_bucket_len,
 };
@@ -173,6 +173,12 @@ kvst_reduce_do_task(int row, int col)
     mgrs[imgr]->mbm_do_reduce_task(col);
 }
 
+uint64_t
+kvst_map_bucket_len(int row, int col)
+{
+    return mgrs[imgr]->mbm_bucket_len(row, col);
+}
+
 void
 kvst_map_worker_finished(int row, int reduce_skipped)
 {
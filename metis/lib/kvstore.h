@@ -22,6 +22,7 @@ void kvst_map_put(int row, void *key, void *val, size_t keylen,
 		  unsigned hash);
 void kvst_map_worker_finished(int row, int reduce_skipped);
 /* reduce phase */
+uint64_t kvst_map_bucket_len(int row, int col);
 void kvst_reduce_do_task(int row, int col);
 void kvst_reduce_put(void *key, void *val);
 
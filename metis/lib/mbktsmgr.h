@@ -16,6 +16,9 @@ typedef struct {
     /* make sure the pairs of the reduce bucket is sorted by key, if
      * no out_cmp function is provided by application. */
     void (*mbm_do_reduce_task) (int col);
+    /* # of keys (or pairs) the mapper of row put in the bucket of col.
+     * Used to run reduce tasks on the node holding most of their input. */
+    uint64_t (*mbm_bucket_len) (int row, int col);
 } mbkts_mgr_t;
 
 extern const mbkts_mgr_t appendbktmgr;
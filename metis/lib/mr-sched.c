@@ -11,6 +11,9 @@
 #include "thread.h"
 #include "presplitter.h"
 #include "apphelper.h"
+#include "numa.h"
+#include "preagg.h"
+#include "value_helper.h"
 
 #if XV6_USER
 #include "sysstubs.h"           /* For xv6 pt_pages */
@@ -40,9 +43,29 @@ typedef struct {
     int merge_ncpus;
     int merge_nsplits;
     int skip_reduce_phase;
+    int preagg;
+    int sampling;
 } mr_state_t;
 
+/* Reduce tasks, grouped by the node that holds most of their input.
+ * Workers drain their own node's queue before stealing from others. */
+typedef struct {
+    int *tasks;
+    int ntasks;
+    int next;
+} __attribute__ ((aligned(JOS_CLINE))) reduce_queue_t;
+
+/* Pairs emitted by each map worker */
+typedef struct {
+    uint64_t n;
+} __attribute__ ((aligned(JOS_CLINE))) emit_count_t;
+
 static mr_state_t mr_state;
+static emit_count_t map_emitted[JOS_NCPU];
+static reduce_queue_t reduce_queues[numa_max_nodes];
+static int *reduce_tasks;
+static uint64_t total_reduce_home_tasks;
+static uint64_t total_reduce_tasks;
 static uint64_t total_sample_time;
 static uint64_t total_map_time;
 static uint64_t total_reduce_time;
@@ -74,9 +97,14 @@ mr_map_worker(void *arg)
 	if (ret == 0)
 	    break;
 	mr_state.mr_fixed.map_func(&ma);
+	// sampling counts keys per task, so it must see them all
+	if (mr_state.preagg && mr_state.sampling)
+	    preagg_flush(cur_lcpu);
 	kvst_map_task_finished(cur_lcpu);
 	num_tasks++;
     }
+    if (mr_state.preagg)
+	preagg_flush(cur_lcpu);
     kvst_map_worker_finished(cur_lcpu, mr_state.skip_reduce_phase);
     dprintf("total %d map tasks executed in thread %ld(%d)\n",
 	    num_tasks, (long)pthread_self(), cur_lcpu);
@@ -88,17 +116,24 @@ static void *
 mr_reduce_worker(void *arg)
 {
     prof_worker_start(REDUCE, cur_lcpu);
-    int *task_idx = (int *) arg;
-    int num_tasks = 0;
+    int num_tasks = 0, num_home = 0;
+    int node = lcpu_to_node[cur_lcpu];
     assert(the_app.atype != atype_maponly);
-    while (1) {
-	int cur_task = atomic_add32_ret(task_idx);
-	if (cur_task >= the_app.mapgr.tasks)
-	    break;
-	kvst_reduce_do_task(cur_lcpu, cur_task);
-	num_tasks++;
-	dprintf("thread : %d, num of tasks : %d\n", cur_lcpu, cur_task);
+    for (int i = 0; i < numa_nnodes; i++) {
+	reduce_queue_t *q = &reduce_queues[(node + i) % numa_nnodes];
+	while (1) {
+	    int k = atomic_add32_ret(&q->next);
+	    if (k >= q->ntasks)
+		break;
+	    int cur_task = q->tasks[k];
+	    kvst_reduce_do_task(cur_lcpu, cur_task);
+	    num_tasks++;
+	    if (i == 0)
+		num_home++;
+	    dprintf("thread : %d, num of tasks : %d\n", cur_lcpu, cur_task);
+	}
     }
+    __sync_fetch_and_add(&total_reduce_home_tasks, num_home);
     dprintf("total %d reduce tasks executed in thread %ld(%d)\n",
 	    num_tasks, (long)getself(), cur_lcpu);
     prof_worker_end(REDUCE, cur_lcpu);
@@ -115,6 +150,46 @@ mr_merge_worker(void * __attribute__ ((unused)) arg)
     return 0;
 }
 
+/* Queue each reduce task on the node whose mappers put the most keys
+ * in its buckets. With one node, this is the task order. */
+static void
+mr_place_reduce_tasks(void)
+{
+    int ntasks = the_app.mapgr.tasks;
+    int nqueued[numa_max_nodes];
+    int *home = (int *) malloc(ntasks * sizeof(int));
+    memset(nqueued, 0, sizeof(nqueued));
+    for (int t = 0; t < ntasks; t++) {
+	home[t] = 0;
+	if (numa_nnodes > 1) {
+	    uint64_t len[numa_max_nodes];
+	    memset(len, 0, numa_nnodes * sizeof(len[0]));
+	    for (int r = 0; r < mr_state.mr_fixed.nr_cpus; r++)
+		len[lcpu_to_node[r]] += kvst_map_bucket_len(r, t);
+	    for (int n = 1; n < numa_nnodes; n++)
+		if (len[n] > len[home[t]])
+		    home[t] = n;
+	}
+	nqueued[home[t]]++;
+    }
+
+    free(reduce_tasks);
+    reduce_tasks = (int *) malloc(ntasks * sizeof(int));
+    int pos = 0;
+    for (int n = 0; n < numa_nnodes; n++) {
+	reduce_queues[n].tasks = &reduce_tasks[pos];
+	reduce_queues[n].ntasks = 0;
+	reduce_queues[n].next = 0;
+	pos += nqueued[n];
+    }
+    for (int t = 0; t < ntasks; t++) {
+	reduce_queue_t *q = &reduce_queues[home[t]];
+	q->tasks[q->ntasks++] = t;
+    }
+    free(home);
+    total_reduce_tasks += ntasks;
+}
+
 static uint64_t
 mr_sample()
 {
@@ -127,7 +202,9 @@ mr_sample()
 	nsampled = 1;
     presplitter_prep_sample(&mr_state.ps, nsampled);
     kvst_sample_init(mr_state.mr_fixed.nr_cpus, the_app.mapgr.tasks);
+    mr_state.sampling = 1;
     mr_run_task(MAP);
+    mr_state.sampling = 0;
     uint64_t ntasks = kvst_sample_finished(ntotal);
     presplitter_done_sample(&mr_state.ps);
     uint64_t sample_time = read_tsc() - start;
@@ -157,11 +234,23 @@ mr_setup(mr_param_t * param)
 	mr_state.mr_fixed.nr_cpus = maxcores;
     // initialize thread manager
     mthread_init(mr_state.mr_fixed.nr_cpus, main_lcpu);
+    // find each lcpu's node, unless NUMA awareness is off
+    numa_init(mr_state.mr_fixed.no_numa ? 0 : mr_state.mr_fixed.nr_cpus,
+	      main_lcpu);
     // initialize splitter
     presplitter_init(&mr_state.ps, param->split_func, param->split_arg,
 		     mr_state.mr_fixed.nr_cpus);
     // setup key comparator and keycopy functions
     kvst_set_util(mr_state.mr_fixed.key_cmp, mr_state.mr_fixed.keycopy);
+    // pre-aggregate map output, if the application can combine values
+    mr_state.preagg = !mr_state.mr_fixed.no_preagg &&
+	the_app.atype == atype_mapreduce &&
+	(the_app.mapreduce.vm || the_app.mapreduce.combiner);
+    values_set_aggregated(mr_state.preagg && the_app.mapreduce.vm);
+    if (mr_state.preagg)
+	preagg_init(mr_state.mr_fixed.nr_cpus, the_app.mapreduce.vm,
+		    the_app.mapreduce.combiner, mr_state.mr_fixed.key_cmp,
+		    mr_state.mr_fixed.keycopy);
     mr_state.skip_reduce_phase = 0;
     if (the_app.atype == atype_maponly) {
 	mr_state.skip_reduce_phase = 1;
@@ -235,6 +324,7 @@ mr_run_scheduler(mr_param_t * param)
 	// reduce phase
         printf("done with map\n");
 	start_time = read_tsc();
+	mr_place_reduce_tasks();
 	mr_run_task(REDUCE);
 	reduce_time = read_tsc() - start_time;
     }
@@ -291,6 +381,18 @@ mr_print_stats(void)
 	printf("Reduce:\t%" PRIu32 SEP, the_app.mapgr.tasks);
     }
     printf("\n");
+    uint64_t nemitted = 0;
+    for (int i = 0; i < JOS_NCPU; i++)
+	nemitted += map_emitted[i].n;
+    printf("Map output pairs: %" PRIu64 " emitted", nemitted);
+    if (mr_state.preagg)
+	printf(", %" PRIu64 " put in buckets after pre-aggregation "
+	       "(%zu entries per worker)", preagg_nstored(), preagg_nentries());
+    printf("\n");
+    if (total_reduce_tasks)
+	printf("NUMA nodes: %d, reduce tasks run on their home node: %"
+	       PRIu64 "/%" PRIu64 "\n", numa_nnodes, total_reduce_home_tasks,
+	       total_reduce_tasks);
 #if XV6_USER
     printf("PT pages: %" PRIu64 "\n", pt_pages());
 #endif
@@ -300,14 +402,22 @@ void
 mr_finalize(void)
 {
     kvst_destroy();
+    if (mr_state.preagg)
+	preagg_destroy();
     mthread_finalize();
+    free(reduce_tasks);
+    reduce_tasks = NULL;
 }
 
 void
 mr_map_emit(void *key, void *val, int keylen)
 {
     unsigned hash = mr_state.mr_fixed.part_func(key, keylen);
-    kvst_map_put(cur_lcpu, key, val, keylen, hash);
+    map_emitted[cur_lcpu].n++;
+    if (mr_state.preagg)
+	preagg_put(cur_lcpu, key, val, keylen, hash);
+    else
+	kvst_map_put(cur_lcpu, key, val, keylen, hash);
 }
 
 void
@@ -15,6 +15,9 @@ typedef struct {
     partition_t part_func;	/* partition func. */
     keycopy_t keycopy;		/* invoked by Metis library for each new key exactly once */
     int nr_cpus;		/* # of cpus to use (use all cores by default) */
+    int no_numa;		/* ignore NUMA when placing buckets and reduce tasks */
+    int no_preagg;		/* don't combine map output in per-worker tables
+				 * before it goes into buckets. See lib/preagg.h */
 } mr_param_t;
 
 /* public functions for use by applications. */
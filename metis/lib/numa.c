@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "numa.h"
+#include "cpumap.h"
+#include "platform.h"
+#if XV6_USER
+#include "sysstubs.h"
+#else
+#include <sys/syscall.h>
+#endif
+
+/* MPOL_PREFERRED, which is the same on Linux and xv6 */
+enum { mpol_preferred = 1 };
+
+int lcpu_to_node[JOS_NCPU];
+int numa_nnodes = 1;
+
+static int
+current_node(void)
+{
+    unsigned cpu, node;
+#if XV6_USER
+    if (ward_getcpu(&cpu, &node) < 0)
+	return 0;
+#else
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+	return 0;
+#endif
+    return node < numa_max_nodes ? node : 0;
+}
+
+void
+numa_init(int nlcpus, int main_lcpu)
+{
+    memset(lcpu_to_node, 0, sizeof(lcpu_to_node));
+    numa_nnodes = 1;
+    if (nlcpus == 0)
+	return;
+    for (int i = 0; i < nlcpus; i++) {
+	if (affinity_set(lcpu_to_pcpu[i]) != 0)
+	    continue;
+	lcpu_to_node[i] = current_node();
+	if (lcpu_to_node[i] >= numa_nnodes)
+	    numa_nnodes = lcpu_to_node[i] + 1;
+    }
+    assert(affinity_set(lcpu_to_pcpu[main_lcpu]) == 0);
+}
+
+void *
+numa_alloc_onnode(size_t size, int node)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(p != MAP_FAILED);
+    if (numa_nnodes > 1) {
+	/* placement is only a hint, so ignore failures */
+	unsigned long mask = 1ul << node;
+#if XV6_USER
+	ward_mbind(p, size, mpol_preferred, &mask, numa_max_nodes, 0);
+#else
+	syscall(SYS_mbind, p, size, mpol_preferred, &mask, numa_max_nodes, 0);
+#endif
+    }
+    return p;
+}
+
+void
+numa_free(void *p, size_t size)
+{
+    if (p)
+	munmap(p, size);
+}
@@ -0,0 +1,20 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+
+enum { numa_max_nodes = 64 };
+
+/* NUMA node of each lcpu, and the number of nodes they span. */
+extern int lcpu_to_node[JOS_NCPU];
+extern int numa_nnodes;
+
+/* learn the nodes of lcpus [0, nlcpus) by running on each of them in
+ * turn, then return to main_lcpu. The rest are assumed to be on node
+ * 0, so nlcpus = 0 disables NUMA awareness. */
+void numa_init(int nlcpus, int main_lcpu);
+/* allocate zeroed memory whose pages come from node, if possible */
+void *numa_alloc_onnode(size_t size, int node);
+void numa_free(void *p, size_t size);
+
+#endif
@@ -0,0 +1,178 @@
+#include <assert.h>
+#include <string.h>
+#include "preagg.h"
+#include "kvstore.h"
+#include "numa.h"
+
+/* If the application has a keycopy function, keys with a length are
+ * copied into the entry, since it may reuse their memory once
+ * mr_map_emit returns. Longer keys bypass the table. */
+enum { preagg_key_max = 40 };
+/* Used when the L2 size is unknown */
+enum { def_l2_size = 256 * 1024 };
+enum { min_ents_shift = 6 };
+
+typedef struct {
+    void *key;			/* NULL if free; kbuf if keys are copied */
+    void *val;
+    unsigned hash;
+    int keylen;
+    char kbuf[preagg_key_max];
+} preagg_ent_t;
+
+typedef struct {
+    preagg_ent_t *ents;
+    uint64_t nstored;
+} __attribute__ ((aligned(JOS_CLINE))) preagg_table_t;
+
+static preagg_table_t tables[JOS_NCPU];
+static int ntables;
+static int ents_shift;
+static vmodifier_t preagg_vm;
+static combine_t preagg_combiner;
+static key_cmp_t preagg_keycmp;
+static keycopy_t preagg_keycopy;
+
+/* L2 size per core in bytes, from the AMD/Intel extended cache leaf */
+static size_t
+l2_size(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t a, b, c, d;
+    __asm__ volatile ("cpuid":"=a" (a), "=b"(b), "=c"(c), "=d"(d)
+		      :"a"(0x80000000));
+    if (a >= 0x80000006) {
+	__asm__ volatile ("cpuid":"=a" (a), "=b"(b), "=c"(c), "=d"(d)
+			  :"a"(0x80000006));
+	if (c >> 16)
+	    return (size_t) (c >> 16) * 1024;
+    }
+#endif
+    return def_l2_size;
+}
+
+static inline size_t
+table_bytes(void)
+{
+    return sizeof(preagg_ent_t) << ents_shift;
+}
+
+void
+preagg_init(int nlcpus, vmodifier_t vm, combine_t combiner,
+	    key_cmp_t keycmp, keycopy_t keycopy)
+{
+    assert(!vm != !combiner);
+    preagg_destroy();
+    preagg_vm = vm;
+    preagg_combiner = combiner;
+    preagg_keycmp = keycmp;
+    preagg_keycopy = keycopy;
+    /* take half of L2, leaving the rest to the input and the buckets */
+    size_t nents = l2_size() / 2 / sizeof(preagg_ent_t);
+    for (ents_shift = min_ents_shift; (2ul << ents_shift) <= nents;
+	 ents_shift++) ;
+    ntables = nlcpus;
+    for (int i = 0; i < ntables; i++)
+	tables[i].ents = numa_alloc_onnode(table_bytes(), lcpu_to_node[i]);
+}
+
+void
+preagg_destroy(void)
+{
+    for (int i = 0; i < ntables; i++) {
+	numa_free(tables[i].ents, table_bytes());
+	tables[i].ents = NULL;
+    }
+    ntables = 0;
+}
+
+static inline void
+store(int lcpu, void *key, void *val, int keylen, unsigned hash)
+{
+    tables[lcpu].nstored++;
+    kvst_map_put(lcpu, key, val, keylen, hash);
+}
+
+/* with a vm, every value that reaches the buckets is an accumulator */
+static inline void *
+first_val(void *val)
+{
+    return preagg_vm ? preagg_vm(0, val, 1) : val;
+}
+
+static inline int
+same_key(preagg_ent_t * e, void *key, int keylen, unsigned hash)
+{
+    if (e->hash != hash)
+	return 0;
+    if (e->key == e->kbuf)
+	return e->keylen == keylen && !memcmp(e->kbuf, key, keylen);
+    return !preagg_keycmp(e->key, key);
+}
+
+void
+preagg_put(int lcpu, void *key, void *val, int keylen, unsigned hash)
+{
+    preagg_table_t *t = &tables[lcpu];
+    if (preagg_keycopy && keylen >= preagg_key_max) {
+	store(lcpu, key, first_val(val), keylen, hash);
+	return;
+    }
+    preagg_ent_t *e = &t->ents[(hash * 2654435761u) >> (32 - ents_shift)];
+    if (e->key && same_key(e, key, keylen, hash)) {
+	if (preagg_vm) {
+	    e->val = preagg_vm(e->val, val, 0);
+	    return;
+	}
+	void *vals[2] = { e->val, val };
+	if (preagg_combiner(e->key, vals, 2) == 1) {
+	    e->val = vals[0];
+	    return;
+	}
+	/* the combiner kept both; keep the newer one here */
+	store(lcpu, e->key, vals[0], e->keylen, e->hash);
+	e->val = vals[1];
+	return;
+    }
+    /* evict the other key */
+    if (e->key)
+	store(lcpu, e->key, e->val, e->keylen, e->hash);
+    if (preagg_keycopy && keylen) {
+	memcpy(e->kbuf, key, keylen);
+	e->kbuf[keylen] = 0;
+	e->key = e->kbuf;
+    } else {
+	e->key = key;
+    }
+    e->val = first_val(val);
+    e->keylen = keylen;
+    e->hash = hash;
+}
+
+void
+preagg_flush(int lcpu)
+{
+    preagg_table_t *t = &tables[lcpu];
+    for (size_t i = 0; i < (1ul << ents_shift); i++) {
+	preagg_ent_t *e = &t->ents[i];
+	if (!e->key)
+	    continue;
+	store(lcpu, e->key, e->val, e->keylen, e->hash);
+	e->key = NULL;
+    }
+}
+
+size_t
+preagg_nentries(void)
+{
+    return ntables ? 1ul << ents_shift : 0;
+}
+
+uint64_t
+preagg_nstored(void)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < JOS_NCPU; i++)
+	n += tables[i].nstored;
+    return n;
+}
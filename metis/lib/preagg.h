@@ -0,0 +1,28 @@
+#ifndef PREAGG_H
+#define PREAGG_H
+
+#include <inttypes.h>
+#include "mr-types.h"
+
+/* Per-worker pre-aggregation of map output. Each map worker folds the
+ * pairs it emits into a small direct-mapped table sized to fit in L2,
+ * combining values of the same key with the application's vm or
+ * combiner, and only puts pairs into its buckets when they are evicted
+ * or flushed. */
+
+/* set up a table for each of lcpus [0, nlcpus); each lcpu's table comes
+ * from its own NUMA node. Exactly one of vm and combiner must be set.
+ * With a vm, a new key's value is seeded with vm(0, val, 1) and the
+ * buckets get the accumulator, so the caller must also turn on
+ * values_set_aggregated. */
+void preagg_init(int nlcpus, vmodifier_t vm, combine_t combiner,
+		 key_cmp_t keycmp, keycopy_t keycopy);
+void preagg_destroy(void);
+void preagg_put(int lcpu, void *key, void *val, int keylen, unsigned hash);
+/* put every pair still in lcpu's table into its buckets */
+void preagg_flush(int lcpu);
+/* entries per table, and pairs all tables have put into buckets */
+size_t preagg_nentries(void);
+uint64_t preagg_nstored(void);
+
+#endif
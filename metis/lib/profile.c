@@ -3,6 +3,7 @@
 #include "bench.h"
 #include "ibs.h"
 #include "mr-types.h"
+#include "numa.h"
 
 #ifdef PROFILE_ENABLED
 enum { profile_app = 1 };
@@ -140,6 +141,24 @@ prof_print_phase(int phase, int ncores, uint64_t scale)
 	("Total[ibslat] / Total[ibscnt] = %ld, Total[pmc0] / Total[pmc] = %4.2f\n",
 	 tots[ibslat] / (tots[ibscnt] + 1),
 	 (double) tots[pmc0] / (double) tots[pmc1]);
+    /* worker time by node, to show when one node's workers lag */
+    printf("node\tcores%" WIDTH "s%" WIDTH "s\n", "avg-tsc", "max-tsc");
+    for (int n = 0; n < numa_nnodes; n++) {
+	uint64_t sum = 0, max = 0;
+	int nworkers = 0;
+	for (int i = 0; i < ncores; i++) {
+	    if (lcpu_to_node[i] != n)
+		continue;
+	    uint64_t t = stats[phase][i].v[tsc] / scale;
+	    sum += t;
+	    if (t > max)
+		max = t;
+	    nworkers++;
+	}
+	if (nworkers)
+	    printf("%d\t%d%" WIDTH "ld%" WIDTH "ld\n", n, nworkers,
+		   sum / nworkers, max);
+    }
 }
 
 void
@@ -10,13 +10,23 @@
 
 enum { combiner_threshold = 8 };
 
+static int vals_aggregated;
+
+void
+values_set_aggregated(int aggregated)
+{
+    vals_aggregated = aggregated;
+}
+
 void
 values_insert(keyvals_t * kvs, void *val)
 {
     if (the_app.atype == atype_mapreduce && the_app.mapreduce.vm) {
 	if (kvs->len == 0) {
 	    kvs->len = 1;
-	    kvs->vals = the_app.mapreduce.vm(0, val, 1);
+	    /* an accumulator is taken as-is, as values_mv does */
+	    kvs->vals =
+		vals_aggregated ? val : the_app.mapreduce.vm(0, val, 1);
 	} else {
 	    kvs->vals = the_app.mapreduce.vm(kvs->vals, val, 0);
 	}
@@ -3,6 +3,9 @@
 
 #include "mr-types.h"
 
+/* if set, the values given to values_insert are accumulators the vm
+ * already returned, rather than raw map output. See lib/preagg.h */
+void values_set_aggregated(int aggregated);
 void values_insert(keyvals_t * kvs, void *val);
 void values_deep_free(keyvals_t * kvs);
 void values_mv(keyvals_t * dst, keyvals_t * src);
@@ -6,6 +6,16 @@
 void lwip_cprintf(const char*, ...) __attribute__((format(printf, 1, 2)));
 void lwip_panic(const char*, ...) __noret__ __attribute__((format(printf, 1, 2)));
 
+// Pool and heap allocation, see lwipopts.h
+void *lwip_memp_malloc(int type);
+void lwip_memp_free(int type, void *mem);
+void *lwip_mem_malloc(u64 size);
+void *lwip_mem_calloc(u64 count, u64 size);
+void lwip_mem_free(void *mem);
+
+extern u32 lwip_tcp_wnd;
+extern u32 lwip_tcp_snd_buf;
+
 typedef u32 u32_t;
 typedef s32 s32_t;
 
@@ -11,28 +11,52 @@
 
 #define MEM_ALIGNMENT		4
 
-#define MEMP_NUM_PBUF		64
+// lwIP's pools and heap are backed by kmalloc (see net/sys_arch.cc).
+// The MEMP_NUM_* values and MEM_SIZE below are only the default
+// limits; the net_* boot parameters in cmdline.hh override them.
+#define MEMP_MEM_MALLOC		1
+#define MEM_LIBC_MALLOC		1
+#define memp_malloc(type)	lwip_memp_malloc(type)
+#define memp_free(type, mem)	lwip_memp_free(type, mem)
+#define mem_malloc		lwip_mem_malloc
+#define mem_calloc		lwip_mem_calloc
+#define mem_free		lwip_mem_free
+
+// Zero-copy sends reference their data with one PBUF_ROM per queued
+// segment.  The default send buffer holds 16 segments, so this allows
+// 64 connections' worth of full send queues; net_pbufs overrides it.
+#define MEMP_NUM_PBUF		1024
 #define MEMP_NUM_UDP_PCB	8
-#define MEMP_NUM_TCP_PCB	32
+#define MEMP_NUM_TCP_PCB	128
 #define MEMP_NUM_TCP_PCB_LISTEN	16
-#define MEMP_NUM_TCP_SEG	TCP_SND_QUEUELEN// at least as big as TCP_SND_QUEUELEN
+#define MEMP_NUM_TCP_SEG	1024
 #define MEMP_NUM_NETBUF		128
-#define MEMP_NUM_NETCONN	32
+// Also the size of the socket table in api/sockets.c.
+#define MEMP_NUM_NETCONN	256
 #define MEMP_NUM_SYS_TIMEOUT    6
 
-#define PER_TCP_PCB_BUFFER	(16 * 4096)
-#define MEM_SIZE		(PER_TCP_PCB_BUFFER*MEMP_NUM_TCP_SEG + 4096*MEMP_NUM_TCP_SEG)
+#define MEM_SIZE		(16 * 1024 * 1024)
 
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
 
+// TCP_WND and TCP_SND_BUF are the defaults for new sockets, set at
+// boot from net_tcp_wnd and net_tcp_sndbuf.  Sockets can change theirs
+// with SO_RCVBUF/SO_SNDBUF up to TCP_BUF_MAX.
+#define LWIP_WND_SCALE		1
+#define TCP_RCV_SCALE		5
 #define TCP_MSS			1460
-#define TCP_WND			24000
-#define TCP_SND_BUF		(16 * TCP_MSS)
-// lwip prints a warning if TCP_SND_QUEUELEN < (2 * TCP_SND_BUF/TCP_MSS), 
-// but 16 is faster.. 
-#define TCP_SND_QUEUELEN	(2 * TCP_SND_BUF/TCP_MSS)
-//#define TCP_SND_QUEUELEN	16
+#define TCP_BUF_MAX		(0xffffUL << TCP_RCV_SCALE)
+#define TCP_WND			lwip_tcp_wnd
+#define TCP_SND_BUF		lwip_tcp_snd_buf
+#define TCP_SNDLOWAT		TCP_MSS
+// The queue length limit has to be a compile-time constant, so size it
+// for the largest send buffer; snd_buf is what bounds a socket in
+// practice.
+#define TCP_SND_QUEUELEN	(2 * TCP_BUF_MAX / TCP_MSS)
+// init.c's checks can't see the runtime buffer sizes;
+// lwip_core_init() validates them instead.
+#define LWIP_DISABLE_TCP_SANITY_CHECKS 1
 
 // Print error messages when we run out of memory
 #define LWIP_DEBUG	1
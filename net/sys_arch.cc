@@ -6,6 +6,8 @@
 
 extern "C" {
 #include "lwip/sys.h"
+#include "lwip/memp.h"
+#include "lwip/tcp.h"
 #include "arch/sys_arch.h"
 }
 
@@ -13,6 +15,9 @@ extern "C" {
 #include "proc.hh"
 #include "cpu.hh"
 #include "cpputil.hh"
+#include "cmdline.hh"
+
+#include <atomic>
 
 #define DIE panic(__func__)
 
@@ -245,6 +250,133 @@ sys_thread_new(const char *name, lwip_thread_fn thread, void *arg,
   return threadrun(lwip_thread, lt, name);
 }
 
+//
+// memory
+//
+// lwIP's pools and heap come straight from kmalloc's per-CPU
+// freelists.  Each pool and the heap are capped so one busy server
+// can't take all of kernel memory; the caps default to the sizes in
+// lwipopts.h and can be changed at boot with the net_* parameters.
+
+u32 lwip_tcp_wnd, lwip_tcp_snd_buf;
+
+struct lwip_pool {
+  const char *name;
+  u64 num;
+  u64 *param;
+  std::atomic<u64> cur, max, fail;
+
+  u64 limit() const {
+    return (param && *param) ? *param : num;
+  }
+
+  bool get(u64 n) {
+    u64 c = cur.fetch_add(n) + n;
+    if (c > limit()) {
+      cur -= n;
+      fail++;
+      return false;
+    }
+    for (u64 m = max; c > m && !max.compare_exchange_weak(m, c); )
+      ;
+    return true;
+  }
+
+  void put(u64 n) {
+    cur -= n;
+  }
+};
+
+static lwip_pool lwip_pools[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name,num,size,desc) { desc, num },
+#include "lwip/memp_std.h"
+};
+
+static lwip_pool lwip_heap{"MEM_HEAP", MEM_SIZE, &cmdline_params.net_heap};
+
+// The heap stores each allocation's size in front of it for mem_free.
+#define HEAP_HDR 16
+
+void *
+lwip_memp_malloc(int type)
+{
+  lwip_pool *p = &lwip_pools[type];
+  if (!p->get(1))
+    return nullptr;
+  void *mem = kmalloc(memp_sizes[type], p->name);
+  if (!mem) {
+    p->put(1);
+    p->fail++;
+  }
+  return mem;
+}
+
+void
+lwip_memp_free(int type, void *mem)
+{
+  lwip_pool *p = &lwip_pools[type];
+  kmfree(mem, memp_sizes[type]);
+  p->put(1);
+}
+
+void *
+lwip_mem_malloc(u64 size)
+{
+  u64 total = size + HEAP_HDR;
+  if (!lwip_heap.get(total))
+    return nullptr;
+  u64 *hdr = (u64*)kmalloc(total, "lwIP heap");
+  if (!hdr) {
+    lwip_heap.put(total);
+    lwip_heap.fail++;
+    return nullptr;
+  }
+  *hdr = total;
+  return (char*)hdr + HEAP_HDR;
+}
+
+void *
+lwip_mem_calloc(u64 count, u64 size)
+{
+  void *mem = lwip_mem_malloc(count * size);
+  if (mem)
+    memset(mem, 0, count * size);
+  return mem;
+}
+
+void
+lwip_mem_free(void *mem)
+{
+  if (!mem)
+    return;
+  u64 *hdr = (u64*)((char*)mem - HEAP_HDR);
+  u64 total = *hdr;
+  kmfree(hdr, total);
+  lwip_heap.put(total);
+}
+
+// Append pool and heap usage to buf for netifread.
+size_t
+lwip_mem_stats(char *buf, size_t n)
+{
+  size_t len = 0;
+  len += snprintf(buf + len, n - len,
+                  "tcp wnd %u sndbuf %u (max %lu)\n",
+                  lwip_tcp_wnd, lwip_tcp_snd_buf, TCP_BUF_MAX);
+  len += snprintf(buf + len, n - len, "%-16s %8s %8s %8s %8s\n",
+                  "pool", "cur", "max", "limit", "fail");
+  auto line = [&](const lwip_pool &p) {
+    if (len < n)
+      len += snprintf(buf + len, n - len, "%-16s %8lu %8lu %8lu %8lu\n",
+                      p.name, p.cur.load(), p.max.load(), p.limit(),
+                      p.fail.load());
+  };
+  for (auto &p : lwip_pools)
+    line(p);
+  line(lwip_heap);
+  return MIN(len, n - 1);
+}
+
 //
 // init
 //
@@ -280,6 +412,16 @@ lwip_core_sleep(struct condvar *c, uint64_t deadline)
 void
 lwip_core_init(void)
 {
+  lwip_pools[MEMP_TCP_PCB].param = &cmdline_params.net_tcp_pcbs;
+  lwip_pools[MEMP_TCP_SEG].param = &cmdline_params.net_tcp_segs;
+  lwip_pools[MEMP_PBUF].param = &cmdline_params.net_pbufs;
+  lwip_pools[MEMP_PBUF_POOL].param = &cmdline_params.net_pbuf_pool;
+
+  // init.c can't check these at compile time, so clamp them here.
+  lwip_tcp_wnd = MAX(MIN(cmdline_params.net_tcp_wnd, TCP_BUF_MAX),
+                     (u64)TCP_MSS);
+  lwip_tcp_snd_buf = MAX(MIN(cmdline_params.net_tcp_sndbuf, TCP_BUF_MAX),
+                         (u64)(2 * TCP_MSS));
 }
 
 void
@@ -4,7 +4,7 @@
 #define KSTACKSIZE 32768 // size of per-process kernel stack
 #define NBUF      10000  // size of disk block cache
 #define NINODE     5000  // maximum number of active i-nodes
-#define NDEV         16  // maximum major device number
+#define NDEV         32  // maximum major device number
 #define MAXARG       32  // max exec arguments
 #define MAXARGLEN   256  // max exec argument length
 #define MAXNAME      16  // max string names
@@ -17,7 +17,7 @@
 #define VERBOSE       0  // print kernel diagnostics
 #define SPINLOCK_DEBUG DEBUG // Debug spin locks
 #define RCU_TYPE_DEBUG DEBUG
-#define LOCKSTAT      DEBUG
+#define LOCKSTAT      1  // lock contention profiling (off until started)
 #define ALLOC_MEMSET  DEBUG
 #define BUDDY_DEBUG   DEBUG
 #define CMDLINE_DEBUG DEBUG
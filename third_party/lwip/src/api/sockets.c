@@ -60,6 +60,12 @@
 
 #define NUM_SOCKETS MEMP_NUM_NETCONN
 
+#if LWIP_TCP
+/** Range accepted for SO_SNDBUF and SO_RCVBUF on TCP sockets */
+#define SOCK_TCP_BUF_MIN  (2 * TCP_MSS)
+#define SOCK_TCP_BUF_MAX  (0xffffUL << TCP_RCV_SCALE)
+#endif /* LWIP_TCP */
+
 /** Contains all internal pointers and states used for a socket */
 struct lwip_sock {
   /** sockets currently are built on netconns, each socket has one netconn */
@@ -786,6 +792,58 @@ lwip_send(int s, const void *data, size_t size, int flags)
   return (err == ERR_OK ? (int)written : -1);
 }
 
+/**
+ * Like lwip_send, but the data is referenced from the queued segments
+ * instead of being copied.  Only valid for TCP sockets.  The caller
+ * must keep the data alive and unmodified until the peer has
+ * acknowledged it (i.e. until lastack of the pcb returned by
+ * lwip_socket_tcp_pcb has passed the end of the data) or until the
+ * pcb is gone.
+ */
+int
+lwip_send_nocopy(int s, const void *data, size_t size, int flags)
+{
+  struct lwip_sock *sock;
+  err_t err;
+  u8_t write_flags;
+  size_t written;
+
+  sock = get_socket(s);
+  if (!sock) {
+    return -1;
+  }
+
+  if (sock->conn->type != NETCONN_TCP) {
+    sock_set_errno(sock, err_to_errno(ERR_ARG));
+    return -1;
+  }
+
+  write_flags = NETCONN_NOCOPY |
+    ((flags & MSG_MORE)     ? NETCONN_MORE      : 0) |
+    ((flags & MSG_DONTWAIT) ? NETCONN_DONTBLOCK : 0);
+  written = 0;
+  err = netconn_write_partly(sock->conn, data, size, write_flags, &written);
+
+  LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_send_nocopy(%d) err=%d written=%"SZT_F"\n", s, err, written));
+  sock_set_errno(sock, err_to_errno(err));
+  return (err == ERR_OK ? (int)written : -1);
+}
+
+/**
+ * Return the TCP pcb backing socket s, or NULL if s is not a
+ * connected TCP socket.
+ */
+struct tcp_pcb *
+lwip_socket_tcp_pcb(int s)
+{
+  struct lwip_sock *sock = tryget_socket(s);
+  if (!sock || sock->conn->type != NETCONN_TCP ||
+      sock->conn->pcb.tcp == NULL || sock->conn->pcb.tcp->state == LISTEN) {
+    return NULL;
+  }
+  return sock->conn->pcb.tcp;
+}
+
 int
 lwip_sendto(int s, const void *data, size_t size, int flags,
        const struct sockaddr *to, socklen_t tolen)
@@ -1491,7 +1549,6 @@ lwip_getsockopt(int s, int level, int optname, void *optval, socklen_t *optlen)
     case SO_RCVBUF:
 #endif /* LWIP_SO_RCVBUF */
     /* UNIMPL case SO_OOBINLINE: */
-    /* UNIMPL case SO_SNDBUF: */
     /* UNIMPL case SO_RCVLOWAT: */
     /* UNIMPL case SO_SNDLOWAT: */
 #if SO_REUSE
@@ -1505,6 +1562,19 @@ lwip_getsockopt(int s, int level, int optname, void *optval, socklen_t *optlen)
       }
       break;
 
+#if LWIP_TCP
+#if !LWIP_SO_RCVBUF
+    case SO_RCVBUF:
+#endif /* !LWIP_SO_RCVBUF */
+    case SO_SNDBUF:
+      if (*optlen < sizeof(int)) {
+        err = EINVAL;
+      } else if ((sock->conn->type != NETCONN_TCP) || (sock->conn->pcb.tcp == NULL)) {
+        err = ENOPROTOOPT;
+      }
+      break;
+#endif /* LWIP_TCP */
+
     case SO_NO_CHECK:
       if (*optlen < sizeof(int)) {
         err = EINVAL;
@@ -1742,7 +1812,16 @@ lwip_getsockopt_internal(void *arg)
     case SO_RCVBUF:
       *(int *)optval = netconn_get_recvbufsize(sock->conn);
       break;
+#elif LWIP_TCP
+    case SO_RCVBUF:
+      *(int *)optval = (int)sock->conn->pcb.tcp->rcv_wnd_max;
+      break;
 #endif /* LWIP_SO_RCVBUF */
+#if LWIP_TCP
+    case SO_SNDBUF:
+      *(int *)optval = (int)sock->conn->pcb.tcp->snd_buf_max;
+      break;
+#endif /* LWIP_TCP */
 #if LWIP_UDP
     case SO_NO_CHECK:
       *(int*)optval = (udp_flags(sock->conn->pcb.udp) & UDP_FLAGS_NOCHKSUM) ? 1 : 0;
@@ -1897,7 +1976,6 @@ lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t opt
     case SO_RCVBUF:
 #endif /* LWIP_SO_RCVBUF */
     /* UNIMPL case SO_OOBINLINE: */
-    /* UNIMPL case SO_SNDBUF: */
     /* UNIMPL case SO_RCVLOWAT: */
     /* UNIMPL case SO_SNDLOWAT: */
 #if SO_REUSE
@@ -1909,6 +1987,18 @@ lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t opt
         err = EINVAL;
       }
       break;
+#if LWIP_TCP
+#if !LWIP_SO_RCVBUF
+    case SO_RCVBUF:
+#endif /* !LWIP_SO_RCVBUF */
+    case SO_SNDBUF:
+      if (optlen < sizeof(int)) {
+        err = EINVAL;
+      } else if ((sock->conn->type != NETCONN_TCP) || (sock->conn->pcb.tcp == NULL)) {
+        err = ENOPROTOOPT;
+      }
+      break;
+#endif /* LWIP_TCP */
     case SO_NO_CHECK:
       if (optlen < sizeof(int)) {
         err = EINVAL;
@@ -2130,6 +2220,29 @@ lwip_setsockopt_internal(void *arg)
       netconn_set_recvbufsize(sock->conn, *(int*)optval);
       break;
 #endif /* LWIP_SO_RCVBUF */
+#if LWIP_TCP
+#if !LWIP_SO_RCVBUF
+    case SO_RCVBUF:
+#endif /* !LWIP_SO_RCVBUF */
+    case SO_SNDBUF:
+      {
+        struct tcp_pcb *pcb = sock->conn->pcb.tcp;
+        long val = *(int*)optval;
+        if (val < SOCK_TCP_BUF_MIN) {
+          val = SOCK_TCP_BUF_MIN;
+        } else if (val > (long)SOCK_TCP_BUF_MAX) {
+          val = SOCK_TCP_BUF_MAX;
+        }
+        if (optname == SO_SNDBUF) {
+          tcp_setbufs(pcb, (tcpwnd_size_t)val, pcb->rcv_wnd_max);
+        } else {
+          tcp_setbufs(pcb, pcb->snd_buf_max, (tcpwnd_size_t)val);
+        }
+        LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_setsockopt(%d, SOL_SOCKET, optname=0x%x, ..) -> %ld\n",
+                    s, optname, val));
+      }
+      break;
+#endif /* LWIP_TCP */
 #if LWIP_UDP
     case SO_NO_CHECK:
       if (*(int*)optval) {
@@ -84,8 +84,10 @@ extern const u16_t memp_sizes[MEMP_MAX];
 #include "mem.h"
 
 #define memp_init()
+#ifndef memp_malloc
 #define memp_malloc(type)     mem_malloc(memp_sizes[type])
 #define memp_free(type, mem)  mem_free(mem)
+#endif
 
 #else /* MEMP_MEM_MALLOC */
 
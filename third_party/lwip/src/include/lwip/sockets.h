@@ -92,7 +92,7 @@ typedef u32_t socklen_t;
 /*
  * Additional options, not kept in so_options.
  */
-#define SO_SNDBUF    0x1001    /* Unimplemented: send buffer size */
+#define SO_SNDBUF    0x1001    /* send buffer size */
 #define SO_RCVBUF    0x1002    /* receive buffer size */
 #define SO_SNDLOWAT  0x1003    /* Unimplemented: send low-water mark */
 #define SO_RCVLOWAT  0x1004    /* Unimplemented: receive low-water mark */
@@ -316,6 +316,8 @@ struct timeval {
 };
 #endif /* LWIP_TIMEVAL_PRIVATE */
 
+struct tcp_pcb;
+
 void lwip_socket_init(void);
 
 int lwip_accept(int s, struct sockaddr *addr, socklen_t *addrlen);
@@ -333,6 +335,8 @@ int lwip_read(int s, void *mem, size_t len);
 int lwip_recvfrom(int s, void *mem, size_t len, int flags,
       struct sockaddr *from, socklen_t *fromlen);
 int lwip_send(int s, const void *dataptr, size_t size, int flags);
+int lwip_send_nocopy(int s, const void *dataptr, size_t size, int flags);
+struct tcp_pcb *lwip_socket_tcp_pcb(int s);
 int lwip_sendto(int s, const void *dataptr, size_t size, int flags,
     const struct sockaddr *to, socklen_t tolen);
 int lwip_socket(int domain, int type, int protocol);
@@ -0,0 +1,70 @@
+#!/usr/bin/python3
+
+# Static-file benchmark for bin/httpd.  Boot Ward with `make qemu`
+# (which forwards host port 8080 to the guest's port 80) and run
+#
+#   tools/httpd-bench.py [url-path] [clients] [seconds] [host:port]
+#
+# Each client repeatedly fetches url-path over a fresh connection and
+# the script reports requests/sec and payload throughput.  Compare the
+# results against a kernel without sendfile/zero-copy sends to measure
+# the send path.
+
+import sys
+import socket
+import threading
+import time
+
+path = sys.argv[1] if len(sys.argv) > 1 else '/bin/usertests'
+nclients = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+seconds = float(sys.argv[3]) if len(sys.argv) > 3 else 10
+host, port = (sys.argv[4] if len(sys.argv) > 4 else 'localhost:8080').split(':')
+port = int(port)
+
+lock = threading.Lock()
+totals = {'requests': 0, 'bytes': 0, 'errors': 0}
+
+def fetch():
+    s = socket.create_connection((host, port))
+    try:
+        s.sendall(('GET %s HTTP/1.0\r\n\r\n' % path).encode())
+        data = bytearray()
+        while True:
+            b = s.recv(1 << 16)
+            if not b:
+                break
+            data += b
+    finally:
+        s.close()
+    hdr, _, body = bytes(data).partition(b'\r\n\r\n')
+    if not hdr.startswith(b'HTTP/1.0 200'):
+        raise IOError(hdr.split(b'\r\n')[0])
+    return len(body)
+
+def client(deadline):
+    requests = nbytes = errors = 0
+    while time.time() < deadline:
+        try:
+            nbytes += fetch()
+            requests += 1
+        except (IOError, OSError):
+            errors += 1
+    with lock:
+        totals['requests'] += requests
+        totals['bytes'] += nbytes
+        totals['errors'] += errors
+
+size = fetch()
+start = time.time()
+threads = [threading.Thread(target=client, args=(start + seconds,))
+           for _ in range(nclients)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+elapsed = time.time() - start
+
+print('%s (%d bytes), %d clients, %.1f s' % (path, size, nclients, elapsed))
+print('requests: %d (%d errors)' % (totals['requests'], totals['errors']))
+print('%.1f req/s, %.2f MB/s' % (totals['requests'] / elapsed,
+                                 totals['bytes'] / elapsed / 1e6))